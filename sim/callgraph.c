@@ -0,0 +1,428 @@
+#include "callgraph.h"
+#include "prof.h"
+#include "sim.h"
+#include "core.h"
+#include "csr.h"
+#include "lsu.h"
+#include <stdlib.h>
+#include <string.h>
+
+void callgraph_init(callgraph_t *cg) {
+  cg->hart = (callgraph_hart_t *)calloc(SIM_MAX_HART, sizeof(callgraph_hart_t));
+}
+
+static unsigned callgraph_hash(unsigned a, unsigned b, unsigned c) {
+  unsigned h = a * 2654435761u;
+  h ^= (b + 0x9e3779b9 + (h << 6) + (h >> 2)) * 2246822519u;
+  h ^= (c + 0x9e3779b9 + (h << 6) + (h >> 2)) * 3266489917u;
+  return h ^ (h >> 15);
+}
+
+static unsigned callgraph_fn_hash(const callgraph_fn_t *fn) {
+  return callgraph_hash(fn->entry, fn->user, 0);
+}
+
+static unsigned callgraph_edge_hash(const callgraph_edge_t *edge) {
+  return callgraph_hash(edge->caller, edge->callee, edge->site);
+}
+
+// the arrays hold up to half of the hash size
+static void callgraph_fn_grow(callgraph_hart_t *h) {
+  unsigned size = h->fn_hash_size ? h->fn_hash_size * 2 : CALLGRAPH_HASH_INIT;
+  free(h->fn_hash);
+  h->fn_hash = (unsigned *)calloc(size, sizeof(unsigned));
+  h->fn_hash_size = size;
+  h->fn = (callgraph_fn_t *)realloc(h->fn, size / 2 * sizeof(callgraph_fn_t));
+  for (unsigned i = 0; i < h->num_fn; i++) {
+    unsigned j = callgraph_fn_hash(&h->fn[i]) & (size - 1);
+    while (h->fn_hash[j]) {
+      j = (j + 1) & (size - 1);
+    }
+    h->fn_hash[j] = i + 1;
+  }
+}
+
+static void callgraph_edge_grow(callgraph_hart_t *h) {
+  unsigned size = h->edge_hash_size ? h->edge_hash_size * 2 : CALLGRAPH_HASH_INIT;
+  free(h->edge_hash);
+  h->edge_hash = (unsigned *)calloc(size, sizeof(unsigned));
+  h->edge_hash_size = size;
+  h->edge = (callgraph_edge_t *)realloc(h->edge, size / 2 * sizeof(callgraph_edge_t));
+  for (unsigned i = 0; i < h->num_edge; i++) {
+    unsigned j = callgraph_edge_hash(&h->edge[i]) & (size - 1);
+    while (h->edge_hash[j]) {
+      j = (j + 1) & (size - 1);
+    }
+    h->edge_hash[j] = i + 1;
+  }
+}
+
+static unsigned callgraph_node_hash(const callgraph_node_t *node) {
+  return callgraph_hash(node->parent, node->fn, node->prv);
+}
+
+static void callgraph_node_grow(callgraph_hart_t *h) {
+  unsigned size = h->node_hash_size ? h->node_hash_size * 2 : CALLGRAPH_HASH_INIT;
+  free(h->node_hash);
+  h->node_hash = (unsigned *)calloc(size, sizeof(unsigned));
+  h->node_hash_size = size;
+  h->node = (callgraph_node_t *)realloc(h->node, size / 2 * sizeof(callgraph_node_t));
+  for (unsigned i = 0; i < h->num_node; i++) {
+    unsigned j = callgraph_node_hash(&h->node[i]) & (size - 1);
+    while (h->node_hash[j]) {
+      j = (j + 1) & (size - 1);
+    }
+    h->node_hash[j] = i + 1;
+  }
+}
+
+static unsigned callgraph_node_get(callgraph_hart_t *h, unsigned parent, unsigned fn, unsigned prv) {
+  if ((h->num_node + 1) * 2 > h->node_hash_size) {
+    callgraph_node_grow(h);
+  }
+  callgraph_node_t key = {parent, fn, prv, 0, 0};
+  unsigned j = callgraph_node_hash(&key) & (h->node_hash_size - 1);
+  while (h->node_hash[j]) {
+    callgraph_node_t *node = &h->node[h->node_hash[j] - 1];
+    if (node->parent == parent && node->fn == fn && node->prv == prv) {
+      return h->node_hash[j] - 1;
+    }
+    j = (j + 1) & (h->node_hash_size - 1);
+  }
+  h->node[h->num_node] = key;
+  h->node_hash[j] = ++h->num_node;
+  return h->num_node - 1;
+}
+
+static unsigned callgraph_fn_get(callgraph_hart_t *h, unsigned entry, unsigned user) {
+  if ((h->num_fn + 1) * 2 > h->fn_hash_size) {
+    callgraph_fn_grow(h);
+  }
+  callgraph_fn_t key = {entry, user, 0, 0};
+  unsigned j = callgraph_fn_hash(&key) & (h->fn_hash_size - 1);
+  while (h->fn_hash[j]) {
+    callgraph_fn_t *fn = &h->fn[h->fn_hash[j] - 1];
+    if (fn->entry == entry && fn->user == user) {
+      return h->fn_hash[j] - 1;
+    }
+    j = (j + 1) & (h->fn_hash_size - 1);
+  }
+  h->fn[h->num_fn] = key;
+  h->fn_hash[j] = ++h->num_fn;
+  return h->num_fn - 1;
+}
+
+static unsigned callgraph_edge_get(callgraph_hart_t *h, unsigned caller, unsigned callee, unsigned site) {
+  if ((h->num_edge + 1) * 2 > h->edge_hash_size) {
+    callgraph_edge_grow(h);
+  }
+  callgraph_edge_t key = {caller, callee, site, 0, 0, 0};
+  unsigned j = callgraph_edge_hash(&key) & (h->edge_hash_size - 1);
+  while (h->edge_hash[j]) {
+    callgraph_edge_t *edge = &h->edge[h->edge_hash[j] - 1];
+    if (edge->caller == caller && edge->callee == callee && edge->site == site) {
+      return h->edge_hash[j] - 1;
+    }
+    j = (j + 1) & (h->edge_hash_size - 1);
+  }
+  h->edge[h->num_edge] = key;
+  h->edge_hash[j] = ++h->num_edge;
+  return h->num_edge - 1;
+}
+
+// M mode has no address space
+static unsigned long long callgraph_key(unsigned prv, lsu_t *lsu) {
+  unsigned long long key = (unsigned long long)prv << 32;
+  if (prv != PRIVILEGE_MODE_M && lsu->vmflag) {
+    key |= lsu_atp_get(lsu);
+  }
+  return key;
+}
+
+static callgraph_ctx_t *callgraph_switch(callgraph_hart_t *h, unsigned long long key) {
+  unsigned lru = 0;
+  h->switches++;
+  for (unsigned i = 0; i < h->num_ctx; i++) {
+    if (h->ctx[i].key == key) {
+      h->cur = i;
+      h->ctx[i].active = h->switches;
+      return &h->ctx[i];
+    }
+    if (h->ctx[i].active < h->ctx[lru].active) {
+      lru = i;
+    }
+  }
+  callgraph_ctx_t *ctx;
+  if (h->num_ctx == CALLGRAPH_MAX_CTX) {
+    // the calls on its stack are not counted
+    ctx = &h->ctx[lru];
+    h->cur = lru;
+  } else {
+    h->ctx = (callgraph_ctx_t *)realloc(h->ctx, (h->num_ctx + 1) * sizeof(callgraph_ctx_t));
+    ctx = &h->ctx[h->num_ctx];
+    ctx->frame = NULL;
+    ctx->max_frame = 0;
+    h->cur = h->num_ctx++;
+  }
+  ctx->key = key;
+  ctx->depth = 0;
+  ctx->overflow = 0;
+  ctx->ir = 0;
+  ctx->cy = 0;
+  ctx->active = h->switches;
+  return ctx;
+}
+
+// called: from the top at site (the pc of the call), or the bottom of a call chain
+static void callgraph_push(callgraph_hart_t *h, callgraph_ctx_t *ctx, unsigned entry, unsigned ret, unsigned site,
+                           unsigned user, unsigned called) {
+  if (ctx->depth == CALLGRAPH_MAX_DEPTH) {
+    ctx->overflow++;
+    return;
+  }
+  if (ctx->depth == ctx->max_frame) {
+    ctx->max_frame = ctx->max_frame ? ctx->max_frame * 2 : CALLGRAPH_FRAME_INIT;
+    ctx->frame = (callgraph_frame_t *)realloc(ctx->frame, ctx->max_frame * sizeof(callgraph_frame_t));
+  }
+  callgraph_frame_t *frame = &ctx->frame[ctx->depth];
+  frame->fn = callgraph_fn_get(h, entry, user);
+  frame->ret = ret;
+  frame->edge = (called && ctx->depth) ? (int)callgraph_edge_get(h, ctx->frame[ctx->depth - 1].fn, frame->fn, site) : -1;
+  frame->node = callgraph_node_get(h, ctx->depth ? ctx->frame[ctx->depth - 1].node + 1 : 0, frame->fn, ctx->key >> 32);
+  frame->ir = ctx->ir;
+  frame->cy = ctx->cy;
+  ctx->depth++;
+}
+
+static void callgraph_pop(callgraph_hart_t *h, callgraph_ctx_t *ctx) {
+  callgraph_frame_t *frame = &ctx->frame[--ctx->depth];
+  if (frame->edge >= 0) {
+    callgraph_edge_t *edge = &h->edge[frame->edge];
+    edge->calls++;
+    edge->ir += ctx->ir - frame->ir;
+    edge->cy += ctx->cy - frame->cy;
+  }
+}
+
+// pops the frames down to the one returning to target (not across a trap)
+static void callgraph_return(callgraph_hart_t *h, callgraph_ctx_t *ctx, unsigned target) {
+  if (ctx->overflow) {
+    ctx->overflow--;
+    return;
+  }
+  for (unsigned i = ctx->depth; i > 0 && ctx->depth - i < CALLGRAPH_SEARCH_DEPTH; i--) {
+    if (ctx->frame[i - 1].ret == 0) {
+      return;
+    }
+    if (ctx->frame[i - 1].ret == target) {
+      while (ctx->depth >= i) {
+        callgraph_pop(h, ctx);
+      }
+      return;
+    }
+  }
+}
+
+// xRET: pops the frames down to the trap handler
+static void callgraph_trapret(callgraph_hart_t *h, callgraph_ctx_t *ctx) {
+  ctx->overflow = 0;
+  for (unsigned i = ctx->depth; i > 0; i--) {
+    if (ctx->frame[i - 1].ret == 0) {
+      while (ctx->depth >= i) {
+        callgraph_pop(h, ctx);
+      }
+      return;
+    }
+  }
+}
+
+// x1 (ra) and x5 (t0) are the link registers
+static int callgraph_link(unsigned reg) {
+  return reg == 1 || reg == 5;
+}
+
+void callgraph_step(callgraph_t *cg, struct core_t *core, struct core_step_result *result) {
+  callgraph_hart_t *h = &cg->hart[result->hart_id];
+  callgraph_ctx_t *ctx;
+  if (h->cur == h->num_ctx) {
+    ctx = callgraph_switch(h, callgraph_key(result->prv, core->lsu));
+  } else {
+    ctx = &h->ctx[h->cur];
+  }
+  if (ctx->depth == 0) {
+    callgraph_push(h, ctx, result->pc, 0, 0, result->prv == PRIVILEGE_MODE_U, 0);
+  }
+  // the cost of this step
+  callgraph_frame_t *top = &ctx->frame[ctx->depth - 1];
+  callgraph_fn_t *fn = &h->fn[top->fn];
+  callgraph_node_t *node = &h->node[top->node];
+  ctx->cy++;
+  fn->cy++;
+  node->cy++;
+  if (result->exception_code == 0) {
+    ctx->ir++;
+    fn->ir++;
+    node->ir++;
+  }
+  unsigned next_pc = core->csr->pc;
+  unsigned next_prv = core->csr->mode;
+  if (result->exception_code == 0 && !result->trapret && next_pc == result->pc_next) {
+    if (result->opcode == OPCODE_JAL || result->opcode == OPCODE_JALR) {
+      unsigned inst = riscv_decompress(result->inst);
+      unsigned rd = riscv_get_rd(inst);
+      unsigned rs1 = riscv_get_rs1(inst);
+      unsigned ret = result->pc + (((result->inst & 0x03) == 0x03) ? 4 : 2);
+      unsigned user = result->prv == PRIVILEGE_MODE_U;
+      if (result->opcode == OPCODE_JAL) {
+        if (callgraph_link(rd)) {
+          callgraph_push(h, ctx, next_pc, ret, result->pc, user, 1);
+        }
+      } else if (callgraph_link(rd)) {
+        if (callgraph_link(rs1) && rs1 != rd) {
+          // coroutine: returns and calls
+          callgraph_return(h, ctx, next_pc);
+        }
+        callgraph_push(h, ctx, next_pc, ret, result->pc, user, 1);
+      } else if (callgraph_link(rs1)) {
+        callgraph_return(h, ctx, next_pc);
+      }
+    }
+    if (result->opcode != OPCODE_SYSTEM) {
+      // the mode and satp are not changed
+      return;
+    }
+  }
+  unsigned long long key = callgraph_key(next_prv, core->lsu);
+  if (result->trapret) {
+    callgraph_trapret(h, ctx);
+  } else if (next_pc != result->pc_next) {
+    // a trap (an exception or an interrupt) is called from the same context
+    unsigned same = (key == ctx->key);
+    ctx = callgraph_switch(h, key);
+    callgraph_push(h, ctx, next_pc, 0, result->pc, next_prv == PRIVILEGE_MODE_U, same);
+    return;
+  }
+  if (key != ctx->key) {
+    // xRET or a satp write
+    callgraph_switch(h, key);
+  }
+}
+
+static const char *callgraph_name(const prof_symtab_t *symtab, unsigned entry, char *buf, unsigned len) {
+  int i = prof_symtab_lookup(symtab, entry);
+  if (i < 0) {
+    snprintf(buf, len, "0x%08x", entry);
+  } else if (symtab->addr[i] == entry) {
+    return symtab->name[i];
+  } else {
+    snprintf(buf, len, "%s+0x%x", symtab->name[i], entry - symtab->addr[i]);
+  }
+  return buf;
+}
+
+void callgraph_write(callgraph_t *cg, FILE *fp, const prof_symtab_t *sym) {
+  static const char *ob[] = {"kernel", "user"};
+  char name[2][320];
+  unsigned long long ir = 0, cy = 0;
+  for (unsigned i = 0; i < SIM_MAX_HART; i++) {
+    for (unsigned j = 0; j < cg->hart[i].num_fn; j++) {
+      ir += cg->hart[i].fn[j].ir;
+      cy += cg->hart[i].fn[j].cy;
+    }
+  }
+  fprintf(fp, "# callgrind format\n");
+  fprintf(fp, "version: 1\n");
+  fprintf(fp, "creator: ladybird\n");
+  fprintf(fp, "positions: instr\n");
+  fprintf(fp, "events: Ir Cy\n");
+  fprintf(fp, "event: Ir : Instructions Retired\n");
+  fprintf(fp, "event: Cy : Steps (with Traps)\n");
+  fprintf(fp, "summary: %llu %llu\n", ir, cy);
+  for (unsigned i = 0; i < SIM_MAX_HART; i++) {
+    callgraph_hart_t *h = &cg->hart[i];
+    if (h->num_fn == 0) {
+      continue;
+    }
+    // the calls by caller
+    unsigned *first = (unsigned *)malloc((h->num_fn + 1) * sizeof(unsigned));
+    unsigned *next = (unsigned *)malloc((h->num_edge + 1) * sizeof(unsigned));
+    for (unsigned j = 0; j < h->num_fn; j++) {
+      first[j] = h->num_edge;
+    }
+    for (unsigned j = h->num_edge; j > 0; j--) {
+      next[j - 1] = first[h->edge[j - 1].caller];
+      first[h->edge[j - 1].caller] = j - 1;
+    }
+    unsigned long long part_ir = 0, part_cy = 0;
+    for (unsigned j = 0; j < h->num_fn; j++) {
+      part_ir += h->fn[j].ir;
+      part_cy += h->fn[j].cy;
+    }
+    fprintf(fp, "\npart: %u\n", i + 1);
+    fprintf(fp, "desc: Hart: %u\n", i);
+    fprintf(fp, "totals: %llu %llu\n", part_ir, part_cy);
+    for (unsigned j = 0; j < h->num_fn; j++) {
+      callgraph_fn_t *fn = &h->fn[j];
+      fprintf(fp, "\nob=%s\n", ob[fn->user]);
+      fprintf(fp, "fn=%s\n", callgraph_name(&sym[fn->user], fn->entry, name[0], sizeof(name[0])));
+      fprintf(fp, "0x%08x %llu %llu\n", fn->entry, fn->ir, fn->cy);
+      for (unsigned k = first[j]; k < h->num_edge; k = next[k]) {
+        callgraph_edge_t *edge = &h->edge[k];
+        callgraph_fn_t *callee = &h->fn[edge->callee];
+        if (edge->calls == 0) {
+          continue; // not returned yet
+        }
+        fprintf(fp, "cob=%s\n", ob[callee->user]);
+        fprintf(fp, "cfn=%s\n", callgraph_name(&sym[callee->user], callee->entry, name[1], sizeof(name[1])));
+        fprintf(fp, "calls=%llu 0x%08x\n", edge->calls, callee->entry);
+        fprintf(fp, "0x%08x %llu %llu\n", edge->site, edge->ir, edge->cy);
+      }
+    }
+    free(first);
+    free(next);
+  }
+}
+
+static void callgraph_write_chain(callgraph_hart_t *h, FILE *fp, const prof_symtab_t *sym, unsigned node) {
+  static const char prv_name[] = {'U', 'S', 'H', 'M', 'D'};
+  char name[320];
+  callgraph_node_t *n = &h->node[node];
+  callgraph_fn_t *fn = &h->fn[n->fn];
+  if (n->parent) {
+    callgraph_write_chain(h, fp, sym, n->parent - 1);
+  } else {
+    fprintf(fp, "%c", prv_name[n->prv]);
+  }
+  fprintf(fp, ";%s", callgraph_name(&sym[fn->user], fn->entry, name, sizeof(name)));
+}
+
+void callgraph_write_folded(callgraph_t *cg, FILE *fp, const prof_symtab_t *sym) {
+  for (unsigned i = 0; i < SIM_MAX_HART; i++) {
+    callgraph_hart_t *h = &cg->hart[i];
+    for (unsigned j = 0; j < h->num_node; j++) {
+      if (h->node[j].ir == 0) {
+        continue;
+      }
+      fprintf(fp, "hart%u;", i);
+      callgraph_write_chain(h, fp, sym, j);
+      fprintf(fp, " %llu\n", h->node[j].ir);
+    }
+  }
+}
+
+void callgraph_fini(callgraph_t *cg) {
+  for (unsigned i = 0; i < SIM_MAX_HART; i++) {
+    callgraph_hart_t *h = &cg->hart[i];
+    for (unsigned j = 0; j < h->num_ctx; j++) {
+      free(h->ctx[j].frame);
+    }
+    free(h->ctx);
+    free(h->fn);
+    free(h->fn_hash);
+    free(h->edge);
+    free(h->edge_hash);
+    free(h->node);
+    free(h->node_hash);
+  }
+  free(cg->hart);
+}
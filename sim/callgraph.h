@@ -0,0 +1,103 @@
+#ifndef CALLGRAPH_H
+#define CALLGRAPH_H
+
+#include <stdio.h>
+
+struct core_t;
+struct core_step_result;
+struct prof_symtab_t;
+
+// call graph of the guest (prof --prof-callgraph): a shadow call stack of each hart, by the hints of
+// jal/jalr (a call links ra or t0, a return jumps to it, the return address is checked). a context
+// (a stack with its own counters) is kept per privilege mode and address space (satp PPN and ASID),
+// so the user processes do not break the kernel stacks. the stack of the least recently active context
+// is dropped for a new one past CALLGRAPH_MAX_CTX (the exited processes). a trap pushes a frame of its handler,
+// xRET pops it. the retired instructions (Ir) and the steps including traps (Cy) are counted to the
+// function on the top (self), to its calling context and to the calls on the stack (inclusive, of
+// the same context).
+// tail calls and longjmp are counted in the caller, a return not matching the stack is ignored
+
+#define CALLGRAPH_MAX_DEPTH 4096 // frames of a context, deeper calls are not tracked
+#define CALLGRAPH_FRAME_INIT 16 // frames allocated first, doubled up to CALLGRAPH_MAX_DEPTH
+#define CALLGRAPH_MAX_CTX 64 // contexts of a hart, then the least recently active one is reused
+#define CALLGRAPH_SEARCH_DEPTH 64 // frames searched for the return address
+#define CALLGRAPH_HASH_INIT (1 << 10) // a power of 2
+
+typedef struct callgraph_frame_t {
+  unsigned fn;
+  unsigned node;
+  unsigned ret; // the return address, 0: a trap handler
+  int edge; // -1: the bottom of a context
+  unsigned long long ir; // of the context at the entry
+  unsigned long long cy;
+} callgraph_frame_t;
+
+typedef struct callgraph_ctx_t {
+  unsigned long long key; // privilege mode and address space
+  callgraph_frame_t *frame;
+  unsigned max_frame; // allocated
+  unsigned depth;
+  unsigned overflow; // calls beyond CALLGRAPH_MAX_DEPTH
+  unsigned long long ir;
+  unsigned long long cy;
+  unsigned long long active; // the switch to it last
+} callgraph_ctx_t;
+
+typedef struct callgraph_fn_t {
+  unsigned entry;
+  unsigned user; // the symbols of U mode
+  unsigned long long ir; // self
+  unsigned long long cy;
+} callgraph_fn_t;
+
+typedef struct callgraph_edge_t {
+  unsigned caller;
+  unsigned callee;
+  unsigned site; // the pc of the call (of the trapped instruction)
+  unsigned long long calls;
+  unsigned long long ir; // inclusive
+  unsigned long long cy;
+} callgraph_edge_t;
+
+// a node of the calling context tree (the folded stacks)
+typedef struct callgraph_node_t {
+  unsigned parent; // index + 1, 0: the bottom
+  unsigned fn;
+  unsigned prv; // of the context
+  unsigned long long ir; // self
+  unsigned long long cy;
+} callgraph_node_t;
+
+typedef struct callgraph_hart_t {
+  callgraph_ctx_t *ctx;
+  unsigned num_ctx;
+  unsigned cur; // the active context, num_ctx: none yet
+  unsigned long long switches;
+  callgraph_fn_t *fn;
+  unsigned num_fn;
+  unsigned *fn_hash; // index + 1, 0: empty
+  unsigned fn_hash_size;
+  callgraph_edge_t *edge;
+  unsigned num_edge;
+  unsigned *edge_hash;
+  unsigned edge_hash_size;
+  callgraph_node_t *node;
+  unsigned num_node;
+  unsigned *node_hash;
+  unsigned node_hash_size;
+} callgraph_hart_t;
+
+typedef struct callgraph_t {
+  callgraph_hart_t *hart;
+} callgraph_t;
+
+void callgraph_init(callgraph_t *);
+// after the step of the core (the state is of the next instruction)
+void callgraph_step(callgraph_t *, struct core_t *core, struct core_step_result *result);
+// callgrind format, a part per hart, the names of the symbol tables (kernel, user)
+void callgraph_write(callgraph_t *, FILE *fp, const struct prof_symtab_t *sym);
+// hart;mode;caller;...;callee instructions
+void callgraph_write_folded(callgraph_t *, FILE *fp, const struct prof_symtab_t *sym);
+void callgraph_fini(callgraph_t *);
+
+#endif
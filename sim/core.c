@@ -5,6 +5,7 @@
 #include "memory.h"
 #include "plic.h"
 #include "trigger.h"
+#include "sbi.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
@@ -29,7 +30,8 @@ void core_init(core_t *core, int hart_id, struct memory_t *mem, struct plic_t *p
   core->window.exception = (unsigned *)calloc(CORE_WINDOW_SIZE, sizeof(unsigned));
   core->lsu = (struct lsu_t *)malloc(sizeof(struct lsu_t));
   lsu_init(core->lsu, mem);
-  core->lsu->tlb->id = 3 * hart_id + 0;
+  core->lsu->itlb->id = 3 * hart_id + 0;
+  core->lsu->dtlb->id = 3 * hart_id + 0;
   core->lsu->dcache->id = 3 * hart_id + 1;
   core->lsu->icache->id = 3 * hart_id + 2;
   // init csr
@@ -41,6 +43,7 @@ void core_init(core_t *core, int hart_id, struct memory_t *mem, struct plic_t *p
   core->csr->aclint = aclint;
   core->csr->trig = trigger;
   core->csr->hart_id = hart_id;
+  core->sbi = NULL;
 }
 
 void core_window_flush(core_t *core) {
@@ -115,8 +118,6 @@ static unsigned core_fetch_instruction(core_t *core, unsigned pc, struct core_st
   }
   // re-search in window
   for (int i = 0; i < CORE_WINDOW_SIZE; i++) {
-    result->inst_window_pc[i] = core->window.pc[i];
-    result->inst_window[i] = core->window.inst[i];
     if (core->window.pc[i] == pc) {
       inst = core->window.inst[i];
       w_index = i;
@@ -126,7 +127,6 @@ static unsigned core_fetch_instruction(core_t *core, unsigned pc, struct core_st
   }
   result->inst = inst;
   result->exception_code = exception;
-  result->inst_window_pos = w_index;
   result->pc_paddr = pc_paddr;
   return w_index;
 }
@@ -144,7 +144,7 @@ static unsigned op_minu(unsigned src1, unsigned src2) { return (src1 < src2) ? s
 static unsigned op_maxu(unsigned src1, unsigned src2) { return (src1 < src2) ? src2 : src1; }
 #endif
 
-void core_step(core_t *core, unsigned pc, struct core_step_result *result, unsigned prv) {
+static void core_exec(core_t *core, unsigned pc, struct core_step_result *result, unsigned prv) {
   // init result
   result->hart_id = core->csr->hart_id;
   result->pc = pc;
@@ -649,7 +649,11 @@ void core_step(core_t *core, unsigned pc, struct core_step_result *result, unsig
         if (core->csr->mode == PRIVILEGE_MODE_M) {
           result->exception_code = TRAP_CODE_ENVIRONMENT_CALL_M;
         } else if (core->csr->mode == PRIVILEGE_MODE_S) {
-          result->exception_code = TRAP_CODE_ENVIRONMENT_CALL_S;
+          if (core->sbi) {
+            sbi_ecall(core->sbi, core);
+          } else {
+            result->exception_code = TRAP_CODE_ENVIRONMENT_CALL_S;
+          }
         } else {
           result->exception_code = TRAP_CODE_ENVIRONMENT_CALL_U;
         }
@@ -667,7 +671,11 @@ void core_step(core_t *core, unsigned pc, struct core_step_result *result, unsig
         break;
       default:
         if (riscv_get_funct7(inst) == 0x09) {
-          lsu_sfence_vma(core->lsu);
+          // SFENCE.VMA, x0 operands for all the addresses/ASIDs
+          unsigned rs1 = riscv_get_rs1(inst);
+          unsigned rs2 = riscv_get_rs2(inst);
+          lsu_sfence_vma(core->lsu, (rs1 ? TLB_FLUSH_VADDR : 0) | (rs2 ? TLB_FLUSH_ASID : 0), core->gpr[rs1], core->gpr[rs2]);
+          result->flush = 1;
         } else {
           result->exception_code = TRAP_CODE_ILLEGAL_INSTRUCTION;
         }
@@ -705,6 +713,12 @@ void core_step(core_t *core, unsigned pc, struct core_step_result *result, unsig
   return;
 }
 
+void core_step(core_t *core, unsigned pc, struct core_step_result *result, unsigned prv) {
+  core_exec(core, pc, result, prv);
+  // the cache and TLB events of this instruction
+  lsu_report_events(core->lsu, result);
+}
+
 void core_fini(core_t *core) {
   free(core->window.pc);
   free(core->window.pc_paddr);
@@ -8,6 +8,7 @@ struct memory_t;
 struct plic_t;
 struct aclint_t;
 struct trigger_t;
+struct sbi_t;
 
 typedef struct window_t {
   unsigned *pc;
@@ -24,6 +25,7 @@ typedef struct core_t {
   struct csr_t *csr;
   struct lsu_t *lsu;
   window_t window; // instruction window
+  struct sbi_t *sbi; // S-mode ecalls are handled by the simulator (NULL: trap)
 } core_t;
 
 void core_init(core_t *, int hart_id, struct memory_t *, struct plic_t *, struct aclint_t *, struct trigger_t *);
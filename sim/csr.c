@@ -6,6 +6,7 @@
 #include "core.h"
 #include "lsu.h"
 #include "trigger.h"
+#include "regstat.h"
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -37,6 +38,7 @@ void csr_init(csr_t *csr) {
   csr->instret = 0;
   // trap & interrupts
   csr->interrupts_enable = 0;
+  csr->stimecmp = 0xffffffffffffffffULL;
   csr->mideleg = 0;
   csr->medeleg = 0;
   csr->mscratch = 0;
@@ -66,8 +68,11 @@ void csr_init(csr_t *csr) {
     csr->hpmcounter[i] = 0;
     csr->hpmevent[i] = 0;
   }
+  csr->mcountinhibit = 0;
+  csr->hpm_active = 0;
 #if REGISTER_STATISTICS
   csr->regstat_en = 0;
+  csr->regstat = NULL;
   for (int i = 0; i < NUM_REGISTERS; i++) {
     csr->cycle_reg_written[i] = -1;
     csr->regalu[i] = 0;
@@ -77,13 +82,22 @@ void csr_init(csr_t *csr) {
   return;
 }
 
+// the triggers and the software interrupt bits are shared with the other harts (parallel mode)
+static void csr_bus_lock(csr_t *csr) {
+  if (csr->lsu->mem->bus_lock_en) mtx_lock(&csr->lsu->mem->bus_lock);
+}
+
+static void csr_bus_unlock(csr_t *csr) {
+  if (csr->lsu->mem->bus_lock_en) mtx_unlock(&csr->lsu->mem->bus_lock);
+}
+
 static unsigned csr_get_s_interrupts_pending(csr_t *csr) {
   unsigned value = 0;
   unsigned swint = 0;
   unsigned extint = 0;
   unsigned timerint = 0;
   extint = (plic_get_interrupt(csr->plic, csr->hart_id * 2 + 1) == 0) ? 0 : 1;
-  timerint = csr->stip;
+  timerint = csr->stip | (csr->aclint->mtime >= csr->stimecmp);
   swint = aclint_get_ssip(csr->aclint, csr->hart_id);
   value =
     (swint << CSR_INT_SSI_FIELD) |
@@ -107,7 +121,37 @@ static unsigned csr_get_m_interrupts_pending(csr_t *csr) {
   return value;
 }
 
+// the counters to update at each instruction, after a write of mhpmevent or mcountinhibit
+static void csr_hpm_update(csr_t *csr) {
+  csr->hpm_active = 0;
+  for (int i = 0; i < CSR_NUM_HPM; i++) {
+    if (csr->hpmevent[i] != CSR_HPM_EVENT_NONE && !((csr->mcountinhibit >> (i + 3)) & 1)) {
+      csr->hpm_active |= 1 << i;
+    }
+  }
+}
+
+// an event counted outside csr_update_counters
+static void csr_hpm_count(csr_t *csr, unsigned event) {
+  for (int i = 0; i < CSR_NUM_HPM && (csr->hpm_active >> i); i++) {
+    if (((csr->hpm_active >> i) & 1) && csr->hpmevent[i] == event) {
+      csr->hpmcounter[i]++;
+    }
+  }
+}
+
 unsigned csr_csrr(csr_t *csr, unsigned addr, struct core_step_result *result) {
+  if ((addr >= CSR_ADDR_U_HPMCOUNTER3 && addr <= CSR_ADDR_U_HPMCOUNTER31) ||
+      (addr >= CSR_ADDR_U_HPMCOUNTER3H && addr <= CSR_ADDR_U_HPMCOUNTER31H)) {
+    // user level HPM counters, as enabled by mcounteren (and scounteren for U mode)
+    unsigned n = addr & 0x1f;
+    if (result && ((result->prv < PRIVILEGE_MODE_M && !((csr->mcounteren >> n) & 1)) ||
+                   (result->prv == PRIVILEGE_MODE_U && !((csr->scounteren >> n) & 1)))) {
+      result->exception_code = TRAP_CODE_ILLEGAL_INSTRUCTION;
+      return 0;
+    }
+    return (addr & 0x80) ? (unsigned)(csr->hpmcounter[n - 3] >> 32) : (unsigned)csr->hpmcounter[n - 3];
+  }
   switch (addr) {
   case CSR_ADDR_U_FFLAGS:
     if (csr->status_fs == CSR_EXTENSION_STATUS_OFF) {
@@ -332,17 +376,26 @@ unsigned csr_csrr(csr_t *csr, unsigned addr, struct core_step_result *result) {
   case CSR_ADDR_T_SELECT:
     return csr->tselect;
   case CSR_ADDR_T_DATA1:
-    return trig_get_tdata(csr->trig, csr->tselect, 0);
   case CSR_ADDR_T_DATA2:
-    return trig_get_tdata(csr->trig, csr->tselect, 1);
   case CSR_ADDR_T_DATA3:
-    return trig_get_tdata(csr->trig, csr->tselect, 2);
-  case CSR_ADDR_T_INFO:
-    return trig_info(csr->trig, csr->tselect);
+  case CSR_ADDR_T_INFO: {
+    csr_bus_lock(csr);
+    unsigned value = (addr == CSR_ADDR_T_INFO) ? trig_info(csr->trig, csr->tselect) :
+                     trig_get_tdata(csr->trig, csr->tselect, addr - CSR_ADDR_T_DATA1);
+    csr_bus_unlock(csr);
+    return value;
+  }
   case CSR_ADDR_M_COUNTEREN:
     return csr->mcounteren;
+  case CSR_ADDR_M_COUNTINHIBIT:
+    return csr->mcountinhibit;
   case CSR_ADDR_S_COUNTEREN:
     return csr->scounteren;
+  case CSR_ADDR_M_ENVCFG:
+  case CSR_ADDR_S_ENVCFG:
+    return 0;
+  case CSR_ADDR_M_ENVCFGH:
+    return csr->lsu->dtlb->adue ? CSR_MENVCFGH_ADUE : 0;
   case CSR_ADDR_M_VENDORID:
     return VENDOR_ID;
   case CSR_ADDR_M_ARCHID:
@@ -530,6 +583,7 @@ void csr_csrw(csr_t *csr, unsigned addr, unsigned value, struct core_step_result
         (csr->lsu->pmpcfg[index * 4 + 1] & 0x80) | (unsigned char)(value >> 8);
       csr->lsu->pmpcfg[index * 4 + 0] =
         (csr->lsu->pmpcfg[index * 4 + 0] & 0x80) | (unsigned char)(value >> 0);
+      lsu_pmp_update(csr->lsu);
     }
     break;
   case CSR_ADDR_M_PMPADDR0:
@@ -597,15 +651,15 @@ void csr_csrw(csr_t *csr, unsigned addr, unsigned value, struct core_step_result
   case CSR_ADDR_M_PMPADDR62:
   case CSR_ADDR_M_PMPADDR63:
     csr->lsu->pmpaddr[addr - CSR_ADDR_M_PMPADDR0] = value;
+    lsu_pmp_update(csr->lsu);
     break;
   case CSR_ADDR_S_ATP:
     lsu_dcache_write_back(csr->lsu);
     if (value & 0x80000000) {
-      lsu_atp_on(csr->lsu, value & 0x000fffff);
+      lsu_atp_on(csr->lsu, (value >> 22) & TLB_ASID_MASK, value & 0x000fffff);
     } else {
       lsu_atp_off(csr->lsu);
     }
-    lsu_tlb_clear(csr->lsu);
     lsu_icache_invalidate(csr->lsu);
     lsu_dcache_invalidate(csr->lsu);
     result->flush = 1;
@@ -635,7 +689,9 @@ void csr_csrw(csr_t *csr, unsigned addr, unsigned value, struct core_step_result
     csr->scause = value;
     break;
   case CSR_ADDR_M_IP:
+    csr_bus_lock(csr);
     aclint_set_msip(csr->aclint, csr->hart_id, ((value & CSR_INT_MSI) ? 1 : 0));
+    csr_bus_unlock(csr);
     // fall-through
   case CSR_ADDR_S_IP:
     if (value & CSR_INT_STI) {
@@ -643,7 +699,9 @@ void csr_csrw(csr_t *csr, unsigned addr, unsigned value, struct core_step_result
     } else {
       csr->stip = 0;
     }
+    csr_bus_lock(csr);
     aclint_set_ssip(csr->aclint, csr->hart_id, ((value & CSR_INT_SSI) ? 1 : 0));
+    csr_bus_unlock(csr);
     break;
   case CSR_ADDR_S_TVAL:
     csr->stval = value;
@@ -690,24 +748,35 @@ void csr_csrw(csr_t *csr, unsigned addr, unsigned value, struct core_step_result
     break;
   case CSR_ADDR_T_SELECT:
     csr->tselect = value;
+    csr_bus_lock(csr);
     if (value + 1 > csr->trig->size) {
       trig_resize(csr->trig, value + 1);
     }
+    csr_bus_unlock(csr);
     break;
   case CSR_ADDR_T_DATA1:
-    trig_set_tdata(csr->trig, csr->tselect, 0, value);
-    break;
   case CSR_ADDR_T_DATA2:
-    trig_set_tdata(csr->trig, csr->tselect, 1, value);
-    break;
   case CSR_ADDR_T_DATA3:
-    trig_set_tdata(csr->trig, csr->tselect, 2, value);
+    csr_bus_lock(csr);
+    trig_set_tdata(csr->trig, csr->tselect, addr - CSR_ADDR_T_DATA1, value);
+    csr_bus_unlock(csr);
     break;
   case CSR_ADDR_M_COUNTEREN:
-    csr->mcounteren = value & 0x07;
+    csr->mcounteren = value;
+    break;
+  case CSR_ADDR_M_COUNTINHIBIT:
+    csr->mcountinhibit = value & CSR_COUNTINHIBIT_MASK;
+    csr_hpm_update(csr);
     break;
   case CSR_ADDR_S_COUNTEREN:
-    csr->scounteren = value & 0x07;
+    csr->scounteren = value;
+    break;
+  case CSR_ADDR_M_ENVCFG:
+  case CSR_ADDR_S_ENVCFG:
+    break;
+  case CSR_ADDR_M_ENVCFGH:
+    // the cached entries stay valid: they have A set, a store through a clean one walks again
+    lsu_set_adue(csr->lsu, (SVADU_EXTENSION && (value & CSR_MENVCFGH_ADUE)) ? 1 : 0);
     break;
   case CSR_ADDR_M_VENDORID:
   case CSR_ADDR_M_ARCHID:
@@ -808,7 +877,8 @@ void csr_csrw(csr_t *csr, unsigned addr, unsigned value, struct core_step_result
   case CSR_ADDR_M_HPMEVENT29:
   case CSR_ADDR_M_HPMEVENT30:
   case CSR_ADDR_M_HPMEVENT31:
-    csr->hpmevent[addr - CSR_ADDR_M_HPMEVENT3] = value;
+    csr->hpmevent[addr - CSR_ADDR_M_HPMEVENT3] = value & CSR_HPM_EVENT_MASK;
+    csr_hpm_update(csr);
     break;
   default:
     if (result) result->exception_code = TRAP_CODE_ILLEGAL_INSTRUCTION;
@@ -940,7 +1010,6 @@ static void csr_trap(csr_t *csr, unsigned trap_code, unsigned trap_value) {
 
 static void csr_restore_trap(csr_t *csr) {
   unsigned from_mode = csr->mode;
-  lsu_tlb_clear(csr->lsu);
   lsu_icache_invalidate(csr->lsu);
   lsu_dcache_invalidate(csr->lsu);
   // restore extension status to clean (required?)
@@ -968,50 +1037,117 @@ static void csr_restore_trap(csr_t *csr) {
   }
 }
 
+// the number of the event on this instruction
+static unsigned csr_hpm_event_count(csr_t *csr, unsigned event, struct core_step_result *result) {
+  unsigned inst = result->inst;
+  switch (event) {
+  case CSR_HPM_EVENT_LOAD:
+    return result->exception_code == 0 && (result->opcode == OPCODE_LOAD || result->opcode == OPCODE_LOAD_FP);
+  case CSR_HPM_EVENT_STORE:
+    return result->exception_code == 0 && (result->opcode == OPCODE_STORE || result->opcode == OPCODE_STORE_FP);
+  case CSR_HPM_EVENT_AMO:
+    return result->exception_code == 0 && result->opcode == OPCODE_AMO;
+  case CSR_HPM_EVENT_BRANCH:
+    return result->exception_code == 0 && result->opcode == OPCODE_BRANCH;
+  case CSR_HPM_EVENT_BRANCH_TAKEN:
+  case CSR_HPM_EVENT_BRANCH_NOT_TAKEN:
+    if (result->exception_code == 0 && result->opcode == OPCODE_BRANCH) {
+      unsigned taken = result->pc_next != result->pc + (((inst & 0x03) == 0x03) ? 4 : 2);
+      return (event == CSR_HPM_EVENT_BRANCH_TAKEN) ? taken : !taken;
+    }
+    return 0;
+  case CSR_HPM_EVENT_JUMP:
+    return result->exception_code == 0 && (result->opcode == OPCODE_JAL || result->opcode == OPCODE_JALR);
+  case CSR_HPM_EVENT_ALU:
+  case CSR_HPM_EVENT_MULDIV:
+    if (result->exception_code == 0) {
+      // M extension: OP with funct7 = 1 (never compressed)
+      unsigned muldiv = result->opcode == OPCODE_OP && (inst & 0x03) == 0x03 && (inst >> 25) == 0x01;
+      if (event == CSR_HPM_EVENT_MULDIV) {
+        return muldiv;
+      }
+      return !muldiv && (result->opcode == OPCODE_OP || result->opcode == OPCODE_OP_IMM ||
+                         result->opcode == OPCODE_LUI || result->opcode == OPCODE_AUIPC);
+    }
+    return 0;
+  case CSR_HPM_EVENT_FP:
+    return result->exception_code == 0 &&
+      (result->opcode == OPCODE_OP_FP || result->opcode == OPCODE_MADD || result->opcode == OPCODE_MSUB ||
+       result->opcode == OPCODE_NMSUB || result->opcode == OPCODE_NMADD);
+  case CSR_HPM_EVENT_SYSTEM:
+    return result->exception_code == 0 && result->opcode == OPCODE_SYSTEM;
+  case CSR_HPM_EVENT_FENCE:
+    return result->exception_code == 0 && result->opcode == OPCODE_MISC_MEM;
+  case CSR_HPM_EVENT_EXCEPTION:
+    return result->exception_code != 0;
+  case CSR_HPM_EVENT_ICACHE_ACCESS:
+    return result->icache_access;
+  case CSR_HPM_EVENT_ICACHE_HIT:
+    return result->icache_hit;
+  case CSR_HPM_EVENT_ICACHE_MISS:
+    return result->icache_access - result->icache_hit;
+  case CSR_HPM_EVENT_DCACHE_ACCESS:
+    return result->dcache_access;
+  case CSR_HPM_EVENT_DCACHE_HIT:
+    return result->dcache_hit;
+  case CSR_HPM_EVENT_DCACHE_MISS:
+    return result->dcache_access - result->dcache_hit;
+  case CSR_HPM_EVENT_DCACHE_WRITE_BACK:
+    return result->dcache_write_back;
+  case CSR_HPM_EVENT_TLB_ACCESS:
+    return result->tlb_access;
+  case CSR_HPM_EVENT_TLB_HIT:
+    return result->tlb_hit;
+  case CSR_HPM_EVENT_TLB_MISS:
+    return result->tlb_access - result->tlb_hit;
+  case CSR_HPM_EVENT_PAGE_WALK:
+    return result->tlb_walk;
+  case CSR_HPM_EVENT_L2_ACCESS:
+    return result->l2_access;
+  case CSR_HPM_EVENT_L2_MISS:
+    return result->l2_access - result->l2_hit;
+  case CSR_HPM_EVENT_MMIO:
+    // the loads, stores and AMOs outside RAM
+    return result->exception_code == 0 &&
+      (result->opcode == OPCODE_LOAD || result->opcode == OPCODE_STORE || result->opcode == OPCODE_AMO ||
+       result->opcode == OPCODE_LOAD_FP || result->opcode == OPCODE_STORE_FP) &&
+      result->m_paddr < MEMORY_BASE_ADDR_RAM;
+#if REGISTER_STATISTICS
+  case CSR_HPM_EVENT_REG_READ:
+    return csr->regstat_en ? (result->rs1_regno != 0) + (result->rs2_regno != 0) : 0;
+  case CSR_HPM_EVENT_REG_READ_SKIP:
+    return csr->regstat_en ? (result->rs1_read_skip != 0) + (result->rs2_read_skip != 0) : 0;
+  case CSR_HPM_EVENT_REG_WRITE:
+    return csr->regstat_en && result->rd_regno != 0;
+  case CSR_HPM_EVENT_REG_WRITE_SKIP:
+    return csr->regstat_en && result->rd_write_skip != 0;
+  case CSR_HPM_EVENT_WIDTH4:
+    return csr->regstat_en && result->rd_regno != 0 && result->rd_data < (1 << 4);
+  case CSR_HPM_EVENT_WIDTH8:
+    return csr->regstat_en && result->rd_regno != 0 && result->rd_data >= (1 << 4) && result->rd_data < (1 << 8);
+  case CSR_HPM_EVENT_WIDTH16:
+    return csr->regstat_en && result->rd_regno != 0 && result->rd_data >= (1 << 8) && result->rd_data < (1 << 16);
+  case CSR_HPM_EVENT_WIDTH24:
+    return csr->regstat_en && result->rd_regno != 0 && result->rd_data >= (1 << 16) && result->rd_data < (1 << 24);
+  case CSR_HPM_EVENT_WIDTH32:
+    return csr->regstat_en && result->rd_regno != 0 && result->rd_data >= (1 << 24);
+#endif
+  default:
+    // CSR_HPM_EVENT_INTERRUPT is counted at the trap
+    return 0;
+  }
+}
+
 static void csr_update_counters(csr_t *csr, struct core_step_result *result) {
   csr->cycle++; // assume 100 MHz
-  csr->instret++;
+  if (!(csr->mcountinhibit & CSR_COUNTINHIBIT_IR)) {
+    csr->instret++;
+  }
   csr->pc = result->pc_next;
   // register counter
   if (csr->regstat_en) {
-    if (result->opcode == OPCODE_OP || result->opcode == OPCODE_OP_IMM) {
-      unsigned r_break = 0;
-      unsigned w_break = 0;
-      for (int i = 1; i < 4; i++) {
-        // read skip search
-        int r_index = result->inst_window_pos - i;
-        if (!r_break && r_index < CORE_WINDOW_SIZE && result->inst_window_pc[r_index] != 0xffffffff) {
-          unsigned r_inst = riscv_decompress(result->inst_window[r_index]);
-          unsigned r_opcode = riscv_get_opcode(r_inst);
-          if (r_opcode == OPCODE_OP || r_opcode == OPCODE_OP_IMM ||
-              r_opcode == OPCODE_LUI || r_opcode == OPCODE_AUIPC) {
-            if (result->rs1_regno != 0 && result->rs1_regno == riscv_get_rd(r_inst)) {
-              result->rs1_read_skip = 1;
-            }
-            if (result->opcode == OPCODE_OP && result->rs2_regno != 0 &&
-                result->rs2_regno == riscv_get_rd(r_inst)) {
-              result->rs2_read_skip = 1;
-            }
-          } else if (r_opcode == OPCODE_BRANCH || r_opcode == OPCODE_JAL || r_opcode == OPCODE_JALR) {
-            r_break = 1;
-          }
-        }
-        // write skip search
-        int w_index = result->inst_window_pos + i;
-        if (!w_break && w_index >= 0 && result->inst_window_pc[w_index] != 0xffffffff) {
-          unsigned w_inst = riscv_decompress(result->inst_window[w_index]);
-          unsigned w_opcode = riscv_get_opcode(w_inst);
-          if (w_opcode == OPCODE_OP || w_opcode == OPCODE_OP_IMM ||
-              w_opcode == OPCODE_LUI || w_opcode == OPCODE_AUIPC || w_opcode == OPCODE_LOAD) {
-            if (result->opcode == OPCODE_OP && result->rd_regno != 0 &&
-                result->rd_regno == riscv_get_rd(w_inst)) {
-              result->rd_write_skip = 1;
-            }
-          } else if (w_opcode == OPCODE_BRANCH || w_opcode == OPCODE_JAL || w_opcode == OPCODE_JALR) {
-            w_break = 1;
-          }
-        }
-      }
+    if (csr->regstat) {
+      regstat_step(csr->regstat, result);
     }
     if (result->opcode == OPCODE_OP || result->opcode == OPCODE_OP_IMM) {
       if (result->rs1_regno != 0 && csr->cycle_reg_written[result->rs1_regno] != -1 &&
@@ -1048,71 +1184,11 @@ static void csr_update_counters(csr_t *csr, struct core_step_result *result) {
       csr->cycle_reg_written[result->rd_regno] = result->cycle;
     }
   }
-  if (csr->regstat_en) {
-    // HPM3 regread total
-    if (result->rs1_regno != 0) {
-      csr->hpmcounter[CSR_ADDR_M_HPMCOUNTER3 - CSR_ADDR_M_HPMCOUNTER3]++;
-    }
-    if (result->rs2_regno != 0) {
-      csr->hpmcounter[CSR_ADDR_M_HPMCOUNTER3 - CSR_ADDR_M_HPMCOUNTER3]++;
-    }
-    // HPM4 regread skip total
-    if (result->rs1_read_skip != 0) {
-      csr->hpmcounter[CSR_ADDR_M_HPMCOUNTER4 - CSR_ADDR_M_HPMCOUNTER3]++;
-    }
-    if (result->rs2_read_skip != 0) {
-      csr->hpmcounter[CSR_ADDR_M_HPMCOUNTER4 - CSR_ADDR_M_HPMCOUNTER3]++;
-    }
-    // HPM5 regwrite total
-    if (result->rd_regno != 0) {
-      csr->hpmcounter[CSR_ADDR_M_HPMCOUNTER5 - CSR_ADDR_M_HPMCOUNTER3]++;
-    }
-    // HPM6 regwrite skip total
-    if (result->rd_write_skip != 0) {
-      csr->hpmcounter[CSR_ADDR_M_HPMCOUNTER6 - CSR_ADDR_M_HPMCOUNTER3]++;
-    }
-  }
-  // HPM7 ICACHE access
-  if (result->icache_access) {
-    csr->hpmcounter[CSR_ADDR_M_HPMCOUNTER7 - CSR_ADDR_M_HPMCOUNTER3]++;
-  }
-  // HPM8 ICACHE hit
-  if (result->icache_hit) {
-    csr->hpmcounter[CSR_ADDR_M_HPMCOUNTER8 - CSR_ADDR_M_HPMCOUNTER3]++;
-  }
-  // HPM9 DCACHE access
-  if (result->dcache_access) {
-    csr->hpmcounter[CSR_ADDR_M_HPMCOUNTER9 - CSR_ADDR_M_HPMCOUNTER3]++;
-  }
-  // HPM10 DCACHE hit
-  if (result->dcache_hit) {
-    csr->hpmcounter[CSR_ADDR_M_HPMCOUNTER10 - CSR_ADDR_M_HPMCOUNTER3]++;
-  }
-  // HPM11 TLB access
-  if (result->tlb_access) {
-    csr->hpmcounter[CSR_ADDR_M_HPMCOUNTER11 - CSR_ADDR_M_HPMCOUNTER3]++;
-  }
-  // HPM12 TLB hit
-  if (result->tlb_hit) {
-    csr->hpmcounter[CSR_ADDR_M_HPMCOUNTER12 - CSR_ADDR_M_HPMCOUNTER3]++;
-  }
-  if (csr->regstat_en) {
-    if (result->rd_regno != 0) {
-      if (result->rd_data < (1 << 4)) {
-        // HPM13 Data Width 4
-        csr->hpmcounter[CSR_ADDR_M_HPMCOUNTER13 - CSR_ADDR_M_HPMCOUNTER3]++;
-      } else if (result->rd_data < (1 << 8)) {
-        // HPM14 Data Width 8
-        csr->hpmcounter[CSR_ADDR_M_HPMCOUNTER14 - CSR_ADDR_M_HPMCOUNTER3]++;
-      } else if (result->rd_data < (1 << 16)) {
-        // HPM15 Data Width 16
-        csr->hpmcounter[CSR_ADDR_M_HPMCOUNTER15 - CSR_ADDR_M_HPMCOUNTER3]++;
-      } else if (result->rd_data < (1 << 24)) {
-        // HPM16 Data Width 24
-        csr->hpmcounter[CSR_ADDR_M_HPMCOUNTER16 - CSR_ADDR_M_HPMCOUNTER3]++;
-      } else {
-        // HPM17 Data Width 32
-        csr->hpmcounter[CSR_ADDR_M_HPMCOUNTER17 - CSR_ADDR_M_HPMCOUNTER3]++;
+  // HPM counters, nothing to do unless an event is selected
+  if (csr->hpm_active) {
+    for (int i = 0; i < CSR_NUM_HPM && (csr->hpm_active >> i); i++) {
+      if ((csr->hpm_active >> i) & 1) {
+        csr->hpmcounter[i] += csr_hpm_event_count(csr, csr->hpmevent[i], result);
       }
     }
   }
@@ -1154,6 +1230,9 @@ void csr_cycle(csr_t *csr, struct core_step_result *result) {
 
     unsigned interrupts_pending = csr_get_m_interrupts_pending(csr);
     unsigned interrupt = interrupts_enable & interrupts_pending;
+    if (interrupt && csr->hpm_active) {
+      csr_hpm_count(csr, CSR_HPM_EVENT_INTERRUPT);
+    }
     // Simultaneous interrupts destined for M-mode are handled in the following
     // decreasing priority order: MEI, MSI, MTI, SEI, SSI, STI
     if (interrupt & CSR_INT_MEI) {
@@ -1187,5 +1266,11 @@ void csr_cycle(csr_t *csr, struct core_step_result *result) {
 }
 
 void csr_fini(csr_t *csr) {
+#if REGISTER_STATISTICS
+  if (csr->regstat) {
+    regstat_fini(csr->regstat);
+    free(csr->regstat);
+  }
+#endif
   return;
 }
@@ -8,6 +8,55 @@ struct memory_t;
 struct plic_t;
 struct aclint_t;
 struct trigger_t;
+struct regstat_t;
+
+// mhpmevent: the events selectable for mhpmcounter3..31 (0: none, not counted)
+#define CSR_HPM_EVENT_NONE 0x00
+// retired instructions
+#define CSR_HPM_EVENT_LOAD 0x01
+#define CSR_HPM_EVENT_STORE 0x02
+#define CSR_HPM_EVENT_AMO 0x03
+#define CSR_HPM_EVENT_BRANCH 0x04
+#define CSR_HPM_EVENT_BRANCH_TAKEN 0x05
+#define CSR_HPM_EVENT_BRANCH_NOT_TAKEN 0x06
+#define CSR_HPM_EVENT_JUMP 0x07
+#define CSR_HPM_EVENT_ALU 0x08
+#define CSR_HPM_EVENT_MULDIV 0x09
+#define CSR_HPM_EVENT_FP 0x0a
+#define CSR_HPM_EVENT_SYSTEM 0x0b
+#define CSR_HPM_EVENT_FENCE 0x0c
+// traps
+#define CSR_HPM_EVENT_EXCEPTION 0x10
+#define CSR_HPM_EVENT_INTERRUPT 0x11
+// memory system
+#define CSR_HPM_EVENT_ICACHE_ACCESS 0x20
+#define CSR_HPM_EVENT_ICACHE_HIT 0x21
+#define CSR_HPM_EVENT_ICACHE_MISS 0x22
+#define CSR_HPM_EVENT_DCACHE_ACCESS 0x23
+#define CSR_HPM_EVENT_DCACHE_HIT 0x24
+#define CSR_HPM_EVENT_DCACHE_MISS 0x25
+#define CSR_HPM_EVENT_DCACHE_WRITE_BACK 0x26
+#define CSR_HPM_EVENT_TLB_ACCESS 0x27
+#define CSR_HPM_EVENT_TLB_HIT 0x28
+#define CSR_HPM_EVENT_TLB_MISS 0x29
+#define CSR_HPM_EVENT_PAGE_WALK 0x2a
+#define CSR_HPM_EVENT_L2_ACCESS 0x2b
+#define CSR_HPM_EVENT_L2_MISS 0x2c
+#define CSR_HPM_EVENT_MMIO 0x2d
+// register statistics (with regstat_en)
+#define CSR_HPM_EVENT_REG_READ 0x40
+#define CSR_HPM_EVENT_REG_READ_SKIP 0x41
+#define CSR_HPM_EVENT_REG_WRITE 0x42
+#define CSR_HPM_EVENT_REG_WRITE_SKIP 0x43
+#define CSR_HPM_EVENT_WIDTH4 0x44
+#define CSR_HPM_EVENT_WIDTH8 0x45
+#define CSR_HPM_EVENT_WIDTH16 0x46
+#define CSR_HPM_EVENT_WIDTH24 0x47
+#define CSR_HPM_EVENT_WIDTH32 0x48
+#define CSR_HPM_EVENT_MASK 0xff
+// mcountinhibit (the cycle counter is also the time base of the interrupt check, never inhibited)
+#define CSR_COUNTINHIBIT_IR 0x00000004
+#define CSR_COUNTINHIBIT_MASK 0xfffffffc
 
 typedef struct csr_t {
   struct lsu_t *lsu;
@@ -24,6 +73,7 @@ typedef struct csr_t {
   unsigned long long cycle;
   unsigned long long instret;
   unsigned char stip;
+  unsigned long long stimecmp; // S-mode timer of the native SBI (set_timer)
   unsigned char status_spp; // previous privilege mode
   unsigned char status_mpp; // previous privilege mode
   unsigned status_sie; // global interrupt enable
@@ -49,9 +99,12 @@ typedef struct csr_t {
   unsigned scounteren;
   unsigned long long hpmcounter[29];
   unsigned hpmevent[29];
+  unsigned mcountinhibit;
+  unsigned hpm_active; // the counters with an event and not inhibited (bit 0: hpmcounter3)
 #if REGISTER_STATISTICS
   // statistics (extension)
   unsigned char regstat_en; // for register access analysis
+  struct regstat_t *regstat; // read and write skips
   long long cycle_reg_written[NUM_REGISTERS];
   long long regalu[NUM_REGISTERS];
   long long regtouch[NUM_REGISTERS];
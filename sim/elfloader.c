@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <sys/mman.h>
 
 #define STRINGIZE(x) STRINGIZE2(x)
@@ -44,6 +45,102 @@ typedef struct {
   Elf32_Word p_align;
 } Elf32_Phdr;
 
+#define SHT_SYMTAB 2
+#define SHN_UNDEF 0
+#define SHN_LORESERVE 0xff00
+#define STT_NOTYPE 0
+#define STT_FUNC 2
+#define STB_LOCAL 0
+#define ELF32_ST_BIND(i) ((i) >> 4)
+#define ELF32_ST_TYPE(i) ((i) & 0x0f)
+
+typedef struct {
+  Elf32_Word sh_name;
+  Elf32_Word sh_type;
+  Elf32_Word sh_flags;
+  Elf32_Addr sh_addr;
+  Elf32_Off sh_offset;
+  Elf32_Word sh_size;
+  Elf32_Word sh_link;
+  Elf32_Word sh_info;
+  Elf32_Word sh_addralign;
+  Elf32_Word sh_entsize;
+} Elf32_Shdr;
+
+typedef struct {
+  Elf32_Word st_name;
+  Elf32_Addr st_value;
+  Elf32_Word st_size;
+  unsigned char st_info;
+  unsigned char st_other;
+  Elf32_Half st_shndx;
+} Elf32_Sym;
+
+typedef struct {
+  unsigned addr;
+  unsigned size;
+  char *name;
+} elf_symbol_t;
+
+static int elf_symbol_cmp(const void *a, const void *b) {
+  unsigned addr_a = ((const elf_symbol_t *)a)->addr;
+  unsigned addr_b = ((const elf_symbol_t *)b)->addr;
+  return (addr_a > addr_b) - (addr_a < addr_b);
+}
+
+// functions and global labels in sections (not the mapping symbols $x/$d)
+static void elf_load_symbols(elf_t *elf, Elf32_Ehdr *elf_header) {
+  unsigned long file_size = elf->file_stat.st_size;
+  if (elf_header->e_shoff == 0 || elf_header->e_shentsize != sizeof(Elf32_Shdr) ||
+      elf_header->e_shoff + (unsigned long)elf_header->e_shnum * sizeof(Elf32_Shdr) > file_size) {
+    return;
+  }
+  Elf32_Shdr *sh = (Elf32_Shdr *)(&elf->head[elf_header->e_shoff]);
+  for (int i = 0; i < elf_header->e_shnum; i++) {
+    if (sh[i].sh_type != SHT_SYMTAB || sh[i].sh_link >= elf_header->e_shnum ||
+        sh[i].sh_offset + (unsigned long)sh[i].sh_size > file_size ||
+        sh[sh[i].sh_link].sh_offset + (unsigned long)sh[sh[i].sh_link].sh_size > file_size) {
+      continue;
+    }
+    Elf32_Sym *sym = (Elf32_Sym *)(&elf->head[sh[i].sh_offset]);
+    unsigned num = sh[i].sh_size / sizeof(Elf32_Sym);
+    char *strtab = &elf->head[sh[sh[i].sh_link].sh_offset];
+    unsigned strtab_size = sh[sh[i].sh_link].sh_size;
+    elf_symbol_t *symbol = (elf_symbol_t *)malloc((num + 1) * sizeof(elf_symbol_t));
+    unsigned n = 0;
+    for (unsigned j = 0; j < num; j++) {
+      unsigned type = ELF32_ST_TYPE(sym[j].st_info);
+      // a local label is a part of a function (loops in assembly), a global one is an entry
+      if ((type != STT_FUNC && (type != STT_NOTYPE || ELF32_ST_BIND(sym[j].st_info) == STB_LOCAL)) ||
+          sym[j].st_shndx == SHN_UNDEF ||
+          sym[j].st_shndx >= SHN_LORESERVE || sym[j].st_name >= strtab_size) {
+        continue;
+      }
+      char *name = &strtab[sym[j].st_name];
+      if (name[0] == '\0' || name[0] == '$' || strncmp(name, ".L", 2) == 0 ||
+          memchr(name, '\0', strtab_size - sym[j].st_name) == NULL) {
+        continue;
+      }
+      symbol[n].addr = sym[j].st_value;
+      symbol[n].size = sym[j].st_size;
+      symbol[n].name = name;
+      n++;
+    }
+    qsort(symbol, n, sizeof(elf_symbol_t), elf_symbol_cmp);
+    elf->symbol_addr = (unsigned *)malloc((n + 1) * sizeof(unsigned));
+    elf->symbol_size = (unsigned *)malloc((n + 1) * sizeof(unsigned));
+    elf->symbol_name = (char **)malloc((n + 1) * sizeof(char *));
+    for (unsigned j = 0; j < n; j++) {
+      elf->symbol_addr[j] = symbol[j].addr;
+      elf->symbol_size[j] = symbol[j].size;
+      elf->symbol_name[j] = symbol[j].name;
+    }
+    elf->symbols = n;
+    free(symbol);
+    break;
+  }
+}
+
 void elf_init(elf_t *elf, const char *elf_path) {
   FILE *fp = NULL;
   Elf32_Ehdr *elf_header;
@@ -61,6 +158,11 @@ void elf_init(elf_t *elf, const char *elf_path) {
   }
   // elf header
   elf_header = (Elf32_Ehdr *)elf->head;
+  if (elf->file_stat.st_size < (long)sizeof(Elf32_Ehdr) || memcmp(elf_header->e_ident, "\177ELF", 4) != 0) {
+    munmap(elf->head, elf->file_stat.st_size);
+    elf->head = NULL;
+    goto cleanup;
+  }
   // set program entry address
   elf->entry_address = elf_header->e_entry;
 
@@ -70,6 +172,10 @@ void elf_init(elf_t *elf, const char *elf_path) {
   elf->program_mem_size = NULL;
   elf->program = NULL;
   elf->program_base = NULL;
+  elf->symbols = 0;
+  elf->symbol_addr = NULL;
+  elf->symbol_size = NULL;
+  elf->symbol_name = NULL;
   for (int i = 0; i < elf_header->e_phnum; i++) {
     Elf32_Phdr *ph = (Elf32_Phdr *)(&elf->head[elf_header->e_phoff + elf_header->e_phentsize * i]);
     switch (ph->p_type) {
@@ -94,6 +200,7 @@ void elf_init(elf_t *elf, const char *elf_path) {
       break;
     }
   }
+  elf_load_symbols(elf, elf_header);
   elf->status = ELF_STATUS_LOADED;
  cleanup:
   if (fp) {
@@ -103,10 +210,16 @@ void elf_init(elf_t *elf, const char *elf_path) {
 }
 
 void elf_fini(elf_t *elf) {
+  if (elf->status != ELF_STATUS_LOADED) {
+    return;
+  }
   munmap(elf->head, elf->file_stat.st_size);
   free(elf->program);
   free(elf->program_file_size);
   free(elf->program_mem_size);
   free(elf->program_base);
+  free(elf->symbol_addr);
+  free(elf->symbol_size);
+  free(elf->symbol_name);
   return;
 }
@@ -16,6 +16,11 @@ typedef struct elf_t {
   unsigned *program_mem_size;
   unsigned *program_base;
   char **program;
+  // the function symbols (sorted by address), the names are in the mapped file
+  unsigned symbols;
+  unsigned *symbol_addr;
+  unsigned *symbol_size; // 0: unknown
+  char **symbol_name;
 } elf_t;
 
 void elf_init(elf_t *, const char *elf_path);
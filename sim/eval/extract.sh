@@ -1,4 +1,5 @@
 #!/bin/sh
+# the events of launch_sim --stat-log
 
 for bench in `cat tests.txt`
 do
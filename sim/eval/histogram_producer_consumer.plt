@@ -7,5 +7,5 @@ set xrange [0:50]
 set title benchname." Histogram of Instructions between Producer and Consumer"
 set boxwidth 1.0 relative
 set style fill solid border lc rgb "black"
-filter(x,y)=int(x/y)*y
-plot benchname.".log.read" using (filter($4,1.0)):(1.0) smooth freq with boxes
+# the histogram of launch_sim --stat
+plot benchname.".riscv.p_to_c.dat" using 1:2 with boxes
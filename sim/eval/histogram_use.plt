@@ -7,5 +7,5 @@ set xrange [0:50]
 set title benchname." Histogram of Usage Count of Produced Data (ALU ONLY)"
 set boxwidth 1.0 relative
 set style fill solid border lc rgb "black"
-filter(x,y)=int(x/y)*y
-plot benchname.".log.write" using (filter($5,1.0)):(1.0) smooth freq with boxes
+# the histogram of launch_sim --stat
+plot benchname.".riscv.use.dat" using 1:2 with boxes
@@ -5,6 +5,6 @@ OUTPUT=read_skip.dat
 
 for item in ${TESTS}
 do
-    WSKIP=`tail -n 1 ${item}.riscv.log | cut -d " " -f 5`
+    WSKIP=`grep "^# write_skip" ${item}.riscv.log | cut -d " " -f 5`
     echo ${item} ${WSKIP}
 done
@@ -5,6 +5,6 @@ OUTPUT=write_skip.dat
 
 for item in ${TESTS}
 do
-    WSKIP=`tail -n 1 ${item}.riscv.log | cut -d " " -f 3`
+    WSKIP=`grep "^# write_skip" ${item}.riscv.log | cut -d " " -f 3`
     echo ${item} ${WSKIP}
 done
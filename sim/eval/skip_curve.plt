@@ -0,0 +1,10 @@
+set terminal png
+set output benchname.".skip.png"
+set key bottom left
+set yrange [0.0:1.0]
+set xlabel "Distance (instructions)"
+set ylabel "Reduction Rate (%)"
+set title benchname." Register Access by the Skip Distance"
+# the configurations of launch_sim --stat-sweep, a line per fetch window
+plot for [w in "8 16 32"] benchname.".riscv.skip.dat" using ($1 == w + 0 ? $2 : 1/0):4 with linespoints title "read (window ".w.")", \
+     for [w in "8 16 32"] benchname.".riscv.skip.dat" using ($1 == w + 0 ? $2 : 1/0):3 with linespoints dashtype 2 title "write (window ".w.")"
@@ -0,0 +1,140 @@
+#include "fdt.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define FDT_MAGIC 0xd00dfeed
+#define FDT_VERSION 17
+#define FDT_LAST_COMP_VERSION 16
+#define FDT_HEADER_SIZE 40
+#define FDT_RSVMAP_SIZE 16 // the terminating entry only
+
+#define FDT_BEGIN_NODE 0x00000001
+#define FDT_END_NODE 0x00000002
+#define FDT_PROP 0x00000003
+#define FDT_END 0x00000009
+
+static void fdt_put_be32(char *p, unsigned value) {
+  p[0] = (char)(value >> 24);
+  p[1] = (char)(value >> 16);
+  p[2] = (char)(value >> 8);
+  p[3] = (char)(value >> 0);
+}
+
+// appends to the structure block, padded to 4 bytes
+static void fdt_append(fdt_t *fdt, const void *data, unsigned len) {
+  unsigned padded = (len + 3) & ~3;
+  if (fdt->struct_len + padded > fdt->struct_cap) {
+    while (fdt->struct_len + padded > fdt->struct_cap) {
+      fdt->struct_cap *= 2;
+    }
+    fdt->dt_struct = (char *)realloc(fdt->dt_struct, fdt->struct_cap);
+  }
+  memcpy(&fdt->dt_struct[fdt->struct_len], data, len);
+  memset(&fdt->dt_struct[fdt->struct_len + len], 0, padded - len);
+  fdt->struct_len += padded;
+}
+
+static void fdt_token(fdt_t *fdt, unsigned token) {
+  char buf[4];
+  fdt_put_be32(buf, token);
+  fdt_append(fdt, buf, 4);
+}
+
+// offset of the name in the strings block (shared by the properties of the same name)
+static unsigned fdt_string(fdt_t *fdt, const char *name) {
+  unsigned len = strlen(name) + 1;
+  for (unsigned offs = 0; offs < fdt->strings_len; offs += strlen(&fdt->dt_strings[offs]) + 1) {
+    if (strcmp(&fdt->dt_strings[offs], name) == 0) {
+      return offs;
+    }
+  }
+  if (fdt->strings_len + len > fdt->strings_cap) {
+    while (fdt->strings_len + len > fdt->strings_cap) {
+      fdt->strings_cap *= 2;
+    }
+    fdt->dt_strings = (char *)realloc(fdt->dt_strings, fdt->strings_cap);
+  }
+  memcpy(&fdt->dt_strings[fdt->strings_len], name, len);
+  fdt->strings_len += len;
+  return fdt->strings_len - len;
+}
+
+void fdt_init(fdt_t *fdt) {
+  fdt->struct_cap = 4096;
+  fdt->struct_len = 0;
+  fdt->dt_struct = (char *)malloc(fdt->struct_cap);
+  fdt->strings_cap = 1024;
+  fdt->strings_len = 0;
+  fdt->dt_strings = (char *)malloc(fdt->strings_cap);
+  fdt->phandle = 0;
+}
+
+void fdt_begin_node(fdt_t *fdt, const char *name) {
+  fdt_token(fdt, FDT_BEGIN_NODE);
+  fdt_append(fdt, name, strlen(name) + 1);
+}
+
+void fdt_end_node(fdt_t *fdt) {
+  fdt_token(fdt, FDT_END_NODE);
+}
+
+void fdt_prop(fdt_t *fdt, const char *name, const void *data, unsigned len) {
+  char buf[12];
+  fdt_put_be32(&buf[0], FDT_PROP);
+  fdt_put_be32(&buf[4], len);
+  fdt_put_be32(&buf[8], fdt_string(fdt, name));
+  fdt_append(fdt, buf, 12);
+  if (len) {
+    fdt_append(fdt, data, len);
+  }
+}
+
+void fdt_prop_u32(fdt_t *fdt, const char *name, unsigned value) {
+  fdt_prop_cells(fdt, name, &value, 1);
+}
+
+void fdt_prop_cells(fdt_t *fdt, const char *name, const unsigned *cells, unsigned num) {
+  char *buf = (char *)malloc(4 * num + 1);
+  for (unsigned i = 0; i < num; i++) {
+    fdt_put_be32(&buf[4 * i], cells[i]);
+  }
+  fdt_prop(fdt, name, buf, 4 * num);
+  free(buf);
+}
+
+void fdt_prop_str(fdt_t *fdt, const char *name, const char *value) {
+  fdt_prop(fdt, name, value, strlen(value) + 1);
+}
+
+unsigned fdt_phandle(fdt_t *fdt) {
+  fdt_prop_u32(fdt, "phandle", ++fdt->phandle);
+  return fdt->phandle;
+}
+
+unsigned fdt_finish(fdt_t *fdt, char **blob) {
+  fdt_token(fdt, FDT_END);
+  unsigned off_rsvmap = FDT_HEADER_SIZE;
+  unsigned off_struct = off_rsvmap + FDT_RSVMAP_SIZE;
+  unsigned off_strings = off_struct + fdt->struct_len;
+  unsigned totalsize = off_strings + fdt->strings_len;
+  char *p = (char *)calloc(totalsize, sizeof(char));
+  fdt_put_be32(&p[0], FDT_MAGIC);
+  fdt_put_be32(&p[4], totalsize);
+  fdt_put_be32(&p[8], off_struct);
+  fdt_put_be32(&p[12], off_strings);
+  fdt_put_be32(&p[16], off_rsvmap);
+  fdt_put_be32(&p[20], FDT_VERSION);
+  fdt_put_be32(&p[24], FDT_LAST_COMP_VERSION);
+  fdt_put_be32(&p[28], 0); // boot_cpuid_phys
+  fdt_put_be32(&p[32], fdt->strings_len);
+  fdt_put_be32(&p[36], fdt->struct_len);
+  memcpy(&p[off_struct], fdt->dt_struct, fdt->struct_len);
+  memcpy(&p[off_strings], fdt->dt_strings, fdt->strings_len);
+  *blob = p;
+  return totalsize;
+}
+
+void fdt_fini(fdt_t *fdt) {
+  free(fdt->dt_struct);
+  free(fdt->dt_strings);
+}
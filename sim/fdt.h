@@ -0,0 +1,29 @@
+#ifndef FDT_H
+#define FDT_H
+
+// flattened device tree (version 17) builder
+typedef struct fdt_t {
+  char *dt_struct;
+  unsigned struct_len;
+  unsigned struct_cap;
+  char *dt_strings;
+  unsigned strings_len;
+  unsigned strings_cap;
+  unsigned phandle; // the last one allocated
+} fdt_t;
+
+void fdt_init(fdt_t *);
+void fdt_begin_node(fdt_t *, const char *name);
+void fdt_end_node(fdt_t *);
+void fdt_prop(fdt_t *, const char *name, const void *data, unsigned len);
+void fdt_prop_u32(fdt_t *, const char *name, unsigned value);
+// cells are converted to big endian
+void fdt_prop_cells(fdt_t *, const char *name, const unsigned *cells, unsigned num);
+void fdt_prop_str(fdt_t *, const char *name, const char *value);
+// adds a phandle property to the current node, returns it
+unsigned fdt_phandle(fdt_t *);
+// the blob (malloc'd), returns the size
+unsigned fdt_finish(fdt_t *, char **blob);
+void fdt_fini(fdt_t *);
+
+#endif
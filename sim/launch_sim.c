@@ -3,7 +3,12 @@
 #include <stdlib.h>
 #include <libgen.h>
 #include "sim.h"
+#include "lsu.h"
 #include "htif.h"
+#include "trace.h"
+#include "regstat.h"
+#include "prof.h"
+#include "procstat.h"
 
 void print_banner() {
   fprintf(stderr, "=============================================\n");
@@ -17,23 +22,209 @@ void dump_inst_callback(struct core_step_result *result, void *arg) {
   printf("%08x -> %08x, %s\n", result->pc, result->pc_next, riscv_get_mnemonic(riscv_decompress(result->inst)));
 }
 
-void stat_handler(struct core_step_result *result, void *file) {
-  unsigned inst = riscv_decompress(result->inst);
-  FILE *logfile = (FILE *)file;
+// histograms of the register statistics (--stat), the last bucket counts the larger ones
+#define STAT_HIST_SIZE 256
+
+typedef struct stat_t {
+  FILE *log; // the events (--stat-log), NULL: not written
+  unsigned long long p_to_c[STAT_HIST_SIZE]; // instructions from the producer to a consumer
+  unsigned long long p_to_o[STAT_HIST_SIZE]; // instructions from the producer to the overwriter
+  unsigned long long use[STAT_HIST_SIZE]; // consumers of the overwritten value
+} stat_t;
+
+static void stat_hist_add(unsigned long long *hist, unsigned value) {
+  hist[(value < STAT_HIST_SIZE) ? value : STAT_HIST_SIZE - 1]++;
+}
+
+void stat_handler(struct core_step_result *result, void *arg) {
+  stat_t *stat = (stat_t *)arg;
   if (result->opcode == OPCODE_OP || result->opcode == OPCODE_OP_IMM) {
     if (result->rs1_cycle_from_producer) {
-      fprintf(logfile, "%s %d R %u\n", riscv_get_mnemonic(inst), result->rs1_regno, result->rs1_cycle_from_producer);
+      stat_hist_add(stat->p_to_c, result->rs1_cycle_from_producer);
     }
     if (result->rs2_cycle_from_producer) {
-      fprintf(logfile, "%s %d R %u\n", riscv_get_mnemonic(inst), result->rs2_regno, result->rs2_cycle_from_producer);
+      stat_hist_add(stat->p_to_c, result->rs2_cycle_from_producer);
     }
     if (result->rd_cycle_from_producer) {
-      fprintf(logfile, "%s %d W %u %d\n", riscv_get_mnemonic(inst), result->rd_regno, result->rd_cycle_from_producer, result->rd_used_count);
+      stat_hist_add(stat->p_to_o, result->rd_cycle_from_producer);
+      stat_hist_add(stat->use, result->rd_used_count);
+    }
+    if (stat->log) {
+      unsigned inst = riscv_decompress(result->inst);
+      FILE *logfile = stat->log;
+      if (result->rs1_cycle_from_producer) {
+        fprintf(logfile, "%s %d R %u\n", riscv_get_mnemonic(inst), result->rs1_regno, result->rs1_cycle_from_producer);
+      }
+      if (result->rs2_cycle_from_producer) {
+        fprintf(logfile, "%s %d R %u\n", riscv_get_mnemonic(inst), result->rs2_regno, result->rs2_cycle_from_producer);
+      }
+      if (result->rd_cycle_from_producer) {
+        fprintf(logfile, "%s %d W %u %d\n", riscv_get_mnemonic(inst), result->rd_regno, result->rd_cycle_from_producer, result->rd_used_count);
+      }
     }
   }
   return;
 }
 
+// [name].[suffix].dat: "value count" per line (eval/histogram_xxx.plt)
+int stat_write_hist(const char *name, const char *suffix, const char *title, const unsigned long long *hist) {
+  char file_name[256];
+  snprintf(file_name, sizeof(file_name), "%s.%s.dat", name, suffix);
+  FILE *fp = fopen(file_name, "w");
+  if (fp == NULL) {
+    perror(file_name);
+    return -1;
+  }
+  fprintf(fp, "# %s: value count (the last one: %u and more)\n", title, STAT_HIST_SIZE - 1);
+  for (unsigned i = 0; i < STAT_HIST_SIZE; i++) {
+    fprintf(fp, "%u %llu\n", i, hist[i]);
+  }
+  fclose(fp);
+  return 0;
+}
+
+// [name].skip.dat: a line per configuration of the skip analysis (eval/skip_curve.plt)
+int stat_write_skip(const char *name, const regstat_t *regstat) {
+  char file_name[256];
+  snprintf(file_name, sizeof(file_name), "%s.skip.dat", name);
+  FILE *fp = fopen(file_name, "w");
+  if (fp == NULL) {
+    perror(file_name);
+    return -1;
+  }
+  fprintf(fp, "# regread %llu regwrite %llu\n", regstat->read, regstat->write);
+  fprintf(fp, "# window distance write_skip read_skip regwrite_skip regread_skip producer consumer writer overwriter\n");
+  for (unsigned c = 0; c < regstat->num_config; c++) {
+    const regstat_config_t *config = &regstat->config[c];
+    fprintf(fp, "%u %u %f %f %llu %llu 0x%02x 0x%02x 0x%02x 0x%02x\n", config->window, config->distance,
+            1.0 - (double)regstat->write_skip[c] / (double)regstat->write,
+            1.0 - (double)regstat->read_skip[c] / (double)regstat->read,
+            regstat->write_skip[c], regstat->read_skip[c],
+            config->producer, config->consumer, config->writer, config->overwriter);
+  }
+  fclose(fp);
+  return 0;
+}
+
+// op+imm+upper+load+other, alu: op+imm+upper
+static int parse_regstat_class(const char *spec, unsigned *cls) {
+  static const struct { const char *name; unsigned cls; } names[] = {
+    {"op", REGSTAT_CLASS_OP}, {"imm", REGSTAT_CLASS_OP_IMM}, {"upper", REGSTAT_CLASS_UPPER},
+    {"load", REGSTAT_CLASS_LOAD}, {"other", REGSTAT_CLASS_OTHER}, {"alu", REGSTAT_CLASS_ALU},
+  };
+  *cls = 0;
+  while (*spec) {
+    size_t len = strcspn(spec, "+");
+    unsigned i;
+    for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+      if (strlen(names[i].name) == len && strncmp(spec, names[i].name, len) == 0) {
+        *cls |= names[i].cls;
+        break;
+      }
+    }
+    if (i == sizeof(names) / sizeof(names[0])) {
+      fprintf(stderr, "unknown instruction class: %.*s\n", (int)len, spec);
+      return -1;
+    }
+    spec += len + (spec[len] == '+');
+  }
+  return 0;
+}
+
+// [Window],[Distance][,p=classes][,c=classes][,w=classes][,o=classes]
+int parse_regstat(const char *spec, regstat_config_t *config) {
+  char buf[128];
+  snprintf(buf, sizeof(buf), "%s", spec);
+  char *field = strtok(buf, ",");
+  for (int n = 0; field; n++, field = strtok(NULL, ",")) {
+    if (n == 0) {
+      config->window = (unsigned)strtol(field, NULL, 0);
+    } else if (n == 1) {
+      config->distance = (unsigned)strtol(field, NULL, 0);
+    } else if (strncmp(field, "p=", 2) == 0) {
+      if (parse_regstat_class(field + 2, &config->producer)) return -1;
+    } else if (strncmp(field, "c=", 2) == 0) {
+      if (parse_regstat_class(field + 2, &config->consumer)) return -1;
+    } else if (strncmp(field, "w=", 2) == 0) {
+      if (parse_regstat_class(field + 2, &config->writer)) return -1;
+    } else if (strncmp(field, "o=", 2) == 0) {
+      if (parse_regstat_class(field + 2, &config->overwriter)) return -1;
+    } else {
+      fprintf(stderr, "unknown skip analysis option: %s\n", field);
+      return -1;
+    }
+  }
+  if (config->window == 0 || config->distance == 0 || config->distance > REGSTAT_MAX_DISTANCE) {
+    fprintf(stderr, "invalid skip analysis (distance 1 to %d): %s\n", REGSTAT_MAX_DISTANCE, spec);
+    return -1;
+  }
+  return 0;
+}
+
+// [sscratch | tp | Address[:Stride]],[Offset of the name]
+static int parse_proc_task(const char *spec, procstat_task_t *task) {
+  char *end;
+  const char *comma = strchr(spec, ',');
+  if (comma == NULL) {
+    fprintf(stderr, "no offset of the task name: %s\n", spec);
+    return -1;
+  }
+  task->stride = 0;
+  if (strncmp(spec, "sscratch,", 9) == 0) {
+    task->base = PROCSTAT_TASK_SSCRATCH;
+  } else if (strncmp(spec, "tp,", 3) == 0) {
+    task->base = PROCSTAT_TASK_TP;
+  } else {
+    task->base = PROCSTAT_TASK_ADDR;
+    task->addr = (unsigned)strtoul(spec, &end, 0);
+    if (*end == ':') {
+      task->stride = (unsigned)strtoul(end + 1, &end, 0);
+    }
+    if (end != comma) {
+      fprintf(stderr, "invalid task address: %s\n", spec);
+      return -1;
+    }
+  }
+  task->offset = (unsigned)strtoul(comma + 1, NULL, 0);
+  return 0;
+}
+
+// [Sets],[Ways],[Line bytes][,lru|plru|random|fifo][,wb|wt][,wa|nwa]
+int parse_cache(const char *spec, cache_config_t *config) {
+  char buf[128];
+  snprintf(buf, sizeof(buf), "%s", spec);
+  char *field = strtok(buf, ",");
+  for (int n = 0; field; n++, field = strtok(NULL, ",")) {
+    if (n == 0) {
+      config->sets = (unsigned)strtol(field, NULL, 0);
+    } else if (n == 1) {
+      config->ways = (unsigned)strtol(field, NULL, 0);
+    } else if (n == 2) {
+      config->line_len = (unsigned)strtol(field, NULL, 0);
+    } else if (strcmp(field, "lru") == 0) {
+      config->replace = CACHE_REPLACE_LRU;
+    } else if (strcmp(field, "plru") == 0) {
+      config->replace = CACHE_REPLACE_PLRU;
+    } else if (strcmp(field, "random") == 0) {
+      config->replace = CACHE_REPLACE_RANDOM;
+    } else if (strcmp(field, "fifo") == 0) {
+      config->replace = CACHE_REPLACE_FIFO;
+    } else if (strcmp(field, "wb") == 0) {
+      config->write &= ~CACHE_WRITE_THROUGH;
+    } else if (strcmp(field, "wt") == 0) {
+      config->write |= CACHE_WRITE_THROUGH;
+    } else if (strcmp(field, "wa") == 0) {
+      config->write &= ~CACHE_WRITE_NO_ALLOCATE;
+    } else if (strcmp(field, "nwa") == 0) {
+      config->write |= CACHE_WRITE_NO_ALLOCATE;
+    } else {
+      fprintf(stderr, "unknown cache policy: %s\n", field);
+      return -1;
+    }
+  }
+  return 0;
+}
+
 void debug_callback(sim_t *sim, unsigned dcause, unsigned trigger_type, unsigned tdata1, unsigned tdata2, unsigned tdata3) {
   unsigned addr = tdata2;
   if (dcause == CSR_DCSR_CAUSE_TRIGGER && trigger_type == CSR_TDATA1_TYPE_MATCH6 && addr != sim->htif_tohost) {
@@ -61,16 +252,56 @@ int main(int argc, char *argv[]) {
   char log_file_name[128];
   char *uart_in_file_name = NULL;
   char *uart_out_file_name = NULL;
-  char *disk_file_name = NULL;
+  char *disk_file_name[VIRTIO_MMIO_MAX_DEVICES];
+  int num_disks = 0;
+  int vcon_enable = 0;
+  char *vcon_in_file_name = NULL;
+  char *vcon_out_file_name = NULL;
+  char *share_dir_name = NULL;
+  char *share_tag = "host0";
+  char *net_socket_name = NULL;
+  int net_switch_enable = 0;
   int htif_enable = 0;
+  int sbi_enable = 0;
   int rvtest_enable = 0;
   int stat_enable = 0;
   int num_cores = 1;
+  int parallel_enable = 0;
+  unsigned quantum = 0;
+  unsigned sched = 0;
+  unsigned sched_seed = 0;
+  unsigned tlb_entries = 64;
+  unsigned tlb_ways = 4;
+  unsigned tlb_replace = TLB_REPLACE_LRU;
+  unsigned tlb_split = 0;
+  cache_config_t icache = {32, 128, 1, CACHE_REPLACE_LRU, CACHE_WRITE_BACK};
+  cache_config_t dcache = {32, 256, 1, CACHE_REPLACE_LRU, CACHE_WRITE_BACK};
+  cache_config_t l2 = {64, 1024, 8, CACHE_REPLACE_LRU, CACHE_WRITE_BACK};
+  int l2_enable = 0;
+  char *dtb_file_name = NULL;
+  char *bootargs = NULL;
+  char *initrd_file_name = NULL;
   FILE *statlog = NULL;
+  stat_t *stat = NULL;
+  int stat_log_enable = 0;
+  char *trace_file_name = NULL;
+  int dump_enable = 0;
+  trace_t *trace = NULL;
+  int prof_enable = 0;
+  unsigned prof_period = 1;
+  int prof_callgraph_enable = 0;
+  char *prof_sym_file_name = NULL;
+  char *prof_user_file_name = NULL;
+  prof_t *prof = NULL;
+  int procstat_enable = 0;
+  procstat_task_t procstat_task_spec = {PROCSTAT_TASK_NONE, 0, 0, 0};
+  procstat_t *procstat = NULL;
+  regstat_config_t stat_config[REGSTAT_MAX_CONFIG];
+  int num_stat_config = 0;
 
   if (argc < 2) {
     print_banner();
-    fprintf(stderr, "usage: %s [ELF FILE]\n", argv[0]);
+    fprintf(stderr, "usage: %s [ELF FILE | Image]\n", argv[0]);
     return 0;
   }
 
@@ -89,8 +320,78 @@ int main(int argc, char *argv[]) {
       sim_write_csr(sim, CSR_ADDR_D_CSR, CSR_DCSR_EBREAK_M | CSR_DCSR_EBREAK_S | CSR_DCSR_EBREAK_U | PRIVILEGE_MODE_M);
     } else if (strcmp(argv[i], "--stat") == 0) {
       stat_enable = 1;
+    } else if (strcmp(argv[i], "--stat-log") == 0) {
+      stat_enable = 1;
+      stat_log_enable = 1;
+    } else if (strcmp(argv[i], "--stat-config") == 0) {
+      i++;
+      if (i < argc) {
+        regstat_config_t config = REGSTAT_CONFIG_DEFAULT;
+        if (num_stat_config == REGSTAT_MAX_CONFIG - 1) {
+          // the default analysis takes one
+          fprintf(stderr, "too many skip analyses (up to %d): %s\n", REGSTAT_MAX_CONFIG - 1, argv[i]);
+          goto cleanup;
+        }
+        if (parse_regstat(argv[i], &config) != 0) {
+          goto cleanup;
+        }
+        stat_config[num_stat_config++] = config;
+        stat_enable = 1;
+      }
+    } else if (strcmp(argv[i], "--stat-sweep") == 0) {
+      // the windows and distances of eval/skip_curve.plt
+      static const unsigned windows[] = {8, 16, 32};
+      static const unsigned distances[] = {1, 2, 3, 4, 6, 8};
+      for (unsigned w = 0; w < sizeof(windows) / sizeof(windows[0]); w++) {
+        for (unsigned d = 0; d < sizeof(distances) / sizeof(distances[0]); d++) {
+          regstat_config_t config = REGSTAT_CONFIG_DEFAULT;
+          if (num_stat_config == REGSTAT_MAX_CONFIG - 1) {
+            fprintf(stderr, "too many skip analyses (up to %d): --stat-sweep\n", REGSTAT_MAX_CONFIG - 1);
+            goto cleanup;
+          }
+          config.window = windows[w];
+          config.distance = distances[d];
+          stat_config[num_stat_config++] = config;
+        }
+      }
+      stat_enable = 1;
     } else if (strcmp(argv[i], "--dump") == 0) {
+      dump_enable = 1;
       sim_set_step_callback(sim, dump_inst_callback);
+    } else if (strcmp(argv[i], "--trace") == 0) {
+      i++;
+      if (i < argc) {
+        trace_file_name = argv[i];
+      }
+    } else if (strcmp(argv[i], "--prof") == 0) {
+      i++;
+      if (i < argc) {
+        prof_enable = 1;
+        prof_period = (unsigned)strtol(argv[i], NULL, 0);
+      }
+    } else if (strcmp(argv[i], "--prof-callgraph") == 0) {
+      prof_enable = 1;
+      prof_callgraph_enable = 1;
+    } else if (strcmp(argv[i], "--prof-sym") == 0) {
+      i++;
+      if (i < argc) {
+        prof_sym_file_name = argv[i];
+      }
+    } else if (strcmp(argv[i], "--prof-user") == 0) {
+      i++;
+      if (i < argc) {
+        prof_user_file_name = argv[i];
+      }
+    } else if (strcmp(argv[i], "--proc-stat") == 0) {
+      procstat_enable = 1;
+    } else if (strcmp(argv[i], "--proc-task") == 0) {
+      i++;
+      if (i < argc) {
+        if (parse_proc_task(argv[i], &procstat_task_spec) != 0) {
+          goto cleanup;
+        }
+        procstat_enable = 1;
+      }
     } else if (strcmp(argv[i], "--timer") == 0) {
       sim_enable_timer(sim);
     } else if (strcmp(argv[i], "--uart-in") == 0) {
@@ -103,10 +404,49 @@ int main(int argc, char *argv[]) {
       if (i < argc) {
         uart_out_file_name = argv[i];
       }
+    } else if (strcmp(argv[i], "--vcon") == 0) {
+      vcon_enable = 1;
+    } else if (strcmp(argv[i], "--vcon-in") == 0) {
+      i++;
+      if (i < argc) {
+        vcon_enable = 1;
+        vcon_in_file_name = argv[i];
+      }
+    } else if (strcmp(argv[i], "--vcon-out") == 0) {
+      i++;
+      if (i < argc) {
+        vcon_enable = 1;
+        vcon_out_file_name = argv[i];
+      }
+    } else if (strcmp(argv[i], "--9p") == 0) {
+      i++;
+      if (i < argc) {
+        share_dir_name = argv[i];
+      }
+    } else if (strcmp(argv[i], "--9p-tag") == 0) {
+      i++;
+      if (i < argc) {
+        share_tag = argv[i];
+      }
+    } else if (strcmp(argv[i], "--net") == 0) {
+      i++;
+      if (i < argc) {
+        net_socket_name = argv[i];
+      }
+    } else if (strcmp(argv[i], "--net-switch") == 0) {
+      i++;
+      if (i < argc) {
+        net_socket_name = argv[i];
+        net_switch_enable = 1;
+      }
     } else if (strcmp(argv[i], "--disk") == 0) {
       i++;
       if (i < argc) {
-        disk_file_name = argv[i];
+        if (num_disks < VIRTIO_MMIO_MAX_DEVICES) {
+          disk_file_name[num_disks++] = argv[i];
+        } else {
+          fprintf(stderr, "too many disks, ignored: %s\n", argv[i]);
+        }
       }
     } else if (strcmp(argv[i], "--tohost") == 0) {
       i++;
@@ -123,11 +463,84 @@ int main(int argc, char *argv[]) {
       if (i < argc) {
         num_cores = atoi(argv[i]);
       }
+    } else if (strcmp(argv[i], "--parallel") == 0) {
+      parallel_enable = 1;
+    } else if (strcmp(argv[i], "--quantum") == 0) {
+      i++;
+      if (i < argc) {
+        quantum = (unsigned)strtol(argv[i], NULL, 0);
+      }
+    } else if (strcmp(argv[i], "--strict") == 0) {
+      sched |= SIM_SCHED_STRICT;
+    } else if (strcmp(argv[i], "--random-sched") == 0) {
+      i++;
+      if (i < argc) {
+        sched |= SIM_SCHED_RANDOM;
+        sched_seed = (unsigned)strtol(argv[i], NULL, 0);
+      }
+    } else if (strcmp(argv[i], "--tlb") == 0) {
+      i++;
+      if (i < argc) {
+        tlb_entries = (unsigned)strtol(argv[i], NULL, 0);
+      }
+    } else if (strcmp(argv[i], "--tlb-ways") == 0) {
+      i++;
+      if (i < argc) {
+        tlb_ways = (unsigned)strtol(argv[i], NULL, 0);
+      }
+    } else if (strcmp(argv[i], "--tlb-plru") == 0) {
+      tlb_replace = TLB_REPLACE_PLRU;
+    } else if (strcmp(argv[i], "--split-tlb") == 0) {
+      tlb_split = 1;
+    } else if (strcmp(argv[i], "--icache") == 0) {
+      i++;
+      if (i < argc && parse_cache(argv[i], &icache) != 0) {
+        goto cleanup;
+      }
+    } else if (strcmp(argv[i], "--dcache") == 0) {
+      i++;
+      if (i < argc && parse_cache(argv[i], &dcache) != 0) {
+        goto cleanup;
+      }
+    } else if (strcmp(argv[i], "--l2") == 0) {
+      i++;
+      l2_enable = 1;
+      if (i < argc && parse_cache(argv[i], &l2) != 0) {
+        goto cleanup;
+      }
+    } else if (strcmp(argv[i], "--sbi") == 0) {
+      sbi_enable = 1;
+    } else if (strcmp(argv[i], "--dtb") == 0) {
+      i++;
+      if (i < argc) {
+        dtb_file_name = argv[i];
+      }
+    } else if (strcmp(argv[i], "--initrd") == 0) {
+      i++;
+      if (i < argc) {
+        initrd_file_name = argv[i];
+      }
+    } else if (strcmp(argv[i], "--bootargs") == 0) {
+      i++;
+      if (i < argc) {
+        bootargs = argv[i];
+      }
     } else if (strcmp(argv[i], "--config-rom") == 0) {
       sim_config_on(sim);
     }
   }
 
+  if (dump_enable + (trace_file_name != NULL) + stat_enable > 1) {
+    // each of them is the step callback
+    fprintf(stderr, "--dump, --trace and --stat can not be used together\n");
+    goto cleanup;
+  }
+  if (parallel_enable && stat_enable) {
+    // the data cache is not simulated, its counters would read 0
+    fprintf(stderr, "--stat can not be used with --parallel\n");
+    goto cleanup;
+  }
+
   if (rvtest_enable) {
     sim_set_debug_callback(sim, htif_riscv_test_callback);
     sim_set_write_trigger(sim, sim->htif_tohost);
@@ -141,35 +554,126 @@ int main(int argc, char *argv[]) {
       sim_add_core(sim);
     }
   }
+  if (sim_tlb_config(sim, tlb_entries, tlb_ways, tlb_replace, tlb_split) != 0) {
+    goto cleanup;
+  }
+  if (sim_cache_config(sim, &icache, &dcache, l2_enable ? &l2 : NULL) != 0) {
+    goto cleanup;
+  }
+  if (parallel_enable) {
+    sim_parallel_on(sim, quantum);
+  } else {
+    sim_schedule(sim, quantum, sched, sched_seed);
+  }
 
-  // load elf file to ram
-  if (sim_load_elf(sim, argv[1]) != 0) {
+  // load Linux Image (boots in S mode) or elf file to ram
+  int image = sim_load_image(sim, argv[1]);
+  if (image < 0) {
+    fprintf(stderr, "error in Image: %s\n", argv[1]);
+    goto cleanup;
+  }
+  if (image > 0 && sim_load_elf(sim, argv[1]) != 0) {
     fprintf(stderr, "error in elf file: %s\n", argv[1]);
     goto cleanup;
   }
+  if (initrd_file_name && sim_load_initrd(sim, initrd_file_name) != 0) {
+    fprintf(stderr, "error in initrd: %s\n", initrd_file_name);
+    goto cleanup;
+  }
+  if (sbi_enable) {
+    // the kernel starts in S mode, the SBI calls are served by the simulator
+    sim_sbi_on(sim);
+    sim_write_csr(sim, CSR_ADDR_D_CSR, (sim_read_csr(sim, CSR_ADDR_D_CSR) & 0xfffffffc) | PRIVILEGE_MODE_S);
+  }
   // if you open disk file read only mode, set 1 to the last argument below
-  if (disk_file_name != NULL) {
-    sim_virtio_disk(sim, disk_file_name, 0);
+  for (int i = 0; i < num_disks; i++) {
+    if (sim_virtio_disk(sim, disk_file_name[i], 0) < 0) {
+      fprintf(stderr, "error in disk file: %s\n", disk_file_name[i]);
+    }
+  }
+  if (share_dir_name && sim_virtio_9p(sim, share_dir_name, share_tag) < 0) {
+    fprintf(stderr, "error in 9p shared directory: %s\n", share_dir_name);
+  }
+  if (net_switch_enable && sim_net_switch(sim, net_socket_name) < 0) {
+    fprintf(stderr, "error in network switch: %s\n", net_socket_name);
+  }
+  if (net_socket_name && sim_virtio_net(sim, net_socket_name) < 0) {
+    fprintf(stderr, "error in network device: %s\n", net_socket_name);
+  }
+  // virtio console after the disks (keeps /dev/vda the first disk)
+  if (vcon_enable) {
+    if (sim_virtio_console(sim, vcon_in_file_name, vcon_out_file_name) < 0) {
+      fprintf(stderr, "error in virtio console\n");
+    } else if (vcon_in_file_name == NULL && uart_in_file_name == NULL) {
+      // stdin belongs to the virtio console
+      uart_in_file_name = "/dev/null";
+    }
   }
   sim_uart_io(sim, uart_in_file_name, uart_out_file_name);
 
+  if (trace_file_name) {
+    // binary trace of the retired instructions (see trace_dump)
+    trace = (trace_t *)malloc(sizeof(trace_t));
+    if (trace_init(trace, trace_file_name) != 0) {
+      free(trace);
+      trace = NULL;
+      goto cleanup;
+    }
+    sim_set_step_callback(sim, trace_step);
+    sim_set_step_callback_arg(sim, (void *)trace);
+  }
+
+  if (prof_enable) {
+    // the symbols of the ELF unless given (vmlinux or System.map for an Image)
+    prof = (prof_t *)malloc(sizeof(prof_t));
+    prof_init(prof, prof_period);
+    if (prof_load_symbols(prof, prof_sym_file_name ? prof_sym_file_name : argv[1], PROF_SYM_KERNEL) != 0 ||
+        (prof_user_file_name && prof_load_symbols(prof, prof_user_file_name, PROF_SYM_USER) != 0)) {
+      fprintf(stderr, "error in profiler symbols\n");
+    }
+    if (prof_callgraph_enable) {
+      prof_callgraph_on(prof);
+    }
+    sim_prof_on(sim, prof);
+  }
+
+  if (procstat_enable) {
+    procstat = (procstat_t *)malloc(sizeof(procstat_t));
+    procstat_init(procstat);
+    procstat_task(procstat, &procstat_task_spec);
+    sim_procstat_on(sim, procstat);
+  }
+
   if (stat_enable) {
     sprintf(log_file_name, "%s.log", basename(argv[1]));
     statlog = fopen(log_file_name, "w");
-    fprintf(statlog, "# mnemonic regno R/W cycles_after_producer times_consumed_by_alu\n");
+    stat = (stat_t *)calloc(1, sizeof(stat_t));
+    if (stat_log_enable) {
+      // every event, the histograms are written anyway
+      fprintf(statlog, "# mnemonic regno R/W cycles_after_producer times_consumed_by_alu\n");
+      stat->log = statlog;
+    }
     sim_set_step_callback(sim, stat_handler);
-    sim_set_step_callback_arg(sim, (void *)statlog);
+    sim_set_step_callback_arg(sim, (void *)stat);
     sim_regstat_en(sim);
+    for (int i = 0; i < num_stat_config; i++) {
+      if (sim_regstat_config(sim, &stat_config[i]) < 0) {
+        fprintf(stderr, "error in skip analysis: %u,%u\n", stat_config[i].window, stat_config[i].distance);
+        goto cleanup;
+      }
+    }
   } else {
-    if (num_cores > 1) {
-      sim_dtb_on(sim, "ladybird_dual.dtb");
-    } else {
-      sim_dtb_on(sim, "ladybird.dtb");
+    if (dtb_file_name) {
+      if (sim_dtb_on(sim, dtb_file_name) != 0) {
+        goto cleanup;
+      }
+    } else if (sim_dtb_generate(sim, bootargs) != 0) {
+      fprintf(stderr, "error in device tree generation\n");
     }
   }
 
   sim_write_register(sim, REG_A0, 0); // contains a unique per-hart ID.
-  sim_write_register(sim, REG_A1, DEVTREE_ROM_ADDR); // contains device tree blob. address
+  sim_write_register(sim, REG_A1, sim->dtb_addr); // contains device tree blob. address
   while (sim->state == running) {
     sim_resume(sim);
   }
@@ -192,13 +696,58 @@ int main(int argc, char *argv[]) {
     fprintf(statlog, "# write_skip %f read_skip %f\n", 1.0 - (double)regwrite_skip_total/(double)regwrite_total, 1.0 - (double)regread_skip_total/(double)regread_total);
     fprintf(statlog, "WIDTH 4=%llu 8=%llu 16=%llu 24=%llu 32=%llu\n",
             count4, count8, count16, count24, count32);
+    fprintf(statlog, "ICACHE access=%llu hit=%llu miss=%llu\n",
+            sim_read_csr64(sim, CSR_ADDR_M_HPMCOUNTER7H, CSR_ADDR_M_HPMCOUNTER7),
+            sim_read_csr64(sim, CSR_ADDR_M_HPMCOUNTER8H, CSR_ADDR_M_HPMCOUNTER8),
+            sim_read_csr64(sim, CSR_ADDR_M_HPMCOUNTER18H, CSR_ADDR_M_HPMCOUNTER18));
+    fprintf(statlog, "DCACHE access=%llu hit=%llu miss=%llu writeback=%llu\n",
+            sim_read_csr64(sim, CSR_ADDR_M_HPMCOUNTER9H, CSR_ADDR_M_HPMCOUNTER9),
+            sim_read_csr64(sim, CSR_ADDR_M_HPMCOUNTER10H, CSR_ADDR_M_HPMCOUNTER10),
+            sim_read_csr64(sim, CSR_ADDR_M_HPMCOUNTER19H, CSR_ADDR_M_HPMCOUNTER19),
+            sim_read_csr64(sim, CSR_ADDR_M_HPMCOUNTER20H, CSR_ADDR_M_HPMCOUNTER20));
+    fprintf(statlog, "TLB access=%llu hit=%llu miss=%llu walk=%llu\n",
+            sim_read_csr64(sim, CSR_ADDR_M_HPMCOUNTER11H, CSR_ADDR_M_HPMCOUNTER11),
+            sim_read_csr64(sim, CSR_ADDR_M_HPMCOUNTER12H, CSR_ADDR_M_HPMCOUNTER12),
+            sim_read_csr64(sim, CSR_ADDR_M_HPMCOUNTER21H, CSR_ADDR_M_HPMCOUNTER21),
+            sim_read_csr64(sim, CSR_ADDR_M_HPMCOUNTER22H, CSR_ADDR_M_HPMCOUNTER22));
+    fprintf(statlog, "L2 access=%llu miss=%llu\n",
+            sim_read_csr64(sim, CSR_ADDR_M_HPMCOUNTER23H, CSR_ADDR_M_HPMCOUNTER23),
+            sim_read_csr64(sim, CSR_ADDR_M_HPMCOUNTER24H, CSR_ADDR_M_HPMCOUNTER24));
+    stat_write_hist(basename(argv[1]), "p_to_c", "instructions between producer and consumer", stat->p_to_c);
+    stat_write_hist(basename(argv[1]), "p_to_o", "instructions between producer and overwriter", stat->p_to_o);
+    stat_write_hist(basename(argv[1]), "use", "usage count of produced data (ALU only)", stat->use);
+    regstat_t *regstat = (regstat_t *)malloc(sizeof(regstat_t));
+    sim_regstat_sum(sim, regstat);
+    stat_write_skip(basename(argv[1]), regstat);
+    free(regstat);
+  }
+
+  if (prof) {
+    fprintf(stderr, "prof: %llu samples\n", prof_write(prof, basename(argv[1])));
+  }
+  if (procstat) {
+    procstat_write(procstat, stderr);
   }
 
  cleanup:
+  if (prof) {
+    prof_fini(prof);
+    free(prof);
+  }
+  if (procstat) {
+    procstat_fini(procstat);
+    free(procstat);
+  }
+  if (trace) {
+    trace_fini(trace);
+    fprintf(stderr, "trace: %llu instructions\n", trace->count);
+    free(trace);
+  }
   sim_fini(sim);
   free(sim);
-  if (stat_enable) {
+  if (statlog) {
     fclose(statlog);
   }
+  free(stat);
   return 0;
 }
@@ -9,20 +9,176 @@
 void lsu_init(lsu_t *lsu, memory_t *mem) {
   lsu->vmflag = 0;
   lsu->vmrppn = 0;
+  lsu->asid = 0;
   lsu->mem = mem;
   lsu->icache = (cache_t *)malloc(sizeof(cache_t));
   lsu->dcache = (cache_t *)malloc(sizeof(cache_t));
-  lsu->tlb = (tlb_t *)malloc(sizeof(tlb_t));
-  cache_init(lsu->icache, mem, 32, 128); // 32 byte/line, 128 entry
-  cache_init(lsu->dcache, mem, 32, 256); // 32 byte/line, 256 entry
-  tlb_init(lsu->tlb, mem, 64); // 64 entry
+  lsu->itlb = (tlb_t *)malloc(sizeof(tlb_t));
+  lsu->dtlb = lsu->itlb;
+  cache_init(lsu->icache, mem, &(cache_config_t){32, 128, 1, CACHE_REPLACE_LRU, CACHE_WRITE_BACK}); // 32 byte/line, 128 entry
+  cache_init(lsu->dcache, mem, &(cache_config_t){32, 256, 1, CACHE_REPLACE_LRU, CACHE_WRITE_BACK}); // 32 byte/line, 256 entry
+  tlb_init(lsu->itlb, mem, 64, 4, TLB_REPLACE_LRU); // 64 entry, 4 way, shared
   memory_add_cache(lsu->mem, lsu->dcache);
   for (int i = 0; i < 64; i++) {
     lsu->pmpcfg[i] = 0;
     lsu->pmpaddr[i] = 0;
   }
+  lsu_pmp_update(lsu);
+  lsu_get_counter(lsu, &lsu->reported);
+  lsu->direct = 0;
+  lsu->ram = NULL;
+  lsu->reserve_valid = 0;
+  lsu->reserve_paddr = 0;
+  lsu->reserve_value = 0;
 }
 
+void lsu_get_counter(const lsu_t *lsu, lsu_counter_t *counter) {
+  counter->icache_access = lsu->icache->access_count;
+  counter->icache_hit = lsu->icache->hit_count;
+  counter->dcache_access = lsu->dcache->access_count;
+  counter->dcache_hit = lsu->dcache->hit_count;
+  counter->dcache_write_back = lsu->dcache->write_back_count;
+  counter->tlb_access = lsu->itlb->access_count;
+  counter->tlb_hit = lsu->itlb->hit_count;
+  counter->tlb_walk = lsu->itlb->walk_count;
+  if (lsu->dtlb != lsu->itlb) {
+    counter->tlb_access += lsu->dtlb->access_count;
+    counter->tlb_hit += lsu->dtlb->hit_count;
+    counter->tlb_walk += lsu->dtlb->walk_count;
+  }
+  counter->l2_access = lsu->icache->next_access_count + lsu->dcache->next_access_count;
+  counter->l2_hit = lsu->icache->next_hit_count + lsu->dcache->next_hit_count;
+}
+
+void lsu_report_events(lsu_t *lsu, struct core_step_result *result) {
+  lsu_counter_t now;
+  lsu_get_counter(lsu, &now);
+  result->icache_access = now.icache_access - lsu->reported.icache_access;
+  result->icache_hit = now.icache_hit - lsu->reported.icache_hit;
+  result->dcache_access = now.dcache_access - lsu->reported.dcache_access;
+  result->dcache_hit = now.dcache_hit - lsu->reported.dcache_hit;
+  result->dcache_write_back = now.dcache_write_back - lsu->reported.dcache_write_back;
+  result->tlb_access = now.tlb_access - lsu->reported.tlb_access;
+  result->tlb_hit = now.tlb_hit - lsu->reported.tlb_hit;
+  result->tlb_walk = now.tlb_walk - lsu->reported.tlb_walk;
+  result->l2_access = now.l2_access - lsu->reported.l2_access;
+  result->l2_hit = now.l2_hit - lsu->reported.l2_hit;
+  lsu->reported = now;
+}
+
+void lsu_direct_on(lsu_t *lsu) {
+  // the data cache is emptied and leaves the coherence, the other harts access the RAM directly
+  lsu_dcache_invalidate(lsu);
+  memory_del_cache(lsu->mem, lsu->dcache);
+  lsu->ram = memory_find_target(lsu->mem, MEMORY_BASE_ADDR_RAM, RAM_SIZE);
+  lsu->direct = 1;
+}
+
+// [*lo, *hi) of a PMP entry, 0 if off
+static int pmp_entry_range(lsu_t *lsu, unsigned i, unsigned long long *lo, unsigned long long *hi) {
+  unsigned long long addr = (unsigned long long)lsu->pmpaddr[i] << 2;
+  switch ((lsu->pmpcfg[i] >> 3) & 0x3) {
+  case CSR_PMPCFG_A_TOR:
+    *lo = (i == 0) ? 0 : ((unsigned long long)lsu->pmpaddr[i - 1] << 2);
+    *hi = addr;
+    break;
+  case CSR_PMPCFG_A_NA4:
+    *lo = addr;
+    *hi = addr + 4;
+    break;
+  case CSR_PMPCFG_A_NAPOT: {
+    // 2^(trailing ones + 3) bytes
+    unsigned long long size = 1ULL << (__builtin_ctzll(~(unsigned long long)lsu->pmpaddr[i]) + 3);
+    *lo = addr & ~(size - 1);
+    *hi = *lo + size;
+    break;
+  }
+  default:
+    return 0;
+  }
+  // the 32 bit physical address space
+  *hi = (*hi > 0x100000000ULL) ? 0x100000000ULL : *hi;
+  return *lo < *hi;
+}
+
+static int pmp_compare(const void *a, const void *b) {
+  unsigned long long x = *(const unsigned long long *)a;
+  unsigned long long y = *(const unsigned long long *)b;
+  return (x > y) - (x < y);
+}
+
+// the regions between the boundaries of the entries, each takes the first (lowest numbered) matching entry
+static void pmp_compile(lsu_t *lsu, pmp_table_t *pmp, int locked_only) {
+  unsigned long long lo[64], hi[64];
+  unsigned long long bound[2 * 64 + 1];
+  unsigned char match[64];
+  unsigned num_bound = 0;
+  bound[num_bound++] = 0;
+  for (unsigned i = 0; i < 64; i++) {
+    match[i] = pmp_entry_range(lsu, i, &lo[i], &hi[i]) && (!locked_only || (lsu->pmpcfg[i] & 0x80));
+    if (match[i]) {
+      bound[num_bound++] = lo[i];
+      bound[num_bound++] = hi[i];
+    }
+  }
+  qsort(bound, num_bound, sizeof(unsigned long long), pmp_compare);
+  pmp->num_region = 0;
+  pmp->active = 0;
+  for (unsigned b = 0; b < num_bound && bound[b] < 0x100000000ULL; b++) {
+    if (b > 0 && bound[b] == bound[b - 1]) {
+      continue;
+    }
+    unsigned char perm = 0x7;
+    for (unsigned i = 0; i < 64; i++) {
+      if (match[i] && lo[i] <= bound[b] && bound[b] < hi[i]) {
+        perm = lsu->pmpcfg[i] & 0x7;
+        break;
+      }
+    }
+    if (pmp->num_region == 0 || pmp->region[pmp->num_region - 1].perm != perm) {
+      pmp->region[pmp->num_region].base = (unsigned)bound[b];
+      pmp->region[pmp->num_region].perm = perm;
+      pmp->num_region++;
+      pmp->active |= (perm != 0x7);
+    }
+  }
+  for (unsigned i = 0; i < PMP_PAGE_CACHE; i++) {
+    pmp->page_tag[i] = 0;
+  }
+}
+
+void lsu_pmp_update(lsu_t *lsu) {
+  pmp_compile(lsu, &lsu->pmp[0], 1);
+  pmp_compile(lsu, &lsu->pmp[1], 0);
+}
+
+#if PMP_FEATURE
+static unsigned char pmp_lookup(pmp_table_t *pmp, unsigned paddr) {
+  unsigned page = paddr >> 12;
+  unsigned index = page % PMP_PAGE_CACHE;
+  if (pmp->page_tag[index] == page + 1) {
+    return pmp->page_perm[index];
+  }
+  // the last region starting at or below paddr
+  unsigned l = 0;
+  unsigned r = pmp->num_region;
+  while (r - l > 1) {
+    unsigned m = (l + r) / 2;
+    if (pmp->region[m].base <= paddr) {
+      l = m;
+    } else {
+      r = m;
+    }
+  }
+  unsigned long long end = (l + 1 < pmp->num_region) ? pmp->region[l + 1].base : 0x100000000ULL;
+  if (pmp->region[l].base <= (page << 12) && ((unsigned long long)page + 1) << 12 <= end) {
+    pmp->page_tag[index] = page + 1;
+    pmp->page_perm[index] = pmp->region[l].perm;
+  }
+  return pmp->region[l].perm;
+}
+#endif
+
 unsigned lsu_address_translation(lsu_t *lsu, unsigned vaddr, unsigned *paddr, unsigned access_type, unsigned prv) {
   unsigned exception_code = 0;
   if (lsu->vmflag == 0 || prv == PRIVILEGE_MODE_M) {
@@ -30,7 +186,8 @@ unsigned lsu_address_translation(lsu_t *lsu, unsigned vaddr, unsigned *paddr, un
     // Executions of the address-translation algorithm may only begin using a given value of satp when satp is active.
     *paddr = vaddr;
   } else {
-    exception_code = tlb_get(lsu->tlb, lsu->vmrppn, vaddr, paddr, access_type, prv);
+    tlb_t *tlb = (access_type == ACCESS_TYPE_INSTRUCTION) ? lsu->itlb : lsu->dtlb;
+    exception_code = tlb_get(tlb, lsu->vmrppn, lsu->asid, vaddr, paddr, access_type, prv);
 #if 0
     fprintf(stderr, "vaddr: %08x, paddr: %08x, code: %08x\n", vaddr, *paddr, exception_code);
 #endif
@@ -38,55 +195,9 @@ unsigned lsu_address_translation(lsu_t *lsu, unsigned vaddr, unsigned *paddr, un
 #if PMP_FEATURE
   // PMP check
   if (exception_code == 0) {
-    int success = 1;
-    for (int i = 0; i < 64; i++) {
-      unsigned char locked = lsu->pmpcfg[i] >> 7;
-      unsigned char address_matching = (lsu->pmpcfg[i] >> 3) & 0x3;
-      int is_match = 0;
-      if (!locked && prv == PRIVILEGE_MODE_M) continue;
-
-      if (address_matching == CSR_PMPCFG_A_OFF) {
-        continue;
-      } else if (address_matching == CSR_PMPCFG_A_TOR) {
-        unsigned from_addr = (i == 0) ? 0 : (lsu->pmpaddr[i - 1] << 2);
-        unsigned to_addr = lsu->pmpaddr[i] << 2;
-        if (*paddr >= from_addr && *paddr < to_addr) {
-          is_match = 1;
-        }
-      } else if (address_matching == CSR_PMPCFG_A_NA4) {
-        if ((*paddr & 0xfffffffc) == (lsu->pmpaddr[i - 1] << 2)) {
-          is_match = 1;
-        }
-      } else {
-        const unsigned pmpaddr = lsu->pmpaddr[i];
-        int first_zero = 0;
-        for (; (((pmpaddr >> first_zero) & 0x1) == 1) && first_zero != XLEN; first_zero++) { }
-        unsigned long long check_addr = ((unsigned long long)pmpaddr) << 2;
-        unsigned long long align_power = 1 << (first_zero + 3);
-        unsigned long long align_power_mask = ~(align_power - 1);
-        if ((check_addr & align_power_mask) == (*paddr & align_power_mask)) {
-#if 0
-          printf("[%d] %d %08llx %08llx %08x pmpaddr %08x firstzero %d R[%d] W[%d] X[%d] L[%d]\n", i, address_matching, check_addr, align_power_mask, *paddr,
-                 pmpaddr, first_zero,
-                 (lsu->pmpcfg[i] >> 0) & 0x1,
-                 (lsu->pmpcfg[i] >> 1) & 0x1,
-                 (lsu->pmpcfg[i] >> 2) & 0x1, locked);
-#endif
-          is_match = 1;
-        }
-      }
-      if (is_match) {
-        if (access_type == ACCESS_TYPE_INSTRUCTION) {
-          success = (lsu->pmpcfg[i] >> 2) & 0x1; // executable flag
-        } else if (access_type == ACCESS_TYPE_LOAD) {
-          success = (lsu->pmpcfg[i] >> 0) & 0x1; // readable flag
-        } else {
-          success = (lsu->pmpcfg[i] >> 1) & 0x1; // writable flag
-        }
-        break;
-      }
-    }
-    if (success == 0) {
+    pmp_table_t *pmp = &lsu->pmp[(prv == PRIVILEGE_MODE_M) ? 0 : 1];
+    // pmpcfg RWX are the PTE bits (the access types) shifted right by 1
+    if (pmp->active && !((pmp_lookup(pmp, *paddr) << 1) & access_type)) {
       if (access_type == ACCESS_TYPE_INSTRUCTION) {
         exception_code = TRAP_CODE_INSTRUCTION_ACCESS_FAULT;
       } else if (access_type == ACCESS_TYPE_LOAD) {
@@ -100,6 +211,49 @@ unsigned lsu_address_translation(lsu_t *lsu, unsigned vaddr, unsigned *paddr, un
   return exception_code;
 }
 
+// the Sv32 walk of the current satp, without the TLBs, the walk cache and the A/D updates
+static unsigned lsu_peek_translation(lsu_t *lsu, unsigned vaddr, unsigned *paddr) {
+  if (lsu->vmflag == 0) {
+    *paddr = vaddr;
+    return 0;
+  }
+  unsigned pte_base = lsu->vmrppn;
+  for (int level = 1; level >= 0; level--) {
+    unsigned pte;
+    unsigned pte_addr = pte_base + ((vaddr >> (12 + 10 * level)) & 0x3ff) * PTE_SIZE;
+    if (memory_peek(lsu->mem, (char *)&pte, pte_addr, PTE_SIZE) || !(pte & PTE_V)) {
+      return 1;
+    }
+    if (pte & (PTE_X | PTE_W | PTE_R)) {
+      if (level == 1) {
+        *paddr = ((pte & 0xfff00000) << 2) | (vaddr & 0x003fffff);
+      } else {
+        *paddr = ((pte & 0xfffffc00) << 2) | (vaddr & 0x00000fff);
+      }
+      return 0;
+    }
+    pte_base = (pte >> 10) << 12;
+  }
+  return 1;
+}
+
+unsigned lsu_peek(lsu_t *lsu, char *dst, unsigned vaddr, unsigned len) {
+  while (len > 0) {
+    unsigned paddr;
+    unsigned burst_len = 0x1000 - (vaddr & 0xfff);
+    if (burst_len > len) {
+      burst_len = len;
+    }
+    if (lsu_peek_translation(lsu, vaddr, &paddr) || memory_peek(lsu->mem, dst, paddr, burst_len)) {
+      return 1;
+    }
+    dst += burst_len;
+    vaddr += burst_len;
+    len -= burst_len;
+  }
+  return 0;
+}
+
 static int is_cacheable(unsigned addr) {
   if (addr >= MEMORY_BASE_ADDR_RAM) {
     return 1;
@@ -108,12 +262,94 @@ static int is_cacheable(unsigned addr) {
   }
 }
 
+// parallel mode, RAM accesses without the data cache, NULL if out of RAM or crossing a RAM page
+static char *lsu_direct_ptr(lsu_t *lsu, unsigned paddr, unsigned len) {
+  unsigned offset = paddr - MEMORY_BASE_ADDR_RAM;
+  if (offset >= RAM_SIZE || RAM_SIZE - offset < len || (offset & RAM_PAGE_OFFS_MASK) + len > RAM_PAGE_SIZE) {
+    return NULL;
+  }
+  return memory_target_get_ptr(lsu->ram, paddr);
+}
+
+// a misaligned access crossing RAM pages (not contiguous on the host) is done byte by byte
+static unsigned lsu_direct_in_ram(unsigned paddr, unsigned len) {
+  unsigned offset = paddr - MEMORY_BASE_ADDR_RAM;
+  return (offset < RAM_SIZE && RAM_SIZE - offset >= len) ? 1 : 0;
+}
+
+static unsigned lsu_direct_load(lsu_t *lsu, unsigned len, struct core_step_result *result) {
+  char *ptr = lsu_direct_ptr(lsu, result->m_paddr, len);
+  if (ptr == NULL) {
+    if (!lsu_direct_in_ram(result->m_paddr, len)) {
+      return TRAP_CODE_LOAD_ACCESS_FAULT;
+    }
+    result->rd_data = 0;
+    for (unsigned i = 0; i < len; i++) {
+      unsigned char *byte = (unsigned char *)lsu_direct_ptr(lsu, result->m_paddr + i, 1);
+      result->rd_data |= (unsigned)__atomic_load_n(byte, __ATOMIC_RELAXED) << (i * 8);
+    }
+    return TRAP_CODE_NONE;
+  }
+  switch (len) {
+  case 1:
+    result->rd_data = __atomic_load_n((unsigned char *)ptr, __ATOMIC_RELAXED);
+    break;
+  case 2:
+    result->rd_data = __atomic_load_n((unsigned short *)ptr, __ATOMIC_RELAXED);
+    break;
+  case 4:
+    result->rd_data = __atomic_load_n((unsigned *)ptr, __ATOMIC_RELAXED);
+    break;
+  default:
+    break;
+  }
+  return TRAP_CODE_NONE;
+}
+
+static unsigned lsu_direct_store(lsu_t *lsu, unsigned len, struct core_step_result *result) {
+  char *ptr = lsu_direct_ptr(lsu, result->m_paddr, len);
+  if (ptr == NULL) {
+    if (!lsu_direct_in_ram(result->m_paddr, len)) {
+      return TRAP_CODE_STORE_ACCESS_FAULT;
+    }
+    for (unsigned i = 0; i < len; i++) {
+      unsigned char *byte = (unsigned char *)lsu_direct_ptr(lsu, result->m_paddr + i, 1);
+      __atomic_store_n(byte, (unsigned char)(result->m_data >> (i * 8)), __ATOMIC_RELAXED);
+    }
+    return TRAP_CODE_NONE;
+  }
+  switch (len) {
+  case 1:
+    __atomic_store_n((unsigned char *)ptr, (unsigned char)result->m_data, __ATOMIC_RELAXED);
+    break;
+  case 2:
+    __atomic_store_n((unsigned short *)ptr, (unsigned short)result->m_data, __ATOMIC_RELAXED);
+    break;
+  case 4:
+    __atomic_store_n((unsigned *)ptr, result->m_data, __ATOMIC_RELAXED);
+    break;
+  default:
+    break;
+  }
+  return TRAP_CODE_NONE;
+}
+
+// word for an atomic access, NULL if it is misaligned or not in RAM
+static unsigned *lsu_direct_word(lsu_t *lsu, unsigned paddr) {
+  if ((paddr & 0x3) || !is_cacheable(paddr)) {
+    return NULL;
+  }
+  return (unsigned *)lsu_direct_ptr(lsu, paddr, 4);
+}
+
 unsigned lsu_load(lsu_t *lsu, unsigned len, struct core_step_result *result) {
   result->exception_code = lsu_address_translation(lsu, result->m_vaddr, &result->m_paddr, ACCESS_TYPE_LOAD, result->prv);
   if (result->exception_code) {
     return result->exception_code;
   }
-  if (is_cacheable(result->m_paddr)) {
+  if (lsu->direct && is_cacheable(result->m_paddr)) {
+    result->exception_code = lsu_direct_load(lsu, len, result);
+  } else if (is_cacheable(result->m_paddr)) {
     char *line = cache_get_line_ptr(lsu->dcache, result->m_vaddr, result->m_paddr, CACHE_ACCESS_READ);
     if (line != NULL) {
       switch (len) {
@@ -143,25 +379,10 @@ unsigned lsu_store(lsu_t *lsu, unsigned len, struct core_step_result *result) {
   if (result->exception_code) {
     return result->exception_code;
   }
-  if (is_cacheable(result->m_paddr)) {
-    char *line = cache_get_line_ptr(lsu->dcache, result->m_vaddr, result->m_paddr, CACHE_ACCESS_WRITE);
-    if (line != NULL) {
-      switch (len) {
-      case 1:
-        line[0] = (unsigned char)result->m_data;
-        break;
-      case 2:
-        ((unsigned short *)line)[0] = (unsigned short)result->m_data;
-        break;
-      case 4:
-        ((unsigned *)line)[0] = result->m_data;
-        break;
-      default:
-        break;
-      }
-    } else {
-      result->exception_code = TRAP_CODE_STORE_ACCESS_FAULT;
-    }
+  if (lsu->direct && is_cacheable(result->m_paddr)) {
+    result->exception_code = lsu_direct_store(lsu, len, result);
+  } else if (is_cacheable(result->m_paddr)) {
+    cache_store(lsu->dcache, result->m_vaddr, result->m_paddr, (const char *)&result->m_data, len);
   } else {
     result->exception_code = memory_store(lsu->mem, len, MEMORY_STORE_DEFAULT, result);
   }
@@ -173,7 +394,18 @@ unsigned lsu_load_reserved(lsu_t *lsu, unsigned aquire, struct core_step_result
   if (result->exception_code) {
     return result->exception_code;
   }
-  if (is_cacheable(result->m_paddr)) {
+  if (lsu->direct) {
+    // the reservation remembers the value, the store conditional succeeds if it is still there
+    unsigned *word = lsu_direct_word(lsu, result->m_paddr);
+    if (word) {
+      result->rd_data = __atomic_load_n(word, aquire ? __ATOMIC_ACQUIRE : __ATOMIC_RELAXED);
+      lsu->reserve_valid = 1;
+      lsu->reserve_paddr = result->m_paddr;
+      lsu->reserve_value = result->rd_data;
+    } else {
+      result->exception_code = TRAP_CODE_LOAD_ACCESS_FAULT;
+    }
+  } else if (is_cacheable(result->m_paddr)) {
     // issue the reserving load to memory bus
     memory_load(lsu->mem, 4, MEMORY_LOAD_RESERVE, result);
     // if reserve set success, start loading from cache
@@ -193,13 +425,23 @@ unsigned lsu_store_conditional(lsu_t *lsu, unsigned release, struct core_step_re
   if (result->exception_code) {
     return result->exception_code;
   }
-  if (is_cacheable(result->m_paddr)) {
+  if (lsu->direct) {
+    unsigned *word = lsu_direct_word(lsu, result->m_paddr);
+    if (word == NULL) {
+      result->exception_code = TRAP_CODE_STORE_ACCESS_FAULT;
+    } else if (lsu->reserve_valid && lsu->reserve_paddr == result->m_paddr &&
+               __atomic_compare_exchange_n(word, &lsu->reserve_value, result->m_data, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+      result->rd_data = MEMORY_STORE_SUCCESS;
+    } else {
+      result->rd_data = MEMORY_STORE_FAILURE;
+    }
+    lsu->reserve_valid = 0;
+  } else if (is_cacheable(result->m_paddr)) {
     // issue the conditional store to memory bus
     memory_store(lsu->mem, 4, MEMORY_STORE_CONDITIONAL, result);
     // if still reserved, start storing to cache
     if (result->exception_code == TRAP_CODE_NONE && result->rd_data == MEMORY_STORE_SUCCESS) {
-      cache_line_t *cline = cache_get_line(lsu->dcache, result->m_vaddr, result->m_paddr, CACHE_ACCESS_WRITE);
-      *((unsigned *)(&cline->data[result->m_paddr & lsu->dcache->line_mask])) = result->m_data;
+      cache_store(lsu->dcache, result->m_vaddr, result->m_paddr, (const char *)&result->m_data, 4);
       if (release) lsu_dcache_write_back(lsu);
     } else {
       result->rd_data = MEMORY_STORE_FAILURE;
@@ -214,6 +456,22 @@ unsigned lsu_atomic_operation(lsu_t *lsu, unsigned aquire, unsigned release,
                               unsigned (*op)(unsigned, unsigned),
                               struct core_step_result *result) {
   unsigned rd_data;
+  if (lsu->direct) {
+    // compare and swap loop on the host
+    result->exception_code = lsu_address_translation(lsu, result->m_vaddr, &result->m_paddr, ACCESS_TYPE_STORE, result->prv);
+    if (result->exception_code) {
+      return result->exception_code;
+    }
+    unsigned *word = lsu_direct_word(lsu, result->m_paddr);
+    if (word == NULL) {
+      result->exception_code = TRAP_CODE_AMO_ACCESS_FAULT;
+      return result->exception_code;
+    }
+    rd_data = __atomic_load_n(word, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(word, &rd_data, op(rd_data, result->m_data), 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) { }
+    result->rd_data = rd_data;
+    return result->exception_code;
+  }
   result->exception_code = lsu_load_reserved(lsu, aquire, result);
   result->m_data = op(result->rd_data, result->m_data);
   rd_data = result->rd_data;
@@ -223,26 +481,37 @@ unsigned lsu_atomic_operation(lsu_t *lsu, unsigned aquire, unsigned release,
 }
 
 unsigned lsu_fence_instruction(lsu_t *lsu) {
+  // the stores reach the memory, the data stays cached (the icache does not snoop, it is refetched)
+  lsu_dcache_write_back(lsu);
   lsu_icache_invalidate(lsu);
-  lsu_dcache_invalidate(lsu);
   return 0;
 }
 
 unsigned lsu_fence(lsu_t *lsu, unsigned char predecessor, unsigned char successor) {
   // only supported full fence
-  lsu_dcache_write_back(lsu);
+  if (lsu->direct) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  } else {
+    lsu_dcache_write_back(lsu);
+  }
   return 0;
 }
 
 unsigned lsu_fence_tso(lsu_t *lsu) {
-  lsu_dcache_write_back(lsu);
+  if (lsu->direct) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  } else {
+    lsu_dcache_write_back(lsu);
+  }
   return 0;
 }
 
-unsigned lsu_sfence_vma(lsu_t *lsu) {
-  lsu_icache_invalidate(lsu);
-  lsu_dcache_write_back(lsu);
-  lsu_tlb_clear(lsu);
+unsigned lsu_sfence_vma(lsu_t *lsu, unsigned flush, unsigned vaddr, unsigned asid) {
+  // the caches are physically tagged and the page walk reads the PTEs through the coherence
+  tlb_flush(lsu->itlb, flush, vaddr, asid & TLB_ASID_MASK);
+  if (lsu->dtlb != lsu->itlb) {
+    tlb_flush(lsu->dtlb, flush, vaddr, asid & TLB_ASID_MASK);
+  }
   return 0;
 }
 
@@ -260,9 +529,11 @@ void lsu_dcache_invalidate(lsu_t *lsu) {
 }
 
 void lsu_dcache_invalidate_line(lsu_t *lsu, unsigned paddr) {
-  for (unsigned i = 0; i < lsu->dcache->line_size; i++) {
-    if (lsu->dcache->line[i].state != CACHE_INVALID && lsu->dcache->line[i].tag == (paddr & lsu->dcache->tag_mask)) {
-      lsu->dcache->line[i].state = CACHE_INVALID;
+  cache_t *cache = lsu->dcache;
+  unsigned set = (paddr / cache->line_len) & cache->index_mask;
+  for (unsigned i = set * cache->ways; i < (set + 1) * cache->ways; i++) {
+    if (cache->line[i].state != CACHE_INVALID && cache->line[i].tag == (paddr & ~cache->line_mask)) {
+      cache->line[i].state = CACHE_INVALID;
     }
   }
 }
@@ -273,24 +544,81 @@ void lsu_dcache_write_back(lsu_t *lsu) {
   }
 }
 
-void lsu_atp_on(lsu_t *lsu, unsigned ppn) {
+static void lsu_pwc_clear(lsu_t *lsu) {
+  tlb_pwc_clear(lsu->itlb);
+  tlb_pwc_clear(lsu->dtlb);
+}
+
+void lsu_atp_on(lsu_t *lsu, unsigned asid, unsigned ppn) {
   lsu->vmflag = 1;
   lsu->vmrppn = ppn << 12;
+  lsu->asid = asid & TLB_ASID_MASK;
+  lsu_pwc_clear(lsu);
   return;
 }
 
 unsigned lsu_atp_get(lsu_t *lsu) {
-  return (lsu->vmflag << 31) | ((lsu->vmrppn >> 12) & 0x000fffff);
+  return (lsu->vmflag << 31) | (lsu->asid << 22) | ((lsu->vmrppn >> 12) & 0x000fffff);
 }
 
 void lsu_atp_off(lsu_t *lsu) {
   lsu->vmflag = 0;
   lsu->vmrppn = 0;
+  lsu->asid = 0;
+  lsu_pwc_clear(lsu);
   return;
 }
 
 void lsu_tlb_clear(lsu_t *lsu) {
-  tlb_clear(lsu->tlb);
+  tlb_clear(lsu->itlb);
+  if (lsu->dtlb != lsu->itlb) {
+    tlb_clear(lsu->dtlb);
+  }
+}
+
+void lsu_tlb_config(lsu_t *lsu, unsigned entries, unsigned ways, unsigned replace, unsigned split) {
+  int id = lsu->itlb->id;
+  unsigned char adue = lsu->itlb->adue;
+  if (lsu->dtlb != lsu->itlb) {
+    tlb_fini(lsu->dtlb);
+    free(lsu->dtlb);
+  }
+  tlb_fini(lsu->itlb);
+  tlb_init(lsu->itlb, lsu->mem, entries, ways, replace);
+  lsu->itlb->id = id;
+  lsu->itlb->adue = adue;
+  lsu->dtlb = lsu->itlb;
+  if (split) {
+    lsu->dtlb = (tlb_t *)malloc(sizeof(tlb_t));
+    tlb_init(lsu->dtlb, lsu->mem, entries, ways, replace);
+    lsu->dtlb->id = id;
+    lsu->dtlb->adue = adue;
+  }
+  lsu_get_counter(lsu, &lsu->reported);
+}
+
+void lsu_cache_config(lsu_t *lsu, const cache_config_t *icache, const cache_config_t *dcache) {
+  int icache_id = lsu->icache->id;
+  int dcache_id = lsu->dcache->id;
+  lsu_dcache_invalidate(lsu);
+  if (!lsu->direct) {
+    memory_del_cache(lsu->mem, lsu->dcache);
+  }
+  cache_fini(lsu->icache);
+  cache_fini(lsu->dcache);
+  cache_init(lsu->icache, lsu->mem, icache);
+  cache_init(lsu->dcache, lsu->mem, dcache);
+  lsu->icache->id = icache_id;
+  lsu->dcache->id = dcache_id;
+  if (!lsu->direct) {
+    memory_add_cache(lsu->mem, lsu->dcache);
+  }
+  lsu_get_counter(lsu, &lsu->reported);
+}
+
+void lsu_set_adue(lsu_t *lsu, unsigned char adue) {
+  lsu->itlb->adue = adue;
+  lsu->dtlb->adue = adue;
 }
 
 void lsu_fini(lsu_t *lsu) {
@@ -298,59 +626,180 @@ void lsu_fini(lsu_t *lsu) {
   free(lsu->dcache);
   cache_fini(lsu->icache);
   free(lsu->icache);
-  tlb_fini(lsu->tlb);
-  free(lsu->tlb);
+  if (lsu->dtlb != lsu->itlb) {
+    tlb_fini(lsu->dtlb);
+    free(lsu->dtlb);
+  }
+  tlb_fini(lsu->itlb);
+  free(lsu->itlb);
 }
 
-void cache_init(cache_t *cache, memory_t *mem, unsigned line_len, unsigned line_size) {
+void cache_init(cache_t *cache, memory_t *mem, const cache_config_t *config) {
   cache->id = 0;
   cache->tag_mode = CACHE_TAG_MODE_PIPT;
   cache->mem = mem;
   cache->access_count = 0;
   cache->hit_count = 0;
-  cache->line_len = line_len;
-  cache->line_size = line_size;
-  cache->line_mask = line_len - 1;
-  cache->index_mask = ((cache->line_size * cache->line_len) - 1) ^ cache->line_mask;
-  cache->tag_mask = (0xffffffff ^ (cache->index_mask | cache->line_mask));
-  cache->line = (cache_line_t *)calloc(line_size, sizeof(cache_line_t));
-  for (unsigned i = 0; i < line_size; i++) {
-    cache->line[i].data = (char *)malloc(line_len * sizeof(char));
+  cache->evict_count = 0;
+  cache->write_back_count = 0;
+  cache->next_access_count = 0;
+  cache->next_hit_count = 0;
+  cache->line_len = config->line_len;
+  cache->line_size = config->sets * config->ways;
+  cache->ways = config->ways;
+  cache->replace = config->replace;
+  cache->write = config->write;
+  cache->seed = 1;
+  cache->line_mask = config->line_len - 1;
+  cache->index_mask = config->sets - 1;
+  cache->line = (cache_line_t *)calloc(cache->line_size, sizeof(cache_line_t));
+  cache->plru = (unsigned *)calloc(config->sets, sizeof(unsigned));
+  for (unsigned i = 0; i < cache->line_size; i++) {
+    cache->line[i].data = (char *)malloc(cache->line_len * sizeof(char));
   }
 }
 
-cache_line_t *cache_get_line(cache_t *cache, unsigned vaddr, unsigned paddr, int is_write) {
+void cache_get_config(const cache_t *cache, cache_config_t *config) {
+  config->line_len = cache->line_len;
+  config->sets = cache->index_mask + 1;
+  config->ways = cache->ways;
+  config->replace = cache->replace;
+  config->write = cache->write;
+}
+
+static void cache_plru_touch(cache_t *cache, unsigned set, unsigned way) {
+  unsigned node = 1;
+  for (unsigned half = cache->ways >> 1; half > 0; half >>= 1) {
+    unsigned right = (way & half) ? 1 : 0;
+    if (right) {
+      cache->plru[set] &= ~(1 << node);
+    } else {
+      cache->plru[set] |= (1 << node);
+    }
+    node = 2 * node + right;
+  }
+}
+
+static unsigned cache_plru_victim(cache_t *cache, unsigned set) {
+  unsigned node = 1;
+  unsigned way = 0;
+  for (unsigned half = cache->ways >> 1; half > 0; half >>= 1) {
+    unsigned right = (cache->plru[set] >> node) & 1;
+    way |= right ? half : 0;
+    node = 2 * node + right;
+  }
+  return way;
+}
+
+// fill: the line has just been brought in
+static void cache_touch(cache_t *cache, cache_line_t *line, int fill) {
+  unsigned pos = line - cache->line;
+  if (cache->replace == CACHE_REPLACE_PLRU) {
+    cache_plru_touch(cache, pos / cache->ways, pos % cache->ways);
+  } else if (cache->replace == CACHE_REPLACE_LRU || fill) {
+    line->lru = cache->access_count;
+  }
+}
+
+static unsigned cache_index(cache_t *cache, unsigned vaddr, unsigned paddr) {
   // supporting VIPT and PIPT. ordinary L1 cache is VIPT reducing latency,
   // but this simulator's implementation assumes PIPT as default
-  unsigned index = (cache->tag_mode == CACHE_TAG_MODE_PIPT) ?
-    (paddr & cache->index_mask) / cache->line_len :
-    (vaddr & cache->index_mask) / cache->line_len;
-  unsigned tag = paddr & cache->tag_mask;
+  unsigned addr = (cache->tag_mode == CACHE_TAG_MODE_PIPT) ? paddr : vaddr;
+  return (addr / cache->line_len) & cache->index_mask;
+}
+
+static cache_line_t *cache_lookup(cache_t *cache, unsigned index, unsigned tag) {
+  cache_line_t *set = &cache->line[index * cache->ways];
+  for (unsigned i = 0; i < cache->ways; i++) {
+    if (set[i].state != CACHE_INVALID && set[i].tag == tag) {
+      return &set[i];
+    }
+  }
+  return NULL;
+}
+
+static cache_line_t *cache_victim(cache_t *cache, unsigned index) {
+  cache_line_t *set = &cache->line[index * cache->ways];
+  cache_line_t *victim = &set[0];
+  for (unsigned i = 0; i < cache->ways; i++) {
+    if (set[i].state == CACHE_INVALID) {
+      return &set[i];
+    }
+    if (set[i].lru < victim->lru) {
+      victim = &set[i];
+    }
+  }
+  if (cache->replace == CACHE_REPLACE_PLRU) {
+    victim = &set[cache_plru_victim(cache, index)];
+  } else if (cache->replace == CACHE_REPLACE_RANDOM) {
+    // xorshift32
+    cache->seed ^= cache->seed << 13;
+    cache->seed ^= cache->seed >> 17;
+    cache->seed ^= cache->seed << 5;
+    victim = &set[cache->seed & (cache->ways - 1)];
+  }
+  cache->evict_count++;
+  return victim;
+}
+
+// the shared L2 sees the misses and the write-backs (or the write-through stores) of the L1s
+static void cache_l2_access(cache_t *cache, unsigned paddr, int is_write) {
+  memory_t *mem = cache->mem;
+  cache_t *l2 = mem->l2;
+  if (l2 == NULL) {
+    return;
+  }
+  if (mem->bus_lock_en) mtx_lock(&mem->l2_lock);
+  unsigned index = (paddr / l2->line_len) & l2->index_mask;
+  unsigned tag = paddr & ~l2->line_mask;
+  l2->access_count++;
+  cache->next_access_count++;
+  cache_line_t *line = cache_lookup(l2, index, tag);
+  if (line) {
+    l2->hit_count++;
+    cache->next_hit_count++;
+    cache_touch(l2, line, 0);
+  } else if (!is_write || !(l2->write & CACHE_WRITE_NO_ALLOCATE)) {
+    line = cache_victim(l2, index);
+    if (line->state == CACHE_MODIFIED) {
+      l2->write_back_count++;
+    }
+    line->state = CACHE_SHARED;
+    line->tag = tag;
+    cache_touch(l2, line, 1);
+  }
+  if (line && is_write && !(l2->write & CACHE_WRITE_THROUGH)) {
+    line->state = CACHE_MODIFIED;
+  }
+  if (mem->bus_lock_en) mtx_unlock(&mem->l2_lock);
+}
+
+cache_line_t *cache_get_line(cache_t *cache, unsigned vaddr, unsigned paddr, int is_write) {
+  unsigned index = cache_index(cache, vaddr, paddr);
+  unsigned tag = paddr & ~cache->line_mask;
   // broadcast to other cashe
   memory_cache_coherent(cache->mem, paddr, cache->line_len, is_write, cache->id);
   cache->access_count++;
-  if (cache->line[index].state != CACHE_INVALID) {
-    if (cache->line[index].tag == tag) {
-      // hit
-      cache->hit_count++;
-    } else {
-      // writeback to memory
-      cache_write_back(cache, index);
-      // read from memory
-      memory_cpy_from(cache->mem, cache->id, cache->line[index].data, paddr & (~cache->line_mask), cache->line_len);
-      cache->line[index].state = CACHE_SHARED;
-      cache->line[index].tag = tag;
-    }
+  cache_line_t *line = cache_lookup(cache, index, tag);
+  if (line) {
+    // hit
+    cache->hit_count++;
+    cache_touch(cache, line, 0);
   } else {
+    line = cache_victim(cache, index);
+    // writeback to memory
+    cache_write_back(cache, line - cache->line);
     // read from memory
-    memory_cpy_from(cache->mem, cache->id, cache->line[index].data, paddr & (~cache->line_mask), cache->line_len);
-    cache->line[index].state = CACHE_SHARED;
-    cache->line[index].tag = tag;
+    cache_l2_access(cache, tag, CACHE_ACCESS_READ);
+    memory_cpy_from(cache->mem, cache->id, line->data, tag, cache->line_len);
+    line->state = CACHE_SHARED;
+    line->tag = tag;
+    cache_touch(cache, line, 1);
   }
   if (is_write) {
-    cache->line[index].state = CACHE_MODIFIED;
+    line->state = CACHE_MODIFIED;
   }
-  return &cache->line[index];
+  return line;
 }
 
 char *cache_get_line_ptr(cache_t *cache, unsigned vaddr, unsigned paddr, int is_write) {
@@ -362,10 +811,31 @@ char *cache_get_line_ptr(cache_t *cache, unsigned vaddr, unsigned paddr, int is_
   }
 }
 
+void cache_store(cache_t *cache, unsigned vaddr, unsigned paddr, const char *data, unsigned len) {
+  if ((cache->write & CACHE_WRITE_NO_ALLOCATE) &&
+      !cache_lookup(cache, cache_index(cache, vaddr, paddr), paddr & ~cache->line_mask)) {
+    // write around (the other caches are made coherent by the copy)
+    cache->access_count++;
+    cache_l2_access(cache, paddr, CACHE_ACCESS_WRITE);
+    memory_cpy_to(cache->mem, cache->id, paddr, data, len);
+    return;
+  }
+  if (cache->write & CACHE_WRITE_THROUGH) {
+    // the line stays clean
+    memcpy(cache_get_line_ptr(cache, vaddr, paddr, CACHE_ACCESS_READ), data, len);
+    cache_l2_access(cache, paddr, CACHE_ACCESS_WRITE);
+    memory_cpy_to(cache->mem, cache->id, paddr, data, len);
+  } else {
+    memcpy(cache_get_line_ptr(cache, vaddr, paddr, CACHE_ACCESS_WRITE), data, len);
+  }
+}
+
 int cache_write_back(cache_t *cache, unsigned index) {
   if (cache->line[index].state == CACHE_MODIFIED) {
-    unsigned victim_addr = cache->line[index].tag | index * cache->line_len;
+    unsigned victim_addr = cache->line[index].tag;
+    cache_l2_access(cache, victim_addr, CACHE_ACCESS_WRITE);
     memory_cpy_to(cache->mem, cache->id, victim_addr, cache->line[index].data, cache->line_len);
+    cache->write_back_count++;
     // MSI Protocol - write back SHARED
     cache->line[index].state = CACHE_SHARED;
     return 1;
@@ -379,29 +849,133 @@ void cache_fini(cache_t *cache) {
     free(cache->line[i].data);
   }
   free(cache->line);
+  free(cache->plru);
   return;
 }
 
-void tlb_init(tlb_t *tlb, memory_t *mem, unsigned size) {
+void tlb_init(tlb_t *tlb, memory_t *mem, unsigned size, unsigned ways, unsigned replace) {
   tlb->mem = mem;
   tlb->line_size = size;
-  tlb->index_mask = tlb->line_size - 1;
-  tlb->tag_mask = (0xffffffff ^ tlb->index_mask) << 12;
+  tlb->ways = ways;
+  tlb->replace = replace;
+  tlb->index_mask = (size / ways) - 1;
   tlb->line = (tlb_line_t *)calloc(size, sizeof(tlb_line_t));
+  tlb->plru = (unsigned *)calloc(size / ways, sizeof(unsigned));
   tlb->access_count = 0;
   tlb->hit_count = 0;
+  tlb->evict_count = 0;
+  tlb->walk_count = 0;
+  tlb->walk_depth[0] = 0;
+  tlb->walk_depth[1] = 0;
+  tlb->pwc_hit_count = 0;
+  for (unsigned i = 0; i < TLB_PWC_SIZE; i++) {
+    tlb->pwc[i].valid = 0;
+  }
+  tlb->ram = memory_find_target(mem, MEMORY_BASE_ADDR_RAM, RAM_SIZE);
   tlb->id = 0;
+  tlb->adue = SVADU_EXTENSION;
+}
+
+void tlb_pwc_clear(tlb_t *tlb) {
+  for (unsigned i = 0; i < TLB_PWC_SIZE; i++) {
+    tlb->pwc[i].valid = 0;
+  }
 }
 
 void tlb_clear(tlb_t *tlb) {
   for (unsigned i = 0; i < tlb->line_size; i++) {
     tlb->line[i].valid = 0;
-    tlb->line[i].megapage = 0;
+  }
+  tlb_pwc_clear(tlb);
+}
+
+void tlb_flush(tlb_t *tlb, unsigned flush, unsigned vaddr, unsigned asid) {
+  unsigned vpn = vaddr >> 12;
+  // the walk cache is not tagged with the ASID
+  if (flush & TLB_FLUSH_VADDR) {
+    tlb->pwc[(vpn >> 10) % TLB_PWC_SIZE].valid = 0;
+  } else {
+    tlb_pwc_clear(tlb);
+  }
+  for (unsigned i = 0; i < tlb->line_size; i++) {
+    tlb_line_t *line = &tlb->line[i];
+    if ((flush & TLB_FLUSH_VADDR) &&
+        !(line->tag == vpn || (line->megapage && (line->tag >> 10) == (vpn >> 10)))) {
+      continue;
+    }
+    if ((flush & TLB_FLUSH_ASID) && (line->global || line->asid != asid)) {
+      continue;
+    }
+    line->valid = 0;
   }
 }
 
 void tlb_fini(tlb_t *tlb) {
   free(tlb->line);
+  free(tlb->plru);
+}
+
+// tree pseudo-LRU: node n (from 1) has the children 2n and 2n + 1, its bit points to the colder half
+static void tlb_plru_touch(tlb_t *tlb, unsigned set, unsigned way) {
+  unsigned node = 1;
+  for (unsigned half = tlb->ways >> 1; half > 0; half >>= 1) {
+    unsigned right = (way & half) ? 1 : 0;
+    if (right) {
+      tlb->plru[set] &= ~(1 << node);
+    } else {
+      tlb->plru[set] |= (1 << node);
+    }
+    node = 2 * node + right;
+  }
+}
+
+static unsigned tlb_plru_victim(tlb_t *tlb, unsigned set) {
+  unsigned node = 1;
+  unsigned way = 0;
+  for (unsigned half = tlb->ways >> 1; half > 0; half >>= 1) {
+    unsigned right = (tlb->plru[set] >> node) & 1;
+    way |= right ? half : 0;
+    node = 2 * node + right;
+  }
+  return way;
+}
+
+static void tlb_touch(tlb_t *tlb, tlb_line_t *line) {
+  unsigned pos = line - tlb->line;
+  if (tlb->replace == TLB_REPLACE_PLRU) {
+    tlb_plru_touch(tlb, pos / tlb->ways, pos % tlb->ways);
+  } else {
+    line->lru = tlb->access_count;
+  }
+}
+
+static tlb_line_t *tlb_lookup(tlb_t *tlb, unsigned asid, unsigned vpn) {
+  tlb_line_t *set = &tlb->line[(vpn & tlb->index_mask) * tlb->ways];
+  for (unsigned i = 0; i < tlb->ways; i++) {
+    if (set[i].valid && set[i].tag == vpn && (set[i].global || set[i].asid == asid)) {
+      return &set[i];
+    }
+  }
+  return NULL;
+}
+
+static tlb_line_t *tlb_victim(tlb_t *tlb, unsigned vpn) {
+  unsigned index = vpn & tlb->index_mask;
+  tlb_line_t *set = &tlb->line[index * tlb->ways];
+  tlb_line_t *victim = &set[0];
+  for (unsigned i = 0; i < tlb->ways; i++) {
+    if (!set[i].valid) {
+      return &set[i];
+    }
+    if (set[i].lru < victim->lru) {
+      victim = &set[i];
+    }
+  }
+  if (tlb->replace == TLB_REPLACE_PLRU) {
+    victim = &set[tlb_plru_victim(tlb, index)];
+  }
+  tlb->evict_count++;
+  return victim;
 }
 
 static int page_check_leaf(unsigned pte) {
@@ -430,23 +1004,52 @@ static int page_check_privilege(unsigned pte, unsigned access_type, unsigned prv
 #define PAGE_PRIVILEGE_ERROR 2
 #define PAGE_SUCCESS_MEGAPAGE 3
 
+// the PTEs are accessed in place in the RAM, after the caches have been made coherent
+static unsigned *tlb_pte_ptr(tlb_t *tlb, unsigned pte_addr, int is_write) {
+  if (tlb->ram == NULL || pte_addr - MEMORY_BASE_ADDR_RAM >= RAM_SIZE) {
+    return NULL;
+  }
+  memory_cache_coherent(tlb->mem, pte_addr, PTE_SIZE, is_write, tlb->id);
+  return (unsigned *)memory_target_get_ptr(tlb->ram, pte_addr);
+}
+
 static unsigned tlb_page_walk(tlb_t *tlb, unsigned vaddr, unsigned pte_base, unsigned *pte, unsigned access_type, unsigned prv) {
-  memory_t *mem = tlb->mem;
   unsigned access_fault = 0;
   unsigned protect_fault = 0;
   unsigned current_pte = 0;
+  unsigned pte_addr = 0;
+  unsigned *pte_ptr = NULL;
+  unsigned root = pte_base;
+  unsigned global = 0; // G in a non-leaf PTE applies to the mappings below
+  unsigned reads = 0;
+  unsigned vpn1 = vaddr >> 22;
+  tlb_pwc_t *pwc = &tlb->pwc[vpn1 % TLB_PWC_SIZE];
   int level = 1;
-  for (level = 1; level >= 0; level--) {
+ walk:
+  global = 0;
+  reads = 0;
+  level = 1;
+  if (pwc->valid && pwc->root == root && pwc->vpn1 == vpn1) {
+    // the level 0 table from the walk cache
+    tlb->pwc_hit_count++;
+    global = pwc->pte & PTE_G;
+    pte_base = ((pwc->pte >> 10) << 12);
+    level = 0;
+  }
+  for (; level >= 0; level--) {
     unsigned pte_id = ((vaddr >> ((2 + (10 * (level + 1))) & 0x0000001f)) & 0x000003ff); // word offset
-    unsigned pte_addr = pte_base + (pte_id * PTE_SIZE);
-    if (pte_addr < MEMORY_BASE_ADDR_RAM || (pte_addr > MEMORY_BASE_ADDR_RAM + RAM_SIZE)) {
+    pte_addr = pte_base + (pte_id * PTE_SIZE);
+    pte_ptr = tlb_pte_ptr(tlb, pte_addr, MEMORY_ACCESS_READ);
+    if (pte_ptr == NULL) {
 #if 0
       fprintf(stderr, "access fault pte%d: addr: %08x base: %08x id: %08x\n", level, pte_addr, pte_base, pte_id);
 #endif
       access_fault = 1;
       break;
     }
-    memory_cpy_from(mem, tlb->id, (char *)&current_pte, pte_base + 4 * pte_id, 4);
+    current_pte = __atomic_load_n(pte_ptr, __ATOMIC_RELAXED);
+    reads++;
+    global |= (current_pte & PTE_G);
     if (level == 0) {
       if (page_check_leaf(current_pte) && page_check_privilege(current_pte, access_type, prv)) {
         protect_fault = 0;
@@ -459,6 +1062,10 @@ static unsigned tlb_page_walk(tlb_t *tlb, unsigned vaddr, unsigned pte_base, uns
         if (page_check_leaf(current_pte)) {
           break;
         }
+        pwc->valid = 1;
+        pwc->root = root;
+        pwc->vpn1 = vpn1;
+        pwc->pte = current_pte;
       } else {
         protect_fault = 1;
       }
@@ -472,7 +1079,30 @@ static unsigned tlb_page_walk(tlb_t *tlb, unsigned vaddr, unsigned pte_base, uns
     }
     pte_base = ((current_pte >> 10) << 12);
   }
-  *pte = current_pte;
+  // the leaf must have A set (and D for a store)
+  unsigned ad = PTE_A | ((access_type == ACCESS_TYPE_STORE) ? PTE_D : 0);
+  if (!access_fault && !protect_fault && (current_pte & ad) != ad) {
+    if (!tlb->adue) {
+      // Svade: the kernel sets them on the page fault
+      protect_fault = 1;
+    } else {
+      // Svadu: written back atomically, through the coherence (the data caches drop the line)
+      unsigned expected = current_pte;
+      pte_ptr = tlb_pte_ptr(tlb, pte_addr, MEMORY_ACCESS_WRITE);
+      if (__atomic_compare_exchange_n(pte_ptr, &expected, current_pte | ad, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+        current_pte |= ad;
+      } else {
+        // the PTE has been changed by another hart since read
+        pte_base = root;
+        goto walk;
+      }
+    }
+  }
+  tlb->walk_count++;
+  if (reads > 0) {
+    tlb->walk_depth[reads - 1]++;
+  }
+  *pte = current_pte | global;
   if (access_fault) {
     return PAGE_ACCESS_ERROR;
   } else if (protect_fault) {
@@ -486,19 +1116,21 @@ static unsigned tlb_page_walk(tlb_t *tlb, unsigned vaddr, unsigned pte_base, uns
   }
 }
 
-unsigned tlb_get(tlb_t *tlb, unsigned vmrppn, unsigned vaddr, unsigned *paddr, unsigned access_type, unsigned prv) {
+unsigned tlb_get(tlb_t *tlb, unsigned vmrppn, unsigned asid, unsigned vaddr, unsigned *paddr, unsigned access_type, unsigned prv) {
   *paddr = 0;
   // search TLB first
-  unsigned index = (vaddr >> 12) & tlb->index_mask;
-  unsigned tag = vaddr & tlb->tag_mask;
+  unsigned vpn = vaddr >> 12;
   unsigned pte = 0;
   unsigned exception = 0;
   tlb->access_count++;
-  if (tlb->line[index].valid && (tlb->line[index].tag == tag)) {
+  tlb_line_t *line = tlb_lookup(tlb, asid, vpn);
+  // the first store through a clean entry walks again to set D
+  if (line && ((access_type != ACCESS_TYPE_STORE) || (line->value & PTE_D))) {
     tlb->hit_count++;
-    pte = tlb->line[index].value;
+    tlb_touch(tlb, line);
+    pte = line->value;
     if (page_check_privilege(pte, access_type, prv)) {
-      if (tlb->line[index].megapage) {
+      if (line->megapage) {
         *paddr = ((pte & 0xfff00000) << 2) | (vaddr & 0x003fffff);
       } else {
         *paddr = ((pte & 0xfffffc00) << 2) | (vaddr & 0x00000fff);
@@ -533,15 +1165,17 @@ unsigned tlb_get(tlb_t *tlb, unsigned vmrppn, unsigned vaddr, unsigned *paddr, u
     }
 
     if ((pw_result == PAGE_SUCCESS) || (pw_result == PAGE_SUCCESS_MEGAPAGE)) {
-      // register to TLB
-      tlb->line[index].valid = 1;
-      tlb->line[index].tag = tag;
-      tlb->line[index].value = pte;
-      if (pw_result == PAGE_SUCCESS_MEGAPAGE) {
-        tlb->line[index].megapage = 1;
-      } else {
-        tlb->line[index].megapage = 0;
+      // register to TLB (over the clean entry if any)
+      if (line == NULL) {
+        line = tlb_victim(tlb, vpn);
       }
+      line->valid = 1;
+      line->tag = vpn;
+      line->asid = asid;
+      line->global = (pte & PTE_G) ? 1 : 0;
+      line->value = pte;
+      line->megapage = (pw_result == PAGE_SUCCESS_MEGAPAGE) ? 1 : 0;
+      tlb_touch(tlb, line);
     } else if (pw_result == PAGE_ACCESS_ERROR) {
       switch (access_type) {
       case ACCESS_TYPE_INSTRUCTION:
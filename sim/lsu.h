@@ -17,9 +17,28 @@ struct core_step_result;
 #define CACHE_TAG_MODE_PIPT 0
 #define CACHE_TAG_MODE_VIPT 1
 
+#define CACHE_REPLACE_LRU 0
+#define CACHE_REPLACE_PLRU 1 // tree pseudo-LRU
+#define CACHE_REPLACE_RANDOM 2
+#define CACHE_REPLACE_FIFO 3
+
+// write policy (bits)
+#define CACHE_WRITE_BACK 0x0
+#define CACHE_WRITE_THROUGH 0x1     // the stores also reach the memory, the lines stay clean
+#define CACHE_WRITE_NO_ALLOCATE 0x2 // a store miss goes to the memory without a fill
+
+typedef struct cache_config_t {
+  unsigned line_len; // bytes, should be power of 2
+  unsigned sets;     // should be power of 2
+  unsigned ways;     // should be power of 2, up to 32
+  unsigned replace;  // CACHE_REPLACE_xxx
+  unsigned write;    // CACHE_WRITE_xxx
+} cache_config_t;
+
 typedef struct cache_line_t {
   unsigned char state;
-  unsigned tag;
+  unsigned tag; // line address
+  unsigned long lru; // last access (CACHE_REPLACE_LRU) or fill (CACHE_REPLACE_FIFO)
   char *data;
 } cache_line_t;
 
@@ -28,52 +47,133 @@ typedef struct cache_t {
   int tag_mode;
   struct memory_t *mem;
   unsigned line_len; // should be power of 2
-  unsigned line_size; // should be power of 2
-  cache_line_t *line;
+  unsigned line_size; // lines, ways * sets
+  unsigned ways;
+  unsigned replace; // CACHE_REPLACE_xxx
+  unsigned write;   // CACHE_WRITE_xxx
+  cache_line_t *line; // set-major
+  unsigned *plru;     // tree bits of each set (CACHE_REPLACE_PLRU)
+  unsigned seed;      // CACHE_REPLACE_RANDOM
   // mask
-  unsigned index_mask;
-  unsigned tag_mask;
+  unsigned index_mask; // set number
   unsigned line_mask;
   // performance counter
   unsigned long access_count;
   unsigned long hit_count;
+  unsigned long evict_count;
+  unsigned long write_back_count;
+  unsigned long next_access_count; // of the L2, by the misses and the write-backs of this cache
+  unsigned long next_hit_count;
 } cache_t;
 
+#define TLB_REPLACE_LRU 0
+#define TLB_REPLACE_PLRU 1 // tree pseudo-LRU
+
+// sfence.vma operands (none: everything)
+#define TLB_FLUSH_VADDR 0x1 // the entries translating the address
+#define TLB_FLUSH_ASID 0x2  // the non-global entries of the ASID
+
+// Sv32
+#define TLB_ASID_BITS 9
+#define TLB_ASID_MASK ((1 << TLB_ASID_BITS) - 1)
+
+#define TLB_PWC_SIZE 8 // page walk cache (non-leaf PTEs), direct mapped by VPN[1]
+
+typedef struct tlb_pwc_t {
+  unsigned char valid;
+  unsigned root; // page table base of satp
+  unsigned vpn1;
+  unsigned pte;
+} tlb_pwc_t;
+
 typedef struct tlb_line_t {
-  unsigned valid;
-  unsigned dirty;
-  unsigned tag;
+  unsigned char valid;
+  unsigned char megapage;
+  unsigned char global; // matches any ASID
+  unsigned short asid;
+  unsigned tag; // VPN (a megapage is entered per 4KiB page)
   unsigned value;
-  unsigned megapage;
+  unsigned long lru; // last access (TLB_REPLACE_LRU)
 } tlb_line_t;
 
 typedef struct tlb_t {
   struct memory_t *mem;
-  unsigned line_size; // should be power of 2
-  tlb_line_t *line;
+  unsigned line_size; // entries, ways * sets
+  unsigned ways;      // should be power of 2
+  unsigned replace;   // TLB_REPLACE_xxx
+  tlb_line_t *line;   // set-major
+  unsigned *plru;     // tree bits of each set (TLB_REPLACE_PLRU)
+  tlb_pwc_t pwc[TLB_PWC_SIZE];
+  struct memory_target_t *ram; // the PTEs are read in place
   // mask
   unsigned index_mask;
-  unsigned tag_mask;
   // performance counter
   unsigned long access_count;
   unsigned long hit_count;
+  unsigned long evict_count;
+  unsigned long walk_count;
+  unsigned long walk_depth[2]; // walks reading 1 (megapage or walk cache hit) and 2 PTEs
+  unsigned long pwc_hit_count;
   int id;
+  unsigned char adue; // A/D bits updated by the page walk (otherwise a page fault)
 } tlb_t;
 
+// PMP compiled into the regions (sorted, disjoint) of each privilege class
+#define PMP_MAX_REGION (2 * 64 + 1)
+#define PMP_PAGE_CACHE 64 // permissions of the pages inside a region, direct mapped
+
+typedef struct pmp_region_t {
+  unsigned base; // up to the base of the next region
+  unsigned char perm; // pmpcfg RWX (all if no entry matches)
+} pmp_region_t;
+
+typedef struct pmp_table_t {
+  unsigned char active; // some region denies something
+  unsigned num_region;
+  pmp_region_t region[PMP_MAX_REGION];
+  unsigned page_tag[PMP_PAGE_CACHE]; // page number + 1, 0: invalid
+  unsigned char page_perm[PMP_PAGE_CACHE];
+} pmp_table_t;
+
+// cache and TLB events of a hart (the sums of the counters of its caches and TLBs)
+typedef struct lsu_counter_t {
+  unsigned long icache_access;
+  unsigned long icache_hit;
+  unsigned long dcache_access;
+  unsigned long dcache_hit;
+  unsigned long dcache_write_back;
+  unsigned long tlb_access;
+  unsigned long tlb_hit;
+  unsigned long tlb_walk;
+  unsigned long l2_access;
+  unsigned long l2_hit;
+} lsu_counter_t;
+
 typedef struct lsu_t {
   struct memory_t *mem;
   // MMU
   // To support a physical address space larger than 4GiB,
   // RV32 stores a PPN in satp, ranther than a physical address.
   unsigned vmrppn; // root physical page number
+  unsigned asid;
   char vmflag; // true: virtual memory on
-  struct tlb_t *tlb;
+  // the entries are tagged with the ASID, a satp write keeps them
+  struct tlb_t *itlb;
+  struct tlb_t *dtlb; // the same as itlb if shared
   // CACHE for RAM
   struct cache_t *dcache;
   struct cache_t *icache;
   // Physical Memory Protection
   unsigned char pmpcfg[64];
   unsigned pmpaddr[64];
+  pmp_table_t pmp[2]; // M mode (the locked entries), S/U mode
+  lsu_counter_t reported; // the counters at the last lsu_report_events
+  // parallel mode: RAM is accessed in place with host atomics (no data cache)
+  unsigned char direct;
+  struct memory_target_t *ram; // resolved once by lsu_direct_on
+  unsigned char reserve_valid;
+  unsigned reserve_paddr;
+  unsigned reserve_value;
 } lsu_t;
 
 void lsu_init(lsu_t *, struct memory_t *mem);
@@ -88,30 +188,50 @@ unsigned lsu_atomic_operation(lsu_t *t, unsigned aquire, unsigned release,
 unsigned lsu_fence_instruction(lsu_t *t);
 unsigned lsu_fence(lsu_t *t, unsigned char predecessor, unsigned char successor);
 unsigned lsu_fence_tso(lsu_t *t);
-unsigned lsu_sfence_vma(lsu_t *t);
+unsigned lsu_sfence_vma(lsu_t *t, unsigned flush, unsigned vaddr, unsigned asid);
 // MMU functions
-void lsu_atp_on(lsu_t *, unsigned ppn);
+void lsu_atp_on(lsu_t *, unsigned asid, unsigned ppn);
 unsigned lsu_atp_get(lsu_t *);
 void lsu_atp_off(lsu_t *);
 void lsu_tlb_clear(lsu_t *);
+// entries (of each TLB if split), ways, TLB_REPLACE_xxx
+void lsu_tlb_config(lsu_t *, unsigned entries, unsigned ways, unsigned replace, unsigned split);
+void lsu_set_adue(lsu_t *, unsigned char adue);
+// the caches are written back and rebuilt empty
+void lsu_cache_config(lsu_t *, const cache_config_t *icache, const cache_config_t *dcache);
 void lsu_icache_invalidate(lsu_t *);
 void lsu_dcache_invalidate(lsu_t *);
 void lsu_dcache_invalidate_line(lsu_t *, unsigned paddr);
 void lsu_dcache_write_back(lsu_t *);
 unsigned lsu_address_translation(lsu_t *mem, unsigned vaddr, unsigned *paddr, unsigned access_type, unsigned prv);
+// reads the memory at a virtual address of the current satp as the harts see it, with no effect on
+// the caches, the TLBs or their counters (the permissions are not checked), returns 0 or 1 on a fault
+unsigned lsu_peek(lsu_t *, char *dst, unsigned vaddr, unsigned len);
+void lsu_direct_on(lsu_t *);
+void lsu_get_counter(const lsu_t *, lsu_counter_t *);
+// the events since the last report into the step result
+void lsu_report_events(lsu_t *, struct core_step_result *result);
+// recompiles the PMP regions after a pmpcfg/pmpaddr write
+void lsu_pmp_update(lsu_t *);
 void lsu_fini(lsu_t *);
 
-// cache (instruction or data)
-void cache_init(cache_t *, struct memory_t *, unsigned line_len, unsigned line_size);
+// cache (instruction, data or the shared L2)
+void cache_init(cache_t *, struct memory_t *, const cache_config_t *config);
+void cache_get_config(const cache_t *, cache_config_t *config);
 cache_line_t *cache_get_line(cache_t *, unsigned vaddr, unsigned paddr, int is_write);
 char *cache_get_line_ptr(cache_t *, unsigned vaddr, unsigned paddr, int is_write);
+// a store under the write policy of the cache
+void cache_store(cache_t *, unsigned vaddr, unsigned paddr, const char *data, unsigned len);
+// index: of the line (set * ways + way)
 int cache_write_back(cache_t *, unsigned index);
 void cache_fini(cache_t *);
 
 // translate lookaside buffer
-void tlb_init(tlb_t *, struct memory_t *, unsigned line_size);
-unsigned tlb_get(tlb_t *, unsigned basepte, unsigned vaddr, unsigned *paddr, unsigned access_type, unsigned prv);
+void tlb_init(tlb_t *, struct memory_t *, unsigned line_size, unsigned ways, unsigned replace);
+unsigned tlb_get(tlb_t *, unsigned basepte, unsigned asid, unsigned vaddr, unsigned *paddr, unsigned access_type, unsigned prv);
 void tlb_clear(tlb_t *);
+void tlb_pwc_clear(tlb_t *);
+void tlb_flush(tlb_t *, unsigned flush, unsigned vaddr, unsigned asid);
 void tlb_fini(tlb_t *);
 
 #endif
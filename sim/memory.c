@@ -19,10 +19,15 @@ void memory_init(memory_t *mem) {
   mem->targets = NULL;
   mem->num_cache = 0;
   mem->cache = NULL;
+  mem->l2 = NULL;
+  mtx_init(&mem->bus_lock, mtx_plain);
+  mtx_init(&mem->l2_lock, mtx_plain);
+  mem->bus_lock_en = 0;
 }
 
 unsigned memory_load(memory_t *mem, unsigned len, unsigned reserved, struct core_step_result *result) {
   unsigned found = 0;
+  if (mem->bus_lock_en) mtx_lock(&mem->bus_lock);
   for (unsigned u = 0; u < mem->num_targets; u++) {
     struct memory_target_t *unit = mem->targets[u];
     if ((result->m_paddr >= unit->base) && ((result->m_paddr + len) < (unit->base + unit->size))) {
@@ -36,6 +41,7 @@ unsigned memory_load(memory_t *mem, unsigned len, unsigned reserved, struct core
       break;
     }
   }
+  if (mem->bus_lock_en) mtx_unlock(&mem->bus_lock);
   if (found == 0) {
     result->exception_code = (reserved == MEMORY_LOAD_RESERVE) ? TRAP_CODE_AMO_ACCESS_FAULT : TRAP_CODE_LOAD_ACCESS_FAULT;
   }
@@ -44,6 +50,7 @@ unsigned memory_load(memory_t *mem, unsigned len, unsigned reserved, struct core
 
 unsigned memory_store(memory_t *mem, unsigned len, unsigned conditional, struct core_step_result *result) {
   unsigned found = 0;
+  if (mem->bus_lock_en) mtx_lock(&mem->bus_lock);
   for (unsigned u = 0; u < mem->num_targets; u++) {
     struct memory_target_t *unit = mem->targets[u];
     if ((result->m_paddr >= unit->base) && ((result->m_paddr + len) < (unit->base + unit->size))) {
@@ -61,125 +68,154 @@ unsigned memory_store(memory_t *mem, unsigned len, unsigned conditional, struct
       break;
     }
   }
+  if (mem->bus_lock_en) mtx_unlock(&mem->bus_lock);
   if (found == 0) {
     result->exception_code = (conditional == MEMORY_STORE_CONDITIONAL) ? TRAP_CODE_AMO_ACCESS_FAULT : TRAP_CODE_STORE_ACCESS_FAULT;
   }
   return result->exception_code;
 }
 
-unsigned memory_cpy_to(memory_t *mem, int device_id, unsigned dst, const char *data, int len) {
-  if (len <= 0) {
-    return 0;
+memory_target_t *memory_find_target(memory_t *mem, unsigned addr, unsigned len) {
+  for (unsigned u = 0; u < mem->num_targets; u++) {
+    struct memory_target_t *unit = mem->targets[u];
+    if ((addr >= unit->base) && (addr - unit->base + len <= unit->size)) {
+      return unit;
+    }
   }
+  return NULL;
+}
+
+int memory_dma_map(memory_t *mem, int device_id, unsigned addr, unsigned len, int is_write, struct iovec *iov, int max_iov) {
+  int num_iov = 0;
+  memory_target_t *unit = NULL;
 #if 0
-  printf("DMA pbase %08x len %08x\n", pbase, len);
+  printf("DMA map pbase %08x len %08x\n", addr, len);
 #endif
-  int len_remain = len;
-
-  unsigned dst_base;
-  unsigned src_base;
-  unsigned burst_len;
-  char *mem_ptr = NULL;
-
-  dst_base = dst;
-  src_base = 0;
-  burst_len = (((dst_base & RAM_PAGE_OFFS_MASK) + len) < RAM_PAGE_SIZE) ? len : RAM_PAGE_SIZE - (dst_base & RAM_PAGE_OFFS_MASK);
-
-  while (len_remain > 0) {
-    for (unsigned u = 0; u < mem->num_targets; u++) {
-      struct memory_target_t *unit = mem->targets[u];
-      if ((dst_base >= unit->base) && (dst_base + burst_len < (unit->base + unit->size))) {
-        mem_ptr = memory_target_get_ptr(unit, dst_base);
-        if (mem_ptr) {
-          memory_cache_coherent(mem, dst_base, burst_len, MEMORY_ACCESS_WRITE, device_id);
-          memcpy(mem_ptr, &data[src_base], burst_len);
-        } else {
-          printf("fatal: DMA could not access this region %08x - %08x\n", dst_base, dst_base + burst_len);
-        }
-        break;
-      }
+  if (len == 0) {
+    return 0;
+  }
+  // the whole range is made coherent at once, the caller owns it until the access is done
+  memory_cache_coherent(mem, addr, len, is_write, device_id);
+  while (len > 0) {
+    // a page is contiguous on the host, the pages are not
+    unsigned burst_len = RAM_PAGE_SIZE - (addr & RAM_PAGE_OFFS_MASK);
+    if (burst_len > len) {
+      burst_len = len;
+    }
+    if ((unit == NULL) || (addr - unit->base + burst_len > unit->size)) {
+      unit = memory_find_target(mem, addr, burst_len);
+    }
+    char *ptr = unit ? memory_target_get_ptr(unit, addr) : NULL;
+    if (ptr == NULL) {
+      return -1;
+    }
+    if ((num_iov > 0) && ((char *)iov[num_iov - 1].iov_base + iov[num_iov - 1].iov_len == ptr)) {
+      iov[num_iov - 1].iov_len += burst_len;
+    } else if (num_iov < max_iov) {
+      iov[num_iov].iov_base = ptr;
+      iov[num_iov].iov_len = burst_len;
+      num_iov++;
+    } else {
+      return -1;
+    }
+    addr += burst_len;
+    len -= burst_len;
+  }
+  return num_iov;
+}
+
+char *memory_dma_ptr(memory_t *mem, int device_id, unsigned addr, unsigned len, int is_write) {
+  struct iovec iov;
+  if ((len == 0) || (memory_dma_map(mem, device_id, addr, len, is_write, &iov, 1) != 1)) {
+    return NULL;
+  }
+  return (char *)iov.iov_base;
+}
+
+unsigned memory_dma_line_len(memory_t *mem) {
+  unsigned line_len = 1;
+  for (unsigned i = 0; i < mem->num_cache; i++) {
+    if (mem->cache[i]->line_len > line_len) {
+      line_len = mem->cache[i]->line_len;
+    }
+  }
+  return line_len;
+}
+
+// copy between the device and a target without host pointers (a ROM) byte by byte
+static void memory_cpy_slow(memory_t *mem, int device_id, unsigned addr, char *dst, const char *src, char fill, unsigned len) {
+  memory_target_t *unit = memory_find_target(mem, addr, len);
+  if (unit == NULL) {
+    printf("fatal: DMA could not access this region %08x - %08x\n", addr, addr + len);
+    return;
+  }
+  memory_cache_coherent(mem, addr, len, dst ? MEMORY_ACCESS_READ : MEMORY_ACCESS_WRITE, device_id);
+  for (unsigned i = 0; i < len; i++) {
+    if (dst) {
+      dst[i] = unit->readb(unit, addr + i);
+    } else {
+      unit->writeb(unit, addr + i, src ? src[i] : fill);
+    }
+  }
+}
+
+#define MEMORY_CPY_IOV 16
+
+unsigned memory_cpy_to(memory_t *mem, int device_id, unsigned dst, const char *data, int len) {
+  struct iovec iov[MEMORY_CPY_IOV];
+  while (len > 0) {
+    unsigned burst_len = (len > (MEMORY_CPY_IOV - 1) * RAM_PAGE_SIZE) ? (MEMORY_CPY_IOV - 1) * RAM_PAGE_SIZE : len;
+    int num_iov = memory_dma_map(mem, device_id, dst, burst_len, MEMORY_ACCESS_WRITE, iov, MEMORY_CPY_IOV);
+    if (num_iov < 0) {
+      memory_cpy_slow(mem, device_id, dst, NULL, data, 0, burst_len);
+    }
+    for (int i = 0; i < num_iov; i++) {
+      memcpy(iov[i].iov_base, data, iov[i].iov_len);
+      data += iov[i].iov_len;
+    }
+    if (num_iov < 0) {
+      data += burst_len;
     }
-    len_remain -= burst_len;
-    dst_base += burst_len;
-    src_base += burst_len;
-    burst_len = (len_remain >= RAM_PAGE_SIZE) ? RAM_PAGE_SIZE : len_remain;
+    dst += burst_len;
+    len -= burst_len;
   }
   return 0;
 }
 
 unsigned memory_cpy_from(memory_t *mem, int device_id, char *dst, unsigned src, int len) {
-  if (len <= 0) {
-    return 0;
-  }
-#if 0
-  printf("DMA pbase %08x len %08x\n", pbase, len);
-#endif
-  int len_remain = len;
-
-  unsigned dst_base;
-  unsigned src_base;
-  unsigned burst_len;
-  const char *mem_ptr = NULL;
-
-  dst_base = 0;
-  src_base = src;
-  burst_len = (((src_base & RAM_PAGE_OFFS_MASK) + len) < RAM_PAGE_SIZE) ? len : RAM_PAGE_SIZE - (src_base & RAM_PAGE_OFFS_MASK);
-
-  while (len_remain > 0) {
-    for (unsigned u = 0; u < mem->num_targets; u++) {
-      struct memory_target_t *unit = mem->targets[u];
-      if ((src_base >= unit->base) && (src_base + burst_len < (unit->base + unit->size))) {
-        mem_ptr = memory_target_get_ptr(unit, src_base);
-        if (mem_ptr) {
-          memory_cache_coherent(mem, src_base, burst_len, MEMORY_ACCESS_READ, device_id);
-          memcpy(&dst[dst_base], mem_ptr, burst_len);
-        } else {
-          printf("fatal: DMA could not access this region %08x - %08x\n", src_base, src_base + burst_len);
-        }
-        break;
-      }
+  struct iovec iov[MEMORY_CPY_IOV];
+  while (len > 0) {
+    unsigned burst_len = (len > (MEMORY_CPY_IOV - 1) * RAM_PAGE_SIZE) ? (MEMORY_CPY_IOV - 1) * RAM_PAGE_SIZE : len;
+    int num_iov = memory_dma_map(mem, device_id, src, burst_len, MEMORY_ACCESS_READ, iov, MEMORY_CPY_IOV);
+    if (num_iov < 0) {
+      memory_cpy_slow(mem, device_id, src, dst, NULL, 0, burst_len);
+    }
+    for (int i = 0; i < num_iov; i++) {
+      memcpy(dst, iov[i].iov_base, iov[i].iov_len);
+      dst += iov[i].iov_len;
     }
-    len_remain -= burst_len;
-    dst_base += burst_len;
-    src_base += burst_len;
-    burst_len = (len_remain >= RAM_PAGE_SIZE) ? RAM_PAGE_SIZE : len_remain;
+    if (num_iov < 0) {
+      dst += burst_len;
+    }
+    src += burst_len;
+    len -= burst_len;
   }
   return 0;
 }
 
 unsigned memory_set(memory_t *mem, int device_id, unsigned dst, char data, int len) {
-  if (len <= 0) {
-    return 0;
-  }
-#if 0
-  printf("DMA (char) pbase %08x len %08x\n", pbase, len);
-#endif
-  int len_remain = len;
-
-  unsigned dst_base;
-  unsigned burst_len;
-  char *mem_ptr = NULL;
-
-  dst_base = dst;
-  burst_len = (((dst_base & RAM_PAGE_OFFS_MASK) + len) < RAM_PAGE_SIZE) ? len : RAM_PAGE_SIZE - (dst_base & RAM_PAGE_OFFS_MASK);
-
-  while (len_remain > 0) {
-    for (unsigned u = 0; u < mem->num_targets; u++) {
-      struct memory_target_t *unit = mem->targets[u];
-      if ((dst_base >= unit->base) && (dst_base + burst_len < (unit->base + unit->size))) {
-        mem_ptr = memory_target_get_ptr(unit, dst_base);
-        if (mem_ptr) {
-          memory_cache_coherent(mem, dst_base, burst_len, MEMORY_ACCESS_WRITE, device_id);
-          memset(mem_ptr, data, burst_len);
-        } else {
-          printf("fatal: DMA could not access this region %08x - %08x\n", dst_base, dst_base + burst_len);
-        }
-        break;
-      }
+  struct iovec iov[MEMORY_CPY_IOV];
+  while (len > 0) {
+    unsigned burst_len = (len > (MEMORY_CPY_IOV - 1) * RAM_PAGE_SIZE) ? (MEMORY_CPY_IOV - 1) * RAM_PAGE_SIZE : len;
+    int num_iov = memory_dma_map(mem, device_id, dst, burst_len, MEMORY_ACCESS_WRITE, iov, MEMORY_CPY_IOV);
+    if (num_iov < 0) {
+      memory_cpy_slow(mem, device_id, dst, NULL, NULL, data, burst_len);
     }
-    len_remain -= burst_len;
-    dst_base += burst_len;
-    burst_len = (len_remain >= RAM_PAGE_SIZE) ? RAM_PAGE_SIZE : len_remain;
+    for (int i = 0; i < num_iov; i++) {
+      memset(iov[i].iov_base, data, iov[i].iov_len);
+    }
+    dst += burst_len;
+    len -= burst_len;
   }
   return 0;
 }
@@ -205,29 +241,76 @@ void memory_add_cache(memory_t *mem, cache_t *cache) {
   mem->cache[mem->num_cache++] = cache;
 }
 
+void memory_del_cache(memory_t *mem, cache_t *cache) {
+  for (unsigned i = 0; i < mem->num_cache; i++) {
+    if (mem->cache[i] == cache) {
+      mem->cache[i] = mem->cache[--mem->num_cache];
+      return;
+    }
+  }
+}
+
+unsigned memory_peek(memory_t *mem, char *dst, unsigned src, unsigned len) {
+  for (unsigned i = 0; i < len; i++) {
+    unsigned addr = src + i;
+    const char *ptr = NULL;
+    for (unsigned c = 0; c < mem->num_cache && ptr == NULL; c++) {
+      cache_t *cache = mem->cache[c];
+      unsigned line_addr = addr & ~(cache->line_len - 1);
+      unsigned set = (line_addr / cache->line_len) & cache->index_mask;
+      for (unsigned index = set * cache->ways; index < (set + 1) * cache->ways; index++) {
+        if (cache->line[index].state == CACHE_MODIFIED && cache->line[index].tag == line_addr) {
+          ptr = &cache->line[index].data[addr - line_addr];
+          break;
+        }
+      }
+    }
+    if (ptr == NULL) {
+      memory_target_t *unit = memory_find_target(mem, addr, 1);
+      ptr = unit ? memory_target_get_ptr(unit, addr) : NULL;
+    }
+    if (ptr == NULL) {
+      return 1;
+    }
+    dst[i] = *ptr;
+  }
+  return 0;
+}
+
 void memory_cache_coherent(memory_t *mem, unsigned addr, unsigned len, int is_write, int device_id) {
+  if (len == 0) {
+    return;
+  }
   for (unsigned i = 0; i < mem->num_cache; i++) {
     if (device_id != mem->cache[i]->id) {
       cache_t *cache = mem->cache[i];
-      unsigned tag_mask = cache->tag_mask;
-      for (unsigned j = 0; j < len; j++) {
-        unsigned index = ((addr + j) & cache->index_mask) / cache->line_len;
-        if (cache->line[index].tag == (addr & tag_mask)) {
-          // MSI Protocol
-          if (is_write) {
-            if (cache->line[index].state == CACHE_SHARED) {
-              // Other device want to write the line, then shard -> invalid
-              cache->line[index].state = CACHE_INVALID;
-            } else if (cache->line[index].state == CACHE_MODIFIED) {
-              // Other device want to write the line, then writeback to invalid
-              cache_write_back(cache, index);
-              cache->line[index].state = CACHE_INVALID;
-            }
-          } else {
-            if (cache->line[index].state == CACHE_MODIFIED) {
-              // Other device want to read the line, then writeback to shared
-              cache_write_back(cache, index);
-              cache->line[index].state = CACHE_SHARED;
+      // once per line of the range (or per set of the cache if the range is larger)
+      unsigned line_addr = addr & ~(cache->line_len - 1);
+      unsigned long long range = (unsigned long long)(addr - line_addr) + len;
+      unsigned num_lines = (range + cache->line_len - 1) / cache->line_len;
+      if (num_lines > cache->index_mask + 1) {
+        num_lines = cache->index_mask + 1;
+      }
+      for (unsigned j = 0; j < num_lines; j++) {
+        unsigned set = (line_addr / cache->line_len + j) & cache->index_mask;
+        for (unsigned index = set * cache->ways; index < (set + 1) * cache->ways; index++) {
+          if ((unsigned)(cache->line[index].tag - line_addr) < range) {
+            // MSI Protocol
+            if (is_write) {
+              if (cache->line[index].state == CACHE_SHARED) {
+                // Other device want to write the line, then shard -> invalid
+                cache->line[index].state = CACHE_INVALID;
+              } else if (cache->line[index].state == CACHE_MODIFIED) {
+                // Other device want to write the line, then writeback to invalid
+                cache_write_back(cache, index);
+                cache->line[index].state = CACHE_INVALID;
+              }
+            } else {
+              if (cache->line[index].state == CACHE_MODIFIED) {
+                // Other device want to read the line, then writeback to shared
+                cache_write_back(cache, index);
+                cache->line[index].state = CACHE_SHARED;
+              }
             }
           }
         }
@@ -239,6 +322,8 @@ void memory_cache_coherent(memory_t *mem, unsigned addr, unsigned len, int is_wr
 void memory_fini(memory_t *mem) {
   free(mem->targets);
   free(mem->cache);
+  mtx_destroy(&mem->bus_lock);
+  mtx_destroy(&mem->l2_lock);
   return;
 }
 
@@ -376,6 +461,7 @@ void sram_init_with_file(sram_t *sram, const char *img_path, int mode) {
   sram->data = (char *)mmap(NULL, sram->file_stat.st_size, PROT_WRITE, mmap_flag, fd, 0);
   if (sram->data == MAP_FAILED) {
     perror("sram mmap");
+    sram->data = NULL;
     close(fd);
     return;
   }
@@ -426,10 +512,17 @@ char *dram_get_ptr(struct memory_target_t *target, unsigned addr) {
     fprintf(stderr, "RAM Exceeds, %08x\n", addr);
     return NULL;
   }
-  if (dram->block[bid] == NULL) {
-    dram->block[bid] = (char *)malloc(dram->block_size * sizeof(char));
+  char *block = __atomic_load_n(&dram->block[bid], __ATOMIC_ACQUIRE);
+  if (block == NULL) {
+    // the harts (and the DMA) may touch a new block at once
+    char *new_block = (char *)malloc(dram->block_size * sizeof(char));
+    if (__atomic_compare_exchange_n(&dram->block[bid], &block, new_block, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      block = new_block;
+    } else {
+      free(new_block);
+    }
   }
-  return &(dram->block[bid][offs]);
+  return &block[offs];
 }
 
 char dram_readb(struct memory_target_t *target, unsigned addr) {
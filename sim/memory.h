@@ -1,6 +1,109 @@
 #ifndef MEMORY_H
 #define MEMORY_H
 
+#ifdef __MACH__
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+typedef pthread_t thrd_t;
+typedef pthread_mutex_t mtx_t;
+typedef pthread_cond_t cnd_t;
+enum {
+  thrd_error = 0,
+  thrd_success = 1
+};
+enum {
+  mtx_plain = 0,
+  mtx_recursive = 1,
+  mtx_timed = 2
+};
+typedef void *(*thrd_start_t)(void *);
+static inline int thrd_create(thrd_t *thr, thrd_start_t start_routine, void *arg) {
+  if (pthread_create(thr, NULL, start_routine, arg) == 0) {
+    return thrd_success;
+  } else {
+    return thrd_error;
+  }
+}
+static inline _Noreturn void thrd_exit(int res) { pthread_exit((void *)(intptr_t)res); }
+static inline int thrd_join(thrd_t thr, int *res) {
+  void *pres;
+  if (pthread_join(thr, &pres) != 0) {
+    return thrd_error;
+  }
+  if (res != NULL) {
+    *res = (int)(intptr_t)pres;
+  }
+  return thrd_success;
+}
+static inline int mtx_init(mtx_t *mtx, int type) {
+  if ((type == mtx_plain) && (pthread_mutex_init(mtx, NULL) == 0)) {
+    return thrd_success;
+  } else {
+    return thrd_error;
+  }
+}
+static inline int mtx_lock(mtx_t *mtx) {
+  if (pthread_mutex_lock(mtx) == 0) {
+    return thrd_success;
+  } else {
+    return thrd_error;
+  }
+}
+static inline int mtx_unlock(mtx_t *mtx) {
+  if (pthread_mutex_unlock(mtx) == 0) {
+    return thrd_success;
+  } else {
+    return thrd_error;
+  }
+}
+static inline int mtx_destroy(mtx_t *mtx) {
+  if (pthread_mutex_destroy(mtx) == 0) {
+    return thrd_success;
+  } else {
+    return thrd_error;
+  }
+}
+static inline int cnd_init(cnd_t *cond) {
+  if (pthread_cond_init(cond, NULL) == 0) {
+    return thrd_success;
+  } else {
+    return thrd_error;
+  }
+}
+static inline int cnd_signal(cnd_t *cond) {
+  if (pthread_cond_signal(cond) == 0) {
+    return thrd_success;
+  } else {
+    return thrd_error;
+  }
+}
+static inline void thrd_yield(void) { sched_yield(); }
+static inline int cnd_broadcast(cnd_t *cond) {
+  if (pthread_cond_broadcast(cond) == 0) {
+    return thrd_success;
+  } else {
+    return thrd_error;
+  }
+}
+static inline int cnd_wait(cnd_t *cond, mtx_t *mtx) {
+  if (pthread_cond_wait(cond, mtx) == 0) {
+    return thrd_success;
+  } else {
+    return thrd_error;
+  }
+}
+static inline int cnd_destroy(cnd_t *cond) {
+  if (pthread_cond_destroy(cond) == 0) {
+    return thrd_success;
+  } else {
+    return thrd_error;
+  }
+}
+#else
+#include <threads.h>
+#endif
+
 // atomic operations
 #define MEMORY_LOAD_DEFAULT 0
 #define MEMORY_LOAD_RESERVE 1
@@ -22,6 +125,7 @@
 
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 
 struct cache_t;
 struct core_step_result;
@@ -67,6 +171,13 @@ typedef struct memory_t {
   struct memory_target_t **targets;
   unsigned num_cache;
   struct cache_t **cache;
+  // the L2 shared by the harts behind their L1 misses and write-backs (NULL: none),
+  // it keeps the tags only, the data is always in the L1s or RAM
+  struct cache_t *l2;
+  mtx_t l2_lock; // with bus_lock_en (the icaches of the hart threads)
+  // serializes the device (non RAM) accesses, when the harts run on their own threads
+  mtx_t bus_lock;
+  unsigned char bus_lock_en;
 } memory_t;
 
 void memory_init(memory_t *);
@@ -75,8 +186,21 @@ unsigned memory_store(memory_t *, unsigned len, unsigned conditional, struct cor
 unsigned memory_cpy_to(memory_t *, int device_id, unsigned dst, const char *data, int len);
 unsigned memory_cpy_from(memory_t *, int device_id, char *dst, unsigned src, int len);
 unsigned memory_set(memory_t *, int device_id, unsigned dst, char c, int len);
+// reads RAM as the harts see it without touching the caches (the modified lines are read in place),
+// returns 0, or 1 if some byte is not RAM
+unsigned memory_peek(memory_t *, char *dst, unsigned src, unsigned len);
+// DMA mapping: the host memory behind [addr, addr + len) as iovecs, the caches are made coherent
+// for the access beforehand. returns the number of iovecs, or -1 if the range is not (all) RAM
+int memory_dma_map(memory_t *, int device_id, unsigned addr, unsigned len, int is_write, struct iovec *iov, int max_iov);
+// host pointer of a range contiguous on the host (always so within a page), NULL otherwise
+char *memory_dma_ptr(memory_t *, int device_id, unsigned addr, unsigned len, int is_write);
+// a mapping written outside the sim thread must not share a line with the cores
+unsigned memory_dma_line_len(memory_t *);
 void memory_add_target(memory_t *, memory_target_t *, unsigned base, unsigned size);
+// the target holding [addr, addr + len), NULL if none
+memory_target_t *memory_find_target(memory_t *, unsigned addr, unsigned len);
 void memory_add_cache(memory_t *, struct cache_t *);
+void memory_del_cache(memory_t *, struct cache_t *);
 void memory_cache_coherent(memory_t *, unsigned addr, unsigned len, int is_write, int device_id);
 void memory_fini(memory_t *);
 
@@ -35,65 +35,6 @@
 
 #define UART_BUF_SIZE 512
 
-#ifdef __MACH__
-enum {
-  thrd_error = 0,
-  thrd_success = 1
-};
-enum {
-  mtx_plain = 0,
-  mtx_recursive = 1,
-  mtx_timed = 2
-};
-typedef void *(*thrd_start_t)(void *);
-inline int thrd_create(thrd_t *thr, thrd_start_t start_routine, void *arg) {
-  if (pthread_create(thr, NULL, start_routine, arg) == 0) {
-    return thrd_success;
-  } else {
-    return thrd_error;
-  }
-}
-_Noreturn void thrd_exit(int res) { pthread_exit((void *)(intptr_t)res); }
-inline int thrd_join(thrd_t thr, int *res) {
-  void *pres;
-  if (pthread_join(thr, &pres) != 0) {
-    return thrd_error;
-  }
-  if (res != NULL) {
-    *res = (int)(intptr_t)pres;
-  }
-  return thrd_success;
-}
-inline int mtx_init(mtx_t *mtx, int type) {
-  if ((type == mtx_plain) && (pthread_mutex_init(mtx, NULL) == 0)) {
-    return thrd_success;
-  } else {
-    return thrd_error;
-  }
-}
-inline int mtx_lock(mtx_t *mtx) {
-  if (pthread_mutex_lock(mtx) == 0) {
-    return thrd_success;
-  } else {
-    return thrd_error;
-  }
-}
-inline int mtx_unlock(mtx_t *mtx) {
-  if (pthread_mutex_unlock(mtx) == 0) {
-    return thrd_success;
-  } else {
-    return thrd_error;
-  }
-}
-inline int mtx_destroy(mtx_t *mtx) {
-  if (pthread_mutex_destroy(mtx) == 0) {
-    return thrd_success;
-  } else {
-    return thrd_error;
-  }
-}
-#endif
-
 static int uart_input_routine(void *arg) {
   uart_t *uart = (uart_t *)arg;
   char c;
@@ -217,6 +158,27 @@ void uart_set_io(uart_t *uart, const char *in_path, const char *out_path) {
   return;
 }
 
+int uart_getchar(uart_t *uart) {
+  int ret = -1;
+  mtx_lock(&uart->mutex);
+  if (uart->buf_rd_index < uart->buf_wr_index) {
+    ret = (unsigned char)uart->buf[uart->buf_rd_index++];
+  }
+  if (uart->buf_rd_index == uart->buf_wr_index) {
+    uart->rx_reading = 0;
+    uart->buf_rd_index = 0;
+    uart->buf_wr_index = 0;
+  }
+  mtx_unlock(&uart->mutex);
+  return ret;
+}
+
+void uart_putchar(uart_t *uart, char c) {
+  if (write(uart->fo, &c, 1) < 0) {
+    perror("uart output");
+  }
+}
+
 char uart_read(struct memory_target_t *unit, unsigned addr) {
   addr -= unit->base;
   uart_t *uart = (uart_t *)unit;
@@ -227,18 +189,7 @@ char uart_read(struct memory_target_t *unit, unsigned addr) {
       ret = uart->dlab;
     } else {
       // RX Register (uart input)
-      mtx_lock(&uart->mutex);
-      if (uart->buf_rd_index < uart->buf_wr_index) {
-        ret = uart->buf[uart->buf_rd_index++];
-      } else {
-        ret = -1;
-      }
-      if (uart->buf_rd_index == uart->buf_wr_index) {
-        uart->rx_reading = 0;
-        uart->buf_rd_index = 0;
-        uart->buf_wr_index = 0;
-      }
-      mtx_unlock(&uart->mutex);
+      ret = (char)uart_getchar(uart);
     }
     return ret;
   }
@@ -297,9 +248,7 @@ void uart_write(struct memory_target_t *unit, unsigned addr, char value) {
     if (uart->lcr_dlab == 1) {
       uart->dlab = value;
     } else {
-      if (write(uart->fo, &value, 1) < 0) {
-        perror("uart output");
-      }
+      uart_putchar(uart, value);
       if (uart->intr_enable) {
         uart->tx_sent = 1;
       }
@@ -385,7 +334,6 @@ void uart_fini(uart_t *uart) {
   return;
 }
 
-#define VIRTIO_BLK_DESC_CHAIN_LEN (3)
 
 #define VIRTIO_BLK_F_SIZE_MAX (1) // Maximum size of any single segment is in size_max.
 #define VIRTIO_BLK_F_SEG_MAX (2) // Maximum number of segments in a request is in seg_max.
@@ -397,6 +345,9 @@ void uart_fini(uart_t *uart) {
 #define VIRTIO_BLK_F_CONFIG_WCE (11) // Device can toggle its cache between writeback and writethrough modes.
 #define VIRTIO_BLK_F_DISCARD (13) // Device can support discard command, maximum discard sectors size in max_discard_sectors and maximum discard segment number in max_discard_seg.
 #define VIRTIO_BLK_F_WRITE_ZEROES (14) // Device can support write zeroes command, maximum write zeroes sectors size in max_write_zeroes_sectors and maximum write zeroes segment number in max_write_zeroes_seg.
+#define VIRTIO_CONSOLE_F_SIZE (0) // Configuration cols and rows are valid.
+#define VIRTIO_CONSOLE_F_MULTIPORT (1) // Device has support for multiple ports.
+#define VIRTIO_CONSOLE_F_EMERG_WRITE (2) // Device has support for emergency write.
 #define VIRTIO_F_INDIRECT_DESC (28)
 #define VIRTIO_F_EVENT_IDX (29)
 #define VIRTIO_F_VERSION_1 (32)
@@ -407,38 +358,8 @@ void uart_fini(uart_t *uart) {
 #define VIRTIO_F_SR_IOV (37)
 #define VIRTIO_F_NOTIFICATION_DATA (38)
 
-void disk_init(disk_t *disk) {
-  disk->base.get_irq = disk_irq;
-  disk->base.ack_irq = disk_irq_ack;
-  disk->capacity = 0;
-  disk->mem = NULL;
-  disk->rom = NULL;
-  disk->current_queue = 0;
-  disk->queue_num = 0;
-  disk->queue_notify = 0;
-  disk->queue_ppn = 0;
-  disk->queue_align = 0;
-  disk->page_size = 0;
-  disk->page_size_mask = 0;
-  disk->status = 0;
-  disk->host_features =
-    (1LL << VIRTIO_F_NOTIFICATION_DATA) | (1LL << VIRTIO_F_VERSION_1);
-  disk->host_features_sel = 0;
-  disk->guest_features = 0; // init value
-  disk->guest_features_sel = 0;
-  disk->last_avail_idx = 0;
-  memory_target_init((struct memory_target_t *)disk, 0, 4096, NULL, disk_read, disk_write);
-}
-
-int disk_load(disk_t *disk, const char *img_path, int rom_mode) {
-  disk->rom = (sram_t *)calloc(1, sizeof(sram_t));
-  sram_init_with_file(disk->rom, img_path, rom_mode);
-  disk->capacity = disk->rom->file_stat.st_blocks;
-  return 0;
-}
-
 // virtio (see https://docs.oasis-open.org/virtio/virtio/v1.1/csprd01/virtio-v1.1-csprd01.html)
-// mmio legacy interface, block device
+// mmio legacy interface
 #define VIRTIO_MMIO_MAGIC_VALUE 0x000
 #define VIRTIO_MMIO_VERSION 0x004
 #define VIRTIO_MMIO_DEVICE_ID 0x008
@@ -457,13 +378,13 @@ int disk_load(disk_t *disk, const char *img_path, int rom_mode) {
 #define VIRTIO_MMIO_INTERRUPT_STATUS 0x060 // read only
 #define VIRTIO_MMIO_INTERRUPT_ACK 0x064 // write only
 #define VIRTIO_MMIO_STATUS 0x070
-#define VIRTIO_MMIO_CAPACITY_0 0x100
-#define VIRTIO_MMIO_CAPACITY_1 0x104
+#define VIRTIO_MMIO_CONFIG 0x100 // device specific configuration space
 
 #define VIRTIO_MMIO_MAGIC 0x74726976
 #define VIRTIO_MMIO_VENDOR_ID_VAL 0x554d4551
 #define VIRTIO_MMIO_VERSION_LEGACY 0x1
-#define VIRTIO_MMIO_DEVICE_BLOCK 0x2
+
+#define VIRTIO_MMIO_INT_VRING (1 << 0) // used buffer notification
 
 #define VIRTIO_MMIO_STATUS_ACKNOWLEDGE 1
 #define VIRTIO_MMIO_STATUS_DRIVER 2
@@ -472,15 +393,67 @@ int disk_load(disk_t *disk, const char *img_path, int rom_mode) {
 #define VIRTIO_MMIO_STATUS_DRIVER_OK 4
 #define VIRTIO_MMIO_STATUS_DEVICE_NEEDS_RESET 64
 
-#define VIRTIO_MMIO_MAX_QUEUE 8
 #define VIRTIO_DEBUG_DUMP 0
 
-char disk_read(struct memory_target_t *unit, unsigned addr) {
+// one entry in the "used" ring, with which the
+// device tells the driver about completed requests.
+typedef struct {
+  unsigned id;   // index of start of completed descriptor chain
+  unsigned len;
+} virtq_used_elem;
+
+#define VIRTQ_DESC_F_NEXT (1 << 0) // exits next queue
+#define VIRTQ_DESC_F_WRITE (1 << 1) // the descriptor is writable by device
+#define VIRTQ_DESC_F_INDIRECT (1 << 2) // the descriptor points an indirect table
+#define VIRTQ_DESC_F_AVAIL (1 << 7)
+#define VIRTQ_DESC_F_USED (1 << 15)
+
+static void virtio_reset(virtio_t *vio) {
+  vio->guest_features = 0; // init value
+  vio->guest_features_sel = 0;
+  vio->host_features_sel = 0;
+  vio->current_queue = 0;
+  vio->queue_notify = 0;
+  vio->interrupt_status = 0;
+  vio->status = 0;
+  for (unsigned i = 0; i < VIRTIO_MMIO_NUM_QUEUES; i++) {
+    vio->queue[i].num = 0;
+    vio->queue[i].pfn = 0;
+    vio->queue[i].align = 0;
+    vio->queue[i].last_avail_idx = 0;
+  }
+}
+
+void virtio_init(virtio_t *vio, struct memory_t *mem) {
+  vio->base.get_irq = virtio_irq;
+  vio->base.ack_irq = virtio_irq_ack;
+  vio->mem = mem; // for DMA
+  vio->device_id = VIRTIO_MMIO_DEVICE_NONE;
+  vio->dev = NULL;
+  vio->dev_notify = NULL;
+  vio->dev_config = NULL;
+  vio->dev_cycle = NULL;
+  vio->dev_fini = NULL;
+  vio->num_queues = 0;
+  vio->page_size = 0;
+  vio->host_features =
+    (1LL << VIRTIO_F_INDIRECT_DESC) | (1LL << VIRTIO_F_NOTIFICATION_DATA) | (1LL << VIRTIO_F_VERSION_1);
+  virtio_reset(vio);
+  memory_target_init((struct memory_target_t *)vio, 0, 4096, NULL, virtio_read, virtio_write);
+}
+
+char virtio_read(struct memory_target_t *unit, unsigned addr) {
   addr -= unit->base;
   unsigned ret = 0;
   unsigned base = addr & 0xFFFFFFFC;
   unsigned offs = addr & 0x00000003;
-  struct disk_t *disk = (struct disk_t *)unit;
+  virtio_t *vio = (virtio_t *)unit;
+  if (base >= VIRTIO_MMIO_CONFIG) {
+    if (vio->dev_config) {
+      ret = vio->dev_config(vio, base - VIRTIO_MMIO_CONFIG);
+    }
+    return ((ret >> (8 * offs)) & 0x000000FF);
+  }
   switch (base) {
   case VIRTIO_MMIO_MAGIC_VALUE:
     ret = VIRTIO_MMIO_MAGIC;
@@ -489,52 +462,48 @@ char disk_read(struct memory_target_t *unit, unsigned addr) {
     ret = VIRTIO_MMIO_VERSION_LEGACY;
     break;
   case VIRTIO_MMIO_DEVICE_ID:
-    ret = VIRTIO_MMIO_DEVICE_BLOCK;
+    ret = vio->device_id;
     break;
   case VIRTIO_MMIO_VENDOR_ID:
     ret = VIRTIO_MMIO_VENDOR_ID_VAL;
     break;
   case VIRTIO_MMIO_HOST_FEATURES:
-    if (disk->host_features_sel) {
-      ret = (unsigned)(disk->host_features >> 32);
+    if (vio->host_features_sel) {
+      ret = (unsigned)(vio->host_features >> 32);
     } else {
-      ret = (unsigned)disk->host_features;
+      ret = (unsigned)vio->host_features;
     }
     break;
   case VIRTIO_MMIO_HOST_FEATURES_SEL:
-    ret = disk->host_features_sel;
+    ret = vio->host_features_sel;
     break;
   case VIRTIO_MMIO_GUEST_FEATURES:
-    if (disk->guest_features_sel) {
-      ret = (unsigned)(disk->guest_features >> 32);
+    if (vio->guest_features_sel) {
+      ret = (unsigned)(vio->guest_features >> 32);
     } else {
-      ret = (unsigned)disk->guest_features;
+      ret = (unsigned)vio->guest_features;
     }
     break;
   case VIRTIO_MMIO_GUEST_FEATURES_SEL:
-    ret = disk->guest_features_sel;
+    ret = vio->guest_features_sel;
     break;
   case VIRTIO_MMIO_QUEUE_NUM_MAX:
-    ret = VIRTIO_MMIO_MAX_QUEUE;
+    ret = (vio->current_queue < vio->num_queues) ? VIRTIO_MMIO_MAX_QUEUE : 0;
     break;
   case VIRTIO_MMIO_INTERRUPT_STATUS:
-    ret = disk->queue_notify;
+    ret = vio->interrupt_status;
     break;
   case VIRTIO_MMIO_STATUS:
-    ret = disk->status;
+    ret = vio->status;
     break;
   case VIRTIO_MMIO_QUEUE_PFN:
-    ret = disk->queue_ppn;
-    break;
-  case VIRTIO_MMIO_CAPACITY_0:
-    ret = (int)disk->capacity;
-    break;
-  case VIRTIO_MMIO_CAPACITY_1:
-    ret = (int)(disk->capacity >> 32);
+    if (vio->current_queue < VIRTIO_MMIO_NUM_QUEUES) {
+      ret = vio->queue[vio->current_queue].pfn;
+    }
     break;
   default:
     ret = 0;
-    fprintf(stderr, "virtio-mmio (disk): unknown addr read: %08x\n", addr);
+    fprintf(stderr, "virtio-mmio: unknown addr read: %08x\n", addr);
     break;
   }
 #if 0
@@ -543,254 +512,119 @@ char disk_read(struct memory_target_t *unit, unsigned addr) {
   return ((ret >> (8 * offs)) & 0x000000FF);
 }
 
-typedef struct {
-  unsigned long long addr;
-  unsigned len;
-  unsigned short flags;
-  unsigned short next;
-} virtq_desc;
-
-typedef struct {
-  unsigned type; // IN or OUT
-  unsigned reserved;
-  unsigned long long sector;
-} virtio_blk_req;
-
-// the (entire) avail ring, from the spec.
-typedef struct {
-  unsigned short flags; // always zero
-  unsigned short idx;   // driver will write ring[idx] next
-  unsigned short ring[VIRTIO_MMIO_MAX_QUEUE]; // descriptor numbers of chain heads
-  unsigned short used_event; // supress interrupts till used_event has been processed
-} virtq_avail;
-
-// one entry in the "used" ring, with which the
-// device tells the driver about completed requests.
-typedef struct {
-  unsigned id;   // index of start of completed descriptor chain
-  unsigned len;
-} virtq_used_elem;
-
-typedef struct {
-  unsigned short flags; // always zero
-  unsigned short idx;   // device increments when it adds a ring[] entry
-  virtq_used_elem ring[VIRTIO_MMIO_MAX_QUEUE];
-  unsigned short avail_event; // supress interrupts till avail_event has been processed
-} virtq_used;
-
-#define VIRTQ_DESC_F_NEXT (1 << 0) // exits next queue
-#define VIRTQ_DESC_F_WRITE (1 << 1) // the descriptor is writable by device
-#define VIRTQ_DESC_F_AVAIL (1 << 7)
-#define VIRTQ_DESC_F_USED (1 << 15)
-
-#define VIRTIO_BLK_T_IN  0 // read the disk
-#define VIRTIO_BLK_T_OUT 1 // write the disk
-
-#define VIRTQ_DONE 0
-
-#define VIRTQ_STAGE_READ_BLK_REQ 0
-#define VIRTQ_STAGE_RW_SECTOR 1
-#define VIRTQ_STAGE_COMPLETE 2
-
-static void disk_process_queue(disk_t *disk) {
-  // run the disk r/w
-  unsigned desc_addr = disk->queue_ppn * disk->page_size;
-  virtq_desc desc;
-  virtq_avail avail;
-  virtq_used used;
-  memory_cpy_from(disk->mem, MEMORY_ACCESS_DEVICE_ID_DMA, (char *)&desc, desc_addr, sizeof(virtq_desc));
-#if VIRTIO_DEBUG_DUMP
-  fprintf(stderr, "ADDR %08x PAGESIZE %d (%08x) LAST_AVAIL_IDX %u\n", disk->queue_ppn, disk->page_size, disk->page_size, disk->last_avail_idx);
-#endif
-  memory_cpy_from(disk->mem, MEMORY_ACCESS_DEVICE_ID_DMA, (char *)&avail, desc_addr + VIRTIO_MMIO_MAX_QUEUE * sizeof(virtq_desc), sizeof(virtq_avail));
-#if VIRTIO_DEBUG_DUMP
-  fprintf(stderr, "AVAIL (GUEST -> HOST) flag %08x idx %08x ring ", avail.flags, avail.idx);
-  for (int i = 0; i < VIRTIO_MMIO_MAX_QUEUE; i++) {
-    fprintf(stderr, "%d ", avail.ring[i]);
-  }
-  fprintf(stderr, "used_event %u\n", avail.used_event);
-#endif
-  memory_cpy_from(disk->mem, MEMORY_ACCESS_DEVICE_ID_DMA, (char *)&used, desc_addr + disk->page_size, sizeof(virtq_used));
-  virtio_blk_req req;
-
-  // process descriptors
-  for (unsigned short idx = disk->last_avail_idx; idx < avail.idx; idx++, disk->last_avail_idx++) {
-    unsigned short current_desc_idx = avail.ring[idx % VIRTIO_MMIO_MAX_QUEUE];
-    for (unsigned i = 0; i < VIRTIO_BLK_DESC_CHAIN_LEN; i++) {
-      virtq_desc current_desc;
-      memory_cpy_from(disk->mem, MEMORY_ACCESS_DEVICE_ID_DMA, (char *)&current_desc, desc_addr + current_desc_idx * sizeof(virtq_desc), sizeof(virtq_desc));
-#if VIRTIO_DEBUG_DUMP
-      fprintf(stderr, "CURRENT DESC [%u] addr %016llx len %08x flags %08x next %08x\n",
-              current_desc_idx, current_desc.addr, current_desc.len, current_desc.flags, current_desc.next);
-#endif
-      int is_write_only = (current_desc.flags & VIRTQ_DESC_F_WRITE) ? 1 : 0;
-      // read from descripted address
-      if (i == VIRTQ_STAGE_READ_BLK_REQ && !is_write_only) {
-        memory_cpy_from(disk->mem, MEMORY_ACCESS_DEVICE_ID_DMA, (char *)&req, current_desc.addr, sizeof(virtio_blk_req));
-#if VIRTIO_DEBUG_DUMP
-        fprintf(stderr, "\tBLK REQ: %s, (req->reserved) = %08x  (req_sector) = %llu\n", (req.type == VIRTIO_BLK_T_IN) ? "READ" : "WRITE", req.reserved, req.sector);
-#endif
-      } else if (i == VIRTQ_STAGE_RW_SECTOR) {
-        if (disk->rom->data == NULL) {
-          fprintf(stderr, "mmio disk (RW queue): no disk\n");
-        } else {
-          char *sector = disk->rom->data + (512 * req.sector);
-          unsigned dma_base = current_desc.addr;
-#if VIRTIO_DEBUG_DUMP
-          fprintf(stderr, "\tBLK CMD: sector %016llx <-> DMA %08x\n", req.sector, dma_base);
-#endif
-          if (req.type == VIRTIO_BLK_T_IN) {
-            // disk -> memory
-            memory_cpy_to(disk->mem, MEMORY_ACCESS_DEVICE_ID_DMA, dma_base, sector, current_desc.len);
-          } else if (req.type == VIRTIO_BLK_T_OUT) {
-            // memory -> disk
-            memory_cpy_from(disk->mem, MEMORY_ACCESS_DEVICE_ID_DMA, sector, dma_base, current_desc.len);
-          } else {
-            fprintf(stderr, "[MMIO ERROR] invalid sequence\n");
-          }
-        }
-      } else if (i == VIRTQ_STAGE_COMPLETE && is_write_only) {
-        char data = VIRTQ_DONE;
-        // done
-        memory_cpy_to(disk->mem, MEMORY_ACCESS_DEVICE_ID_DMA, current_desc.addr, &data, 1);
-        // complete
-        used.ring[used.idx % VIRTIO_MMIO_MAX_QUEUE].id = avail.ring[idx % VIRTIO_MMIO_MAX_QUEUE];
-        used.ring[used.idx % VIRTIO_MMIO_MAX_QUEUE].len = i + 1;
-        used.idx++; // increment when completed
-        memory_cpy_to(disk->mem, MEMORY_ACCESS_DEVICE_ID_DMA, desc_addr + disk->page_size, (const char *)&used, sizeof(virtq_used));
-      }
-      // does next queue exist ?
-      if (!(current_desc.flags & VIRTQ_DESC_F_NEXT)) {
-        break;
-      };
-      current_desc_idx = current_desc.next;
-    }
-  }
-#if VIRTIO_DEBUG_DUMP
-  fprintf(stderr, "UPDATE USED  (Host -> GUEST) flag %08x idx %08x ids", used.flags, used.idx);
-  for (int i = 0; i < VIRTIO_MMIO_MAX_QUEUE; i++) {
-    fprintf(stderr, " %u [%u]", used.ring[i].id, used.ring[i].len);
-  }
-  fprintf(stderr, " avail_event %u\n", used.avail_event);
-#endif
-  // raise interrupt
-  disk->queue_notify = 1;
-}
-
-void disk_write(struct memory_target_t *unit, unsigned addr, char value) {
+void virtio_write(struct memory_target_t *unit, unsigned addr, char value) {
   addr -= unit->base;
-  disk_t *disk = (disk_t *)unit;
+  virtio_t *vio = (virtio_t *)unit;
   unsigned base = addr & 0xfffffffc;
   unsigned offs = addr & 0x00000003;
   unsigned mask = 0x000000FF << (8 * offs);
+  virtio_queue_t *queue = (vio->current_queue < VIRTIO_MMIO_NUM_QUEUES) ? &vio->queue[vio->current_queue] : NULL;
   switch (base) {
   case VIRTIO_MMIO_QUEUE_NOTIFY:
-    if ((disk->host_features & disk->guest_features) & (1LL << VIRTIO_F_NOTIFICATION_DATA)) {
-      disk->current_queue =
-        (disk->current_queue & (~mask)) | ((unsigned char)value << (8 * offs));
-    }
+    // the queue index (with VIRTIO_F_NOTIFICATION_DATA, the next avail index in upper 16 bit)
+    vio->queue_notify =
+      (vio->queue_notify & (~mask)) | ((unsigned char)value << (8 * offs));
     if (offs == 3) {
-      disk_process_queue(disk);
+      unsigned notified = vio->queue_notify & 0x0000ffff;
+      if (notified < vio->num_queues && vio->dev_notify) {
+        vio->dev_notify(vio, notified);
+      }
     }
     break;
   case VIRTIO_MMIO_GUEST_PAGE_SIZE:
-    disk->page_size =
-      (disk->page_size & (~mask)) | ((unsigned char)value << (8 * offs));
-    // [TODO?] for non 2 power
-    disk->page_size_mask = disk->page_size - 1;
+    vio->page_size =
+      (vio->page_size & (~mask)) | ((unsigned char)value << (8 * offs));
     break;
   case VIRTIO_MMIO_HOST_FEATURES:
     // read only
     break;
   case VIRTIO_MMIO_HOST_FEATURES_SEL:
-    disk->host_features_sel =
-      (disk->host_features_sel & (~mask)) | ((unsigned char)value << (8 * offs));
+    vio->host_features_sel =
+      (vio->host_features_sel & (~mask)) | ((unsigned char)value << (8 * offs));
     break;
   case VIRTIO_MMIO_GUEST_FEATURES:
-    if (disk->guest_features_sel) {
-      disk->guest_features =
-        ((((disk->guest_features >> 32) & (~mask)) | ((unsigned char)value << (8 * offs))) << 32) |
-        (disk->guest_features & 0x00000000FFFFFFFF);
+    if (vio->guest_features_sel) {
+      vio->guest_features =
+        ((((vio->guest_features >> 32) & (~mask)) | ((unsigned char)value << (8 * offs))) << 32) |
+        (vio->guest_features & 0x00000000FFFFFFFF);
     } else {
-      disk->guest_features =
-        (disk->guest_features & 0xFFFFFFFF00000000) |
-        ((disk->guest_features & (~mask)) | ((unsigned char)value << (8 * offs)));
+      vio->guest_features =
+        (vio->guest_features & 0xFFFFFFFF00000000) |
+        ((vio->guest_features & (~mask)) | ((unsigned char)value << (8 * offs)));
     }
     break;
   case VIRTIO_MMIO_GUEST_FEATURES_SEL:
-    disk->guest_features_sel =
-      (disk->guest_features_sel & (~mask)) | ((unsigned char)value << (8 * offs));
+    vio->guest_features_sel =
+      (vio->guest_features_sel & (~mask)) | ((unsigned char)value << (8 * offs));
     break;
   case VIRTIO_MMIO_QUEUE_SEL:
-    disk->current_queue =
-      (disk->current_queue & (~mask)) | ((unsigned char)value << (8 * offs));
-#if 0
-    if (offs == 3) {
-      printf("CURRENT QUEUE: %08x\n", disk->current_queue);
-    }
-#endif
+    vio->current_queue =
+      (vio->current_queue & (~mask)) | ((unsigned char)value << (8 * offs));
     break;
   case VIRTIO_MMIO_QUEUE_NUM:
-    disk->queue_num =
-      (disk->queue_num & (~mask)) | ((unsigned char)value << (8 * offs));
-#if 0
-    if (offs == 3) {
-      printf("CURRENT Q Num: %08x\n", disk->queue_num);
+    if (queue) {
+      queue->num =
+        (queue->num & (~mask)) | ((unsigned char)value << (8 * offs));
+      if (offs == 3 && queue->num > VIRTIO_MMIO_MAX_QUEUE) {
+        queue->num = VIRTIO_MMIO_MAX_QUEUE;
+      }
     }
-#endif
     break;
   case VIRTIO_MMIO_QUEUE_ALIGN:
-    disk->queue_align =
-      (disk->current_queue & (~mask)) | ((unsigned char)value << (8 * offs));
-#if 0
-    if (offs == 3) {
-      printf("CURRENT Q Align: %08x\n", disk->queue_align);
+    if (queue) {
+      queue->align =
+        (queue->align & (~mask)) | ((unsigned char)value << (8 * offs));
     }
-#endif
     break;
   case VIRTIO_MMIO_QUEUE_PFN:
-    disk->queue_ppn =
-      (disk->queue_ppn & (~mask)) | ((unsigned char)value << (8 * offs));
+    if (queue) {
+      queue->pfn =
+        (queue->pfn & (~mask)) | ((unsigned char)value << (8 * offs));
 #if 0
-    if (offs == 3) {
-      printf("Q PPN %08x\n", disk->queue_ppn);
-    }
+      if (offs == 3) {
+        printf("Q[%u] PPN %08x\n", vio->current_queue, queue->pfn);
+      }
 #endif
+    }
     break;
   case VIRTIO_MMIO_STATUS:
-    disk->status =
-      (disk->status & (~mask)) | ((unsigned char)value << (8 * offs));
+    vio->status =
+      (vio->status & (~mask)) | ((unsigned char)value << (8 * offs));
+    if (offs == 3 && vio->status == 0) {
+      // writing zero resets the device
+      virtio_reset(vio);
+    }
 #if 0
-    if (disk->status & VIRTIO_MMIO_STATUS_ACKNOWLEDGE) {
+    if (vio->status & VIRTIO_MMIO_STATUS_ACKNOWLEDGE) {
       fprintf(stderr, "VTIO STATUS ACK\n");
     }
-    if (disk->status & VIRTIO_MMIO_STATUS_DRIVER) {
+    if (vio->status & VIRTIO_MMIO_STATUS_DRIVER) {
       fprintf(stderr, "VTIO STATUS DRIVER\n");
     }
-    if (disk->status & VIRTIO_MMIO_STATUS_FAILED) {
+    if (vio->status & VIRTIO_MMIO_STATUS_FAILED) {
       fprintf(stderr, "VTIO STATUS FAILED\n");
     }
-    if (disk->status & VIRTIO_MMIO_STATUS_DRIVER_OK) {
+    if (vio->status & VIRTIO_MMIO_STATUS_DRIVER_OK) {
       fprintf(stderr, "VTIO STATUS Driver OK\n");
     }
-    if (disk->status & VIRTIO_MMIO_STATUS_FEATURES_OK) {
+    if (vio->status & VIRTIO_MMIO_STATUS_FEATURES_OK) {
       fprintf(stderr, "VTIO STATUS Features OK\n");
     }
-    if (disk->status & VIRTIO_MMIO_STATUS_DEVICE_NEEDS_RESET) {
+    if (vio->status & VIRTIO_MMIO_STATUS_DEVICE_NEEDS_RESET) {
       fprintf(stderr, "VTIO STATUS Device Needs to Reset\n");
     }
 #endif
     break;
   case VIRTIO_MMIO_INTERRUPT_ACK:
-    if (value) {
-      disk->queue_notify = 0;
+    vio->interrupt_status &= ~((unsigned char)value << (8 * offs));
 #if 0
-      fprintf(stderr, "VTIO queue ack\n");
+    fprintf(stderr, "VTIO queue ack\n");
 #endif
-    }
     break;
   default:
-    fprintf(stderr, "mmio (disk): unknown addr write: %08x, %08x\n", addr, value);
+    if (base < VIRTIO_MMIO_CONFIG) {
+      fprintf(stderr, "virtio-mmio: unknown addr write: %08x, %08x\n", addr, value);
+    }
     break;
   }
 #if 0
@@ -799,21 +633,653 @@ void disk_write(struct memory_target_t *unit, unsigned addr, char value) {
   return;
 }
 
-unsigned disk_irq(const struct mmio_t *mmio) {
-  const disk_t *disk = (const disk_t *)mmio;
-  return disk->queue_notify;
+void virtio_cycle(virtio_t *vio, unsigned cycles) {
+  if (vio->dev_cycle) {
+    vio->dev_cycle(vio, cycles);
+  }
 }
 
-void disk_irq_ack(struct mmio_t *mmio) {
-  disk_t *disk = (disk_t *)mmio;
-  disk->queue_notify = 0;
+unsigned virtio_irq(const struct mmio_t *mmio) {
+  const virtio_t *vio = (const virtio_t *)mmio;
+  return (vio->interrupt_status != 0);
 }
 
-void disk_fini(disk_t *disk) {
-  if (disk->rom) {
-    sram_fini(disk->rom);
-    free(disk->rom);
+void virtio_irq_ack(struct mmio_t *mmio) {
+  // level triggered, the driver clears the status with InterruptACK
+  return;
+}
+
+void virtio_fini(virtio_t *vio) {
+  if (vio->dev_fini) {
+    vio->dev_fini(vio);
   }
-  memory_target_fini((struct memory_target_t *)disk);
+  free(vio->dev);
+  memory_target_fini((struct memory_target_t *)vio);
   return;
 }
+
+// legacy virtqueue layout: descriptor table, avail ring, (aligned) used ring
+static unsigned virtq_desc_addr(const virtio_t *vio, const virtio_queue_t *queue) {
+  return queue->pfn * vio->page_size;
+}
+
+static unsigned virtq_avail_addr(const virtio_t *vio, const virtio_queue_t *queue) {
+  return virtq_desc_addr(vio, queue) + queue->num * sizeof(virtq_desc);
+}
+
+static unsigned virtq_used_addr(const virtio_t *vio, const virtio_queue_t *queue) {
+  unsigned align = (queue->align) ? queue->align : vio->page_size;
+  // flags, idx, ring[num], used_event
+  unsigned avail_end = virtq_avail_addr(vio, queue) + 2 * (3 + queue->num);
+  return (avail_end + align - 1) & ~(align - 1);
+}
+
+int virtio_queue_pop(virtio_t *vio, unsigned queue_idx, virtio_chain_t *chain) {
+  virtio_queue_t *queue = &vio->queue[queue_idx];
+  if (queue->pfn == 0 || queue->num == 0) {
+    return 0;
+  }
+  // the rings are read in place
+  const virtq_desc *desc_table = (const virtq_desc *)memory_dma_ptr(vio->mem, MEMORY_ACCESS_DEVICE_ID_DMA, virtq_desc_addr(vio, queue),
+                                                                    queue->num * sizeof(virtq_desc), MEMORY_ACCESS_READ);
+  // flags, idx, ring[num]
+  const unsigned short *avail = (const unsigned short *)memory_dma_ptr(vio->mem, MEMORY_ACCESS_DEVICE_ID_DMA, virtq_avail_addr(vio, queue),
+                                                                       2 * (2 + queue->num), MEMORY_ACCESS_READ);
+  if (desc_table == NULL || avail == NULL) {
+    fprintf(stderr, "[MMIO ERROR] virtqueue %u is not in RAM\n", queue_idx);
+    return 0;
+  }
+  if (queue->last_avail_idx == avail[1]) {
+    return 0;
+  }
+  unsigned short desc_idx = avail[2 + (queue->last_avail_idx % queue->num)];
+  queue->last_avail_idx++;
+  chain->head = desc_idx;
+  chain->num = 0;
+  // collect the descriptor chain
+  for (unsigned i = 0; i < queue->num && chain->num < VIRTIO_MMIO_MAX_CHAIN; i++) {
+    virtq_desc *desc = &chain->desc[chain->num++];
+    *desc = desc_table[desc_idx % queue->num];
+#if VIRTIO_DEBUG_DUMP
+    fprintf(stderr, "Q[%u] DESC [%u] addr %016llx len %08x flags %08x next %08x\n",
+            queue_idx, desc_idx, desc->addr, desc->len, desc->flags, desc->next);
+#endif
+    if (desc->flags & VIRTQ_DESC_F_INDIRECT) {
+      // the table replaces this descriptor, and ends the chain
+      virtq_desc copy[VIRTIO_MMIO_MAX_CHAIN];
+      unsigned table_len = desc->len / sizeof(virtq_desc);
+      if (table_len > VIRTIO_MMIO_MAX_CHAIN) {
+        table_len = VIRTIO_MMIO_MAX_CHAIN;
+      }
+      const virtq_desc *table = (const virtq_desc *)memory_dma_ptr(vio->mem, MEMORY_ACCESS_DEVICE_ID_DMA, desc->addr,
+                                                                   table_len * sizeof(virtq_desc), MEMORY_ACCESS_READ);
+      if (table == NULL) {
+        // crossing pages
+        memory_cpy_from(vio->mem, MEMORY_ACCESS_DEVICE_ID_DMA, (char *)copy, desc->addr, table_len * sizeof(virtq_desc));
+        table = copy;
+      }
+      chain->num--;
+      for (unsigned j = 0, k = 0; j < table_len && chain->num < VIRTIO_MMIO_MAX_CHAIN; j++) {
+        chain->desc[chain->num++] = table[k];
+        if (!(table[k].flags & VIRTQ_DESC_F_NEXT) || table[k].next >= table_len) {
+          break;
+        }
+        k = table[k].next;
+      }
+      break;
+    }
+    // does next queue exist ?
+    if (!(desc->flags & VIRTQ_DESC_F_NEXT)) {
+      break;
+    }
+    desc_idx = desc->next;
+  }
+  return 1;
+}
+
+void virtio_queue_push(virtio_t *vio, unsigned queue_idx, unsigned short head, unsigned len) {
+  virtio_queue_t *queue = &vio->queue[queue_idx];
+  // flags, idx, ring[num]
+  char *used = memory_dma_ptr(vio->mem, MEMORY_ACCESS_DEVICE_ID_DMA, virtq_used_addr(vio, queue),
+                              4 + sizeof(virtq_used_elem) * queue->num, MEMORY_ACCESS_WRITE);
+  if (used == NULL) {
+    fprintf(stderr, "[MMIO ERROR] virtqueue %u is not in RAM\n", queue_idx);
+    return;
+  }
+  unsigned short used_idx = *(unsigned short *)&used[2];
+  virtq_used_elem *elem = (virtq_used_elem *)&used[4 + sizeof(virtq_used_elem) * (used_idx % queue->num)];
+  elem->id = head;
+  elem->len = len;
+  used_idx++; // increment when completed
+  *(unsigned short *)&used[2] = used_idx;
+#if VIRTIO_DEBUG_DUMP
+  fprintf(stderr, "Q[%u] USED (HOST -> GUEST) idx %u id %u len %u\n", queue_idx, used_idx, head, len);
+#endif
+  // raise interrupt
+  vio->interrupt_status |= VIRTIO_MMIO_INT_VRING;
+}
+
+// total length of the device readable (writable = 0) or writable (writable = 1) buffers
+unsigned virtio_chain_len(const virtio_chain_t *chain, int writable) {
+  unsigned len = 0;
+  for (unsigned i = 0; i < chain->num; i++) {
+    if (((chain->desc[i].flags & VIRTQ_DESC_F_WRITE) != 0) == (writable != 0)) {
+      len += chain->desc[i].len;
+    }
+  }
+  return len;
+}
+
+// guest memory (device readable buffers from offs) -> buf
+unsigned virtio_chain_read(virtio_t *vio, const virtio_chain_t *chain, unsigned offs, char *buf, unsigned len) {
+  unsigned done = 0;
+  for (unsigned i = 0; i < chain->num && done < len; i++) {
+    const virtq_desc *desc = &chain->desc[i];
+    if (desc->flags & VIRTQ_DESC_F_WRITE) {
+      continue;
+    }
+    if (offs >= desc->len) {
+      offs -= desc->len;
+      continue;
+    }
+    unsigned n = desc->len - offs;
+    if (n > len - done) {
+      n = len - done;
+    }
+    memory_cpy_from(vio->mem, MEMORY_ACCESS_DEVICE_ID_DMA, &buf[done], desc->addr + offs, n);
+    done += n;
+    offs = 0;
+  }
+  return done;
+}
+
+// buf -> guest memory (device writable buffers from offs)
+unsigned virtio_chain_write(virtio_t *vio, const virtio_chain_t *chain, unsigned offs, const char *buf, unsigned len) {
+  unsigned done = 0;
+  for (unsigned i = 0; i < chain->num && done < len; i++) {
+    const virtq_desc *desc = &chain->desc[i];
+    if (!(desc->flags & VIRTQ_DESC_F_WRITE)) {
+      continue;
+    }
+    if (offs >= desc->len) {
+      offs -= desc->len;
+      continue;
+    }
+    unsigned n = desc->len - offs;
+    if (n > len - done) {
+      n = len - done;
+    }
+    memory_cpy_to(vio->mem, MEMORY_ACCESS_DEVICE_ID_DMA, desc->addr + offs, &buf[done], n);
+    done += n;
+    offs = 0;
+  }
+  return done;
+}
+
+// device readable (writable = 0) or writable (writable = 1) buffers [offs, offs + len) of the chain
+// in place, as host iovecs. returns the number of iovecs, or -1 if they are not all in RAM
+int virtio_chain_map(virtio_t *vio, const virtio_chain_t *chain, int writable, unsigned offs, unsigned len, struct iovec *iov, int max_iov) {
+  unsigned done = 0;
+  int num_iov = 0;
+  for (unsigned i = 0; i < chain->num && done < len; i++) {
+    const virtq_desc *desc = &chain->desc[i];
+    if (((desc->flags & VIRTQ_DESC_F_WRITE) != 0) != (writable != 0)) {
+      continue;
+    }
+    if (offs >= desc->len) {
+      offs -= desc->len;
+      continue;
+    }
+    unsigned n = desc->len - offs;
+    if (n > len - done) {
+      n = len - done;
+    }
+    int ret = memory_dma_map(vio->mem, MEMORY_ACCESS_DEVICE_ID_DMA, desc->addr + offs, n,
+                             writable ? MEMORY_ACCESS_WRITE : MEMORY_ACCESS_READ, &iov[num_iov], max_iov - num_iov);
+    if (ret < 0) {
+      return -1;
+    }
+    num_iov += ret;
+    done += n;
+    offs = 0;
+  }
+  return num_iov;
+}
+
+// block device
+typedef struct {
+  unsigned type; // IN or OUT
+  unsigned reserved;
+  unsigned long long sector;
+} virtio_blk_req;
+
+#define VIRTIO_BLK_T_IN  0 // read the disk
+#define VIRTIO_BLK_T_OUT 1 // write the disk
+
+#define VIRTIO_BLK_S_OK 0
+#define VIRTIO_BLK_S_IOERR 1
+#define VIRTIO_BLK_S_UNSUPP 2
+
+#define VIRTIO_BLK_SECTOR_SIZE 512
+
+// the data buffers of a request are mapped in place for the worker. it writes read data outside of
+// the sim thread, so a read buffer sharing a cache line with something else goes through the bounce
+// buffer and is copied at the completion (unbounce = 1)
+static int disk_map(virtio_t *vio, disk_request_t *req, int unbounce) {
+  int writable = (req->type == VIRTIO_BLK_T_IN);
+  unsigned offs = writable ? 0 : sizeof(virtio_blk_req);
+  unsigned line_mask = memory_dma_line_len(vio->mem) - 1;
+  unsigned done = 0;
+  for (unsigned i = 0; i < req->chain.num && done < req->len; i++) {
+    const virtq_desc *desc = &req->chain.desc[i];
+    if (((desc->flags & VIRTQ_DESC_F_WRITE) != 0) != writable) {
+      continue;
+    }
+    if (offs >= desc->len) {
+      offs -= desc->len;
+      continue;
+    }
+    unsigned addr = desc->addr + offs;
+    unsigned n = desc->len - offs;
+    if (n > req->len - done) {
+      n = req->len - done;
+    }
+    offs = 0;
+    if (writable && ((addr | n) & line_mask)) {
+      if (unbounce) {
+        memory_cpy_to(vio->mem, MEMORY_ACCESS_DEVICE_ID_DMA, addr, &req->bounce[done], n);
+      } else if (req->iovcnt < DISK_MAX_IOV) {
+        if (req->bounce == NULL) {
+          req->bounce = (char *)malloc(req->len);
+        }
+        req->iov[req->iovcnt].iov_base = &req->bounce[done];
+        req->iov[req->iovcnt].iov_len = n;
+        req->iovcnt++;
+      } else {
+        return -1;
+      }
+    } else if (!unbounce) {
+      int ret = memory_dma_map(vio->mem, MEMORY_ACCESS_DEVICE_ID_DMA, addr, n, writable ? MEMORY_ACCESS_WRITE : MEMORY_ACCESS_READ,
+                               &req->iov[req->iovcnt], DISK_MAX_IOV - req->iovcnt);
+      if (ret < 0) {
+        return -1;
+      }
+      req->iovcnt += ret;
+    }
+    done += n;
+  }
+  return 0;
+}
+
+static void disk_notify(virtio_t *vio, unsigned queue) {
+  // pick up the new request chains and hand them to the worker
+  disk_t *disk = (disk_t *)vio->dev;
+  virtio_chain_t chain;
+  while (virtio_queue_pop(vio, queue, &chain)) {
+    disk_request_t *req = &disk->request[disk->req_submit % VIRTIO_MMIO_MAX_QUEUE];
+    // [header, data..., status]
+    unsigned rlen = virtio_chain_len(&chain, 0);
+    unsigned wlen = virtio_chain_len(&chain, 1);
+    virtio_blk_req header;
+    req->chain = chain;
+    req->len = 0;
+    req->iovcnt = 0;
+    req->bounce = NULL;
+    req->status = VIRTIO_BLK_S_OK;
+    if (rlen < sizeof(virtio_blk_req) || wlen < 1) {
+      fprintf(stderr, "[MMIO ERROR] invalid sequence\n");
+      req->type = (unsigned)-1;
+    } else {
+      virtio_chain_read(vio, &chain, 0, (char *)&header, sizeof(virtio_blk_req));
+#if VIRTIO_DEBUG_DUMP
+      fprintf(stderr, "\tBLK REQ: %s, (req->reserved) = %08x  (req_sector) = %llu\n", (header.type == VIRTIO_BLK_T_IN) ? "READ" : "WRITE", header.reserved, header.sector);
+#endif
+      req->type = header.type;
+      req->sector = header.sector;
+      if (req->type == VIRTIO_BLK_T_IN) {
+        req->len = wlen - 1;
+      } else if (req->type == VIRTIO_BLK_T_OUT) {
+        req->len = rlen - sizeof(virtio_blk_req);
+      }
+      if (disk_map(vio, req, 0) < 0) {
+        fprintf(stderr, "[MMIO ERROR] disk request buffer is not in RAM\n");
+        req->status = VIRTIO_BLK_S_IOERR;
+      }
+    }
+    mtx_lock(&disk->mutex);
+    disk->req_submit++;
+    cnd_signal(&disk->cond);
+    mtx_unlock(&disk->mutex);
+  }
+}
+
+static void disk_transfer(disk_t *disk, disk_request_t *req) {
+  off_t offs = (off_t)req->sector * VIRTIO_BLK_SECTOR_SIZE;
+  ssize_t ret;
+  if (req->status != VIRTIO_BLK_S_OK) {
+    return;
+  } else if (req->type != VIRTIO_BLK_T_IN && req->type != VIRTIO_BLK_T_OUT) {
+    req->status = VIRTIO_BLK_S_UNSUPP;
+    return;
+  } else if (req->sector + (req->len + VIRTIO_BLK_SECTOR_SIZE - 1) / VIRTIO_BLK_SECTOR_SIZE > disk->capacity) {
+    req->status = VIRTIO_BLK_S_IOERR;
+    return;
+  } else if (req->type == VIRTIO_BLK_T_IN) {
+    // disk -> memory
+    ret = preadv(disk->fd, req->iov, req->iovcnt, offs);
+  } else if (disk->read_only) {
+    req->status = VIRTIO_BLK_S_IOERR;
+    return;
+  } else {
+    // memory -> disk
+    ret = pwritev(disk->fd, req->iov, req->iovcnt, offs);
+  }
+  if (ret != (ssize_t)req->len) {
+    req->status = VIRTIO_BLK_S_IOERR;
+  }
+}
+
+static int disk_worker_routine(void *arg) {
+  disk_t *disk = (disk_t *)arg;
+  mtx_lock(&disk->mutex);
+  while (!disk->worker_quit) {
+    if (disk->req_done == disk->req_submit) {
+      cnd_wait(&disk->cond, &disk->mutex);
+      continue;
+    }
+    disk_request_t *req = &disk->request[disk->req_done % VIRTIO_MMIO_MAX_QUEUE];
+    mtx_unlock(&disk->mutex);
+    disk_transfer(disk, req);
+    mtx_lock(&disk->mutex);
+    disk->req_done++;
+  }
+  mtx_unlock(&disk->mutex);
+  thrd_exit(0);
+}
+
+static void disk_cycle(virtio_t *vio, unsigned cycles) {
+  disk_t *disk = (disk_t *)vio->dev;
+  // nothing in flight
+  if (disk->req_complete == disk->req_submit) {
+    return;
+  }
+  mtx_lock(&disk->mutex);
+  unsigned req_done = disk->req_done;
+  mtx_unlock(&disk->mutex);
+  // complete the finished requests (status and used ring)
+  for (; disk->req_complete != req_done; disk->req_complete++) {
+    disk_request_t *req = &disk->request[disk->req_complete % VIRTIO_MMIO_MAX_QUEUE];
+    unsigned wlen = virtio_chain_len(&req->chain, 1);
+    if (req->bounce && req->status == VIRTIO_BLK_S_OK) {
+      disk_map(vio, req, 1);
+    }
+    if (wlen > 0) {
+      virtio_chain_write(vio, &req->chain, wlen - 1, (const char *)&req->status, 1);
+    }
+    virtio_queue_push(vio, 0, req->chain.head, (req->type == VIRTIO_BLK_T_IN) ? req->len + 1 : 1);
+    free(req->bounce);
+    req->bounce = NULL;
+  }
+}
+
+static unsigned disk_config(virtio_t *vio, unsigned offs) {
+  disk_t *disk = (disk_t *)vio->dev;
+  switch (offs) {
+  case 0x0: // capacity (in 512 byte sectors)
+    return (unsigned)disk->capacity;
+  case 0x4:
+    return (unsigned)(disk->capacity >> 32);
+  case 0x8: // size_max
+    return RAM_PAGE_SIZE;
+  case 0xc: // seg_max
+    return DISK_MAX_SEG;
+  default:
+    return 0;
+  }
+}
+
+static void disk_fini(virtio_t *vio) {
+  disk_t *disk = (disk_t *)vio->dev;
+  mtx_lock(&disk->mutex);
+  disk->worker_quit = 1;
+  cnd_signal(&disk->cond);
+  mtx_unlock(&disk->mutex);
+  thrd_join(disk->worker, NULL);
+  cnd_destroy(&disk->cond);
+  mtx_destroy(&disk->mutex);
+  for (unsigned i = 0; i < VIRTIO_MMIO_MAX_QUEUE; i++) {
+    free(disk->request[i].bounce);
+  }
+  close(disk->fd);
+}
+
+int disk_attach(virtio_t *vio, const char *img_path, int rom_mode) {
+  struct stat file_stat;
+  if (vio->dev) {
+    return -1;
+  }
+  int read_only = (rom_mode == MEMORY_SRAM_MODE_READ_ONLY);
+  int fd = open(img_path, read_only ? O_RDONLY : O_RDWR);
+  if (fd == -1) {
+    perror("disk image open");
+    return -1;
+  }
+  if (fstat(fd, &file_stat) == -1) {
+    perror("disk image stat");
+    close(fd);
+    return -1;
+  }
+  disk_t *disk = (disk_t *)calloc(1, sizeof(disk_t));
+  disk->fd = fd;
+  disk->read_only = read_only;
+  // in 512 byte sectors
+  disk->capacity = file_stat.st_size / VIRTIO_BLK_SECTOR_SIZE;
+  mtx_init(&disk->mutex, mtx_plain);
+  cnd_init(&disk->cond);
+  if (thrd_create(&disk->worker, (thrd_start_t)disk_worker_routine, (void *)disk) == thrd_error) {
+    fprintf(stderr, "disk initialization error: thread create\n");
+  }
+  vio->dev = disk;
+  vio->device_id = VIRTIO_MMIO_DEVICE_BLOCK;
+  vio->num_queues = 1; // requestq
+  vio->host_features |= (1LL << VIRTIO_BLK_F_SIZE_MAX) | (1LL << VIRTIO_BLK_F_SEG_MAX);
+  if (read_only) {
+    vio->host_features |= (1LL << VIRTIO_BLK_F_RO);
+  }
+  vio->dev_notify = disk_notify;
+  vio->dev_config = disk_config;
+  vio->dev_cycle = disk_cycle;
+  vio->dev_fini = disk_fini;
+  return 0;
+}
+
+// console device
+#define VCONSOLE_RECEIVEQ 0
+#define VCONSOLE_TRANSMITQ 1
+// the input buffer is checked once in the cycles below
+#define VCONSOLE_POLL_INTERVAL 1024
+
+static int vconsole_input_routine(void *arg) {
+  vconsole_t *con = (vconsole_t *)arg;
+  int select_maxfd = (con->fi > con->i_pipe[0]) ? con->fi : con->i_pipe[0];
+  int ret = 0;
+  int loop = 1;
+  while (loop) {
+    // wait for room in the buffer
+    mtx_lock(&con->mutex);
+    while (!con->quit && (con->buf_wr_index - con->buf_rd_index) == VCONSOLE_BUF_SIZE) {
+      cnd_wait(&con->cond, &con->mutex);
+    }
+    unsigned wr = con->buf_wr_index;
+    unsigned room = VCONSOLE_BUF_SIZE - (wr - con->buf_rd_index);
+    loop = !con->quit;
+    mtx_unlock(&con->mutex);
+    if (!loop) {
+      break;
+    }
+    fd_set select_fds;
+    FD_ZERO(&select_fds);
+    FD_SET(con->fi, &select_fds);
+    FD_SET(con->i_pipe[0], &select_fds);
+    select(select_maxfd + 1, &select_fds, NULL, NULL, NULL);
+    if (FD_ISSET(con->i_pipe[0], &select_fds)) {
+      loop = 0;
+    } else if (FD_ISSET(con->fi, &select_fds)) {
+      // up to the end of the ring
+      unsigned len = VCONSOLE_BUF_SIZE - (wr % VCONSOLE_BUF_SIZE);
+      if (len > room) {
+        len = room;
+      }
+      if ((ret = read(con->fi, &con->buf[wr % VCONSOLE_BUF_SIZE], len)) < 0) {
+        perror("virtio console read");
+        loop = 0;
+      } else if (ret == 0) {
+        loop = 0;
+      } else {
+        mtx_lock(&con->mutex);
+        con->buf_wr_index += ret;
+        mtx_unlock(&con->mutex);
+      }
+    }
+  }
+  thrd_exit(ret);
+}
+
+static void vconsole_receive(virtio_t *vio) {
+  vconsole_t *con = (vconsole_t *)vio->dev;
+  virtio_chain_t chain;
+  mtx_lock(&con->mutex);
+  unsigned wr = con->buf_wr_index;
+  mtx_unlock(&con->mutex);
+  unsigned rd = con->buf_rd_index;
+  if (rd == wr) {
+    return;
+  }
+  // fill the receive buffers as long as the input lasts
+  while (rd != wr && virtio_queue_pop(vio, VCONSOLE_RECEIVEQ, &chain)) {
+    unsigned room = virtio_chain_len(&chain, 1);
+    unsigned len = 0;
+    while (len < room && rd != wr) {
+      unsigned n = VCONSOLE_BUF_SIZE - (rd % VCONSOLE_BUF_SIZE);
+      if (n > wr - rd) {
+        n = wr - rd;
+      }
+      if (n > room - len) {
+        n = room - len;
+      }
+      virtio_chain_write(vio, &chain, len, &con->buf[rd % VCONSOLE_BUF_SIZE], n);
+      len += n;
+      rd += n;
+    }
+    virtio_queue_push(vio, VCONSOLE_RECEIVEQ, chain.head, len);
+  }
+  mtx_lock(&con->mutex);
+  con->buf_rd_index = rd;
+  cnd_signal(&con->cond);
+  mtx_unlock(&con->mutex);
+}
+
+static void vconsole_transmit(virtio_t *vio) {
+  vconsole_t *con = (vconsole_t *)vio->dev;
+  virtio_chain_t chain;
+  // a whole buffer for each descriptor chain
+  while (virtio_queue_pop(vio, VCONSOLE_TRANSMITQ, &chain)) {
+    unsigned len = virtio_chain_len(&chain, 0);
+    char *buf = (char *)malloc(len);
+    virtio_chain_read(vio, &chain, 0, buf, len);
+    for (unsigned offs = 0; offs < len; ) {
+      ssize_t ret = write(con->fo, &buf[offs], len - offs);
+      if (ret < 0) {
+        perror("virtio console write");
+        break;
+      }
+      offs += ret;
+    }
+    free(buf);
+    virtio_queue_push(vio, VCONSOLE_TRANSMITQ, chain.head, 0);
+  }
+}
+
+static void vconsole_notify(virtio_t *vio, unsigned queue) {
+  if (queue == VCONSOLE_TRANSMITQ) {
+    vconsole_transmit(vio);
+  } else {
+    // new receive buffers
+    vconsole_receive(vio);
+  }
+}
+
+static void vconsole_cycle(virtio_t *vio, unsigned cycles) {
+  vconsole_t *con = (vconsole_t *)vio->dev;
+  con->poll_count += cycles;
+  if (con->poll_count < VCONSOLE_POLL_INTERVAL) {
+    return;
+  }
+  con->poll_count = 0;
+  vconsole_receive(vio);
+}
+
+static void vconsole_fini(virtio_t *vio) {
+  vconsole_t *con = (vconsole_t *)vio->dev;
+  char c = 'a';
+  mtx_lock(&con->mutex);
+  con->quit = 1;
+  cnd_signal(&con->cond);
+  mtx_unlock(&con->mutex);
+  if (write(con->i_pipe[1], &c, 1) < 0) {
+    perror("virtio console fini write notification");
+  }
+  thrd_join(con->i_thread, NULL);
+  if (con->fi >= 3) {
+    close(con->fi);
+  }
+  if (con->fo >= 3) {
+    close(con->fo);
+  }
+  close(con->i_pipe[0]);
+  close(con->i_pipe[1]);
+  cnd_destroy(&con->cond);
+  mtx_destroy(&con->mutex);
+  free(con->buf);
+}
+
+int vconsole_attach(virtio_t *vio, const char *in_path, const char *out_path) {
+  if (vio->dev) {
+    return -1;
+  }
+  vconsole_t *con = (vconsole_t *)calloc(1, sizeof(vconsole_t));
+  if (in_path == NULL) {
+    con->fi = STDIN_FILENO;
+  } else if ((con->fi = open(in_path, O_RDONLY)) < 0) {
+    perror("virtio console input open");
+    free(con);
+    return -1;
+  }
+  if (out_path == NULL) {
+    con->fo = STDOUT_FILENO;
+  } else if ((con->fo = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+    perror("virtio console output open");
+    if (con->fi >= 3) {
+      close(con->fi);
+    }
+    free(con);
+    return -1;
+  }
+  if (pipe(con->i_pipe) == -1) {
+    perror("virtio console init pipe for child thread");
+  }
+  con->buf = (char *)malloc(VCONSOLE_BUF_SIZE * sizeof(char));
+  mtx_init(&con->mutex, mtx_plain);
+  cnd_init(&con->cond);
+  if (thrd_create(&con->i_thread, (thrd_start_t)vconsole_input_routine, (void *)con) == thrd_error) {
+    fprintf(stderr, "virtio console initialization error: thread create\n");
+  }
+  vio->dev = con;
+  vio->device_id = VIRTIO_MMIO_DEVICE_CONSOLE;
+  vio->num_queues = 2; // receiveq0, transmitq0
+  vio->dev_notify = vconsole_notify;
+  vio->dev_config = NULL; // no VIRTIO_CONSOLE_F_SIZE, VIRTIO_CONSOLE_F_MULTIPORT
+  vio->dev_cycle = vconsole_cycle;
+  vio->dev_fini = vconsole_fini;
+  return 0;
+}
@@ -2,14 +2,6 @@
 #define MMIO_H
 
 #include <stdio.h>
-#ifdef __MACH__
-#include <pthread.h>
-typedef pthread_t thrd_t;
-typedef pthread_mutex_t mtx_t;
-#else
-#include <threads.h>
-#endif
-
 #include "memory.h"
 
 typedef struct uart_t {
@@ -39,38 +31,141 @@ typedef struct uart_t {
 
 void uart_init(uart_t *uart);
 void uart_set_io(uart_t *uart, const char *in_path, const char *out_path);
+// console I/O bypassing the registers, getchar returns -1 if no input
+int uart_getchar(uart_t *uart);
+void uart_putchar(uart_t *uart, char c);
 char uart_read(struct memory_target_t *uart, unsigned addr);
 void uart_write(struct memory_target_t *uart, unsigned addr, char value);
 unsigned uart_irq(const struct mmio_t *uart);
 void uart_irq_ack(struct mmio_t *uart);
 void uart_fini(uart_t *uart);
 
-typedef struct disk_t {
+// virtqueue size (QueueNumMax) of the legacy virtio-mmio devices
+#define VIRTIO_MMIO_MAX_QUEUE 8
+// virtqueues per device
+#define VIRTIO_MMIO_NUM_QUEUES 2
+// descriptors in a chain (with indirect descriptor tables)
+#define VIRTIO_MMIO_MAX_CHAIN 256
+
+#define VIRTIO_MMIO_DEVICE_NONE 0x0 // no backend, the driver skips the slot
+#define VIRTIO_MMIO_DEVICE_NET 0x1
+#define VIRTIO_MMIO_DEVICE_BLOCK 0x2
+#define VIRTIO_MMIO_DEVICE_CONSOLE 0x3
+#define VIRTIO_MMIO_DEVICE_9P 0x9
+
+typedef struct virtq_desc {
+  unsigned long long addr;
+  unsigned len;
+  unsigned short flags;
+  unsigned short next;
+} virtq_desc;
+
+// a descriptor chain popped from the avail ring
+typedef struct virtio_chain_t {
+  unsigned short head; // index of the descriptor chain head
+  unsigned num;
+  virtq_desc desc[VIRTIO_MMIO_MAX_CHAIN];
+} virtio_chain_t;
+
+typedef struct virtio_queue_t {
+  unsigned num;
+  unsigned pfn;
+  unsigned align;
+  unsigned short last_avail_idx;
+} virtio_queue_t;
+
+// legacy virtio-mmio transport, a device backend is attached by xxx_attach
+typedef struct virtio_t {
   struct mmio_t base;
   struct memory_t *mem;
-  struct sram_t *rom;
+  unsigned device_id; // VIRTIO_MMIO_DEVICE_NONE until a backend is attached
+  void *dev;
+  void (*dev_notify)(struct virtio_t *, unsigned queue);
+  unsigned (*dev_config)(struct virtio_t *, unsigned offs);
+  void (*dev_cycle)(struct virtio_t *, unsigned cycles);
+  void (*dev_fini)(struct virtio_t *);
   unsigned long long host_features;
   unsigned host_features_sel;
   unsigned long long guest_features;
   unsigned guest_features_sel;
-  unsigned long long capacity;
-  unsigned queue_num;
-  unsigned queue_notify;
-  unsigned queue_ppn;
-  unsigned queue_align;
   unsigned page_size;
-  unsigned page_size_mask;
   unsigned current_queue;
+  unsigned queue_notify;
+  unsigned interrupt_status;
   unsigned status;
-  unsigned short last_avail_idx;
+  unsigned num_queues;
+  virtio_queue_t queue[VIRTIO_MMIO_NUM_QUEUES];
+} virtio_t;
+
+void virtio_init(virtio_t *vio, struct memory_t *mem);
+// advances the device by cycles (instructions of a hart)
+void virtio_cycle(virtio_t *vio, unsigned cycles);
+char virtio_read(struct memory_target_t *vio, unsigned addr);
+void virtio_write(struct memory_target_t *vio, unsigned addr, char value);
+unsigned virtio_irq(const struct mmio_t *vio);
+void virtio_irq_ack(struct mmio_t *vio);
+void virtio_fini(virtio_t *vio);
+// virtqueue helpers for the backends
+int virtio_queue_pop(virtio_t *vio, unsigned queue, virtio_chain_t *chain);
+void virtio_queue_push(virtio_t *vio, unsigned queue, unsigned short head, unsigned len);
+unsigned virtio_chain_len(const virtio_chain_t *chain, int writable);
+unsigned virtio_chain_read(virtio_t *vio, const virtio_chain_t *chain, unsigned offs, char *buf, unsigned len);
+unsigned virtio_chain_write(virtio_t *vio, const virtio_chain_t *chain, unsigned offs, const char *buf, unsigned len);
+int virtio_chain_map(virtio_t *vio, const virtio_chain_t *chain, int writable, unsigned offs, unsigned len, struct iovec *iov, int max_iov);
+
+// segments of a request (and the pages they span)
+#define DISK_MAX_SEG 126
+#define DISK_MAX_IOV (2 * DISK_MAX_SEG + 2)
+
+typedef struct disk_request_t {
+  virtio_chain_t chain;
+  unsigned type;
+  unsigned long long sector;
+  unsigned len; // data length
+  // the data buffers mapped from guest memory, the worker reads/writes the image into them
+  struct iovec iov[DISK_MAX_IOV];
+  int iovcnt;
+  char *bounce; // for the read buffers sharing cache lines with something else
+  unsigned char status;
+} disk_request_t;
+
+// virtio-blk
+typedef struct disk_t {
+  int fd;
+  unsigned char read_only;
+  // I/O worker: the sim thread submits requests, the worker moves the data
+  // from/to the image and the sim thread completes them (see disk_cycle)
+  thrd_t worker;
+  mtx_t mutex;
+  cnd_t cond;
+  unsigned char worker_quit;
+  disk_request_t request[VIRTIO_MMIO_MAX_QUEUE];
+  unsigned req_submit;   // written by the sim thread
+  unsigned req_done;     // written by the worker
+  unsigned req_complete; // written by the sim thread
+  unsigned long long capacity;
 } disk_t;
 
-void disk_init(disk_t *disk);
-int disk_load(disk_t *disk, const char *, int rom_mode);
-char disk_read(struct memory_target_t *disk, unsigned addr);
-void disk_write(struct memory_target_t *disk, unsigned addr, char value);
-unsigned disk_irq(const struct mmio_t *disk);
-void disk_irq_ack(struct mmio_t *disk);
-void disk_fini(disk_t *disk);
+int disk_attach(virtio_t *vio, const char *img_path, int rom_mode);
+
+#define VCONSOLE_BUF_SIZE 4096
+
+// virtio-console (single port, no multiport)
+typedef struct vconsole_t {
+  int fi;
+  int fo;
+  // input: the reader thread fills buf, vconsole_cycle moves it to the receiveq
+  char *buf;
+  unsigned buf_wr_index; // written by the reader
+  unsigned buf_rd_index; // written by the sim thread
+  thrd_t i_thread;
+  mtx_t mutex;
+  cnd_t cond;
+  int i_pipe[2];
+  unsigned char quit;
+  unsigned poll_count;
+} vconsole_t;
+
+int vconsole_attach(virtio_t *vio, const char *in_path, const char *out_path);
 
 #endif
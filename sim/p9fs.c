@@ -0,0 +1,992 @@
+#include "p9fs.h"
+#include "memory.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/time.h>
+#ifndef __MACH__
+#include <sys/sysmacros.h>
+#endif
+
+// 9P2000.L (see https://github.com/chaos/diod/blob/master/protocol.md)
+#define P9_TLERROR 6
+#define P9_TSTATFS 8
+#define P9_TLOPEN 12
+#define P9_TLCREATE 14
+#define P9_TSYMLINK 16
+#define P9_TMKNOD 18
+#define P9_TRENAME 20
+#define P9_TREADLINK 22
+#define P9_TGETATTR 24
+#define P9_TSETATTR 26
+#define P9_TXATTRWALK 30
+#define P9_TXATTRCREATE 32
+#define P9_TREADDIR 40
+#define P9_TFSYNC 50
+#define P9_TLOCK 52
+#define P9_TGETLOCK 54
+#define P9_TLINK 70
+#define P9_TMKDIR 72
+#define P9_TRENAMEAT 74
+#define P9_TUNLINKAT 76
+#define P9_TVERSION 100
+#define P9_TAUTH 102
+#define P9_TATTACH 104
+#define P9_TFLUSH 108
+#define P9_TWALK 110
+#define P9_TREAD 116
+#define P9_TWRITE 118
+#define P9_TCLUNK 120
+#define P9_TREMOVE 122
+
+#define P9_HEADER_SIZE 7 // size[4] type[1] tag[2]
+#define P9_IOHDR_SIZE 11 // size[4] type[1] tag[2] count[4]
+#define P9_TWRITE_HDR_SIZE 23 // size[4] type[1] tag[2] fid[4] offset[8] count[4]
+#define P9_NOFID 0xffffffff
+
+#define P9_QID_TYPE_DIR 0x80
+#define P9_QID_TYPE_SYMLINK 0x02
+#define P9_QID_TYPE_FILE 0x00
+
+#define P9_GETATTR_BASIC 0x000007ff
+
+#define P9_SETATTR_MODE (1 << 0)
+#define P9_SETATTR_UID (1 << 1)
+#define P9_SETATTR_GID (1 << 2)
+#define P9_SETATTR_SIZE (1 << 3)
+#define P9_SETATTR_ATIME (1 << 4)
+#define P9_SETATTR_MTIME (1 << 5)
+#define P9_SETATTR_ATIME_SET (1 << 7)
+#define P9_SETATTR_MTIME_SET (1 << 8)
+
+// open flags of the guest (Linux generic values)
+#define P9_DOTL_ACCMODE 00000003
+#define P9_DOTL_CREATE 00000100
+#define P9_DOTL_EXCL 00000200
+#define P9_DOTL_TRUNC 00001000
+#define P9_DOTL_APPEND 00002000
+#define P9_DOTL_DIRECTORY 00200000
+#define P9_DOTL_NOFOLLOW 00400000
+#define P9_DOTL_AT_REMOVEDIR 0x200
+
+#define P9_LOCK_SUCCESS 0
+#define P9_LOCK_TYPE_UNLCK 2
+
+#define V9FS_MAGIC 0x01021997
+
+#define VIRTIO_9P_MOUNT_TAG (0) // the mount tag is in the configuration space
+
+#ifdef __MACH__
+#define P9FS_ATIME(st) ((st)->st_atimespec)
+#define P9FS_MTIME(st) ((st)->st_mtimespec)
+#define P9FS_CTIME(st) ((st)->st_ctimespec)
+#else
+#define P9FS_ATIME(st) ((st)->st_atim)
+#define P9FS_MTIME(st) ((st)->st_mtim)
+#define P9FS_CTIME(st) ((st)->st_ctim)
+#endif
+
+#define P9FS_DEBUG_DUMP 0
+
+typedef struct p9_msg_t {
+  char *buf;
+  unsigned pos;
+  unsigned size;
+  int error; // overrun
+} p9_msg_t;
+
+static unsigned long long p9_get(p9_msg_t *msg, unsigned n) {
+  unsigned long long ret = 0;
+  if (msg->pos + n > msg->size) {
+    msg->error = 1;
+    return 0;
+  }
+  for (unsigned i = 0; i < n; i++) {
+    ret |= (unsigned long long)(unsigned char)msg->buf[msg->pos++] << (8 * i);
+  }
+  return ret;
+}
+
+// returns a NUL terminated copy
+static char *p9_get_str(p9_msg_t *msg) {
+  unsigned len = p9_get(msg, 2);
+  char *str = NULL;
+  if (msg->error || msg->pos + len > msg->size) {
+    msg->error = 1;
+    return NULL;
+  }
+  str = (char *)malloc(len + 1);
+  memcpy(str, &msg->buf[msg->pos], len);
+  str[len] = '\0';
+  msg->pos += len;
+  return str;
+}
+
+static void p9_put(p9_msg_t *msg, unsigned long long value, unsigned n) {
+  if (msg->pos + n > msg->size) {
+    msg->error = 1;
+    return;
+  }
+  for (unsigned i = 0; i < n; i++) {
+    msg->buf[msg->pos++] = (char)(value >> (8 * i));
+  }
+}
+
+static void p9_put_str(p9_msg_t *msg, const char *str) {
+  unsigned len = strlen(str);
+  p9_put(msg, len, 2);
+  if (msg->error || msg->pos + len > msg->size) {
+    msg->error = 1;
+    return;
+  }
+  memcpy(&msg->buf[msg->pos], str, len);
+  msg->pos += len;
+}
+
+static void p9_put_qid(p9_msg_t *msg, const struct stat *st) {
+  unsigned char type = P9_QID_TYPE_FILE;
+  if (S_ISDIR(st->st_mode)) {
+    type = P9_QID_TYPE_DIR;
+  } else if (S_ISLNK(st->st_mode)) {
+    type = P9_QID_TYPE_SYMLINK;
+  }
+  p9_put(msg, type, 1);
+  p9_put(msg, (unsigned)P9FS_MTIME(st).tv_sec ^ (unsigned)st->st_size, 4); // version
+  p9_put(msg, st->st_ino, 8); // path
+}
+
+// the guest expects Linux errno values
+static unsigned p9_errno(int err) {
+#ifdef __MACH__
+  switch (err) {
+  case ENOTEMPTY: return 39;
+  case ENAMETOOLONG: return 36;
+  case ELOOP: return 40;
+  case ENOSYS: return 38;
+  case ENOTSUP: return 95;
+  case EOPNOTSUPP: return 95;
+  case EMSGSIZE: return 90;
+  default: return err;
+  }
+#else
+  return err;
+#endif
+}
+
+static int p9_open_flags(unsigned flags) {
+  int ret = 0;
+  switch (flags & P9_DOTL_ACCMODE) {
+  case 1: ret = O_WRONLY; break;
+  case 2: ret = O_RDWR; break;
+  default: ret = O_RDONLY; break;
+  }
+  if (flags & P9_DOTL_CREATE) ret |= O_CREAT;
+  if (flags & P9_DOTL_EXCL) ret |= O_EXCL;
+  if (flags & P9_DOTL_TRUNC) ret |= O_TRUNC;
+  if (flags & P9_DOTL_APPEND) ret |= O_APPEND;
+  if (flags & P9_DOTL_DIRECTORY) ret |= O_DIRECTORY;
+  if (flags & P9_DOTL_NOFOLLOW) ret |= O_NOFOLLOW;
+  return ret;
+}
+
+static p9fs_fid_t *p9fs_fid_get(p9fs_t *fs, unsigned fid) {
+  for (p9fs_fid_t *f = fs->fid[fid % P9FS_FID_HASH]; f; f = f->next) {
+    if (f->fid == fid) {
+      return f;
+    }
+  }
+  return NULL;
+}
+
+static void p9fs_fid_close(p9fs_fid_t *f) {
+  if (f->fd >= 0) {
+    close(f->fd);
+    f->fd = -1;
+  }
+  if (f->dir) {
+    closedir((DIR *)f->dir);
+    f->dir = NULL;
+  }
+}
+
+static void p9fs_fid_del(p9fs_t *fs, unsigned fid) {
+  for (p9fs_fid_t **f = &fs->fid[fid % P9FS_FID_HASH]; *f; f = &(*f)->next) {
+    if ((*f)->fid == fid) {
+      p9fs_fid_t *del = *f;
+      *f = del->next;
+      p9fs_fid_close(del);
+      free(del->path);
+      free(del);
+      return;
+    }
+  }
+}
+
+// binds fid to path (takes the path)
+static p9fs_fid_t *p9fs_fid_new(p9fs_t *fs, unsigned fid, char *path) {
+  p9fs_fid_t *f = p9fs_fid_get(fs, fid);
+  if (f) {
+    p9fs_fid_close(f);
+    free(f->path);
+  } else {
+    f = (p9fs_fid_t *)malloc(sizeof(p9fs_fid_t));
+    f->fid = fid;
+    f->next = fs->fid[fid % P9FS_FID_HASH];
+    fs->fid[fid % P9FS_FID_HASH] = f;
+  }
+  f->path = path;
+  f->fd = -1;
+  f->dir = NULL;
+  f->dir_offs = 0;
+  return f;
+}
+
+static void p9fs_fid_clear(p9fs_t *fs) {
+  for (unsigned i = 0; i < P9FS_FID_HASH; i++) {
+    while (fs->fid[i]) {
+      p9fs_fid_del(fs, fs->fid[i]->fid);
+    }
+  }
+}
+
+// renamed paths are followed by the other fids
+static void p9fs_fix_path(p9fs_t *fs, const char *old_path, const char *new_path) {
+  unsigned old_len = strlen(old_path);
+  for (unsigned i = 0; i < P9FS_FID_HASH; i++) {
+    for (p9fs_fid_t *f = fs->fid[i]; f; f = f->next) {
+      if (strncmp(f->path, old_path, old_len) == 0 && (f->path[old_len] == '\0' || f->path[old_len] == '/')) {
+        char *path = (char *)malloc(strlen(new_path) + strlen(&f->path[old_len]) + 1);
+        sprintf(path, "%s%s", new_path, &f->path[old_len]);
+        free(f->path);
+        f->path = path;
+      }
+    }
+  }
+}
+
+static int p9fs_valid_name(const char *name) {
+  return (name && name[0] != '\0' && strcmp(name, ".") != 0 && strcmp(name, "..") != 0 && strchr(name, '/') == NULL);
+}
+
+// host path of name in dir, ".." does not go up beyond the root
+static char *p9fs_join(p9fs_t *fs, const char *dir, const char *name) {
+  char *path = NULL;
+  if (strcmp(name, ".") == 0 || (strcmp(name, "..") == 0 && strcmp(dir, fs->root) == 0)) {
+    path = strdup(dir);
+  } else if (strcmp(name, "..") == 0) {
+    path = strdup(dir);
+    *strrchr(path, '/') = '\0';
+    if (path[0] == '\0') {
+      strcpy(path, "/");
+    }
+  } else if (p9fs_valid_name(name)) {
+    path = (char *)malloc(strlen(dir) + strlen(name) + 2);
+    sprintf(path, "%s/%s", dir, name);
+  }
+  return path;
+}
+
+// the directories of a host path resolve inside the root (a symlink of the guest may point anywhere),
+// the last component is never followed (lstat, O_NOFOLLOW). the requests are served one at a time,
+// so the guest cannot change the tree between the check and the use
+static int p9fs_beneath(p9fs_t *fs, const char *path) {
+  size_t len = strlen(fs->root);
+  if (strcmp(path, fs->root) == 0 || strcmp(fs->root, "/") == 0) {
+    return 1;
+  }
+  char *dir = strdup(path);
+  *strrchr(dir, '/') = '\0';
+  char *real = realpath(dir, NULL);
+  int ret = real && strncmp(real, fs->root, len) == 0 && (real[len] == '\0' || real[len] == '/');
+  free(real);
+  free(dir);
+  return ret;
+}
+
+static int p9fs_version(p9fs_t *fs, p9_msg_t *req, p9_msg_t *resp) {
+  unsigned msize = p9_get(req, 4);
+  char *version = p9_get_str(req);
+  if (req->error) {
+    free(version);
+    return EINVAL;
+  }
+  fs->msize = (msize < P9FS_MAX_MSIZE) ? msize : P9FS_MAX_MSIZE;
+  // a new session
+  p9fs_fid_clear(fs);
+  p9_put(resp, fs->msize, 4);
+  p9_put_str(resp, (strncmp(version, "9P2000.L", 8) == 0) ? "9P2000.L" : "unknown");
+  free(version);
+  return 0;
+}
+
+static int p9fs_attach_fid(p9fs_t *fs, p9_msg_t *req, p9_msg_t *resp) {
+  unsigned fid = p9_get(req, 4);
+  struct stat st;
+  if (lstat(fs->root, &st) != 0) {
+    return errno;
+  }
+  p9fs_fid_new(fs, fid, strdup(fs->root));
+  p9_put_qid(resp, &st);
+  return 0;
+}
+
+static int p9fs_walk(p9fs_t *fs, p9_msg_t *req, p9_msg_t *resp) {
+  unsigned fid = p9_get(req, 4);
+  unsigned newfid = p9_get(req, 4);
+  unsigned nwname = p9_get(req, 2);
+  p9fs_fid_t *f = p9fs_fid_get(fs, fid);
+  if (f == NULL) {
+    return EBADF;
+  }
+  char *path = strdup(f->path);
+  unsigned nwqid_pos = resp->pos;
+  unsigned nwqid = 0;
+  p9_put(resp, 0, 2);
+  for (unsigned i = 0; i < nwname; i++) {
+    char *name = p9_get_str(req);
+    char *next = (name) ? p9fs_join(fs, path, name) : NULL;
+    struct stat st;
+    int err = (next == NULL) ? ENOENT : !p9fs_beneath(fs, next) ? EACCES : (lstat(next, &st) != 0) ? errno : 0;
+    free(name);
+    if (err) {
+      free(next);
+      if (i == 0) {
+        free(path);
+        return err;
+      }
+      break;
+    }
+    p9_put_qid(resp, &st);
+    free(path);
+    path = next;
+    nwqid++;
+  }
+  if (nwqid == nwname) {
+    p9fs_fid_new(fs, newfid, path);
+  } else {
+    free(path);
+  }
+  resp->buf[nwqid_pos] = (char)nwqid;
+  resp->buf[nwqid_pos + 1] = (char)(nwqid >> 8);
+  return 0;
+}
+
+static int p9fs_getattr(p9fs_t *fs, p9_msg_t *req, p9_msg_t *resp) {
+  p9fs_fid_t *f = p9fs_fid_get(fs, p9_get(req, 4));
+  struct stat st;
+  if (f == NULL) {
+    return EBADF;
+  }
+  if (!p9fs_beneath(fs, f->path)) {
+    return EACCES;
+  }
+  if (lstat(f->path, &st) != 0) {
+    return errno;
+  }
+  p9_put(resp, P9_GETATTR_BASIC, 8); // valid
+  p9_put_qid(resp, &st);
+  p9_put(resp, st.st_mode, 4);
+  p9_put(resp, st.st_uid, 4);
+  p9_put(resp, st.st_gid, 4);
+  p9_put(resp, st.st_nlink, 8);
+  p9_put(resp, st.st_rdev, 8);
+  p9_put(resp, st.st_size, 8);
+  p9_put(resp, st.st_blksize, 8);
+  p9_put(resp, st.st_blocks, 8);
+  p9_put(resp, P9FS_ATIME(&st).tv_sec, 8);
+  p9_put(resp, P9FS_ATIME(&st).tv_nsec, 8);
+  p9_put(resp, P9FS_MTIME(&st).tv_sec, 8);
+  p9_put(resp, P9FS_MTIME(&st).tv_nsec, 8);
+  p9_put(resp, P9FS_CTIME(&st).tv_sec, 8);
+  p9_put(resp, P9FS_CTIME(&st).tv_nsec, 8);
+  p9_put(resp, 0, 8); // btime
+  p9_put(resp, 0, 8);
+  p9_put(resp, 0, 8); // gen
+  p9_put(resp, 0, 8); // data_version
+  return 0;
+}
+
+static int p9fs_setattr(p9fs_t *fs, p9_msg_t *req, p9_msg_t *resp) {
+  p9fs_fid_t *f = p9fs_fid_get(fs, p9_get(req, 4));
+  unsigned valid = p9_get(req, 4);
+  unsigned mode = p9_get(req, 4);
+  unsigned uid = p9_get(req, 4);
+  unsigned gid = p9_get(req, 4);
+  unsigned long long size = p9_get(req, 8);
+  struct timespec ts[2];
+  ts[0].tv_sec = p9_get(req, 8);
+  ts[0].tv_nsec = p9_get(req, 8);
+  ts[1].tv_sec = p9_get(req, 8);
+  ts[1].tv_nsec = p9_get(req, 8);
+  struct stat st;
+  if (f == NULL) {
+    return EBADF;
+  }
+  if (!p9fs_beneath(fs, f->path)) {
+    return EACCES;
+  }
+  if (lstat(f->path, &st) != 0) {
+    return errno;
+  }
+  // chmod and truncate would follow a symlink
+  if ((valid & (P9_SETATTR_MODE | P9_SETATTR_SIZE)) && S_ISLNK(st.st_mode)) {
+    return (valid & P9_SETATTR_MODE) ? EOPNOTSUPP : EINVAL;
+  }
+  if ((valid & P9_SETATTR_MODE) && chmod(f->path, mode & 07777) != 0) {
+    return errno;
+  }
+  if ((valid & (P9_SETATTR_UID | P9_SETATTR_GID)) &&
+      lchown(f->path, (valid & P9_SETATTR_UID) ? uid : (uid_t)-1, (valid & P9_SETATTR_GID) ? gid : (gid_t)-1) != 0) {
+    return errno;
+  }
+  if ((valid & P9_SETATTR_SIZE) && truncate(f->path, size) != 0) {
+    return errno;
+  }
+  if (valid & (P9_SETATTR_ATIME | P9_SETATTR_MTIME)) {
+    if (!(valid & P9_SETATTR_ATIME)) {
+      ts[0].tv_nsec = UTIME_OMIT;
+    } else if (!(valid & P9_SETATTR_ATIME_SET)) {
+      ts[0].tv_nsec = UTIME_NOW;
+    }
+    if (!(valid & P9_SETATTR_MTIME)) {
+      ts[1].tv_nsec = UTIME_OMIT;
+    } else if (!(valid & P9_SETATTR_MTIME_SET)) {
+      ts[1].tv_nsec = UTIME_NOW;
+    }
+    if (utimensat(AT_FDCWD, f->path, ts, AT_SYMLINK_NOFOLLOW) != 0) {
+      return errno;
+    }
+  }
+  return 0;
+}
+
+static int p9fs_lopen(p9fs_t *fs, p9_msg_t *req, p9_msg_t *resp) {
+  p9fs_fid_t *f = p9fs_fid_get(fs, p9_get(req, 4));
+  unsigned flags = p9_get(req, 4);
+  struct stat st;
+  if (f == NULL) {
+    return EBADF;
+  }
+  if (!p9fs_beneath(fs, f->path)) {
+    return EACCES;
+  }
+  if (lstat(f->path, &st) != 0) {
+    return errno;
+  }
+  p9fs_fid_close(f);
+  if ((f->fd = open(f->path, (p9_open_flags(flags) & ~(O_CREAT | O_EXCL)) | O_NOFOLLOW)) < 0) {
+    return errno;
+  }
+  p9_put_qid(resp, &st);
+  p9_put(resp, 0, 4); // iounit
+  return 0;
+}
+
+static int p9fs_lcreate(p9fs_t *fs, p9_msg_t *req, p9_msg_t *resp) {
+  p9fs_fid_t *f = p9fs_fid_get(fs, p9_get(req, 4));
+  char *name = p9_get_str(req);
+  unsigned flags = p9_get(req, 4);
+  unsigned mode = p9_get(req, 4);
+  char *path = (f && name && p9fs_valid_name(name)) ? p9fs_join(fs, f->path, name) : NULL;
+  struct stat st;
+  int fd;
+  free(name);
+  if (path == NULL) {
+    return (f == NULL) ? EBADF : EINVAL;
+  }
+  if (!p9fs_beneath(fs, path)) {
+    free(path);
+    return EACCES;
+  }
+  if ((fd = open(path, p9_open_flags(flags) | O_CREAT | O_NOFOLLOW, mode & 07777)) < 0 || fstat(fd, &st) != 0) {
+    int err = errno;
+    if (fd >= 0) {
+      close(fd);
+    }
+    free(path);
+    return err;
+  }
+  // the fid now represents the new file
+  p9fs_fid_close(f);
+  free(f->path);
+  f->path = path;
+  f->fd = fd;
+  p9_put_qid(resp, &st);
+  p9_put(resp, 0, 4); // iounit
+  return 0;
+}
+
+static int p9fs_read(p9fs_t *fs, p9_msg_t *req, p9_msg_t *resp) {
+  p9fs_fid_t *f = p9fs_fid_get(fs, p9_get(req, 4));
+  unsigned long long offset = p9_get(req, 8);
+  unsigned count = p9_get(req, 4);
+  ssize_t ret;
+  if (f == NULL || f->fd < 0) {
+    return EBADF;
+  }
+  if (count > resp->size - P9_IOHDR_SIZE) {
+    count = resp->size - P9_IOHDR_SIZE;
+  }
+  // directly into the guest memory behind the response
+  struct iovec iov[P9FS_MAX_IOV];
+  int iovcnt = virtio_chain_map(fs->vio, fs->chain, 1, P9_IOHDR_SIZE, count, iov, P9FS_MAX_IOV);
+  if (iovcnt >= 0) {
+    ret = preadv(f->fd, iov, iovcnt, offset);
+  } else {
+    ret = pread(f->fd, &resp->buf[P9_IOHDR_SIZE], count, offset);
+  }
+  if (ret < 0) {
+    return errno;
+  }
+  p9_put(resp, ret, 4);
+  resp->pos += ret;
+  if (iovcnt >= 0) {
+    fs->resp_direct = ret;
+  }
+  return 0;
+}
+
+static int p9fs_write(p9fs_t *fs, p9_msg_t *req, p9_msg_t *resp) {
+  p9fs_fid_t *f = p9fs_fid_get(fs, p9_get(req, 4));
+  unsigned long long offset = p9_get(req, 8);
+  unsigned count = p9_get(req, 4);
+  ssize_t ret;
+  if (f == NULL || f->fd < 0) {
+    return EBADF;
+  }
+  if (req->pos + count > req->size) {
+    // the data is left in the guest memory
+    struct iovec iov[P9FS_MAX_IOV];
+    int iovcnt = virtio_chain_map(fs->vio, fs->chain, 0, req->pos, count, iov, P9FS_MAX_IOV);
+    if (iovcnt < 0 || virtio_chain_len(fs->chain, 0) < req->pos + count) {
+      return EINVAL;
+    }
+    ret = pwritev(f->fd, iov, iovcnt, offset);
+  } else {
+    ret = pwrite(f->fd, &req->buf[req->pos], count, offset);
+  }
+  if (ret < 0) {
+    return errno;
+  }
+  p9_put(resp, ret, 4);
+  return 0;
+}
+
+static int p9fs_readdir(p9fs_t *fs, p9_msg_t *req, p9_msg_t *resp) {
+  p9fs_fid_t *f = p9fs_fid_get(fs, p9_get(req, 4));
+  unsigned long long offset = p9_get(req, 8);
+  unsigned count = p9_get(req, 4);
+  if (f == NULL) {
+    return EBADF;
+  }
+  if (f->dir == NULL) {
+    if (!p9fs_beneath(fs, f->path)) {
+      return EACCES;
+    }
+    int fd = open(f->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    if (fd < 0) {
+      return errno;
+    }
+    if ((f->dir = fdopendir(fd)) == NULL) {
+      int err = errno;
+      close(fd);
+      return err;
+    }
+    f->dir_offs = 0;
+  }
+  DIR *dir = (DIR *)f->dir;
+  // the offset is the entry number
+  if (offset != f->dir_offs) {
+    rewinddir(dir);
+    for (f->dir_offs = 0; f->dir_offs < offset && readdir(dir); f->dir_offs++);
+  }
+  if (count > resp->size - P9_IOHDR_SIZE) {
+    count = resp->size - P9_IOHDR_SIZE;
+  }
+  unsigned count_pos = resp->pos;
+  p9_put(resp, 0, 4);
+  unsigned end = resp->pos + count;
+  for (;;) {
+    long loc = telldir(dir);
+    struct dirent *de = readdir(dir);
+    if (de == NULL) {
+      break;
+    }
+    // qid[13] offset[8] type[1] name[s]
+    if (resp->pos + 24 + strlen(de->d_name) > end) {
+      seekdir(dir, loc);
+      break;
+    }
+    p9_put(resp, (de->d_type == DT_DIR) ? P9_QID_TYPE_DIR : (de->d_type == DT_LNK) ? P9_QID_TYPE_SYMLINK : P9_QID_TYPE_FILE, 1);
+    p9_put(resp, 0, 4);
+    p9_put(resp, de->d_ino, 8);
+    p9_put(resp, ++f->dir_offs, 8);
+    p9_put(resp, de->d_type, 1);
+    p9_put_str(resp, de->d_name);
+  }
+  unsigned len = resp->pos - count_pos - 4;
+  for (unsigned i = 0; i < 4; i++) {
+    resp->buf[count_pos + i] = (char)(len >> (8 * i));
+  }
+  return 0;
+}
+
+static int p9fs_statfs(p9fs_t *fs, p9_msg_t *req, p9_msg_t *resp) {
+  p9fs_fid_t *f = p9fs_fid_get(fs, p9_get(req, 4));
+  struct statvfs st;
+  if (f == NULL) {
+    return EBADF;
+  }
+  if (!p9fs_beneath(fs, f->path)) {
+    return EACCES;
+  }
+  if (statvfs(f->path, &st) != 0) {
+    return errno;
+  }
+  p9_put(resp, V9FS_MAGIC, 4);
+  p9_put(resp, st.f_bsize, 4);
+  p9_put(resp, st.f_blocks, 8);
+  p9_put(resp, st.f_bfree, 8);
+  p9_put(resp, st.f_bavail, 8);
+  p9_put(resp, st.f_files, 8);
+  p9_put(resp, st.f_ffree, 8);
+  p9_put(resp, st.f_fsid, 8);
+  p9_put(resp, st.f_namemax, 4);
+  return 0;
+}
+
+// mkdir, symlink and mknod: dfid[4] name[s] ... -> qid[13]
+static int p9fs_mknode(p9fs_t *fs, unsigned type, p9_msg_t *req, p9_msg_t *resp) {
+  p9fs_fid_t *f = p9fs_fid_get(fs, p9_get(req, 4));
+  char *name = p9_get_str(req);
+  char *path = (f && name && p9fs_valid_name(name)) ? p9fs_join(fs, f->path, name) : NULL;
+  struct stat st;
+  int ret = 0;
+  free(name);
+  if (path == NULL) {
+    return (f == NULL) ? EBADF : EINVAL;
+  }
+  if (!p9fs_beneath(fs, path)) {
+    free(path);
+    return EACCES;
+  }
+  if (type == P9_TMKDIR) {
+    ret = mkdir(path, p9_get(req, 4) & 07777);
+  } else if (type == P9_TSYMLINK) {
+    char *target = p9_get_str(req);
+    if (target == NULL) {
+      free(path);
+      return EINVAL;
+    }
+    ret = symlink(target, path);
+    free(target);
+  } else {
+    unsigned mode = p9_get(req, 4);
+    unsigned major = p9_get(req, 4);
+    unsigned minor = p9_get(req, 4);
+    if (S_ISFIFO(mode)) {
+      ret = mkfifo(path, mode & 07777);
+    } else {
+      ret = mknod(path, mode, makedev(major, minor));
+    }
+  }
+  if (ret != 0 || lstat(path, &st) != 0) {
+    ret = errno;
+    free(path);
+    return ret;
+  }
+  free(path);
+  p9_put_qid(resp, &st);
+  return 0;
+}
+
+static int p9fs_readlink(p9fs_t *fs, p9_msg_t *req, p9_msg_t *resp) {
+  p9fs_fid_t *f = p9fs_fid_get(fs, p9_get(req, 4));
+  char target[PATH_MAX];
+  ssize_t len;
+  if (f == NULL) {
+    return EBADF;
+  }
+  if (!p9fs_beneath(fs, f->path)) {
+    return EACCES;
+  }
+  if ((len = readlink(f->path, target, sizeof(target) - 1)) < 0) {
+    return errno;
+  }
+  target[len] = '\0';
+  p9_put_str(resp, target);
+  return 0;
+}
+
+static int p9fs_rename_path(p9fs_t *fs, const char *old_path, const char *new_path) {
+  if (!p9fs_beneath(fs, old_path) || !p9fs_beneath(fs, new_path)) {
+    return EACCES;
+  }
+  if (rename(old_path, new_path) != 0) {
+    return errno;
+  }
+  p9fs_fix_path(fs, old_path, new_path);
+  return 0;
+}
+
+static int p9fs_rename(p9fs_t *fs, p9_msg_t *req, p9_msg_t *resp) {
+  p9fs_fid_t *f = p9fs_fid_get(fs, p9_get(req, 4));
+  p9fs_fid_t *d = p9fs_fid_get(fs, p9_get(req, 4));
+  char *name = p9_get_str(req);
+  char *path = (f && d && name && p9fs_valid_name(name)) ? p9fs_join(fs, d->path, name) : NULL;
+  int ret = (path) ? p9fs_rename_path(fs, f->path, path) : EINVAL;
+  free(name);
+  free(path);
+  return ret;
+}
+
+static int p9fs_renameat(p9fs_t *fs, p9_msg_t *req, p9_msg_t *resp) {
+  p9fs_fid_t *od = p9fs_fid_get(fs, p9_get(req, 4));
+  char *old_name = p9_get_str(req);
+  p9fs_fid_t *nd = p9fs_fid_get(fs, p9_get(req, 4));
+  char *new_name = p9_get_str(req);
+  char *old_path = (od && old_name && p9fs_valid_name(old_name)) ? p9fs_join(fs, od->path, old_name) : NULL;
+  char *new_path = (nd && new_name && p9fs_valid_name(new_name)) ? p9fs_join(fs, nd->path, new_name) : NULL;
+  int ret = (old_path && new_path) ? p9fs_rename_path(fs, old_path, new_path) : EINVAL;
+  free(old_name);
+  free(new_name);
+  free(old_path);
+  free(new_path);
+  return ret;
+}
+
+static int p9fs_unlinkat(p9fs_t *fs, p9_msg_t *req, p9_msg_t *resp) {
+  p9fs_fid_t *d = p9fs_fid_get(fs, p9_get(req, 4));
+  char *name = p9_get_str(req);
+  unsigned flags = p9_get(req, 4);
+  char *path = (d && name && p9fs_valid_name(name)) ? p9fs_join(fs, d->path, name) : NULL;
+  int ret = 0;
+  if (path == NULL) {
+    ret = EINVAL;
+  } else if (!p9fs_beneath(fs, path)) {
+    ret = EACCES;
+  } else if (((flags & P9_DOTL_AT_REMOVEDIR) ? rmdir(path) : unlink(path)) != 0) {
+    ret = errno;
+  }
+  free(name);
+  free(path);
+  return ret;
+}
+
+static int p9fs_link(p9fs_t *fs, p9_msg_t *req, p9_msg_t *resp) {
+  p9fs_fid_t *d = p9fs_fid_get(fs, p9_get(req, 4));
+  p9fs_fid_t *f = p9fs_fid_get(fs, p9_get(req, 4));
+  char *name = p9_get_str(req);
+  char *path = (d && f && name && p9fs_valid_name(name)) ? p9fs_join(fs, d->path, name) : NULL;
+  int ret = 0;
+  if (path == NULL) {
+    ret = EINVAL;
+  } else if (!p9fs_beneath(fs, f->path) || !p9fs_beneath(fs, path)) {
+    ret = EACCES;
+  } else if (link(f->path, path) != 0) {
+    ret = errno;
+  }
+  free(name);
+  free(path);
+  return ret;
+}
+
+static int p9fs_remove(p9fs_t *fs, p9_msg_t *req, p9_msg_t *resp) {
+  unsigned fid = p9_get(req, 4);
+  p9fs_fid_t *f = p9fs_fid_get(fs, fid);
+  int ret = 0;
+  if (f == NULL) {
+    return EBADF;
+  }
+  if (!p9fs_beneath(fs, f->path)) {
+    ret = EACCES;
+  } else if (remove(f->path) != 0) {
+    ret = errno;
+  }
+  // clunked even if the remove fails
+  p9fs_fid_del(fs, fid);
+  return ret;
+}
+
+static int p9fs_fsync(p9fs_t *fs, p9_msg_t *req, p9_msg_t *resp) {
+  p9fs_fid_t *f = p9fs_fid_get(fs, p9_get(req, 4));
+  if (f == NULL || f->fd < 0) {
+    return EBADF;
+  }
+  if (fsync(f->fd) != 0) {
+    return errno;
+  }
+  return 0;
+}
+
+static int p9fs_getlock(p9fs_t *fs, p9_msg_t *req, p9_msg_t *resp) {
+  // single client: nothing conflicts
+  p9_get(req, 4); // fid
+  p9_get(req, 1); // type
+  unsigned long long start = p9_get(req, 8);
+  unsigned long long length = p9_get(req, 8);
+  unsigned proc_id = p9_get(req, 4);
+  char *client_id = p9_get_str(req);
+  p9_put(resp, P9_LOCK_TYPE_UNLCK, 1);
+  p9_put(resp, start, 8);
+  p9_put(resp, length, 8);
+  p9_put(resp, proc_id, 4);
+  p9_put_str(resp, (client_id) ? client_id : "");
+  free(client_id);
+  return 0;
+}
+
+// returns the length of the response
+static unsigned p9fs_process(p9fs_t *fs, p9_msg_t *req, p9_msg_t *resp) {
+  unsigned size = p9_get(req, 4);
+  unsigned type = p9_get(req, 1);
+  unsigned tag = p9_get(req, 2);
+  int err = 0;
+  if (size < req->size) {
+    req->size = size;
+  }
+  resp->pos = P9_HEADER_SIZE;
+#if P9FS_DEBUG_DUMP
+  fprintf(stderr, "9P T%u tag %u size %u\n", type, tag, size);
+#endif
+  switch (type) {
+  case P9_TVERSION: err = p9fs_version(fs, req, resp); break;
+  case P9_TATTACH: err = p9fs_attach_fid(fs, req, resp); break;
+  case P9_TWALK: err = p9fs_walk(fs, req, resp); break;
+  case P9_TGETATTR: err = p9fs_getattr(fs, req, resp); break;
+  case P9_TSETATTR: err = p9fs_setattr(fs, req, resp); break;
+  case P9_TLOPEN: err = p9fs_lopen(fs, req, resp); break;
+  case P9_TLCREATE: err = p9fs_lcreate(fs, req, resp); break;
+  case P9_TREAD: err = p9fs_read(fs, req, resp); break;
+  case P9_TWRITE: err = p9fs_write(fs, req, resp); break;
+  case P9_TREADDIR: err = p9fs_readdir(fs, req, resp); break;
+  case P9_TSTATFS: err = p9fs_statfs(fs, req, resp); break;
+  case P9_TMKDIR:
+  case P9_TSYMLINK:
+  case P9_TMKNOD: err = p9fs_mknode(fs, type, req, resp); break;
+  case P9_TREADLINK: err = p9fs_readlink(fs, req, resp); break;
+  case P9_TRENAME: err = p9fs_rename(fs, req, resp); break;
+  case P9_TRENAMEAT: err = p9fs_renameat(fs, req, resp); break;
+  case P9_TUNLINKAT: err = p9fs_unlinkat(fs, req, resp); break;
+  case P9_TLINK: err = p9fs_link(fs, req, resp); break;
+  case P9_TREMOVE: err = p9fs_remove(fs, req, resp); break;
+  case P9_TFSYNC: err = p9fs_fsync(fs, req, resp); break;
+  case P9_TCLUNK: p9fs_fid_del(fs, p9_get(req, 4)); break;
+  case P9_TFLUSH: break; // requests are processed in order
+  case P9_TLOCK: p9_put(resp, P9_LOCK_SUCCESS, 1); break;
+  case P9_TGETLOCK: err = p9fs_getlock(fs, req, resp); break;
+  default: err = EOPNOTSUPP; break; // xattr, auth
+  }
+  if (err == 0 && (req->error || resp->error)) {
+    err = (req->error) ? EINVAL : ERANGE;
+  }
+  if (err) {
+    resp->pos = P9_HEADER_SIZE;
+    resp->error = 0;
+    fs->resp_direct = 0;
+    p9_put(resp, p9_errno(err), 4);
+    type = P9_TLERROR;
+  }
+  unsigned len = resp->pos;
+  resp->pos = 0;
+  p9_put(resp, len, 4);
+  p9_put(resp, type + 1, 1);
+  p9_put(resp, tag, 2);
+  return len;
+}
+
+static void p9fs_notify(virtio_t *vio, unsigned queue) {
+  p9fs_t *fs = (p9fs_t *)vio->dev;
+  virtio_chain_t chain;
+  while (virtio_queue_pop(vio, queue, &chain)) {
+    p9_msg_t req = {fs->req, 0, virtio_chain_len(&chain, 0), 0};
+    p9_msg_t resp = {fs->resp, 0, virtio_chain_len(&chain, 1), 0};
+    if (req.size > P9FS_MAX_MSIZE) {
+      req.size = P9FS_MAX_MSIZE;
+    }
+    if (resp.size > P9FS_MAX_MSIZE) {
+      resp.size = P9FS_MAX_MSIZE;
+    }
+    // Twrite data is not copied, p9fs_write takes it from the guest memory
+    virtio_chain_read(vio, &chain, 0, req.buf, P9_HEADER_SIZE);
+    if (req.size >= P9_TWRITE_HDR_SIZE && (unsigned char)req.buf[4] == P9_TWRITE) {
+      req.size = P9_TWRITE_HDR_SIZE;
+    }
+    if (req.size > P9_HEADER_SIZE) {
+      virtio_chain_read(vio, &chain, P9_HEADER_SIZE, &req.buf[P9_HEADER_SIZE], req.size - P9_HEADER_SIZE);
+    }
+    unsigned len = 0;
+    if (resp.size >= P9_IOHDR_SIZE) {
+      fs->vio = vio;
+      fs->chain = &chain;
+      fs->resp_direct = 0;
+      len = p9fs_process(fs, &req, &resp);
+      // Rread data is already there
+      virtio_chain_write(vio, &chain, 0, resp.buf, len - fs->resp_direct);
+    }
+    virtio_queue_push(vio, queue, chain.head, len);
+  }
+}
+
+static unsigned p9fs_config(virtio_t *vio, unsigned offs) {
+  // tag_len[2] tag[tag_len]
+  p9fs_t *fs = (p9fs_t *)vio->dev;
+  unsigned tag_len = strlen(fs->tag);
+  unsigned ret = 0;
+  for (unsigned i = 0; i < 4; i++) {
+    unsigned pos = offs + i;
+    unsigned char c = 0;
+    if (pos < 2) {
+      c = (unsigned char)(tag_len >> (8 * pos));
+    } else if (pos - 2 < tag_len) {
+      c = fs->tag[pos - 2];
+    }
+    ret |= (unsigned)c << (8 * i);
+  }
+  return ret;
+}
+
+static void p9fs_fini(virtio_t *vio) {
+  p9fs_t *fs = (p9fs_t *)vio->dev;
+  p9fs_fid_clear(fs);
+  free(fs->root);
+  free(fs->tag);
+  free(fs->req);
+  free(fs->resp);
+}
+
+int p9fs_attach(virtio_t *vio, const char *root, const char *tag) {
+  struct stat st;
+  char *real_root = NULL;
+  if (vio->dev) {
+    return -1;
+  }
+  if ((real_root = realpath(root, NULL)) == NULL || stat(real_root, &st) != 0 || !S_ISDIR(st.st_mode)) {
+    fprintf(stderr, "virtio 9p: not a directory: %s\n", root);
+    free(real_root);
+    return -1;
+  }
+  p9fs_t *fs = (p9fs_t *)calloc(1, sizeof(p9fs_t));
+  fs->root = real_root;
+  fs->tag = strdup(tag);
+  fs->msize = P9FS_MAX_MSIZE;
+  fs->req = (char *)malloc(P9FS_MAX_MSIZE);
+  fs->resp = (char *)malloc(P9FS_MAX_MSIZE);
+  vio->dev = fs;
+  vio->device_id = VIRTIO_MMIO_DEVICE_9P;
+  vio->num_queues = 1; // requests
+  vio->host_features |= (1LL << VIRTIO_9P_MOUNT_TAG);
+  vio->dev_notify = p9fs_notify;
+  vio->dev_config = p9fs_config;
+  vio->dev_cycle = NULL;
+  vio->dev_fini = p9fs_fini;
+  return 0;
+}
@@ -0,0 +1,36 @@
+#ifndef P9FS_H
+#define P9FS_H
+
+#include "mmio.h"
+
+// largest msize offered to the guest (the Linux virtio transport stops at 500KiB)
+#define P9FS_MAX_MSIZE (512 * 1024)
+#define P9FS_FID_HASH 256
+#define P9FS_MAX_IOV 256
+
+typedef struct p9fs_fid_t {
+  unsigned fid;
+  char *path; // host path
+  int fd;
+  void *dir; // DIR * for readdir
+  unsigned long long dir_offs;
+  struct p9fs_fid_t *next;
+} p9fs_fid_t;
+
+// virtio-9p (9P2000.L) sharing a host directory
+typedef struct p9fs_t {
+  char *root;
+  char *tag;
+  unsigned msize;
+  char *req; // request message
+  char *resp; // response message
+  // the request in process, read/write data goes directly between the file and the guest memory
+  virtio_t *vio;
+  const virtio_chain_t *chain;
+  unsigned resp_direct;
+  p9fs_fid_t *fid[P9FS_FID_HASH];
+} p9fs_t;
+
+int p9fs_attach(virtio_t *vio, const char *root, const char *tag);
+
+#endif
@@ -11,27 +11,77 @@ void plic_init(plic_t *plic) {
   plic->base.get_irq = NULL;
   plic->base.ack_irq = NULL;
   plic->num_hart = 0;
-  plic->priorities = (unsigned *)malloc((PLIC_MAX_IRQ + 1) * sizeof(unsigned));
-  plic->peripherals = (struct mmio_t **)calloc((PLIC_MAX_IRQ + 1), sizeof(struct mmio_t));
-  plic->interrupt_enable = NULL;
-  plic->interrupt_threshold = NULL;
-  plic->interrupt_complete = NULL;
-  plic->hart_rr = 0;
+  plic->priorities = (unsigned *)calloc((PLIC_MAX_IRQ + 1), sizeof(unsigned));
+  plic->peripherals = (struct mmio_t **)calloc((PLIC_MAX_IRQ + 1), sizeof(struct mmio_t *));
+  plic->pending = 0;
+  plic->claimed = 0;
+  // 2 contexts for each of the harts (up to SIM_MAX_HART)
+  plic->interrupt_enable = (unsigned *)calloc(2 * SIM_MAX_HART, sizeof(unsigned));
+  plic->interrupt_threshold = (unsigned *)calloc(2 * SIM_MAX_HART, sizeof(unsigned));
+  plic->interrupt_id = (unsigned *)calloc(2 * SIM_MAX_HART, sizeof(unsigned));
   memory_target_init((struct memory_target_t *)plic, 0, (1 << 24), NULL, plic_read, plic_write);
   return;
 }
 
 void plic_add_hart(plic_t *plic) {
-  if (plic->num_hart == 0) {
-    plic->interrupt_enable = (unsigned *)malloc(2 * sizeof(unsigned));
-    plic->interrupt_threshold = (unsigned *)malloc(2 * sizeof(unsigned));
-    plic->interrupt_complete = (unsigned *)malloc(2 * sizeof(unsigned));
-  } else {
-    plic->interrupt_enable = (unsigned *)realloc(plic->interrupt_enable, 2 * (plic->num_hart + 1) * sizeof(unsigned));
-    plic->interrupt_threshold = (unsigned *)realloc(plic->interrupt_threshold, 2 * (plic->num_hart + 1) * sizeof(unsigned));
-    plic->interrupt_complete = (unsigned *)realloc(plic->interrupt_complete, 2 * (plic->num_hart + 1) * sizeof(unsigned));
+  if (plic->num_hart < SIM_MAX_HART) {
+    plic->num_hart++;
+  }
+}
+
+// the highest priority (the lowest id on a tie) pending interrupt over the threshold for each context,
+// only when the pending bits or the registers change (not on every plic_get_interrupt)
+static void plic_update(plic_t *plic) {
+  for (unsigned context_id = 0; context_id < 2 * plic->num_hart; context_id++) {
+    unsigned candidates = plic->pending & plic->interrupt_enable[context_id];
+    unsigned max_priority = plic->interrupt_threshold[context_id];
+    unsigned irq_id = 0;
+    for (unsigned i = 1; candidates >> i; i++) {
+      if (((candidates >> i) & 0x00000001) && (plic->priorities[i] > max_priority)) {
+        max_priority = plic->priorities[i];
+        irq_id = i;
+      }
+    }
+    __atomic_store_n(&plic->interrupt_id[context_id], irq_id, __ATOMIC_RELAXED);
+  }
+}
+
+void plic_cycle(plic_t *plic) {
+  unsigned asserted = 0;
+  for (unsigned i = 1; i <= PLIC_MAX_IRQ; i++) {
+    if (plic->peripherals[i] && plic->peripherals[i]->get_irq &&
+        plic->peripherals[i]->get_irq(plic->peripherals[i])) {
+      asserted |= (1 << i);
+    }
+  }
+  asserted &= ~plic->claimed;
+  if (asserted != plic->pending) {
+    plic->pending = asserted;
+    plic_update(plic);
+  }
+}
+
+static unsigned plic_claim(plic_t *plic, unsigned context_id) {
+  plic_cycle(plic);
+  unsigned irq_id = plic->interrupt_id[context_id];
+  if (irq_id) {
+    plic->claimed |= (1 << irq_id);
+    plic->pending &= ~(1 << irq_id);
+    plic_update(plic);
+  }
+  return irq_id;
+}
+
+static void plic_complete(plic_t *plic, unsigned context_id, unsigned irq_id) {
+  // ignored for the sources not enabled for the context
+  if (irq_id == 0 || irq_id > PLIC_MAX_IRQ || ((plic->interrupt_enable[context_id] >> irq_id) & 0x00000001) == 0) {
+    return;
+  }
+  plic->claimed &= ~(1 << irq_id);
+  if (plic->peripherals[irq_id] && plic->peripherals[irq_id]->ack_irq) {
+    plic->peripherals[irq_id]->ack_irq(plic->peripherals[irq_id]);
   }
-  plic->num_hart++;
+  plic_cycle(plic);
 }
 
 char plic_read(struct memory_target_t *unit, unsigned addr) {
@@ -39,18 +89,27 @@ char plic_read(struct memory_target_t *unit, unsigned addr) {
   plic_t *plic = (plic_t *)unit;
   unsigned woff = addr & 0x00000003;
   unsigned value = 0;
-  if (addr >= PLIC_ADDR_CTX_ENABLE_BASE &&
-      addr < (PLIC_ADDR_CTX_ENABLE_BASE + (2 * plic->num_hart * 0x080))) {
+  if (addr >= PLIC_ADDR_IRQ_PRIORITY_BASE &&
+      addr < (PLIC_ADDR_IRQ_PRIORITY_BASE + (PLIC_MAX_IRQ + 1) * 0x4)) {
+    value = plic->priorities[(addr - PLIC_ADDR_IRQ_PRIORITY_BASE) >> 2];
+  } else if (addr >= PLIC_ADDR_PENDING_BASE && addr < PLIC_ADDR_CTX_ENABLE_BASE) {
+    if (((addr - PLIC_ADDR_PENDING_BASE) >> 2) == 0) {
+      value = plic->pending;
+    }
+  } else if (addr >= PLIC_ADDR_CTX_ENABLE_BASE &&
+             addr < (PLIC_ADDR_CTX_ENABLE_BASE + (2 * plic->num_hart * 0x080))) {
     unsigned context_id = (addr - PLIC_ADDR_CTX_ENABLE_BASE) / 0x080;
-    value = plic->interrupt_enable[context_id];
+    if ((addr & 0x7c) == 0) {
+      value = plic->interrupt_enable[context_id];
+    }
   } else if (addr >= PLIC_ADDR_CTX_THRESHOLD_BASE &&
              addr < (PLIC_ADDR_CTX_THRESHOLD_BASE + (2 * plic->num_hart * 0x1000))) {
     unsigned context_id = (addr - PLIC_ADDR_CTX_THRESHOLD_BASE) / 0x1000;
-    if ((addr & 0x7) < 4) { // threashold
+    if ((addr & 0xffc) == 0) { // threashold
       value = plic->interrupt_threshold[context_id];
-    } else { // claim
-      if ((context_id == 2 * plic->hart_rr) || (context_id == 2 * plic->hart_rr + 1)) {
-        value = plic_get_interrupt(plic, context_id);
+    } else if ((addr & 0xffc) == 4) { // claim (the id fits in the first byte)
+      if (woff == 0) {
+        value = plic_claim(plic, context_id);
       }
     }
   } else {
@@ -69,26 +128,25 @@ void plic_write(struct memory_target_t *unit, unsigned addr, char value) {
     unsigned irqno = ((addr & 0x1fff) >> 2);
     plic->priorities[irqno] =
       (plic->priorities[irqno] & (~mask)) | ((unsigned char)value << (8 * woff));
+    plic_update(plic);
   } else if (addr >= PLIC_ADDR_CTX_ENABLE_BASE &&
              addr < (PLIC_ADDR_CTX_ENABLE_BASE + (2 * plic->num_hart * 0x080))) {
     unsigned context_id = (addr - PLIC_ADDR_CTX_ENABLE_BASE) / 0x080;
-    plic->interrupt_enable[context_id] =
-      (plic->interrupt_enable[context_id] & (~mask)) | ((unsigned char)value << (8 * woff));
+    if ((addr & 0x7c) == 0) {
+      plic->interrupt_enable[context_id] =
+        (plic->interrupt_enable[context_id] & (~mask)) | ((unsigned char)value << (8 * woff));
+      plic->interrupt_enable[context_id] &= ((2 << PLIC_MAX_IRQ) - 2);
+      plic_update(plic);
+    }
   } else if (addr >= PLIC_ADDR_CTX_THRESHOLD_BASE &&
              addr < (PLIC_ADDR_CTX_THRESHOLD_BASE + (2 * plic->num_hart * 0x1000))) {
     unsigned context_id = (addr - PLIC_ADDR_CTX_THRESHOLD_BASE) / 0x1000;
-    if ((addr & 0x7) < 4) { // threashold
+    if ((addr & 0xffc) == 0) { // threashold
       plic->interrupt_threshold[context_id] =
         (plic->interrupt_threshold[context_id] & (~mask)) | ((unsigned char)value << (8 * woff));
-    } else { // complete
-      plic->interrupt_complete[context_id] =
-        (plic->interrupt_complete[context_id] & (~mask)) | ((unsigned char)value << (8 * woff));
-      if (woff == 0 && plic->interrupt_complete[context_id] <= PLIC_MAX_IRQ) {
-        unsigned irqno = plic->interrupt_complete[context_id];
-        if (plic->peripherals[irqno] && plic->peripherals[irqno]->ack_irq) {
-          plic->peripherals[irqno]->ack_irq(plic->peripherals[irqno]);
-        }
-      }
+      plic_update(plic);
+    } else if ((addr & 0xffc) == 4 && woff == 0) { // complete
+      plic_complete(plic, context_id, (unsigned char)value);
     }
   } else {
     fprintf(stderr, "PLIC: unknown addr write: %08x, %08x\n", addr, value);
@@ -103,30 +161,16 @@ void plic_set_peripheral(plic_t *plic, struct mmio_t *mmio, unsigned irqno) {
 }
 
 unsigned plic_get_interrupt(plic_t *plic, unsigned context) {
-  unsigned enable = plic->interrupt_enable[context];
-  unsigned threshold = plic->interrupt_threshold[context];
-  unsigned pending = 0;
-  for (unsigned i = 1; i <= PLIC_MAX_IRQ; i++) {
-    if (plic->peripherals[i] && plic->peripherals[i]->get_irq &&
-        plic->peripherals[i]->get_irq(plic->peripherals[i])) {
-      pending = pending | (1 << i);
-    }
-  }
-  unsigned irq_id = 0;
-  for (unsigned i = 1; i <= PLIC_MAX_IRQ; i++) {
-    if ((((enable & pending) >> i) & 0x00000001) && (plic->priorities[i] > threshold)) {
-      irq_id = i;
-      break;
-    }
-  }
-  return irq_id;
+  // updated by plic_cycle/plic_update under the bus lock in the parallel mode
+  return __atomic_load_n(&plic->interrupt_id[context], __ATOMIC_RELAXED);
 }
 
 void plic_fini(plic_t *plic) {
   free(plic->priorities);
+  free(plic->peripherals);
   free(plic->interrupt_enable);
   free(plic->interrupt_threshold);
-  free(plic->interrupt_complete);
+  free(plic->interrupt_id);
   memory_target_fini((struct memory_target_t *)plic);
   return;
 }
@@ -136,25 +180,19 @@ void aclint_init(aclint_t *aclint) {
   aclint->base.ack_irq = NULL;
   aclint->num_hart = 0;
   aclint->mtime = 0;
-  aclint->mtimecmp = NULL;
-  aclint->msip = NULL;
-  aclint->ssip = NULL;
+  // the harts may read the registers of each other (no realloc under them)
+  aclint->mtimecmp = (unsigned long long *)calloc(SIM_MAX_HART, sizeof(unsigned long long));
+  aclint->msip = (unsigned char *)calloc(SIM_MAX_HART, sizeof(unsigned char));
+  aclint->ssip = (unsigned char *)calloc(SIM_MAX_HART, sizeof(unsigned char));
   aclint->timer_enable = 0;
   aclint->cycle_count = 0;
   memory_target_init((struct memory_target_t *)aclint, 0, (1 << 16), NULL, aclint_read, aclint_write);
 }
 
 void aclint_add_hart(aclint_t *aclint) {
-  if (aclint->num_hart == 0) {
-    aclint->mtimecmp = (unsigned long long *)malloc(sizeof(unsigned long long));
-    aclint->msip = (unsigned char *)malloc(sizeof(unsigned char));
-    aclint->ssip = (unsigned char *)malloc(sizeof(unsigned char));
-  } else {
-    aclint->mtimecmp = (unsigned long long *)realloc(aclint->mtimecmp, (aclint->num_hart + 1) * sizeof(unsigned long long));
-    aclint->msip = (unsigned char *)realloc(aclint->msip, (aclint->num_hart + 1) * sizeof(unsigned char));
-    aclint->ssip = (unsigned char *)realloc(aclint->ssip, (aclint->num_hart + 1) * sizeof(unsigned char));
+  if (aclint->num_hart < SIM_MAX_HART) {
+    aclint->num_hart++;
   }
-  aclint->num_hart++;
 }
 
 char aclint_read(struct memory_target_t *unit, unsigned addr) {
@@ -207,7 +245,7 @@ void aclint_write(struct memory_target_t *unit, unsigned addr, char value) {
     aclint->mtimecmp[hart_id] =
       ((aclint->mtimecmp[hart_id] & mask) |
        (((uint64_t)value << (8 * byte_offset)) & (0x0FFL << (8 * byte_offset))));
-  } else if (addr >= ACLINT_MTIME_BASE && addr < 8) {
+  } else if (addr >= ACLINT_MTIME_BASE && addr < ACLINT_MTIME_BASE + 8) {
     // mtime read only
   } else {
     fprintf(stderr, "aclint write unimplemented region: %08x\n", addr);
@@ -220,6 +258,15 @@ void aclint_cycle(aclint_t *aclint) {
   }
 }
 
+// aclint_cycle for a number of cycles at once
+void aclint_advance(aclint_t *aclint, unsigned cycles) {
+  unsigned long long from = aclint->cycle_count;
+  unsigned long long to = from + cycles;
+  // ticks at the multiples of 10 in [from, to)
+  aclint->mtime += (to + 9) / 10 - (from + 9) / 10;
+  aclint->cycle_count = (unsigned)to;
+}
+
 void aclint_enable_timer(aclint_t *aclint) {
   aclint->timer_enable = 1;
 }
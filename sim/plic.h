@@ -3,21 +3,25 @@
 
 #include "memory.h"
 
+// the sources (1 - PLIC_MAX_IRQ) fit in a word of pending/enable bits
 typedef struct plic_t {
   struct mmio_t base;
   unsigned num_hart;
   struct mmio_t **peripherals;
   // for each prepherals
   unsigned *priorities;
-  // for each hart context
+  unsigned pending; // asserted and not claimed
+  unsigned claimed; // in flight until the completion, hidden from the other contexts
+  // for each hart context (hart_id * 2: M mode, hart_id * 2 + 1: S mode)
   unsigned *interrupt_enable;
   unsigned *interrupt_threshold;
-  unsigned *interrupt_complete;
-  unsigned hart_rr;
+  unsigned *interrupt_id; // the interrupt to claim, 0 if none
 } plic_t;
 
 void plic_init(plic_t *);
 void plic_add_hart(plic_t *);
+// samples the interrupt lines of the peripherals
+void plic_cycle(plic_t *);
 unsigned plic_get_interrupt(plic_t *, unsigned context_id);
 void plic_set_peripheral(plic_t *, struct mmio_t *, unsigned irq_no);
 char plic_read(memory_target_t *, unsigned addr);
@@ -28,6 +32,7 @@ typedef struct aclint_t {
   struct mmio_t base;
   unsigned num_hart;
   unsigned long long mtime;
+  // for each hart
   unsigned long long *mtimecmp;
   unsigned char *msip;
   unsigned char *ssip;
@@ -40,6 +45,7 @@ void aclint_add_hart(aclint_t *);
 char aclint_read(memory_target_t *, unsigned addr);
 void aclint_write(memory_target_t *, unsigned addr, char value);
 void aclint_cycle(aclint_t *);
+void aclint_advance(aclint_t *, unsigned cycles);
 void aclint_enable_timer(aclint_t *);
 unsigned long long aclint_get_mtimecmp(aclint_t *, int hart_id);
 unsigned aclint_get_msip(aclint_t *, int hart_id);
@@ -0,0 +1,247 @@
+#include "procstat.h"
+#include "sim.h"
+#include "core.h"
+#include "csr.h"
+#include "lsu.h"
+#include "memory.h"
+#include "riscv.h"
+#include <stdlib.h>
+#include <string.h>
+
+void procstat_init(procstat_t *procstat) {
+  procstat->hart = (procstat_hart_t *)calloc(SIM_MAX_HART, sizeof(procstat_hart_t));
+  memset(&procstat->task, 0, sizeof(procstat_task_t));
+}
+
+void procstat_task(procstat_t *procstat, const procstat_task_t *task) {
+  procstat->task = *task;
+}
+
+static unsigned *procstat_find(unsigned *hash, unsigned size, const procstat_entry_t *entry, unsigned satp) {
+  unsigned i = (satp * 2654435761u) & (size - 1);
+  while (hash[i] && entry[hash[i] - 1].satp != satp) {
+    i = (i + 1) & (size - 1);
+  }
+  return &hash[i];
+}
+
+static void procstat_grow(procstat_hart_t *h) {
+  unsigned size = h->hash_size ? h->hash_size * 2 : PROCSTAT_HASH_INIT;
+  unsigned *hash = (unsigned *)calloc(size, sizeof(unsigned));
+  for (unsigned i = 0; i < h->hash_size; i++) {
+    if (h->hash[i]) {
+      *procstat_find(hash, size, h->entry, h->entry[h->hash[i] - 1].satp) = h->hash[i];
+    }
+  }
+  free(h->hash);
+  h->hash = hash;
+  h->hash_size = size;
+}
+
+static unsigned procstat_new(procstat_hart_t *h, unsigned satp) {
+  if (h->num_entry == h->cap_entry) {
+    h->cap_entry = h->cap_entry ? h->cap_entry * 2 : PROCSTAT_HASH_INIT;
+    h->entry = (procstat_entry_t *)realloc(h->entry, h->cap_entry * sizeof(procstat_entry_t));
+  }
+  procstat_entry_t *e = &h->entry[h->num_entry];
+  memset(e, 0, sizeof(procstat_entry_t));
+  e->satp = satp;
+  return h->num_entry++;
+}
+
+static void procstat_switch(procstat_t *procstat, procstat_hart_t *h, unsigned satp) {
+  if (h->num_entry * 2 >= h->hash_size) {
+    procstat_grow(h);
+  }
+  unsigned *slot = procstat_find(h->hash, h->hash_size, h->entry, satp);
+  if (*slot == 0) {
+    *slot = procstat_new(h, satp) + 1;
+  }
+  h->cur = *slot - 1;
+  h->entry[h->cur].switches++;
+  h->resolve = (procstat->task.base != PROCSTAT_TASK_NONE);
+}
+
+// through satp, or the physical address if it is not mapped (the xv6 kernel from U mode)
+static unsigned procstat_peek(core_t *core, char *dst, unsigned addr, unsigned len) {
+  return lsu_peek(core->lsu, dst, addr, len) && memory_peek(core->lsu->mem, dst, addr, len);
+}
+
+static void procstat_resolve(procstat_t *procstat, procstat_hart_t *h, core_t *core, unsigned hart_id) {
+  const procstat_task_t *t = &procstat->task;
+  unsigned task = 0;
+  char name[PROCSTAT_NAME_LEN];
+  switch (t->base) {
+  case PROCSTAT_TASK_SSCRATCH:
+    task = core->csr->sscratch;
+    break;
+  case PROCSTAT_TASK_TP:
+    task = core->gpr[REG_TP];
+    break;
+  default:
+    if (procstat_peek(core, (char *)&task, t->addr + hart_id * t->stride, sizeof(task))) {
+      task = 0;
+    }
+    break;
+  }
+  if (task == 0 || procstat_peek(core, name, task + t->offset, PROCSTAT_NAME_LEN)) {
+    return;
+  }
+  for (unsigned i = 0; i < PROCSTAT_NAME_LEN; i++) {
+    if (i == PROCSTAT_NAME_LEN - 1 || name[i] < 0x20 || name[i] > 0x7e) {
+      name[i] = '\0';
+      break;
+    }
+  }
+  procstat_entry_t *e = &h->entry[h->cur];
+  if (name[0] == '\0' || strcmp(e->name, name) == 0) {
+    return;
+  }
+  if (e->name[0] != '\0') {
+    // the address space is reused, the new entry takes the key and the switch
+    unsigned *slot = procstat_find(h->hash, h->hash_size, h->entry, e->satp);
+    e->switches--;
+    h->cur = procstat_new(h, e->satp);
+    *slot = h->cur + 1;
+    e = &h->entry[h->cur];
+    e->switches = 1;
+  }
+  strcpy(e->name, name);
+}
+
+void procstat_step(procstat_t *procstat, core_t *core, struct core_step_result *result) {
+  procstat_hart_t *h = &procstat->hart[result->hart_id];
+  if (h->cur == h->num_entry) {
+    procstat_switch(procstat, h, lsu_atp_get(core->lsu));
+  }
+  if (h->resolve && result->prv == PRIVILEGE_MODE_U) {
+    h->resolve = 0;
+    procstat_resolve(procstat, h, core, result->hart_id);
+  }
+  procstat_entry_t *e = &h->entry[h->cur];
+  e->cycle++;
+  if (result->exception_code == 0) {
+    e->instret++;
+    if (result->prv == PRIVILEGE_MODE_U) {
+      e->instret_user++;
+    }
+    if (!result->trapret && core->csr->pc != result->pc_next) {
+      // taken in csr_cycle after the instruction
+      e->interrupt++;
+    }
+  } else {
+    e->exception++;
+  }
+  e->icache_access += result->icache_access;
+  e->icache_miss += result->icache_access - result->icache_hit;
+  e->dcache_access += result->dcache_access;
+  e->dcache_miss += result->dcache_access - result->dcache_hit;
+  e->dcache_write_back += result->dcache_write_back;
+  e->tlb_access += result->tlb_access;
+  e->tlb_miss += result->tlb_access - result->tlb_hit;
+  e->tlb_walk += result->tlb_walk;
+  e->l2_access += result->l2_access;
+  e->l2_miss += result->l2_access - result->l2_hit;
+  if (result->opcode == OPCODE_SYSTEM) {
+    // satp is written by csrrw, csrrs or csrrc
+    unsigned satp = lsu_atp_get(core->lsu);
+    if (satp != e->satp) {
+      procstat_switch(procstat, h, satp);
+    }
+  }
+}
+
+static int procstat_key_cmp(const void *a, const void *b) {
+  const procstat_entry_t *ea = (const procstat_entry_t *)a;
+  const procstat_entry_t *eb = (const procstat_entry_t *)b;
+  if (ea->satp != eb->satp) {
+    return (ea->satp > eb->satp) ? 1 : -1;
+  }
+  return strcmp(ea->name, eb->name);
+}
+
+static int procstat_cycle_cmp(const void *a, const void *b) {
+  unsigned long long ca = ((const procstat_entry_t *)a)->cycle;
+  unsigned long long cb = ((const procstat_entry_t *)b)->cycle;
+  return (ca < cb) - (ca > cb);
+}
+
+static void procstat_add(procstat_entry_t *sum, const procstat_entry_t *e) {
+  sum->cycle += e->cycle;
+  sum->instret += e->instret;
+  sum->instret_user += e->instret_user;
+  sum->icache_access += e->icache_access;
+  sum->icache_miss += e->icache_miss;
+  sum->dcache_access += e->dcache_access;
+  sum->dcache_miss += e->dcache_miss;
+  sum->dcache_write_back += e->dcache_write_back;
+  sum->tlb_access += e->tlb_access;
+  sum->tlb_miss += e->tlb_miss;
+  sum->tlb_walk += e->tlb_walk;
+  sum->l2_access += e->l2_access;
+  sum->l2_miss += e->l2_miss;
+  sum->exception += e->exception;
+  sum->interrupt += e->interrupt;
+  sum->switches += e->switches;
+}
+
+static void procstat_write_row(FILE *fp, const procstat_entry_t *e, const char *satp, unsigned long long total) {
+  fprintf(fp, "%-9s %-15s %12llu %5.1f %12llu %5.1f %10llu %10llu %7.2f %9llu %9llu %9llu %9llu %9llu %9llu %8llu\n",
+          satp, e->name[0] ? e->name : "-", e->cycle, total ? 100.0 * e->cycle / total : 0.0,
+          e->instret, e->instret ? 100.0 * e->instret_user / e->instret : 0.0,
+          e->icache_miss, e->dcache_miss, e->instret ? 1000.0 * e->dcache_miss / e->instret : 0.0,
+          e->dcache_write_back, e->tlb_miss, e->tlb_walk, e->l2_miss, e->exception, e->interrupt, e->switches);
+}
+
+unsigned procstat_write(procstat_t *procstat, FILE *fp) {
+  unsigned num = 0;
+  for (unsigned i = 0; i < SIM_MAX_HART; i++) {
+    num += procstat->hart[i].num_entry;
+  }
+  if (num == 0) {
+    return 0;
+  }
+  procstat_entry_t *row = (procstat_entry_t *)malloc(num * sizeof(procstat_entry_t));
+  num = 0;
+  for (unsigned i = 0; i < SIM_MAX_HART; i++) {
+    memcpy(&row[num], procstat->hart[i].entry, procstat->hart[i].num_entry * sizeof(procstat_entry_t));
+    num += procstat->hart[i].num_entry;
+  }
+  // the same address space and name on several harts or at several times
+  qsort(row, num, sizeof(procstat_entry_t), procstat_key_cmp);
+  unsigned merged = 0;
+  procstat_entry_t total;
+  memset(&total, 0, sizeof(procstat_entry_t));
+  for (unsigned i = 0; i < num; i++) {
+    if (merged > 0 && procstat_key_cmp(&row[merged - 1], &row[i]) == 0) {
+      procstat_add(&row[merged - 1], &row[i]);
+    } else {
+      row[merged++] = row[i];
+    }
+    procstat_add(&total, &row[i]);
+  }
+  qsort(row, merged, sizeof(procstat_entry_t), procstat_cycle_cmp);
+  fprintf(fp, "%-9s %-15s %12s %5s %12s %5s %10s %10s %7s %9s %9s %9s %9s %9s %9s %8s\n",
+          "satp", "name", "cycle", "%", "instret", "user%", "i$miss", "d$miss", "d$mpki",
+          "d$wb", "tlbmiss", "walk", "l2miss", "exception", "interrupt", "switch");
+  for (unsigned i = 0; i < merged; i++) {
+    char satp[16];
+    if (row[i].satp) {
+      snprintf(satp, sizeof(satp), "%08x", row[i].satp);
+    } else {
+      strcpy(satp, "bare");
+    }
+    procstat_write_row(fp, &row[i], satp, total.cycle);
+  }
+  procstat_write_row(fp, &total, "total", total.cycle);
+  free(row);
+  return merged;
+}
+
+void procstat_fini(procstat_t *procstat) {
+  for (unsigned i = 0; i < SIM_MAX_HART; i++) {
+    free(procstat->hart[i].entry);
+    free(procstat->hart[i].hash);
+  }
+  free(procstat->hart);
+}
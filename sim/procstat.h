@@ -0,0 +1,77 @@
+#ifndef PROCSTAT_H
+#define PROCSTAT_H
+
+#include <stdio.h>
+
+struct core_t;
+struct core_step_result;
+
+// per-process accounting (--proc-stat): every step of a hart is counted to the address space it runs
+// in, the root PPN and ASID of satp (bare: translation off), so the kernel running on the page table
+// of a process (Linux) is counted to that process, while xv6 runs the kernel on a table of its own.
+// the name of a process is read from the guest at its first step in U mode after a switch to it,
+// an address space reused by a process of another name starts a new entry.
+// the harts count into their own tables, merged at the end
+
+#define PROCSTAT_HASH_INIT (1 << 6) // address spaces of a hart, a power of 2, doubled at half full
+#define PROCSTAT_NAME_LEN 16 // TASK_COMM_LEN of Linux, the name of xv6
+
+// where the current task is found
+#define PROCSTAT_TASK_NONE 0
+#define PROCSTAT_TASK_SSCRATCH 1 // sscratch (Linux keeps the task_struct there in U mode)
+#define PROCSTAT_TASK_TP 2 // the tp register
+#define PROCSTAT_TASK_ADDR 3 // the word at addr + hart ID * stride (xv6: cpus[hart].proc)
+
+typedef struct procstat_task_t {
+  unsigned base; // PROCSTAT_TASK_xxx
+  unsigned addr;
+  unsigned stride;
+  unsigned offset; // of the name in the task
+} procstat_task_t;
+
+typedef struct procstat_entry_t {
+  unsigned satp; // the mode, ASID and root PPN, 0: bare
+  char name[PROCSTAT_NAME_LEN]; // empty: unknown
+  unsigned long long cycle; // the steps including traps
+  unsigned long long instret;
+  unsigned long long instret_user;
+  unsigned long long icache_access;
+  unsigned long long icache_miss;
+  unsigned long long dcache_access;
+  unsigned long long dcache_miss;
+  unsigned long long dcache_write_back;
+  unsigned long long tlb_access;
+  unsigned long long tlb_miss;
+  unsigned long long tlb_walk;
+  unsigned long long l2_access;
+  unsigned long long l2_miss;
+  unsigned long long exception;
+  unsigned long long interrupt;
+  unsigned long long switches; // times switched to
+} procstat_entry_t;
+
+typedef struct procstat_hart_t {
+  procstat_entry_t *entry;
+  unsigned num_entry;
+  unsigned cap_entry;
+  unsigned *hash; // the latest entry of a key, index + 1, 0: empty
+  unsigned hash_size;
+  unsigned cur; // num_entry: none yet
+  unsigned char resolve; // the name is read at the next step in U mode
+} procstat_hart_t;
+
+typedef struct procstat_t {
+  procstat_hart_t *hart;
+  procstat_task_t task;
+} procstat_t;
+
+void procstat_init(procstat_t *);
+// the names of the processes, a PROCSTAT_TASK_xxx base
+void procstat_task(procstat_t *, const procstat_task_t *task);
+// called by sim_step on every step of every hart (sim_procstat_on)
+void procstat_step(procstat_t *, struct core_t *core, struct core_step_result *result);
+// the entries of all harts by cycles, returns the number of rows
+unsigned procstat_write(procstat_t *, FILE *fp);
+void procstat_fini(procstat_t *);
+
+#endif
@@ -0,0 +1,332 @@
+#include "prof.h"
+#include "sim.h"
+#include "elfloader.h"
+#include "callgraph.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct prof_symbol_t {
+  unsigned addr;
+  unsigned size;
+  char *name;
+} prof_symbol_t;
+
+// a resolved sample
+typedef struct prof_row_t {
+  unsigned hart_id;
+  unsigned prv;
+  int sym; // -1: unknown
+  unsigned long long count;
+} prof_row_t;
+
+static const char prof_prv_name[] = {'U', 'S', 'H', 'M', 'D'};
+
+void prof_init(prof_t *prof, unsigned period) {
+  prof->period = period ? period : 1;
+  prof->hart = (prof_hart_t *)calloc(SIM_MAX_HART, sizeof(prof_hart_t));
+  for (unsigned i = 0; i < SIM_MAX_HART; i++) {
+    prof->hart[i].countdown = prof->period;
+  }
+  memset(prof->sym, 0, sizeof(prof->sym));
+  prof->callgraph = NULL;
+}
+
+void prof_callgraph_on(prof_t *prof) {
+  if (prof->callgraph == NULL) {
+    prof->callgraph = (callgraph_t *)malloc(sizeof(callgraph_t));
+    callgraph_init(prof->callgraph);
+  }
+}
+
+static int prof_symbol_cmp(const void *a, const void *b) {
+  unsigned addr_a = ((const prof_symbol_t *)a)->addr;
+  unsigned addr_b = ((const prof_symbol_t *)b)->addr;
+  return (addr_a > addr_b) - (addr_a < addr_b);
+}
+
+// takes the names, a symbol without a size ends at the next one
+static void prof_symtab_set(prof_symtab_t *symtab, prof_symbol_t *symbol, unsigned num) {
+  qsort(symbol, num, sizeof(prof_symbol_t), prof_symbol_cmp);
+  symtab->addr = (unsigned *)malloc((num + 1) * sizeof(unsigned));
+  symtab->end = (unsigned *)malloc((num + 1) * sizeof(unsigned));
+  symtab->name = (char **)malloc((num + 1) * sizeof(char *));
+  for (unsigned i = 0; i < num; i++) {
+    symtab->addr[i] = symbol[i].addr;
+    if (symbol[i].size) {
+      symtab->end[i] = symbol[i].addr + symbol[i].size;
+    } else {
+      symtab->end[i] = 0xffffffff;
+      for (unsigned j = i + 1; j < num; j++) {
+        if (symbol[j].addr != symbol[i].addr) {
+          symtab->end[i] = symbol[j].addr;
+          break;
+        }
+      }
+    }
+    symtab->name[i] = symbol[i].name;
+  }
+  symtab->num = num;
+}
+
+static void prof_symtab_free(prof_symtab_t *symtab) {
+  for (unsigned i = 0; i < symtab->num; i++) {
+    free(symtab->name[i]);
+  }
+  free(symtab->addr);
+  free(symtab->end);
+  free(symtab->name);
+  memset(symtab, 0, sizeof(prof_symtab_t));
+}
+
+int prof_symtab_lookup(const prof_symtab_t *symtab, unsigned pc) {
+  // the last symbol at or below pc
+  unsigned lo = 0, hi = symtab->num;
+  while (lo < hi) {
+    unsigned mid = (lo + hi) / 2;
+    if (symtab->addr[mid] <= pc) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  // the nearest one covering pc (a sized symbol may be followed by labels)
+  for (unsigned i = lo; i > 0 && lo - i < 8; i--) {
+    if (pc < symtab->end[i - 1]) {
+      return i - 1;
+    }
+  }
+  return -1;
+}
+
+// System.map: "address type name", the text symbols (T, t, W, w)
+static int prof_load_map(prof_symbol_t **symbol, const char *path) {
+  FILE *fp = fopen(path, "r");
+  if (fp == NULL) {
+    perror(path);
+    return -1;
+  }
+  char line[512];
+  char name[256];
+  unsigned addr;
+  char type;
+  unsigned num = 0;
+  unsigned cap = 1024;
+  *symbol = (prof_symbol_t *)malloc(cap * sizeof(prof_symbol_t));
+  while (fgets(line, sizeof(line), fp)) {
+    if (sscanf(line, "%x %c %255s", &addr, &type, name) != 3 || strchr("TtWw", type) == NULL) {
+      continue;
+    }
+    if (num == cap) {
+      cap *= 2;
+      *symbol = (prof_symbol_t *)realloc(*symbol, cap * sizeof(prof_symbol_t));
+    }
+    (*symbol)[num].addr = addr;
+    (*symbol)[num].size = 0;
+    (*symbol)[num].name = strdup(name);
+    num++;
+  }
+  fclose(fp);
+  return num;
+}
+
+int prof_load_symbols(prof_t *prof, const char *path, unsigned table) {
+  prof_symbol_t *symbol = NULL;
+  int num = 0;
+  elf_t elf;
+  elf_init(&elf, path);
+  if (elf.status == ELF_STATUS_LOADED) {
+    symbol = (prof_symbol_t *)malloc((elf.symbols + 1) * sizeof(prof_symbol_t));
+    for (unsigned i = 0; i < elf.symbols; i++) {
+      symbol[i].addr = elf.symbol_addr[i];
+      symbol[i].size = elf.symbol_size[i];
+      symbol[i].name = strdup(elf.symbol_name[i]);
+    }
+    num = elf.symbols;
+    elf_fini(&elf);
+  } else if ((num = prof_load_map(&symbol, path)) < 0) {
+    return -1;
+  }
+  prof_symtab_free(&prof->sym[table]);
+  prof_symtab_set(&prof->sym[table], symbol, num);
+  free(symbol);
+  return 0;
+}
+
+static unsigned prof_hash(unsigned pc, unsigned prv) {
+  return ((pc >> 1) ^ (prv << 29)) * 2654435761u;
+}
+
+static prof_entry_t *prof_find(prof_entry_t *table, unsigned size, unsigned pc, unsigned prv) {
+  unsigned i = prof_hash(pc, prv) & (size - 1);
+  while (table[i].count && (table[i].pc != pc || table[i].prv != prv)) {
+    i = (i + 1) & (size - 1);
+  }
+  return &table[i];
+}
+
+static void prof_grow(prof_hart_t *hart) {
+  unsigned size = hart->size ? hart->size * 2 : PROF_HASH_INIT;
+  prof_entry_t *table = (prof_entry_t *)calloc(size, sizeof(prof_entry_t));
+  for (unsigned i = 0; i < hart->size; i++) {
+    if (hart->table[i].count) {
+      *prof_find(table, size, hart->table[i].pc, hart->table[i].prv) = hart->table[i];
+    }
+  }
+  free(hart->table);
+  hart->table = table;
+  hart->size = size;
+}
+
+void prof_step(prof_t *prof, struct core_t *core, struct core_step_result *result) {
+  if (prof->callgraph) {
+    callgraph_step(prof->callgraph, core, result);
+  }
+  if (result->exception_code != 0) {
+    return;
+  }
+  prof_hart_t *hart = &prof->hart[result->hart_id];
+  if (--hart->countdown != 0) {
+    return;
+  }
+  hart->countdown = prof->period;
+  hart->samples++;
+  if (hart->used * 2 >= hart->size) {
+    prof_grow(hart);
+  }
+  prof_entry_t *e = prof_find(hart->table, hart->size, result->pc, result->prv);
+  if (e->count == 0) {
+    e->pc = result->pc;
+    e->prv = result->prv;
+    hart->used++;
+  }
+  e->count++;
+}
+
+static int prof_row_cmp_key(const void *a, const void *b) {
+  const prof_row_t *ra = (const prof_row_t *)a;
+  const prof_row_t *rb = (const prof_row_t *)b;
+  if (ra->hart_id != rb->hart_id) {
+    return (ra->hart_id > rb->hart_id) - (ra->hart_id < rb->hart_id);
+  }
+  if (ra->prv != rb->prv) {
+    return (ra->prv < rb->prv) - (ra->prv > rb->prv); // M, S, U
+  }
+  return (ra->sym > rb->sym) - (ra->sym < rb->sym);
+}
+
+static int prof_row_cmp_count(const void *a, const void *b) {
+  const prof_row_t *ra = (const prof_row_t *)a;
+  const prof_row_t *rb = (const prof_row_t *)b;
+  if (ra->count != rb->count) {
+    return (ra->count < rb->count) - (ra->count > rb->count);
+  }
+  return prof_row_cmp_key(a, b);
+}
+
+static const char *prof_symbol_name(prof_t *prof, const prof_row_t *row) {
+  if (row->sym < 0) {
+    return "[unknown]";
+  }
+  return prof->sym[(row->prv == PRIVILEGE_MODE_U) ? PROF_SYM_USER : PROF_SYM_KERNEL].name[row->sym];
+}
+
+unsigned long long prof_write(prof_t *prof, const char *name) {
+  unsigned long long samples = 0;
+  unsigned num = 0;
+  for (unsigned i = 0; i < SIM_MAX_HART; i++) {
+    samples += prof->hart[i].samples;
+    num += prof->hart[i].used;
+  }
+  // resolved and merged by (hart, mode, symbol)
+  prof_row_t *row = (prof_row_t *)malloc((num + 1) * sizeof(prof_row_t));
+  unsigned n = 0;
+  for (unsigned i = 0; i < SIM_MAX_HART; i++) {
+    prof_hart_t *hart = &prof->hart[i];
+    for (unsigned j = 0; j < hart->size; j++) {
+      prof_entry_t *e = &hart->table[j];
+      if (e->count == 0) {
+        continue;
+      }
+      row[n].hart_id = i;
+      row[n].prv = e->prv;
+      row[n].sym = prof_symtab_lookup(&prof->sym[(e->prv == PRIVILEGE_MODE_U) ? PROF_SYM_USER : PROF_SYM_KERNEL], e->pc);
+      row[n].count = e->count;
+      n++;
+    }
+  }
+  qsort(row, n, sizeof(prof_row_t), prof_row_cmp_key);
+  unsigned m = 0;
+  for (unsigned i = 0; i < n; i++) {
+    if (m > 0 && prof_row_cmp_key(&row[m - 1], &row[i]) == 0) {
+      row[m - 1].count += row[i].count;
+    } else {
+      row[m++] = row[i];
+    }
+  }
+  char file_name[256];
+  FILE *fp;
+  // hart;mode;symbol count, the call chains of the call graph
+  snprintf(file_name, sizeof(file_name), "%s.folded", name);
+  if ((fp = fopen(file_name, "w")) != NULL) {
+    if (prof->callgraph) {
+      callgraph_write_folded(prof->callgraph, fp, prof->sym);
+    } else {
+      for (unsigned i = 0; i < m; i++) {
+        fprintf(fp, "hart%u;%c;%s %llu\n", row[i].hart_id, prof_prv_name[row[i].prv], prof_symbol_name(prof, &row[i]), row[i].count);
+      }
+    }
+    fclose(fp);
+  } else {
+    perror(file_name);
+  }
+  if (prof->callgraph) {
+    snprintf(file_name, sizeof(file_name), "%s.callgrind", name);
+    if ((fp = fopen(file_name, "w")) != NULL) {
+      callgraph_write(prof->callgraph, fp, prof->sym);
+      fclose(fp);
+    } else {
+      perror(file_name);
+    }
+  }
+  // the flat profile, the modes of each hart then the symbols by samples
+  snprintf(file_name, sizeof(file_name), "%s.prof", name);
+  if ((fp = fopen(file_name, "w")) != NULL) {
+    fprintf(fp, "# %llu samples, every %u instructions\n", samples, prof->period);
+    for (unsigned i = 0; i < m;) {
+      unsigned long long count = 0;
+      unsigned j;
+      for (j = i; j < m && row[j].hart_id == row[i].hart_id && row[j].prv == row[i].prv; j++) {
+        count += row[j].count;
+      }
+      fprintf(fp, "# hart %u %c %llu (%.2f%%)\n", row[i].hart_id, prof_prv_name[row[i].prv], count, 100.0 * count / samples);
+      i = j;
+    }
+    fprintf(fp, "#  samples       %%   cumul%% hart mode symbol\n");
+    qsort(row, m, sizeof(prof_row_t), prof_row_cmp_count);
+    unsigned long long cumulative = 0;
+    for (unsigned i = 0; i < m; i++) {
+      cumulative += row[i].count;
+      fprintf(fp, "%10llu %6.2f%% %6.2f%% %4u %c    %s\n", row[i].count, 100.0 * row[i].count / samples,
+              100.0 * cumulative / samples, row[i].hart_id, prof_prv_name[row[i].prv], prof_symbol_name(prof, &row[i]));
+    }
+    fclose(fp);
+  } else {
+    perror(file_name);
+  }
+  free(row);
+  return samples;
+}
+
+void prof_fini(prof_t *prof) {
+  for (unsigned i = 0; i < SIM_MAX_HART; i++) {
+    free(prof->hart[i].table);
+  }
+  free(prof->hart);
+  if (prof->callgraph) {
+    callgraph_fini(prof->callgraph);
+    free(prof->callgraph);
+  }
+  prof_symtab_free(&prof->sym[PROF_SYM_KERNEL]);
+  prof_symtab_free(&prof->sym[PROF_SYM_USER]);
+}
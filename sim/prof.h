@@ -0,0 +1,62 @@
+#ifndef PROF_H
+#define PROF_H
+
+struct core_t;
+struct core_step_result;
+struct callgraph_t;
+
+// guest profiler: samples the retired pc of each hart every period instructions (1: all of them)
+// into a hash table of (pc, privilege mode) per hart, so the harts do not share anything.
+// at the end the samples are resolved against the symbols of an ELF or a System.map
+// (the kernel table for M/S mode, the user table for U mode) and written as
+//   [name].prof    the flat profile
+//   [name].folded  hart;mode;symbol count (flamegraph.pl)
+// with the call graph (callgraph.h) the folded stacks are the call chains and
+//   [name].callgrind  the instructions of each function and call (KCachegrind)
+
+#define PROF_HASH_INIT (1 << 12) // entries of a hart, a power of 2, doubled at half full
+#define PROF_SYM_KERNEL 0
+#define PROF_SYM_USER 1
+
+typedef struct prof_entry_t {
+  unsigned pc;
+  unsigned prv;
+  unsigned long long count; // 0: empty
+} prof_entry_t;
+
+typedef struct prof_hart_t {
+  prof_entry_t *table;
+  unsigned size;
+  unsigned used;
+  unsigned countdown; // instructions to the next sample
+  unsigned long long samples;
+} prof_hart_t;
+
+typedef struct prof_symtab_t {
+  unsigned num;
+  unsigned *addr; // sorted
+  unsigned *end; // the next symbol unless the size is known
+  char **name;
+} prof_symtab_t;
+
+typedef struct prof_t {
+  unsigned period;
+  prof_hart_t *hart;
+  prof_symtab_t sym[2];
+  struct callgraph_t *callgraph; // NULL: off
+} prof_t;
+
+void prof_init(prof_t *, unsigned period);
+// an ELF or a System.map (the text symbols), PROF_SYM_KERNEL or PROF_SYM_USER
+int prof_load_symbols(prof_t *, const char *path, unsigned table);
+// the shadow call stacks of every hart
+void prof_callgraph_on(prof_t *);
+// called by sim_step on every step of every hart (sim_prof_on)
+void prof_step(prof_t *, struct core_t *core, struct core_step_result *result);
+// returns the samples of all harts
+unsigned long long prof_write(prof_t *, const char *name);
+void prof_fini(prof_t *);
+// the symbol covering pc, -1 if none
+int prof_symtab_lookup(const prof_symtab_t *, unsigned pc);
+
+#endif
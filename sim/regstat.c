@@ -0,0 +1,156 @@
+#include "regstat.h"
+#include "sim.h"
+#include <string.h>
+
+void regstat_init(regstat_t *regstat) {
+  memset(regstat, 0, sizeof(regstat_t));
+}
+
+int regstat_add_config(regstat_t *regstat, const regstat_config_t *config) {
+  if (regstat->num_config == REGSTAT_MAX_CONFIG || config->window == 0 ||
+      config->distance == 0 || config->distance > REGSTAT_MAX_DISTANCE) {
+    return -1;
+  }
+  unsigned n = regstat->num_config++;
+  regstat->config[n] = *config;
+  // the first instruction starts a new window
+  regstat->window[n].count = config->window;
+  if (config->distance > regstat->max_distance) {
+    regstat->max_distance = config->distance;
+  }
+  return n;
+}
+
+static unsigned regstat_class(unsigned opcode) {
+  switch (opcode) {
+  case OPCODE_OP:
+    return REGSTAT_CLASS_OP;
+  case OPCODE_OP_IMM:
+    return REGSTAT_CLASS_OP_IMM;
+  case OPCODE_LUI:
+  case OPCODE_AUIPC:
+    return REGSTAT_CLASS_UPPER;
+  case OPCODE_LOAD:
+    return REGSTAT_CLASS_LOAD;
+  case OPCODE_BRANCH:
+  case OPCODE_JAL:
+  case OPCODE_JALR:
+    return REGSTAT_CLASS_BRANCH;
+  default:
+    return REGSTAT_CLASS_OTHER;
+  }
+}
+
+// the GPR sources, 0 for the FP registers and the rs2 field of the FP conversions, moves and fsqrt
+static void regstat_sources(const struct core_step_result *result, unsigned rs[2]) {
+  rs[0] = result->rs1_regno;
+  rs[1] = result->rs2_regno;
+  switch (result->opcode) {
+  case OPCODE_STORE_FP:
+    rs[1] = 0;
+    break;
+  case OPCODE_MADD:
+  case OPCODE_MSUB:
+  case OPCODE_NMSUB:
+  case OPCODE_NMADD:
+    rs[0] = 0;
+    rs[1] = 0;
+    break;
+  case OPCODE_OP_FP: {
+    unsigned funct7 = riscv_get_funct7(result->inst);
+    if (funct7 != 0x68 && funct7 != 0x78) { // fcvt.s.w[u] and fmv.w.x read a GPR
+      rs[0] = 0;
+    }
+    rs[1] = 0;
+    break;
+  }
+  default:
+    break;
+  }
+}
+
+// the fetch window of each configuration: refilled from a pc out of it, or when full
+static void regstat_fetch(regstat_t *regstat, regstat_entry_t *e, unsigned pc) {
+  for (unsigned c = 0; c < regstat->num_config; c++) {
+    regstat_window_t *w = &regstat->window[c];
+    if (pc - w->base < w->end - w->base) {
+      // a loop in the window
+    } else if (pc == w->end && w->count < regstat->config[c].window) {
+      w->end = e->pc_next;
+      w->count++;
+    } else {
+      w->base = pc;
+      w->end = e->pc_next;
+      w->count = 1;
+      w->block++;
+    }
+    e->block[c] = w->block;
+  }
+}
+
+void regstat_step(regstat_t *regstat, struct core_step_result *result) {
+  if (result->exception_code != 0) {
+    return;
+  }
+  unsigned long long n = regstat->num_inst++;
+  regstat_entry_t *e = &regstat->entry[n & (REGSTAT_RING_SIZE - 1)];
+  unsigned rs[2];
+  regstat_sources(result, rs);
+  unsigned rd = result->rd_is_fpr ? 0 : result->rd_regno;
+  e->pc = result->pc;
+  e->pc_next = result->pc + (((result->inst & 0x03) == 0x03) ? 4 : 2);
+  e->cls = regstat_class(result->opcode);
+  e->rd = rd;
+  e->skipped = 0;
+  regstat_fetch(regstat, e, result->pc);
+  regstat->read += (rs[0] != 0) + (rs[1] != 0);
+  regstat->write += (rd != 0);
+  // the nearest earlier writers of rs1, rs2 and rd
+  unsigned pending = ((rs[0] != 0) ? 0x1 : 0) | ((rs[1] != 0) ? 0x2 : 0) | ((rd != 0) ? 0x4 : 0);
+  unsigned pc = result->pc;
+  for (unsigned i = 1; pending && i <= regstat->max_distance && i <= n; i++) {
+    regstat_entry_t *p = &regstat->entry[(n - i) & (REGSTAT_RING_SIZE - 1)];
+    if (p->cls == REGSTAT_CLASS_BRANCH || p->pc_next != pc) {
+      break;
+    }
+    pc = p->pc;
+    for (unsigned r = 0; r < 2; r++) {
+      if (!((pending >> r) & 1) || p->rd != rs[r]) {
+        continue;
+      }
+      pending &= ~(1 << r);
+      for (unsigned c = 0; c < regstat->num_config; c++) {
+        const regstat_config_t *config = &regstat->config[c];
+        if (i <= config->distance && p->block[c] == e->block[c] &&
+            (p->cls & config->producer) && (e->cls & config->consumer)) {
+          regstat->read_skip[c]++;
+          if (c == 0) {
+            if (r == 0) {
+              result->rs1_read_skip = 1;
+            } else {
+              result->rs2_read_skip = 1;
+            }
+          }
+        }
+      }
+    }
+    if ((pending & 0x4) && p->rd == rd) {
+      pending &= ~0x4;
+      for (unsigned c = 0; c < regstat->num_config; c++) {
+        const regstat_config_t *config = &regstat->config[c];
+        if (i <= config->distance && p->block[c] == e->block[c] && !((p->skipped >> c) & 1) &&
+            (p->cls & config->writer) && (e->cls & config->overwriter)) {
+          p->skipped |= 1u << c;
+          regstat->write_skip[c]++;
+          if (c == 0) {
+            result->rd_write_skip = 1;
+          }
+        }
+      }
+    }
+  }
+}
+
+void regstat_fini(regstat_t *regstat) {
+  return;
+}
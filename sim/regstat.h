@@ -0,0 +1,77 @@
+#ifndef REGSTAT_H
+#define REGSTAT_H
+
+struct core_step_result;
+
+// register access analysis (--stat): a register read is skipped when a recent producer forwards
+// the value (read skip), a register write when a recent instruction overwrites it (write skip).
+// it runs on the retired instructions: the nearest earlier writer of the register within distance
+// instructions, in the same fetch window and with no branch, jump or trap between. the
+// configurations are evaluated in one pass
+
+// instruction classes
+#define REGSTAT_CLASS_OP 0x01 // register-register ALU
+#define REGSTAT_CLASS_OP_IMM 0x02
+#define REGSTAT_CLASS_UPPER 0x04 // lui, auipc
+#define REGSTAT_CLASS_LOAD 0x08
+#define REGSTAT_CLASS_OTHER 0x10 // stores, AMOs, FP, system
+#define REGSTAT_CLASS_BRANCH 0x20 // branches and jumps, end the search
+#define REGSTAT_CLASS_ALU (REGSTAT_CLASS_OP | REGSTAT_CLASS_OP_IMM | REGSTAT_CLASS_UPPER)
+
+#define REGSTAT_MAX_CONFIG 32
+#define REGSTAT_RING_SIZE 64 // the recent instructions, a power of 2
+#define REGSTAT_MAX_DISTANCE (REGSTAT_RING_SIZE - 1)
+
+typedef struct regstat_config_t {
+  unsigned window; // instructions of the fetch window
+  unsigned distance; // instructions looked behind (read skip) and ahead (write skip)
+  unsigned producer; // classes forwarding their result (read skip)
+  unsigned consumer; // classes of which the reads may be skipped
+  unsigned writer; // classes of which the writes may be skipped
+  unsigned overwriter; // classes overwriting them (write skip)
+} regstat_config_t;
+
+// the default: the window, distance and classes of the earlier analysis on the static fetch window
+// (16 instructions, 3 instructions, ALU to OP/OP_IMM, OP by ALU or load). it follows the retired
+// instructions, so a loop reads no producer before its head and the counts are not comparable
+#define REGSTAT_CONFIG_DEFAULT \
+  {16, 3, REGSTAT_CLASS_ALU, REGSTAT_CLASS_OP | REGSTAT_CLASS_OP_IMM, REGSTAT_CLASS_OP, REGSTAT_CLASS_ALU | REGSTAT_CLASS_LOAD}
+
+typedef struct regstat_entry_t {
+  unsigned pc;
+  unsigned pc_next; // sequential
+  unsigned char cls;
+  unsigned char rd; // 0: none (x0 or an FP register)
+  unsigned skipped; // the configurations skipping its write
+  unsigned block[REGSTAT_MAX_CONFIG]; // the fetch window of each configuration
+} regstat_entry_t;
+
+typedef struct regstat_window_t {
+  unsigned base; // the first pc
+  unsigned end; // the pc after the last instruction
+  unsigned count; // instructions
+  unsigned block; // increments at each refill
+} regstat_window_t;
+
+typedef struct regstat_t {
+  unsigned num_config;
+  regstat_config_t config[REGSTAT_MAX_CONFIG];
+  regstat_window_t window[REGSTAT_MAX_CONFIG];
+  unsigned max_distance;
+  regstat_entry_t entry[REGSTAT_RING_SIZE];
+  unsigned long long num_inst;
+  unsigned long long read; // register reads (not x0)
+  unsigned long long write; // register writes (not x0)
+  unsigned long long read_skip[REGSTAT_MAX_CONFIG];
+  unsigned long long write_skip[REGSTAT_MAX_CONFIG];
+} regstat_t;
+
+void regstat_init(regstat_t *);
+// returns the index of the configuration, -1 if invalid or full
+int regstat_add_config(regstat_t *, const regstat_config_t *);
+// a retired instruction, the skips found by the first configuration are set to the result
+// (rd_write_skip: the write of an earlier instruction is skipped)
+void regstat_step(regstat_t *, struct core_step_result *result);
+void regstat_fini(regstat_t *);
+
+#endif
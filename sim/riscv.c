@@ -357,7 +357,6 @@ unsigned riscv_decompress(unsigned inst) {
 
 const char *riscv_get_extension_string() {
   static char buf[256];
-  int z_seperate = 0;
   if (E_EXTENSION) {
     sprintf(buf, "RV%dE", XLEN);
   } else {
@@ -381,13 +380,15 @@ const char *riscv_get_extension_string() {
   if (V_EXTENSION) {
     sprintf(&buf[strlen(buf)], "V");
   }
+  // multi-letter extensions are separated by underscores
   if (Z_ICSR_EXTENSION) {
-    if (z_seperate++) sprintf(&buf[strlen(buf)], "_");
-    sprintf(&buf[strlen(buf)], "Zicsr");
+    sprintf(&buf[strlen(buf)], "_Zicsr");
   }
   if (Z_IFENCEI_EXTENSION) {
-    if (z_seperate++) sprintf(&buf[strlen(buf)], "_");
-    sprintf(&buf[strlen(buf)], "Zifencei");
+    sprintf(&buf[strlen(buf)], "_Zifencei");
+  }
+  if (SVADU_EXTENSION) {
+    sprintf(&buf[strlen(buf)], "_Svadu");
   }
   return buf;
 }
@@ -17,6 +17,7 @@
 #define Z_IFENCEI_EXTENSION 1
 #define Z_AM_EXTENSION      0
 #define Z_TSO_EXTENSION     0
+#define SVADU_EXTENSION     1 // hardware A/D bit update (menvcfg.ADUE)
 
 #define PMP_FEATURE 1
 
@@ -76,6 +77,9 @@
 #define PTE_W (1 << 2)
 #define PTE_X (1 << 3)
 #define PTE_U (1 << 4)
+#define PTE_G (1 << 5)
+#define PTE_A (1 << 6)
+#define PTE_D (1 << 7)
 
 #define ACCESS_TYPE_INSTRUCTION PTE_X
 #define ACCESS_TYPE_LOAD PTE_R
@@ -147,6 +151,9 @@
 #define CSR_PMPCFG_A_NA4 0x2
 #define CSR_PMPCFG_A_NAPOT 0x3
 
+// environment configuration (menvcfgh holds the upper half on RV32)
+#define CSR_MENVCFGH_ADUE 0x20000000
+
 // extension status codes
 #define CSR_EXTENSION_STATUS_OFF 0x0
 #define CSR_EXTENSION_STATUS_INITIAL 0x1
@@ -258,6 +265,10 @@
 #define CSR_ADDR_U_CYCLEH 0x00000c80
 #define CSR_ADDR_U_TIMEH 0x00000c81
 #define CSR_ADDR_U_INSTRETH 0x00000c82
+#define CSR_ADDR_U_HPMCOUNTER3 0x00000c03
+#define CSR_ADDR_U_HPMCOUNTER31 0x00000c1f
+#define CSR_ADDR_U_HPMCOUNTER3H 0x00000c83
+#define CSR_ADDR_U_HPMCOUNTER31H 0x00000c9f
 #define CSR_ADDR_M_IP 0x00000344
 #define CSR_ADDR_S_IP 0x00000144
 #define CSR_ADDR_S_EPC 0x00000141
@@ -285,6 +296,9 @@
 #define CSR_ADDR_M_INSTRETH 0x00000b82
 #define CSR_ADDR_M_COUNTEREN 0x00000306
 #define CSR_ADDR_S_COUNTEREN 0x00000106
+#define CSR_ADDR_M_ENVCFG 0x0000030a
+#define CSR_ADDR_M_ENVCFGH 0x0000031a
+#define CSR_ADDR_S_ENVCFG 0x0000010a
 #define CSR_ADDR_M_HPMCOUNTER3 0x00000b03
 #define CSR_ADDR_M_HPMCOUNTER4 0x00000b04
 #define CSR_ADDR_M_HPMCOUNTER5 0x00000b05
@@ -343,6 +357,7 @@
 #define CSR_ADDR_M_HPMCOUNTER29H 0x00000b9d
 #define CSR_ADDR_M_HPMCOUNTER30H 0x00000b9e
 #define CSR_ADDR_M_HPMCOUNTER31H 0x00000b9f
+#define CSR_ADDR_M_COUNTINHIBIT 0x00000320
 #define CSR_ADDR_M_HPMEVENT3 0x00000323
 #define CSR_ADDR_M_HPMEVENT4 0x00000324
 #define CSR_ADDR_M_HPMEVENT5 0x00000325
@@ -0,0 +1,535 @@
+#include "sbi.h"
+#include "core.h"
+#include "csr.h"
+#include "lsu.h"
+#include "memory.h"
+#include "mmio.h"
+#include "plic.h"
+#include <stdio.h>
+#include <string.h>
+
+#define SBI_DBCN_BUF_SIZE 256
+
+// generic hardware events and cache events (cache_id << 3 | op << 1 | result) with an exact
+// counterpart, the others are raw events (event_data: mhpmevent)
+const sbi_pmu_event_t sbi_pmu_events[] = {
+  {0x00003, CSR_HPM_EVENT_DCACHE_ACCESS}, // cache references
+  {0x00004, CSR_HPM_EVENT_DCACHE_MISS}, // cache misses
+  {0x00005, CSR_HPM_EVENT_BRANCH}, // branch instructions
+  {0x10008, CSR_HPM_EVENT_ICACHE_ACCESS}, // L1I read access
+  {0x10009, CSR_HPM_EVENT_ICACHE_MISS}, // L1I read miss
+};
+const unsigned sbi_pmu_num_events = sizeof(sbi_pmu_events) / sizeof(sbi_pmu_events[0]);
+_Static_assert(sizeof(sbi_pmu_events) / sizeof(sbi_pmu_events[0]) <= SBI_PMU_MAX_EVENTS, "sbi_pmu_events");
+
+void sbi_init(sbi_t *sbi, struct sim_t *sim) {
+  sbi->sim = sim;
+  // the boot hart runs, the others wait for hart_start
+  for (unsigned i = 0; i < SIM_MAX_HART; i++) {
+    sbi->hart[i].state = (i == 0) ? SBI_HSM_STARTED : SBI_HSM_STOPPED;
+    memset(&sbi->hart[i].rfence, 0, sizeof(sbi_rfence_t));
+    sbi->hart[i].rfence_seq = 0;
+    sbi->hart[i].rfence_ack = 0;
+    mtx_init(&sbi->hart[i].lock, mtx_plain);
+    sbi->hart[i].pmu_used = 0;
+    sbi->hart[i].pmu_started = 0;
+  }
+  sbi->threaded = 0;
+}
+
+// harts selected by hart_mask and hart_mask_base (-1: all)
+static int sbi_hart_mask(sbi_t *sbi, unsigned hart_mask, unsigned hart_mask_base, unsigned *targets) {
+  unsigned num_core = sbi->sim->num_core;
+  unsigned n = 0;
+  if (hart_mask_base == 0xffffffff) {
+    for (unsigned i = 0; i < num_core; i++) {
+      targets[n++] = i;
+    }
+    return n;
+  }
+  for (unsigned i = 0; i < XLEN && (hart_mask >> i); i++) {
+    if ((hart_mask >> i) & 0x1) {
+      if (hart_mask_base + i >= num_core) {
+        return SBI_ERR_INVALID_PARAM;
+      }
+      targets[n++] = hart_mask_base + i;
+    }
+  }
+  return n;
+}
+
+static void sbi_apply_rfence(sbi_t *sbi, unsigned hart_id, const sbi_rfence_t *req) {
+  core_t *core = sbi->sim->core[hart_id];
+  if (req->fence & SBI_RFENCE_I) {
+    lsu_dcache_write_back(core->lsu);
+    lsu_icache_invalidate(core->lsu);
+    core_window_flush(core);
+  }
+  if (req->fence & SBI_RFENCE_VMA) {
+    if (req->vma_flush & TLB_FLUSH_VADDR) {
+      for (unsigned i = 0; i < req->vma_pages; i++) {
+        lsu_sfence_vma(core->lsu, req->vma_flush, req->vma_vaddr + (i << 12), req->vma_asid);
+      }
+    } else {
+      lsu_sfence_vma(core->lsu, req->vma_flush, 0, req->vma_asid);
+    }
+    core_window_flush(core);
+  }
+}
+
+// start_addr and size of the spec to the pages to flush, the whole TLB (or ASID) for size 0 or -1
+// (the whole address space) and for a range wrapping or over SBI_RFENCE_MAX_PAGES
+static void sbi_rfence_range(sbi_rfence_t *req, unsigned start_addr, unsigned size) {
+  unsigned first = start_addr >> 12;
+  unsigned last = (start_addr + size - 1) >> 12;
+  if (size == 0 || size == 0xffffffff || start_addr + size - 1 < start_addr || last - first >= SBI_RFENCE_MAX_PAGES) {
+    return;
+  }
+  req->vma_flush |= TLB_FLUSH_VADDR;
+  req->vma_vaddr = first << 12;
+  req->vma_pages = last - first + 1;
+}
+
+static int sbi_remote_fence(sbi_t *sbi, unsigned caller, unsigned hart_mask, unsigned hart_mask_base, const sbi_rfence_t *req) {
+  unsigned targets[SIM_MAX_HART];
+  unsigned seq[SIM_MAX_HART];
+  int n = sbi_hart_mask(sbi, hart_mask, hart_mask_base, targets);
+  if (n < 0) {
+    return n;
+  }
+  for (int i = 0; i < n; i++) {
+    if (targets[i] == caller) {
+      sbi_apply_rfence(sbi, caller, req);
+      continue;
+    }
+    sbi_hart_t *hart = &sbi->hart[targets[i]];
+    mtx_lock(&hart->lock);
+    unsigned pending = hart->rfence.fence;
+    if ((req->fence & SBI_RFENCE_VMA) && (pending & SBI_RFENCE_VMA)) {
+      // two requests before the hart runs: the whole TLB
+      hart->rfence.vma_flush = 0;
+    } else if (req->fence & SBI_RFENCE_VMA) {
+      hart->rfence.vma_flush = req->vma_flush;
+      hart->rfence.vma_vaddr = req->vma_vaddr;
+      hart->rfence.vma_pages = req->vma_pages;
+      hart->rfence.vma_asid = req->vma_asid;
+    }
+    seq[i] = ++hart->rfence_seq;
+    __atomic_store_n(&hart->rfence.fence, pending | req->fence, __ATOMIC_RELEASE);
+    mtx_unlock(&hart->lock);
+  }
+  if (!sbi->threaded) {
+    // interleaved: the targets apply the fences before they run again
+    return SBI_SUCCESS;
+  }
+  for (int i = 0; i < n; i++) {
+    if (targets[i] == caller) {
+      continue;
+    }
+    // the targets may be waiting for this hart's fences in turn
+    while ((int)(__atomic_load_n(&sbi->hart[targets[i]].rfence_ack, __ATOMIC_ACQUIRE) - seq[i]) < 0) {
+      sbi_hart_fence(sbi, caller);
+      thrd_yield();
+    }
+  }
+  return SBI_SUCCESS;
+}
+
+// the ACLINT, the UART and the DMA to RAM are shared with the other harts (parallel mode)
+static void sbi_bus_lock(sbi_t *sbi) {
+  if (sbi->sim->mem->bus_lock_en) mtx_lock(&sbi->sim->mem->bus_lock);
+}
+
+static void sbi_bus_unlock(sbi_t *sbi) {
+  if (sbi->sim->mem->bus_lock_en) mtx_unlock(&sbi->sim->mem->bus_lock);
+}
+
+static int sbi_send_ipi(sbi_t *sbi, unsigned hart_mask, unsigned hart_mask_base) {
+  unsigned targets[SIM_MAX_HART];
+  int n = sbi_hart_mask(sbi, hart_mask, hart_mask_base, targets);
+  if (n < 0) {
+    return n;
+  }
+  sbi_bus_lock(sbi);
+  for (int i = 0; i < n; i++) {
+    aclint_set_ssip(sbi->sim->aclint, targets[i], 1);
+  }
+  sbi_bus_unlock(sbi);
+  return SBI_SUCCESS;
+}
+
+static void sbi_set_timer(core_t *core, unsigned long long stime_value) {
+  // the S-mode timer interrupt is pending while time >= stimecmp
+  core->csr->stimecmp = stime_value;
+  core->csr->stip = 0;
+}
+
+static int sbi_hart_start(sbi_t *sbi, unsigned hart_id, unsigned start_addr, unsigned opaque) {
+  if (hart_id >= sbi->sim->num_core) {
+    return SBI_ERR_INVALID_PARAM;
+  }
+  // the other harts calling hart_start at the same time fail
+  unsigned stopped = SBI_HSM_STOPPED;
+  if (!__atomic_compare_exchange_n(&sbi->hart[hart_id].state, &stopped, SBI_HSM_START_PENDING, 0,
+                                   __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+    return SBI_ERR_ALREADY_AVAILABLE;
+  }
+  core_t *core = sbi->sim->core[hart_id];
+  core->gpr[REG_A0] = hart_id;
+  core->gpr[REG_A1] = opaque;
+  core->csr->pc = start_addr;
+  core->csr->mode = PRIVILEGE_MODE_S;
+  core->csr->status_sie = 0;
+  lsu_atp_off(core->lsu);
+  lsu_tlb_clear(core->lsu);
+  lsu_icache_invalidate(core->lsu);
+  core_window_flush(core);
+  __atomic_store_n(&sbi->hart[hart_id].state, SBI_HSM_STARTED, __ATOMIC_RELEASE);
+  return SBI_SUCCESS;
+}
+
+static void sbi_shutdown(sbi_t *sbi) {
+  sbi->sim->state = quit;
+}
+
+static void sbi_console_putchar(sbi_t *sbi, char c) {
+  sbi_bus_lock(sbi);
+  uart_putchar(sbi->sim->uart, c);
+  sbi_bus_unlock(sbi);
+}
+
+static int sbi_console_getchar(sbi_t *sbi) {
+  sbi_bus_lock(sbi);
+  int c = uart_getchar(sbi->sim->uart);
+  sbi_bus_unlock(sbi);
+  return c;
+}
+
+// console write/read on guest physical memory
+static int sbi_console_rw(sbi_t *sbi, unsigned num_bytes, unsigned base_lo, unsigned base_hi, int is_write, unsigned *value) {
+  char buf[SBI_DBCN_BUF_SIZE];
+  unsigned done = 0;
+  if (base_hi != 0) {
+    return SBI_ERR_INVALID_PARAM;
+  }
+  while (done < num_bytes) {
+    unsigned len = num_bytes - done;
+    if (len > SBI_DBCN_BUF_SIZE) {
+      len = SBI_DBCN_BUF_SIZE;
+    }
+    sbi_bus_lock(sbi);
+    if (is_write) {
+      memory_cpy_from(sbi->sim->mem, MEMORY_ACCESS_DEVICE_ID_DMA, buf, base_lo + done, len);
+      for (unsigned i = 0; i < len; i++) {
+        uart_putchar(sbi->sim->uart, buf[i]);
+      }
+      sbi_bus_unlock(sbi);
+    } else {
+      unsigned n = 0;
+      int c;
+      for (; n < len && (c = uart_getchar(sbi->sim->uart)) >= 0; n++) {
+        buf[n] = (char)c;
+      }
+      memory_cpy_to(sbi->sim->mem, MEMORY_ACCESS_DEVICE_ID_DMA, base_lo + done, buf, n);
+      sbi_bus_unlock(sbi);
+      if (n < len) {
+        done += n;
+        break;
+      }
+    }
+    done += len;
+  }
+  *value = done;
+  return SBI_SUCCESS;
+}
+
+static unsigned sbi_pmu_counter_info(unsigned counter_idx, unsigned *value) {
+  if (counter_idx >= SBI_PMU_NUM_COUNTERS || counter_idx == 1) {
+    return SBI_ERR_INVALID_PARAM;
+  }
+  // hardware counter: CSR number, width - 1
+  *value = (CSR_ADDR_U_CYCLE + counter_idx) | (63 << 12);
+  return SBI_SUCCESS;
+}
+
+// the mhpmevent of an event_idx (0: not supported)
+static unsigned sbi_pmu_mhpmevent(unsigned event_idx, unsigned event_data) {
+  if (((event_idx >> 16) & 0xf) == SBI_PMU_EVENT_TYPE_RAW) {
+    return (event_data & ~CSR_HPM_EVENT_MASK) ? 0 : event_data;
+  }
+  for (unsigned i = 0; i < sbi_pmu_num_events; i++) {
+    if (sbi_pmu_events[i].event_idx == event_idx) {
+      return sbi_pmu_events[i].mhpmevent;
+    }
+  }
+  return 0;
+}
+
+static int sbi_pmu_config_matching(sbi_t *sbi, core_t *core, unsigned counter_idx_base, unsigned counter_idx_mask,
+                                   unsigned config_flags, unsigned event_idx, unsigned event_data, unsigned *value) {
+  sbi_hart_t *hart = &sbi->hart[core->csr->hart_id];
+  unsigned mask = (counter_idx_base < SBI_PMU_NUM_COUNTERS) ? counter_idx_mask << counter_idx_base : 0;
+  unsigned counter_idx = SBI_PMU_NUM_COUNTERS;
+  unsigned mhpmevent = 0;
+  if (config_flags & SBI_PMU_CFG_FLAG_SKIP_MATCH) {
+    // the counter configured before
+    for (counter_idx = 0; counter_idx < SBI_PMU_NUM_COUNTERS && !((mask >> counter_idx) & 1); counter_idx++);
+    if (counter_idx == SBI_PMU_NUM_COUNTERS || !((hart->pmu_used >> counter_idx) & 1)) {
+      return SBI_ERR_INVALID_PARAM;
+    }
+  } else if (event_idx == SBI_PMU_HW_CPU_CYCLES || event_idx == SBI_PMU_HW_INSTRUCTIONS) {
+    // the fixed counters
+    counter_idx = (event_idx == SBI_PMU_HW_CPU_CYCLES) ? 0 : 2;
+    if (!((mask & ~hart->pmu_used) >> counter_idx & 1)) {
+      return SBI_ERR_NOT_SUPPORTED;
+    }
+  } else {
+    mhpmevent = sbi_pmu_mhpmevent(event_idx, event_data);
+    if (mhpmevent == 0) {
+      return SBI_ERR_NOT_SUPPORTED;
+    }
+    for (counter_idx = 3; counter_idx < SBI_PMU_NUM_COUNTERS && !((mask & ~hart->pmu_used) >> counter_idx & 1); counter_idx++);
+    if (counter_idx == SBI_PMU_NUM_COUNTERS) {
+      return SBI_ERR_NOT_SUPPORTED;
+    }
+  }
+  unsigned inhibit = csr_csrr(core->csr, CSR_ADDR_M_COUNTINHIBIT, NULL);
+  if (!(config_flags & SBI_PMU_CFG_FLAG_SKIP_MATCH)) {
+    hart->pmu_used |= 1 << counter_idx;
+    if (counter_idx >= 3) {
+      csr_csrw(core->csr, CSR_ADDR_M_COUNTINHIBIT, inhibit | (1 << counter_idx), NULL);
+      csr_csrw(core->csr, CSR_ADDR_M_HPMEVENT3 + counter_idx - 3, mhpmevent, NULL);
+    }
+  }
+  if (config_flags & SBI_PMU_CFG_FLAG_CLEAR_VALUE) {
+    csr_csrw(core->csr, CSR_ADDR_M_CYCLE + counter_idx, 0, NULL);
+    csr_csrw(core->csr, CSR_ADDR_M_CYCLEH + counter_idx, 0, NULL);
+  }
+  if (config_flags & SBI_PMU_CFG_FLAG_AUTO_START) {
+    hart->pmu_started |= 1 << counter_idx;
+    inhibit = csr_csrr(core->csr, CSR_ADDR_M_COUNTINHIBIT, NULL);
+    csr_csrw(core->csr, CSR_ADDR_M_COUNTINHIBIT, inhibit & ~(1 << counter_idx), NULL);
+  }
+  *value = counter_idx;
+  return SBI_SUCCESS;
+}
+
+static int sbi_pmu_start_stop(sbi_t *sbi, core_t *core, unsigned counter_idx_base, unsigned counter_idx_mask,
+                              unsigned flags, int start, unsigned long long initial_value) {
+  sbi_hart_t *hart = &sbi->hart[core->csr->hart_id];
+  unsigned mask = (counter_idx_base < SBI_PMU_NUM_COUNTERS) ? counter_idx_mask << counter_idx_base : 0;
+  if (mask == 0 || (mask & ~hart->pmu_used)) {
+    return SBI_ERR_INVALID_PARAM;
+  }
+  // the others are still started (stopped, reset)
+  int error = SBI_SUCCESS;
+  if (start && (mask & hart->pmu_started)) {
+    error = SBI_ERR_ALREADY_STARTED;
+  } else if (!start && (mask & ~hart->pmu_started)) {
+    error = SBI_ERR_ALREADY_STOPPED;
+  }
+  unsigned inhibit = csr_csrr(core->csr, CSR_ADDR_M_COUNTINHIBIT, NULL);
+  for (unsigned i = 0; i < SBI_PMU_NUM_COUNTERS; i++) {
+    if (!((mask >> i) & 1)) {
+      continue;
+    }
+    if (start && (flags & SBI_PMU_START_FLAG_SET_INIT_VALUE)) {
+      csr_csrw(core->csr, CSR_ADDR_M_CYCLE + i, (unsigned)initial_value, NULL);
+      csr_csrw(core->csr, CSR_ADDR_M_CYCLEH + i, (unsigned)(initial_value >> 32), NULL);
+    }
+    if (!start && (flags & SBI_PMU_STOP_FLAG_RESET)) {
+      // released for the next counter_config_matching
+      hart->pmu_used &= ~(1 << i);
+      if (i >= 3) {
+        csr_csrw(core->csr, CSR_ADDR_M_HPMEVENT3 + i - 3, CSR_HPM_EVENT_NONE, NULL);
+      }
+    }
+  }
+  if (start) {
+    hart->pmu_started |= mask;
+    inhibit &= ~mask;
+  } else {
+    hart->pmu_started &= ~mask;
+    inhibit |= mask;
+  }
+  csr_csrw(core->csr, CSR_ADDR_M_COUNTINHIBIT, inhibit, NULL);
+  return error;
+}
+
+static int sbi_probe_extension(unsigned eid) {
+  switch (eid) {
+  case SBI_EXT_LEGACY_SET_TIMER:
+  case SBI_EXT_LEGACY_CONSOLE_PUTCHAR:
+  case SBI_EXT_LEGACY_CONSOLE_GETCHAR:
+  case SBI_EXT_LEGACY_SHUTDOWN:
+  case SBI_EXT_BASE:
+  case SBI_EXT_TIME:
+  case SBI_EXT_IPI:
+  case SBI_EXT_RFENCE:
+  case SBI_EXT_HSM:
+  case SBI_EXT_SRST:
+  case SBI_EXT_DBCN:
+  case SBI_EXT_PMU:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+void sbi_ecall(sbi_t *sbi, struct core_t *core) {
+  unsigned *a = &core->gpr[REG_A0];
+  unsigned eid = core->gpr[REG_A7];
+  unsigned fid = core->gpr[REG_A6];
+  unsigned hart_id = core->csr->hart_id;
+  int error = SBI_SUCCESS;
+  unsigned value = 0;
+  sbi_rfence_t req;
+  switch (eid) {
+  // legacy extensions return in a0 only
+  case SBI_EXT_LEGACY_SET_TIMER:
+    sbi_set_timer(core, ((unsigned long long)a[1] << 32) | a[0]);
+    a[0] = 0;
+    return;
+  case SBI_EXT_LEGACY_CONSOLE_PUTCHAR:
+    sbi_console_putchar(sbi, (char)a[0]);
+    a[0] = 0;
+    return;
+  case SBI_EXT_LEGACY_CONSOLE_GETCHAR:
+    a[0] = (unsigned)sbi_console_getchar(sbi);
+    return;
+  case SBI_EXT_LEGACY_SHUTDOWN:
+    sbi_shutdown(sbi);
+    return;
+  case SBI_EXT_BASE:
+    switch (fid) {
+    case 0: value = SBI_SPEC_VERSION; break;
+    case 1: value = SBI_IMPL_ID; break;
+    case 2: value = SBI_IMPL_VERSION; break;
+    case 3: value = sbi_probe_extension(a[0]); break;
+    case 4: value = csr_csrr(core->csr, CSR_ADDR_M_VENDORID, NULL); break;
+    case 5: value = csr_csrr(core->csr, CSR_ADDR_M_ARCHID, NULL); break;
+    case 6: value = csr_csrr(core->csr, CSR_ADDR_M_IMPID, NULL); break;
+    default: error = SBI_ERR_NOT_SUPPORTED; break;
+    }
+    break;
+  case SBI_EXT_TIME:
+    if (fid == 0) {
+      sbi_set_timer(core, ((unsigned long long)a[1] << 32) | a[0]);
+    } else {
+      error = SBI_ERR_NOT_SUPPORTED;
+    }
+    break;
+  case SBI_EXT_IPI:
+    if (fid == 0) {
+      error = sbi_send_ipi(sbi, a[0], a[1]);
+    } else {
+      error = SBI_ERR_NOT_SUPPORTED;
+    }
+    break;
+  case SBI_EXT_RFENCE:
+    memset(&req, 0, sizeof(req));
+    switch (fid) {
+    case 0:
+      req.fence = SBI_RFENCE_I;
+      error = sbi_remote_fence(sbi, hart_id, a[0], a[1], &req);
+      break;
+    case 1: // an address range
+    case 2: // an address range of an ASID
+      req.fence = SBI_RFENCE_VMA;
+      if (fid == 2) {
+        req.vma_flush = TLB_FLUSH_ASID;
+        req.vma_asid = a[4];
+      }
+      sbi_rfence_range(&req, a[2], a[3]);
+      error = sbi_remote_fence(sbi, hart_id, a[0], a[1], &req);
+      break;
+    default:
+      error = SBI_ERR_NOT_SUPPORTED;
+      break;
+    }
+    break;
+  case SBI_EXT_HSM:
+    switch (fid) {
+    case 0: // hart_start
+      error = sbi_hart_start(sbi, a[0], a[1], a[2]);
+      break;
+    case 1: // hart_stop
+      __atomic_store_n(&sbi->hart[hart_id].state, SBI_HSM_STOPPED, __ATOMIC_RELEASE);
+      break;
+    case 2: // hart_get_status
+      if (a[0] < sbi->sim->num_core) {
+        value = __atomic_load_n(&sbi->hart[a[0]].state, __ATOMIC_ACQUIRE);
+      } else {
+        error = SBI_ERR_INVALID_PARAM;
+      }
+      break;
+    default:
+      error = SBI_ERR_NOT_SUPPORTED;
+      break;
+    }
+    break;
+  case SBI_EXT_SRST:
+    if (fid == 0 && a[0] <= 2) {
+      // shutdown, cold reboot and warm reboot end the simulation
+      sbi_shutdown(sbi);
+    } else {
+      error = (fid == 0) ? SBI_ERR_INVALID_PARAM : SBI_ERR_NOT_SUPPORTED;
+    }
+    break;
+  case SBI_EXT_DBCN:
+    switch (fid) {
+    case 0: error = sbi_console_rw(sbi, a[0], a[1], a[2], 1, &value); break;
+    case 1: error = sbi_console_rw(sbi, a[0], a[1], a[2], 0, &value); break;
+    case 2: sbi_console_putchar(sbi, (char)a[0]); break;
+    default: error = SBI_ERR_NOT_SUPPORTED; break;
+    }
+    break;
+  case SBI_EXT_PMU:
+    switch (fid) {
+    case 0: value = SBI_PMU_NUM_COUNTERS; break;
+    case 1: error = sbi_pmu_counter_info(a[0], &value); break;
+    // RV32: event_data is a4 (a5: upper half)
+    case 2: error = sbi_pmu_config_matching(sbi, core, a[0], a[1], a[2], a[3], a[4], &value); break;
+    case 3: error = sbi_pmu_start_stop(sbi, core, a[0], a[1], a[2], 1, ((unsigned long long)a[4] << 32) | a[3]); break;
+    case 4: error = sbi_pmu_start_stop(sbi, core, a[0], a[1], a[2], 0, 0); break;
+    // no firmware counters
+    case 5:
+    case 6: error = SBI_ERR_INVALID_PARAM; break;
+    default: error = SBI_ERR_NOT_SUPPORTED; break;
+    }
+    break;
+  default:
+    error = SBI_ERR_NOT_SUPPORTED;
+    break;
+  }
+#if 0
+  fprintf(stderr, "SBI hart %u eid %08x fid %u error %d value %08x\n", hart_id, eid, fid, error, value);
+#endif
+  a[0] = (unsigned)error;
+  a[1] = value;
+}
+
+void sbi_hart_fence(sbi_t *sbi, unsigned hart_id) {
+  sbi_hart_t *hart = &sbi->hart[hart_id];
+  if (!__atomic_load_n(&hart->rfence.fence, __ATOMIC_ACQUIRE)) {
+    return;
+  }
+  mtx_lock(&hart->lock);
+  sbi_rfence_t req = hart->rfence;
+  unsigned seq = hart->rfence_seq;
+  hart->rfence.fence = 0;
+  mtx_unlock(&hart->lock);
+  sbi_apply_rfence(sbi, hart_id, &req);
+  __atomic_store_n(&hart->rfence_ack, seq, __ATOMIC_RELEASE);
+}
+
+int sbi_hart_idle(sbi_t *sbi, unsigned hart_id) {
+  sbi_hart_fence(sbi, hart_id);
+  return __atomic_load_n(&sbi->hart[hart_id].state, __ATOMIC_ACQUIRE) != SBI_HSM_STARTED;
+}
+
+void sbi_fini(sbi_t *sbi) {
+  for (unsigned i = 0; i < SIM_MAX_HART; i++) {
+    mtx_destroy(&sbi->hart[i].lock);
+  }
+}
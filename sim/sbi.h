@@ -0,0 +1,101 @@
+#ifndef SBI_H
+#define SBI_H
+
+#include "sim.h"
+#include <threads.h>
+
+// extension ids
+#define SBI_EXT_LEGACY_SET_TIMER 0x00
+#define SBI_EXT_LEGACY_CONSOLE_PUTCHAR 0x01
+#define SBI_EXT_LEGACY_CONSOLE_GETCHAR 0x02
+#define SBI_EXT_LEGACY_SHUTDOWN 0x08
+#define SBI_EXT_BASE 0x10
+#define SBI_EXT_TIME 0x54494d45 // "TIME"
+#define SBI_EXT_IPI 0x00735049  // "sPI"
+#define SBI_EXT_RFENCE 0x52464e43 // "RFNC"
+#define SBI_EXT_HSM 0x0048534d  // "HSM"
+#define SBI_EXT_SRST 0x53525354 // "SRST"
+#define SBI_EXT_DBCN 0x4442434e // "DBCN"
+#define SBI_EXT_PMU 0x00504d55  // "PMU"
+
+#define SBI_SUCCESS 0
+#define SBI_ERR_FAILED -1
+#define SBI_ERR_NOT_SUPPORTED -2
+#define SBI_ERR_INVALID_PARAM -3
+#define SBI_ERR_DENIED -4
+#define SBI_ERR_INVALID_ADDRESS -5
+#define SBI_ERR_ALREADY_AVAILABLE -6
+#define SBI_ERR_ALREADY_STARTED -7
+#define SBI_ERR_ALREADY_STOPPED -8
+
+#define SBI_SPEC_VERSION 0x02000000 // v2.0
+#define SBI_IMPL_ID 0x4c42 // "LB"
+#define SBI_IMPL_VERSION 1
+
+#define SBI_HSM_STARTED 0
+#define SBI_HSM_STOPPED 1
+#define SBI_HSM_START_PENDING 2 // taken by a hart_start, the hart is being set up
+
+// remote fences requested to a hart
+#define SBI_RFENCE_I 0x1
+#define SBI_RFENCE_VMA 0x2
+#define SBI_RFENCE_MAX_PAGES 64 // a larger range flushes the whole TLB (or the ASID)
+
+// PMU: counter_idx is the CSR number - cycle (0: cycle, 2: instret, 3..31: hpmcounter)
+#define SBI_PMU_NUM_COUNTERS 32
+#define SBI_PMU_EVENT_TYPE_HW 0x0
+#define SBI_PMU_EVENT_TYPE_CACHE 0x1
+#define SBI_PMU_EVENT_TYPE_RAW 0x2
+#define SBI_PMU_HW_CPU_CYCLES 0x1
+#define SBI_PMU_HW_INSTRUCTIONS 0x2
+#define SBI_PMU_CFG_FLAG_SKIP_MATCH 0x1
+#define SBI_PMU_CFG_FLAG_CLEAR_VALUE 0x2
+#define SBI_PMU_CFG_FLAG_AUTO_START 0x4
+#define SBI_PMU_START_FLAG_SET_INIT_VALUE 0x1
+#define SBI_PMU_STOP_FLAG_RESET 0x1
+
+// the SBI PMU events (event_idx) and their mhpmevent, also given to firmware by the device tree
+typedef struct sbi_pmu_event_t {
+  unsigned event_idx;
+  unsigned mhpmevent;
+} sbi_pmu_event_t;
+#define SBI_PMU_MAX_EVENTS 8 // the events in the device tree
+extern const sbi_pmu_event_t sbi_pmu_events[];
+extern const unsigned sbi_pmu_num_events;
+
+// a remote fence: SBI_RFENCE_VMA flushes TLB_FLUSH_xxx of the pages [vma_vaddr, + vma_pages)
+typedef struct sbi_rfence_t {
+  unsigned fence; // SBI_RFENCE_xxx
+  unsigned vma_flush;
+  unsigned vma_vaddr;
+  unsigned vma_pages;
+  unsigned vma_asid;
+} sbi_rfence_t;
+
+typedef struct sbi_hart_t {
+  unsigned state;  // SBI_HSM_xxx
+  sbi_rfence_t rfence; // pending, applied before the next instruction of the hart
+  unsigned rfence_seq; // requested
+  unsigned rfence_ack; // applied
+  mtx_t lock; // the pending fences
+  unsigned pmu_used; // the counters configured by counter_config_matching
+  unsigned pmu_started;
+} sbi_hart_t;
+
+// SBI implemented in the simulator: S-mode ecalls do not trap to M-mode firmware
+typedef struct sbi_t {
+  struct sim_t *sim;
+  sbi_hart_t hart[SIM_MAX_HART];
+  unsigned char threaded; // the harts run on their own threads, a remote fence waits for the targets
+} sbi_t;
+
+void sbi_init(sbi_t *, struct sim_t *);
+// an S-mode ecall of the core (a7: extension, a6: function), the results go to a0 and a1
+void sbi_ecall(sbi_t *, struct core_t *);
+// applies the pending remote fences, returns 1 while the hart is stopped (or start pending)
+int sbi_hart_idle(sbi_t *, unsigned hart_id);
+// applies the pending remote fences only (a hart waiting for the others)
+void sbi_hart_fence(sbi_t *, unsigned hart_id);
+void sbi_fini(sbi_t *);
+
+#endif
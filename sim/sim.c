@@ -5,18 +5,309 @@
 #include "lsu.h"
 #include "memory.h"
 #include "mmio.h"
+#include "p9fs.h"
+#include "vnet.h"
 #include "plic.h"
 #include "trigger.h"
+#include "fdt.h"
+#include "sbi.h"
+#include "regstat.h"
+#include "prof.h"
+#include "procstat.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #define MAX_DBG_HANDLER 10
 
-void sim_dtb_on(sim_t *sim, const char *dtb_path) {
+// parallel mode, the harts meet at a barrier after each quantum
+typedef struct sim_parallel_t {
+  unsigned count;      // harts arrived
+  unsigned generation; // quanta done
+  unsigned char stop;
+  // waiting for the others: spinning first, then yielding the host cpu
+  unsigned spin;
+} sim_parallel_t;
+
+#define SIM_PARALLEL_SPIN 1000
+
+// RISC-V Linux Image header (Documentation/riscv/boot-image-header.rst)
+#define IMAGE_HEADER_SIZE 64
+#define IMAGE_TEXT_OFFSET 8
+#define IMAGE_SIZE 16
+#define IMAGE_MAGIC 48  // "RISCV\0\0\0" (deprecated)
+#define IMAGE_MAGIC2 56 // "RSC\x05"
+// the DTB is copied to the last DEVTREE_ROM_SIZE of RAM, the initrd is placed below
+#define BOOT_DTB_ADDR (MEMORY_BASE_ADDR_RAM + RAM_SIZE - DEVTREE_ROM_SIZE)
+
+// copies a file to RAM, returns its size or -1
+static int sim_load_file(sim_t *sim, FILE *fp, unsigned addr) {
+  char buf[64 * 1024];
+  size_t len;
+  unsigned total = 0;
+  while ((len = fread(buf, sizeof(char), sizeof(buf), fp)) > 0) {
+    memory_cpy_to(sim->mem, MEMORY_ACCESS_DEVICE_ID_DMA, addr + total, buf, len);
+    total += len;
+  }
+  return ferror(fp) ? -1 : (int)total;
+}
+
+static long sim_file_size(FILE *fp) {
+  long size;
+  if (fseek(fp, 0, SEEK_END) != 0 || (size = ftell(fp)) < 0 || fseek(fp, 0, SEEK_SET) != 0) {
+    return -1;
+  }
+  return size;
+}
+
+int sim_dtb_on(sim_t *sim, const char *dtb_path) {
+  FILE *fp = fopen(dtb_path, "rb");
+  long size = fp ? sim_file_size(fp) : -1;
+  int ret = -1;
+  if (size < 0 || size > DEVTREE_ROM_SIZE) {
+    fprintf(stderr, "invalid device tree: %s\n", dtb_path);
+  } else if (sim->image_end) {
+    if (sim_load_file(sim, fp, BOOT_DTB_ADDR) < 0) {
+      fprintf(stderr, "invalid device tree: %s\n", dtb_path);
+    } else {
+      sim->dtb_addr = BOOT_DTB_ADDR;
+      ret = 0;
+    }
+  } else {
+    // the rest of the rom reads as zero
+    char *rom = (char *)calloc(DEVTREE_ROM_SIZE, sizeof(char));
+    if (fread(rom, sizeof(char), size, fp) != (size_t)size) {
+      fprintf(stderr, "invalid device tree: %s\n", dtb_path);
+    } else {
+      sim->dtb_rom = (sram_t *)malloc(sizeof(sram_t));
+      sram_init_with_str(sim->dtb_rom, rom, DEVTREE_ROM_SIZE);
+      memory_add_target(sim->mem, (struct memory_target_t *)sim->dtb_rom, DEVTREE_ROM_ADDR, DEVTREE_ROM_SIZE);
+      ret = 0;
+    }
+    free(rom);
+  }
+  if (fp) {
+    fclose(fp);
+  }
+  return ret;
+}
+
+int sim_dtb_generate(sim_t *sim, const char *bootargs) {
+  fdt_t fdt;
+  char buf[256];
+  char default_bootargs[128];
+  unsigned cells[4 * SIM_MAX_HART];
+  unsigned intc[SIM_MAX_HART];
+  unsigned plic_phandle = 0;
+  unsigned l2_phandle = 0;
+  unsigned is_disk = 0;
+  unsigned is_console = 0;
+  for (unsigned i = 0; i < sim->num_virtio; i++) {
+    is_disk |= (sim->virtio[i]->device_id == VIRTIO_MMIO_DEVICE_BLOCK);
+    is_console |= (sim->virtio[i]->device_id == VIRTIO_MMIO_DEVICE_CONSOLE);
+  }
+  if (bootargs == NULL) {
+    snprintf(default_bootargs, sizeof(default_bootargs), "console=%s%s",
+             is_console ? "hvc0" : "ttyS0", is_disk ? " ro root=/dev/vda" : "");
+    bootargs = default_bootargs;
+  }
+  fdt_init(&fdt);
+  fdt_begin_node(&fdt, "");
+  fdt_prop_u32(&fdt, "#address-cells", 1);
+  fdt_prop_u32(&fdt, "#size-cells", 1);
+  fdt_prop_str(&fdt, "model", "RISC-Vシミュレーターですの！,よろしくって？");
+  // phandles: cpu interrupt controllers first, then the plic
+  for (unsigned i = 0; i < sim->num_core; i++) {
+    intc[i] = i + 1;
+  }
+  plic_phandle = sim->num_core + 1;
+  l2_phandle = sim->num_core + 2;
+  /// chosen
+  fdt_begin_node(&fdt, "chosen");
+  fdt_prop_str(&fdt, "bootargs", bootargs);
+  sprintf(buf, "/serial@%x", MEMORY_BASE_ADDR_UART);
+  fdt_prop_str(&fdt, "stdout-path", buf);
+  if (sim->initrd_end) {
+    fdt_prop_u32(&fdt, "linux,initrd-start", sim->initrd_start);
+    fdt_prop_u32(&fdt, "linux,initrd-end", sim->initrd_end);
+  }
+  fdt_end_node(&fdt);
+  /// attached virtio-mmio devices
+  for (unsigned i = 0; i < sim->num_virtio; i++) {
+    sprintf(buf, "virtio@%x", MEMORY_BASE_ADDR_VIRTIO(i));
+    fdt_begin_node(&fdt, buf);
+    fdt_prop_str(&fdt, "compatible", "virtio,mmio");
+    fdt_prop_u32(&fdt, "interrupt-parent", plic_phandle);
+    fdt_prop_u32(&fdt, "interrupts", PLIC_VIRTIO_MMIO_IRQ(i));
+    cells[0] = MEMORY_BASE_ADDR_VIRTIO(i);
+    cells[1] = sim->virtio[i]->base.base.size;
+    fdt_prop_cells(&fdt, "reg", cells, 2);
+    fdt_end_node(&fdt);
+  }
+  /// uart
+  sprintf(buf, "serial@%x", MEMORY_BASE_ADDR_UART);
+  fdt_begin_node(&fdt, buf);
+  fdt_prop_u32(&fdt, "clock-frequency", 0x384000);
+  fdt_prop_str(&fdt, "compatible", "ns16550a");
+  fdt_prop_u32(&fdt, "current-speed", 115200);
+  fdt_prop_str(&fdt, "device_type", "serial");
+  fdt_prop_u32(&fdt, "interrupt-parent", plic_phandle);
+  fdt_prop_u32(&fdt, "interrupts", PLIC_UART_IRQ_NO);
+  cells[0] = MEMORY_BASE_ADDR_UART;
+  cells[1] = sim->uart->base.base.size;
+  fdt_prop_cells(&fdt, "reg", cells, 2);
+  fdt_prop_u32(&fdt, "reg-shift", 0);
+  fdt_end_node(&fdt);
+  /// harts
+  fdt_begin_node(&fdt, "cpus");
+  fdt_prop_u32(&fdt, "#address-cells", 1);
+  fdt_prop_u32(&fdt, "#size-cells", 0);
+  fdt_prop_u32(&fdt, "timebase-frequency", ACLINT_TIMEBASE_FREQ);
+  // riscv,isa is lower case
+  unsigned len = 0;
+  for (const char *isa = riscv_get_extension_string(); *isa && len < sizeof(buf) - 1; isa++) {
+    buf[len++] = (*isa >= 'A' && *isa <= 'Z') ? (*isa - 'A' + 'a') : *isa;
+  }
+  buf[len] = '\0';
+  for (unsigned i = 0; i < sim->num_core; i++) {
+    const lsu_t *lsu = sim->core[i]->lsu;
+    char name[32];
+    sprintf(name, "cpu@%x", i);
+    fdt_begin_node(&fdt, name);
+    fdt_prop_str(&fdt, "device_type", "cpu");
+    fdt_prop_u32(&fdt, "i-cache-size", lsu->icache->line_len * lsu->icache->line_size);
+    fdt_prop_u32(&fdt, "i-cache-sets", lsu->icache->index_mask + 1);
+    fdt_prop_u32(&fdt, "i-cache-line-size", lsu->icache->line_len);
+    fdt_prop_u32(&fdt, "d-cache-size", lsu->dcache->line_len * lsu->dcache->line_size);
+    fdt_prop_u32(&fdt, "d-cache-sets", lsu->dcache->index_mask + 1);
+    fdt_prop_u32(&fdt, "d-cache-line-size", lsu->dcache->line_len);
+    if (sim->mem->l2) {
+      fdt_prop_u32(&fdt, "next-level-cache", l2_phandle);
+    }
+    fdt_prop_str(&fdt, "compatible", "riscv");
+    fdt_prop_str(&fdt, "mmu-type", "riscv,sv32");
+    fdt_prop_u32(&fdt, "clock-frequency", SIM_CLOCK_FREQ);
+    fdt_prop_u32(&fdt, "reg", i);
+    fdt_prop_str(&fdt, "riscv,isa", buf);
+    fdt_prop_str(&fdt, "status", "okay");
+    fdt_begin_node(&fdt, "interrupt-controller");
+    fdt_prop_u32(&fdt, "#interrupt-cells", 1);
+    fdt_prop_str(&fdt, "compatible", "riscv,cpu-intc");
+    fdt_prop(&fdt, "interrupt-controller", NULL, 0);
+    fdt_phandle(&fdt);
+    fdt_end_node(&fdt);
+    fdt_end_node(&fdt);
+  }
+  fdt_end_node(&fdt);
+  /// plic: M and S mode external interrupts of each hart
+  sprintf(buf, "interrupt-controller@%x", MEMORY_BASE_ADDR_PLIC);
+  fdt_begin_node(&fdt, buf);
+  fdt_prop_str(&fdt, "compatible", "riscv,plic0");
+  fdt_prop_u32(&fdt, "#interrupt-cells", 1);
+  fdt_prop(&fdt, "interrupt-controller", NULL, 0);
+  for (unsigned i = 0; i < sim->num_core; i++) {
+    cells[4 * i + 0] = intc[i];
+    cells[4 * i + 1] = CSR_INT_MEI_FIELD;
+    cells[4 * i + 2] = intc[i];
+    cells[4 * i + 3] = CSR_INT_SEI_FIELD;
+  }
+  fdt_prop_cells(&fdt, "interrupts-extended", cells, 4 * sim->num_core);
+  fdt_prop_u32(&fdt, "riscv,ndev", PLIC_MAX_IRQ);
+  cells[0] = MEMORY_BASE_ADDR_PLIC;
+  cells[1] = sim->plic->base.base.size;
+  fdt_prop_cells(&fdt, "reg", cells, 2);
+  fdt_phandle(&fdt);
+  fdt_end_node(&fdt);
+  /// shared L2 (after the plic, keeping the phandles above)
+  if (sim->mem->l2) {
+    const cache_t *l2 = sim->mem->l2;
+    fdt_begin_node(&fdt, "l2-cache");
+    fdt_prop_str(&fdt, "compatible", "cache");
+    fdt_prop_u32(&fdt, "cache-level", 2);
+    fdt_prop(&fdt, "cache-unified", NULL, 0);
+    fdt_prop_u32(&fdt, "cache-size", l2->line_len * l2->line_size);
+    fdt_prop_u32(&fdt, "cache-sets", l2->index_mask + 1);
+    fdt_prop_u32(&fdt, "cache-line-size", l2->line_len);
+    fdt_phandle(&fdt);
+    fdt_end_node(&fdt);
+  }
+  /// ram
+  sprintf(buf, "memory@%x", MEMORY_BASE_ADDR_RAM);
+  fdt_begin_node(&fdt, buf);
+  fdt_prop_str(&fdt, "device_type", "memory");
+  cells[0] = MEMORY_BASE_ADDR_RAM;
+  cells[1] = sim->dram->base.size;
+  fdt_prop_cells(&fdt, "reg", cells, 2);
+  fdt_end_node(&fdt);
+  /// aclint: software and timer interrupts of each hart
+  sprintf(buf, "clint@%x", MEMORY_BASE_ADDR_ACLINT);
+  fdt_begin_node(&fdt, buf);
+  fdt_prop_str(&fdt, "compatible", "riscv,clint0");
+  for (unsigned i = 0; i < sim->num_core; i++) {
+    cells[4 * i + 0] = intc[i];
+    cells[4 * i + 1] = CSR_INT_MSI_FIELD;
+    cells[4 * i + 2] = intc[i];
+    cells[4 * i + 3] = CSR_INT_MTI_FIELD;
+  }
+  fdt_prop_cells(&fdt, "interrupts-extended", cells, 4 * sim->num_core);
+  cells[0] = MEMORY_BASE_ADDR_ACLINT;
+  cells[1] = sim->aclint->base.base.size;
+  fdt_prop_cells(&fdt, "reg", cells, 2);
+  fdt_end_node(&fdt);
+  fdt_begin_node(&fdt, "htif");
+  fdt_prop_str(&fdt, "compatible", "ucb,htif0");
+  fdt_end_node(&fdt);
+  /// pmu: the SBI PMU events of firmware (mhpmevent selects any counter 3..31)
+  if (sim->sbi) {
+    fdt_begin_node(&fdt, "pmu");
+    fdt_prop_str(&fdt, "compatible", "riscv,pmu");
+    unsigned pmu_cells[3 * SBI_PMU_MAX_EVENTS];
+    for (unsigned i = 0; i < sbi_pmu_num_events; i++) {
+      pmu_cells[3 * i + 0] = sbi_pmu_events[i].event_idx;
+      pmu_cells[3 * i + 1] = 0;
+      pmu_cells[3 * i + 2] = sbi_pmu_events[i].mhpmevent;
+    }
+    fdt_prop_cells(&fdt, "riscv,event-to-mhpmevent", pmu_cells, 3 * sbi_pmu_num_events);
+    for (unsigned i = 0; i < sbi_pmu_num_events; i++) {
+      pmu_cells[3 * i + 0] = sbi_pmu_events[i].event_idx;
+      pmu_cells[3 * i + 1] = sbi_pmu_events[i].event_idx;
+      pmu_cells[3 * i + 2] = 0xfffffff8;
+    }
+    fdt_prop_cells(&fdt, "riscv,event-to-mhpmcounters", pmu_cells, 3 * sbi_pmu_num_events);
+    // raw events: mhpmevent itself
+    pmu_cells[0] = 0;
+    pmu_cells[1] = 0;
+    pmu_cells[2] = 0xffffffff;
+    pmu_cells[3] = ~CSR_HPM_EVENT_MASK;
+    pmu_cells[4] = 0xfffffff8;
+    fdt_prop_cells(&fdt, "riscv,raw-event-to-mhpmcounters", pmu_cells, 5);
+    fdt_end_node(&fdt);
+  }
+  fdt_end_node(&fdt);
+
+  char *blob = NULL;
+  unsigned size = fdt_finish(&fdt, &blob);
+  fdt_fini(&fdt);
+  if (size > DEVTREE_ROM_SIZE) {
+    fprintf(stderr, "device tree exceeds the rom: %u bytes\n", size);
+    free(blob);
+    return -1;
+  }
+  if (sim->image_end) {
+    // direct boot: in RAM, the kernel reserves it early
+    memory_cpy_to(sim->mem, MEMORY_ACCESS_DEVICE_ID_DMA, BOOT_DTB_ADDR, blob, size);
+    sim->dtb_addr = BOOT_DTB_ADDR;
+    free(blob);
+    return 0;
+  }
+  char *rom = (char *)calloc(DEVTREE_ROM_SIZE, sizeof(char));
+  memcpy(rom, blob, size);
+  free(blob);
   sim->dtb_rom = (sram_t *)malloc(sizeof(sram_t));
-  sram_init_with_file(sim->dtb_rom, dtb_path, MEMORY_SRAM_MODE_READ_ONLY);
+  sram_init_with_str(sim->dtb_rom, rom, DEVTREE_ROM_SIZE);
   memory_add_target(sim->mem, (struct memory_target_t *)sim->dtb_rom, DEVTREE_ROM_ADDR, DEVTREE_ROM_SIZE);
+  free(rom);
+  return 0;
 }
 
 void sim_config_on(sim_t *sim) {
@@ -38,8 +329,33 @@ void sim_config_on(sim_t *sim) {
   free(config_rom);
 }
 
+// the traps of S/U mode go to S mode, except the SBI calls
+static void sim_sbi_hart(sim_t *sim, unsigned hart_id) {
+  core_t *core = sim->core[hart_id];
+  core->sbi = sim->sbi;
+  core->csr->medeleg = 0x0000ffff & ~((1 << TRAP_CODE_ENVIRONMENT_CALL_S) | (1 << TRAP_CODE_ENVIRONMENT_CALL_M));
+  core->csr->mideleg = CSR_INT_SSI | CSR_INT_STI | CSR_INT_SEI;
+  // the counters are readable in S mode (as the firmware would do)
+  core->csr->mcounteren = 0xffffffff;
+}
+
+void sim_sbi_on(sim_t *sim) {
+  if (sim->sbi) {
+    return;
+  }
+  sim->sbi = (sbi_t *)malloc(sizeof(sbi_t));
+  sbi_init(sim->sbi, sim);
+  for (unsigned i = 0; i < sim->num_core; i++) {
+    sim_sbi_hart(sim, i);
+  }
+}
+
 void sim_add_core(sim_t *sim) {
   unsigned hart_id = sim->num_core;
+  if (hart_id >= SIM_MAX_HART) {
+    fprintf(stderr, "exceeds harts: %u\n", SIM_MAX_HART);
+    return;
+  }
   if (sim->core) {
     sim->core = (core_t **)realloc(sim->core, (hart_id + 1) * sizeof(core_t *));
   } else {
@@ -48,6 +364,22 @@ void sim_add_core(sim_t *sim) {
   sim->core[hart_id] = (core_t *)malloc(sizeof(core_t));
   core_init(sim->core[hart_id], hart_id, sim->mem, sim->plic, sim->aclint, sim->trigger);
   ++sim->num_core;
+  if (hart_id > 0) {
+    // the same TLBs as hart 0
+    lsu_t *lsu = sim->core[0]->lsu;
+    lsu_tlb_config(sim->core[hart_id]->lsu, lsu->itlb->line_size, lsu->itlb->ways, lsu->itlb->replace, lsu->dtlb != lsu->itlb);
+    // and caches
+    cache_config_t icache, dcache;
+    cache_get_config(lsu->icache, &icache);
+    cache_get_config(lsu->dcache, &dcache);
+    lsu_cache_config(sim->core[hart_id]->lsu, &icache, &dcache);
+  }
+  if (sim->parallel) {
+    lsu_direct_on(sim->core[hart_id]->lsu);
+  }
+  if (sim->sbi) {
+    sim_sbi_hart(sim, hart_id);
+  }
   plic_add_hart(sim->plic);
   aclint_add_hart(sim->aclint);
 }
@@ -66,16 +398,31 @@ void sim_init(sim_t *sim) {
   sim->uart = (uart_t *)malloc(sizeof(uart_t));
   uart_init(sim->uart);
   memory_add_target(sim->mem, (struct memory_target_t *)sim->uart, MEMORY_BASE_ADDR_UART, sim->uart->base.base.size);
-  /// disk
-  sim->disk = (disk_t *)malloc(sizeof(disk_t));
-  disk_init(sim->disk);
-  sim->disk->mem = sim->mem; // for DMA
-  memory_add_target(sim->mem, (struct memory_target_t *)sim->disk, MEMORY_BASE_ADDR_DISK, sim->disk->base.base.size);
+  /// virtio-mmio slots (devices are attached by sim_virtio_xxx)
+  sim->virtio = (virtio_t **)calloc(VIRTIO_MMIO_MAX_DEVICES, sizeof(virtio_t *));
+  sim->num_virtio = 0;
+  for (unsigned i = 0; i < VIRTIO_MMIO_MAX_DEVICES; i++) {
+    sim->virtio[i] = (virtio_t *)malloc(sizeof(virtio_t));
+    virtio_init(sim->virtio[i], sim->mem);
+    memory_add_target(sim->mem, (struct memory_target_t *)sim->virtio[i], MEMORY_BASE_ADDR_VIRTIO(i), sim->virtio[i]->base.base.size);
+  }
+  sim->net_switch = NULL;
+  sim->parallel = NULL;
+  sim->sbi = NULL;
+  sim->image_end = 0;
+  sim->initrd_start = 0;
+  sim->initrd_end = 0;
+  sim->dtb_addr = DEVTREE_ROM_ADDR;
+  sim->quantum = 1;
+  sim->sched = 0;
+  sim->sched_seed = 1;
   /// platform level interrupt controller
   sim->plic = (plic_t *)malloc(sizeof(plic_t));
   plic_init(sim->plic);
   plic_set_peripheral(sim->plic, (struct mmio_t *)sim->uart, PLIC_UART_IRQ_NO);
-  plic_set_peripheral(sim->plic, (struct mmio_t *)sim->disk, PLIC_VIRTIO_MMIO_IRQ_NO);
+  for (unsigned i = 0; i < VIRTIO_MMIO_MAX_DEVICES; i++) {
+    plic_set_peripheral(sim->plic, (struct mmio_t *)sim->virtio[i], PLIC_VIRTIO_MMIO_IRQ(i));
+  }
   memory_add_target(sim->mem, (struct memory_target_t *)sim->plic, MEMORY_BASE_ADDR_PLIC, sim->plic->base.base.size);
   /// core local interrupt module
   sim->aclint = (aclint_t *)malloc(sizeof(aclint_t));
@@ -114,6 +461,8 @@ void sim_init(sim_t *sim) {
   sim->htif_tohost = 0;
   sim->htif_fromhost = 0;
   sim->selected_hart = 0;
+  sim->prof = NULL;
+  sim->procstat = NULL;
   return;
 }
 
@@ -153,9 +502,128 @@ int sim_load_elf(sim_t *sim, const char *elf_path) {
   return ret;
 }
 
+static unsigned sim_image_u32(const unsigned char *header, unsigned offs) {
+  return header[offs] | (header[offs + 1] << 8) | (header[offs + 2] << 16) | ((unsigned)header[offs + 3] << 24);
+}
+
+int sim_load_image(sim_t *sim, const char *image_path) {
+  int ret = -1;
+  unsigned char header[IMAGE_HEADER_SIZE];
+  FILE *fp = fopen(image_path, "rb");
+  if (fp == NULL) {
+    return 1;
+  }
+  if (fread(header, sizeof(char), IMAGE_HEADER_SIZE, fp) != IMAGE_HEADER_SIZE ||
+      (memcmp(&header[IMAGE_MAGIC], "RISCV\0\0\0", 8) != 0 && memcmp(&header[IMAGE_MAGIC2], "RSC\x05", 4) != 0)) {
+    ret = 1;
+    goto cleanup;
+  }
+  // loaded at text_offset from the start of RAM (4MiB on RV32, a megapage)
+  unsigned text_offset = sim_image_u32(header, IMAGE_TEXT_OFFSET);
+  unsigned image_size = sim_image_u32(header, IMAGE_SIZE); // including bss
+  long file_size = sim_file_size(fp);
+  // the bss past the end of the file must not overlap the initrd and the DTB either
+  long load_size = ((long)image_size > file_size) ? (long)image_size : file_size;
+  if (file_size < 0 || text_offset >= RAM_SIZE - DEVTREE_ROM_SIZE || sim_image_u32(header, IMAGE_SIZE + 4) != 0 ||
+      load_size > RAM_SIZE - DEVTREE_ROM_SIZE - text_offset) {
+    fprintf(stderr, "Image does not fit in RAM: %s\n", image_path);
+    goto cleanup;
+  }
+  unsigned entry = MEMORY_BASE_ADDR_RAM + text_offset;
+  if (sim_load_file(sim, fp, entry) != file_size) {
+    goto cleanup;
+  }
+  sim->image_end = entry + (unsigned)load_size;
+  // a0: hart id, a1: DTB (see launch_sim), satp 0, the other harts wait for hart_start
+  for (unsigned i = 0; i < sim->num_core; i++) {
+    sim->core[i]->csr->pc = entry;
+  }
+  sim_sbi_on(sim);
+  sim_write_csr(sim, CSR_ADDR_D_PC, entry);
+  sim_write_csr(sim, CSR_ADDR_D_CSR, (sim_read_csr(sim, CSR_ADDR_D_CSR) & 0xfffffffc) | PRIVILEGE_MODE_S);
+  ret = 0;
+ cleanup:
+  fclose(fp);
+  return ret;
+}
+
+int sim_load_initrd(sim_t *sim, const char *initrd_path) {
+  int ret = -1;
+  FILE *fp = fopen(initrd_path, "rb");
+  if (fp == NULL) {
+    return -1;
+  }
+  long size = sim_file_size(fp);
+  unsigned lowest = sim->image_end ? sim->image_end : MEMORY_BASE_ADDR_RAM;
+  if (size < 0 || size > BOOT_DTB_ADDR - lowest) {
+    fprintf(stderr, "initrd does not fit in RAM: %s\n", initrd_path);
+    goto cleanup;
+  }
+  // page aligned, just below the DTB
+  unsigned start = (BOOT_DTB_ADDR - size) & ~RAM_PAGE_OFFS_MASK;
+  if (start < lowest || sim_load_file(sim, fp, start) != size) {
+    goto cleanup;
+  }
+  sim->initrd_start = start;
+  sim->initrd_end = start + size;
+  ret = 0;
+ cleanup:
+  fclose(fp);
+  return ret;
+}
+
 void sim_regstat_en(sim_t *sim) {
+  // the events of mhpmcounter3..24 read by the statistics (a guest may select others)
+  static const unsigned events[] = {
+    CSR_HPM_EVENT_REG_READ, CSR_HPM_EVENT_REG_READ_SKIP, CSR_HPM_EVENT_REG_WRITE, CSR_HPM_EVENT_REG_WRITE_SKIP,
+    CSR_HPM_EVENT_ICACHE_ACCESS, CSR_HPM_EVENT_ICACHE_HIT, CSR_HPM_EVENT_DCACHE_ACCESS, CSR_HPM_EVENT_DCACHE_HIT,
+    CSR_HPM_EVENT_TLB_ACCESS, CSR_HPM_EVENT_TLB_HIT,
+    CSR_HPM_EVENT_WIDTH4, CSR_HPM_EVENT_WIDTH8, CSR_HPM_EVENT_WIDTH16, CSR_HPM_EVENT_WIDTH24, CSR_HPM_EVENT_WIDTH32,
+    CSR_HPM_EVENT_ICACHE_MISS, CSR_HPM_EVENT_DCACHE_MISS, CSR_HPM_EVENT_DCACHE_WRITE_BACK,
+    CSR_HPM_EVENT_TLB_MISS, CSR_HPM_EVENT_PAGE_WALK, CSR_HPM_EVENT_L2_ACCESS, CSR_HPM_EVENT_L2_MISS,
+  };
+  static const regstat_config_t config = REGSTAT_CONFIG_DEFAULT;
   for (unsigned i = 0; i < sim->num_core; i++) {
     sim->core[i]->csr->regstat_en = 1;
+    if (sim->core[i]->csr->regstat == NULL) {
+      // the default analysis feeds the skip events
+      sim->core[i]->csr->regstat = (regstat_t *)malloc(sizeof(regstat_t));
+      regstat_init(sim->core[i]->csr->regstat);
+      regstat_add_config(sim->core[i]->csr->regstat, &config);
+    }
+    for (unsigned j = 0; j < sizeof(events) / sizeof(events[0]); j++) {
+      csr_csrw(sim->core[i]->csr, CSR_ADDR_M_HPMEVENT3 + j, events[j], NULL);
+    }
+  }
+}
+
+int sim_regstat_config(sim_t *sim, const regstat_config_t *config) {
+  int ret = -1;
+  for (unsigned i = 0; i < sim->num_core; i++) {
+    if (sim->core[i]->csr->regstat == NULL) {
+      return -1;
+    }
+    ret = regstat_add_config(sim->core[i]->csr->regstat, config);
+  }
+  return ret;
+}
+
+void sim_regstat_sum(sim_t *sim, regstat_t *sum) {
+  regstat_init(sum);
+  for (unsigned i = 0; i < sim->num_core; i++) {
+    regstat_t *regstat = sim->core[i]->csr->regstat;
+    if (regstat == NULL) {
+      continue;
+    }
+    sum->num_config = regstat->num_config;
+    for (unsigned c = 0; c < regstat->num_config; c++) {
+      sum->config[c] = regstat->config[c];
+      sum->read_skip[c] += regstat->read_skip[c];
+      sum->write_skip[c] += regstat->write_skip[c];
+    }
+    sum->num_inst += regstat->num_inst;
+    sum->read += regstat->read;
+    sum->write += regstat->write;
   }
 }
 
@@ -171,14 +639,25 @@ void sim_fini(sim_t *sim) {
   if (sim->config_rom) sram_fini(sim->config_rom);
   free(sim->config_rom);
   free(sim->core);
+  if (sim->mem->l2) {
+    cache_fini(sim->mem->l2);
+    free(sim->mem->l2);
+  }
   memory_fini(sim->mem);
   free(sim->mem);
   trig_fini(sim->trigger);
   free(sim->trigger);
   uart_fini(sim->uart);
   free(sim->uart);
-  disk_fini(sim->disk);
-  free(sim->disk);
+  for (unsigned i = 0; i < VIRTIO_MMIO_MAX_DEVICES; i++) {
+    virtio_fini(sim->virtio[i]);
+    free(sim->virtio[i]);
+  }
+  free(sim->virtio);
+  if (sim->net_switch) {
+    vnet_switch_fini(sim->net_switch);
+    free(sim->net_switch);
+  }
   plic_fini(sim->plic);
   free(sim->plic);
   for (int i = 0; i < NUM_REGISTERS; i++) {
@@ -186,6 +665,11 @@ void sim_fini(sim_t *sim) {
   }
   free(sim->reginfo);
   free(sim->dbg_handler);
+  free(sim->parallel);
+  if (sim->sbi) {
+    sbi_fini(sim->sbi);
+    free(sim->sbi);
+  }
   return;
 }
 
@@ -209,22 +693,256 @@ void sim_set_step_callback_arg(sim_t *sim, void *arg) {
   sim->stp_arg = arg;
 }
 
+void sim_prof_on(sim_t *sim, prof_t *prof) {
+  sim->prof = prof;
+}
+
+void sim_procstat_on(sim_t *sim, procstat_t *procstat) {
+  sim->procstat = procstat;
+}
+
+void sim_parallel_on(sim_t *sim, unsigned quantum) {
+  if (sim->parallel == NULL) {
+    sim->parallel = (sim_parallel_t *)calloc(1, sizeof(sim_parallel_t));
+  }
+  sim->quantum = quantum ? quantum : SIM_PARALLEL_QUANTUM;
+  // devices are shared by the hart threads, RAM is accessed in place
+  sim->mem->bus_lock_en = 1;
+  for (unsigned i = 0; i < sim->num_core; i++) {
+    lsu_direct_on(sim->core[i]->lsu);
+  }
+}
+
+int sim_tlb_config(sim_t *sim, unsigned entries, unsigned ways, unsigned replace, unsigned split) {
+  // powers of 2, up to 32 ways (the tree bits of a set in a word)
+  if (entries == 0 || (entries & (entries - 1)) || ways == 0 || (ways & (ways - 1)) || ways > entries || ways > 32) {
+    fprintf(stderr, "invalid TLB: %u entries %u ways\n", entries, ways);
+    return -1;
+  }
+  for (unsigned i = 0; i < sim->num_core; i++) {
+    lsu_tlb_config(sim->core[i]->lsu, entries, ways, replace, split);
+  }
+  return 0;
+}
+
+static int sim_cache_check(const char *name, const cache_config_t *config) {
+  // powers of 2, up to 32 ways (the tree bits of a set in a word)
+  if (config->line_len < 8 || config->line_len > RAM_PAGE_SIZE || (config->line_len & (config->line_len - 1)) ||
+      config->sets == 0 || (config->sets & (config->sets - 1)) ||
+      config->ways == 0 || (config->ways & (config->ways - 1)) || config->ways > 32 ||
+      config->replace > CACHE_REPLACE_FIFO) {
+    fprintf(stderr, "invalid %s: %u sets %u ways %u byte/line\n", name, config->sets, config->ways, config->line_len);
+    return -1;
+  }
+  return 0;
+}
+
+int sim_cache_config(sim_t *sim, const cache_config_t *icache, const cache_config_t *dcache, const cache_config_t *l2) {
+  if (sim_cache_check("icache", icache) || sim_cache_check("dcache", dcache) || (l2 && sim_cache_check("L2", l2))) {
+    return -1;
+  }
+  if (l2 && (l2->line_len < icache->line_len || l2->line_len < dcache->line_len)) {
+    // an L1 line is in one L2 line
+    fprintf(stderr, "L2 line is shorter than L1: %u byte\n", l2->line_len);
+    return -1;
+  }
+  for (unsigned i = 0; i < sim->num_core; i++) {
+    lsu_cache_config(sim->core[i]->lsu, icache, dcache);
+  }
+  if (sim->mem->l2) {
+    cache_fini(sim->mem->l2);
+    free(sim->mem->l2);
+    sim->mem->l2 = NULL;
+  }
+  if (l2) {
+    sim->mem->l2 = (cache_t *)malloc(sizeof(cache_t));
+    cache_init(sim->mem->l2, sim->mem, l2);
+  }
+  return 0;
+}
+
+void sim_schedule(sim_t *sim, unsigned quantum, unsigned sched, unsigned seed) {
+  sim->quantum = quantum ? quantum : 1;
+  sim->sched = sched;
+  // xorshift never leaves 0
+  sim->sched_seed = seed ? seed : 1;
+}
+
+// returns 1 if the instruction is visible to the other harts (MMIO access, AMO, fence)
+static int sim_step(sim_t *sim, unsigned i) {
+  // stopped by the SBI (hart state management)
+  if (sim->sbi && sbi_hart_idle(sim->sbi, i)) {
+    return 0;
+  }
+  struct core_step_result result;
+  memset(&result, 0, sizeof(struct core_step_result));
+  unsigned pc = sim->core[i]->csr->pc;
+  core_step(sim->core[i], pc, &result, sim->core[i]->csr->mode);
+  if (__atomic_load_n(&sim->trigger->size, __ATOMIC_RELAXED)) {
+    // the triggers are shared by the hart threads (parallel mode)
+    if (sim->mem->bus_lock_en) mtx_lock(&sim->mem->bus_lock);
+    trig_cycle(sim->trigger, &result);
+    if (sim->mem->bus_lock_en) mtx_unlock(&sim->mem->bus_lock);
+  }
+  csr_cycle(sim->core[i]->csr, &result);
+  if (sim->prof) {
+    prof_step(sim->prof, sim->core[i], &result);
+  }
+  if (sim->procstat) {
+    procstat_step(sim->procstat, sim->core[i], &result);
+  }
+  if ((int)i == sim->selected_hart) {
+    if (sim->stp_handler) sim->stp_handler(&result, sim->stp_arg);
+  }
+  switch (result.opcode) {
+  case OPCODE_AMO:
+    // not after LR, switching between LR and SC would break the reservation
+    return (result.inst >> 27) != 0x02;
+  case OPCODE_MISC_MEM:
+    return 1;
+  case OPCODE_LOAD:
+  case OPCODE_LOAD_FP:
+  case OPCODE_STORE:
+  case OPCODE_STORE_FP:
+    return (result.exception_code == 0) && (result.m_paddr - MEMORY_BASE_ADDR_RAM >= RAM_SIZE);
+  default:
+    return 0;
+  }
+}
+
+static unsigned sim_sched_rand(sim_t *sim) {
+  // xorshift32
+  unsigned x = sim->sched_seed;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return sim->sched_seed = x;
+}
+
+// runs hart i for up to len instructions, returns the instructions done
+static unsigned sim_slice(sim_t *sim, unsigned i, unsigned len) {
+  unsigned n = 0;
+  while (n < len) {
+    int sync = sim_step(sim, i);
+    n++;
+    // entering debug mode (hart 0) ends the quantum
+    if (i == 0 && sim->core[0]->csr->mode == PRIVILEGE_MODE_D) {
+      break;
+    }
+    if (sync && (sim->sched & SIM_SCHED_STRICT)) {
+      break;
+    }
+  }
+  return n;
+}
+
+// the last hart to arrive advances the time and the devices for the quantum,
+// so every hart sees the same mtime within a quantum. returns 1 to stop
+static int sim_parallel_sync(sim_t *sim, unsigned hart_id) {
+  sim_parallel_t *par = sim->parallel;
+  unsigned generation = __atomic_load_n(&par->generation, __ATOMIC_ACQUIRE);
+  if (__atomic_add_fetch(&par->count, 1, __ATOMIC_ACQ_REL) == sim->num_core) {
+    aclint_advance(sim->aclint, sim->quantum);
+    mtx_lock(&sim->mem->bus_lock);
+    for (unsigned i = 0; i < sim->num_virtio; i++) {
+      virtio_cycle(sim->virtio[i], sim->quantum);
+    }
+    plic_cycle(sim->plic);
+    mtx_unlock(&sim->mem->bus_lock);
+    par->stop = (sim->core[0]->csr->mode == PRIVILEGE_MODE_D) || (sim->state != running);
+    par->count = 0;
+    __atomic_store_n(&par->generation, generation + 1, __ATOMIC_RELEASE);
+  } else {
+    for (unsigned n = 0; __atomic_load_n(&par->generation, __ATOMIC_ACQUIRE) == generation; n++) {
+      // a hart still running may wait for a remote fence of this one
+      if (sim->sbi) {
+        sbi_hart_fence(sim->sbi, hart_id);
+      }
+      if (n >= par->spin) {
+        thrd_yield();
+      }
+    }
+  }
+  return par->stop;
+}
+
+typedef struct sim_hart_arg_t {
+  sim_t *sim;
+  unsigned hart_id;
+} sim_hart_arg_t;
+
+static int sim_parallel_routine(void *arg) {
+  sim_t *sim = ((sim_hart_arg_t *)arg)->sim;
+  unsigned hart_id = ((sim_hart_arg_t *)arg)->hart_id;
+  do {
+    for (unsigned n = 0; n < sim->quantum; n++) {
+      sim_step(sim, hart_id);
+      // entering debug mode (hart 0) ends the quantum
+      if (hart_id == 0 && sim->core[0]->csr->mode == PRIVILEGE_MODE_D) {
+        break;
+      }
+    }
+  } while (!sim_parallel_sync(sim, hart_id));
+  return 0;
+}
+
+static void sim_resume_parallel(sim_t *sim) {
+  thrd_t *thread = (thrd_t *)calloc(sim->num_core, sizeof(thrd_t));
+  sim_hart_arg_t *arg = (sim_hart_arg_t *)calloc(sim->num_core, sizeof(sim_hart_arg_t));
+  sim->parallel->count = 0;
+  sim->parallel->stop = 0;
+  sim->parallel->spin = SIM_PARALLEL_SPIN;
+  if (sim->sbi) {
+    sim->sbi->threaded = 1;
+  }
+  // hart 0 runs on this thread
+  for (unsigned i = 0; i < sim->num_core; i++) {
+    arg[i].sim = sim;
+    arg[i].hart_id = i;
+    if (i > 0 && thrd_create(&thread[i], (thrd_start_t)sim_parallel_routine, (void *)&arg[i]) == thrd_error) {
+      fprintf(stderr, "parallel mode error: thread create\n");
+    }
+  }
+  sim_parallel_routine(&arg[0]);
+  for (unsigned i = 1; i < sim->num_core; i++) {
+    thrd_join(thread[i], NULL);
+  }
+  if (sim->sbi) {
+    sim->sbi->threaded = 0;
+  }
+  free(arg);
+  free(thread);
+}
+
 void sim_resume(sim_t *sim) {
   sim->core[0]->csr->pc = sim_read_csr(sim, CSR_ADDR_D_PC);
   sim->core[0]->csr->mode = sim_read_csr(sim, CSR_ADDR_D_CSR) & 0x3;
-  while (sim->core[0]->csr->mode != PRIVILEGE_MODE_D) {
+  if (sim->parallel && sim->num_core > 1 && !sim->core[0]->csr->dcsr_step) {
+    sim_resume_parallel(sim);
+  }
+  // sim->state: system reset by the SBI
+  while (sim->core[0]->csr->mode != PRIVILEGE_MODE_D && sim->state == running) {
+    // the time and the devices advance by the longest slice of the round
+    unsigned round = 0;
     for (unsigned i = 0; i < sim->num_core; i++) {
-      struct core_step_result result;
-      memset(&result, 0, sizeof(struct core_step_result));
-      unsigned pc = sim->core[i]->csr->pc;
-      core_step(sim->core[i], pc, &result, sim->core[i]->csr->mode);
-      trig_cycle(sim->trigger, &result);
-      csr_cycle(sim->core[i]->csr, &result);
-      if ((int)i == sim->selected_hart) {
-        if (sim->stp_handler) sim->stp_handler(&result, sim->stp_arg);
+      unsigned len = sim->quantum;
+      if (sim->sched & SIM_SCHED_RANDOM) {
+        len = 1 + sim_sched_rand(sim) % sim->quantum;
+      }
+      // hart 0 has entered debug mode, the others run no further than it did
+      if (i > 0 && sim->core[0]->csr->mode == PRIVILEGE_MODE_D && len > round) {
+        len = round;
       }
+      unsigned n = sim_slice(sim, i, len);
+      if (i == 0 || n > round) {
+        round = n;
+      }
+    }
+    aclint_advance(sim->aclint, round);
+    for (unsigned i = 0; i < sim->num_virtio; i++) {
+      virtio_cycle(sim->virtio[i], round);
     }
-    aclint_cycle(sim->aclint);
+    plic_cycle(sim->plic);
   }
 
   // fire debug handlers
@@ -360,7 +1078,59 @@ int sim_rst_access_trigger(sim_t *sim, unsigned addr) {
 };
 
 int sim_virtio_disk(sim_t *sim, const char *img_path, int mode) {
-  disk_load(sim->disk, img_path, mode);
+  if (sim->num_virtio >= VIRTIO_MMIO_MAX_DEVICES) {
+    fprintf(stderr, "exceeds virtio-mmio slots: %s\n", img_path);
+    return -1;
+  }
+  if (disk_attach(sim->virtio[sim->num_virtio], img_path, mode) != 0) {
+    return -1;
+  }
+  return sim->num_virtio++;
+}
+
+int sim_virtio_console(sim_t *sim, const char *in_path, const char *out_path) {
+  if (sim->num_virtio >= VIRTIO_MMIO_MAX_DEVICES) {
+    fprintf(stderr, "exceeds virtio-mmio slots: console\n");
+    return -1;
+  }
+  if (vconsole_attach(sim->virtio[sim->num_virtio], in_path, out_path) != 0) {
+    return -1;
+  }
+  return sim->num_virtio++;
+}
+
+int sim_virtio_9p(sim_t *sim, const char *root, const char *tag) {
+  if (sim->num_virtio >= VIRTIO_MMIO_MAX_DEVICES) {
+    fprintf(stderr, "exceeds virtio-mmio slots: %s\n", root);
+    return -1;
+  }
+  if (p9fs_attach(sim->virtio[sim->num_virtio], root, tag) != 0) {
+    return -1;
+  }
+  return sim->num_virtio++;
+}
+
+int sim_virtio_net(sim_t *sim, const char *socket_path) {
+  if (sim->num_virtio >= VIRTIO_MMIO_MAX_DEVICES) {
+    fprintf(stderr, "exceeds virtio-mmio slots: %s\n", socket_path);
+    return -1;
+  }
+  if (vnet_attach(sim->virtio[sim->num_virtio], socket_path, sim->num_virtio) != 0) {
+    return -1;
+  }
+  return sim->num_virtio++;
+}
+
+int sim_net_switch(sim_t *sim, const char *socket_path) {
+  if (sim->net_switch) {
+    return -1;
+  }
+  sim->net_switch = (vnet_switch_t *)malloc(sizeof(vnet_switch_t));
+  if (vnet_switch_init(sim->net_switch, socket_path) != 0) {
+    free(sim->net_switch);
+    sim->net_switch = NULL;
+    return -1;
+  }
   return 0;
 }
 
@@ -6,6 +6,7 @@
 // memory map
 #define MEMORY_BASE_ADDR_UART   0x10000000
 #define MEMORY_BASE_ADDR_DISK   0x10001000
+#define MEMORY_BASE_ADDR_VIRTIO(n) (MEMORY_BASE_ADDR_DISK + 0x1000 * (n))
 #define MEMORY_BASE_ADDR_ACLINT 0x02000000
 #define MEMORY_BASE_ADDR_PLIC   0x0c000000
 #define MEMORY_BASE_ADDR_RAM    0x80000000
@@ -16,7 +17,7 @@
 
 // debug address
 #define DEVTREE_ROM_ADDR 0x00001020
-#define DEVTREE_ROM_SIZE 4096
+#define DEVTREE_ROM_SIZE (64 * 1024) // the cpu nodes for SIM_MAX_HART
 #define CONFIG_ROM_ADDR 0x00001000
 #define CONFIG_ROM_SIZE 1024
 
@@ -28,19 +29,37 @@
 
 // platform level interrupt controller map
 #define PLIC_ADDR_IRQ_PRIORITY(n) (0x00000000 + (4 * n))
+#define PLIC_ADDR_PENDING(n) (0x00001000 + (4 * n))
 #define PLIC_ADDR_CTX_ENABLE(n) (0x00002000 + (0x80 * n))
 #define PLIC_ADDR_CTX_THRESHOLD(n) (0x00200000 + (0x00001000 * n))
 #define PLIC_ADDR_IRQ_PRIORITY_BASE PLIC_ADDR_IRQ_PRIORITY(0)
+#define PLIC_ADDR_PENDING_BASE PLIC_ADDR_PENDING(0)
 #define PLIC_ADDR_CTX_ENABLE_BASE PLIC_ADDR_CTX_ENABLE(0)
 #define PLIC_ADDR_CTX_THRESHOLD_BASE PLIC_ADDR_CTX_THRESHOLD(0)
 
 // IRQ
 #define PLIC_MAX_IRQ 10
 #define PLIC_VIRTIO_MMIO_IRQ_NO 1
+#define PLIC_VIRTIO_MMIO_IRQ(n) (PLIC_VIRTIO_MMIO_IRQ_NO + (n))
 #define PLIC_UART_IRQ_NO 10
 
+// virtio-mmio slots (0x10001000 - 0x10008fff, IRQ 1 - 8)
+#define VIRTIO_MMIO_MAX_DEVICES 8
+
 #define CORE_WINDOW_SIZE 16
 
+// harts (PLIC contexts and ACLINT registers are allocated for all of them)
+#define SIM_MAX_HART 64
+// an instruction per cycle, mtime ticks once in 10 cycles (aclint_cycle)
+#define SIM_CLOCK_FREQ 100000000
+#define ACLINT_TIMEBASE_FREQ (SIM_CLOCK_FREQ / 10)
+
+// parallel mode: instructions each hart runs between the synchronizations
+#define SIM_PARALLEL_QUANTUM 1000
+// sequential mode scheduling (sim_schedule)
+#define SIM_SCHED_STRICT 0x1 // a quantum ends early after an MMIO access, AMO or fence
+#define SIM_SCHED_RANDOM 0x2 // quantum lengths drawn from [1, quantum]
+
 #define REGISTER_STATISTICS 1
 
 enum sim_state { running, quit };
@@ -78,16 +97,17 @@ struct core_step_result {
   unsigned rs2_cycle_from_producer;
   unsigned char rs3_regno;
 
-  unsigned inst_window_pos;
-  unsigned inst_window_pc[CORE_WINDOW_SIZE];
-  unsigned inst_window[CORE_WINDOW_SIZE];
-
+  // cache and TLB events (an instruction fetch may access several lines)
   unsigned char icache_access;
   unsigned char icache_hit;
   unsigned char dcache_access;
   unsigned char dcache_hit;
+  unsigned char dcache_write_back;
   unsigned char tlb_access;
   unsigned char tlb_hit;
+  unsigned char tlb_walk;
+  unsigned char l2_access;
+  unsigned char l2_hit;
 };
 
 typedef struct sim_t {
@@ -101,9 +121,22 @@ typedef struct sim_t {
   struct elf_t *elf;
   struct trigger_t *trigger;
   struct uart_t *uart;
-  struct disk_t *disk;
+  struct virtio_t **virtio; // virtio-mmio slots
+  unsigned num_virtio;      // attached devices, from slot 0
+  struct vnet_switch_t *net_switch;
   struct plic_t *plic;
   struct aclint_t *aclint;
+  // one host thread per hart (NULL: the harts are interleaved on this thread)
+  struct sim_parallel_t *parallel;
+  struct sbi_t *sbi; // native SBI (NULL: firmware in M mode)
+  // direct kernel boot: the Image at the start of RAM, the initrd and the DTB at the end
+  unsigned image_end; // 0: no Image loaded
+  unsigned initrd_start;
+  unsigned initrd_end; // 0: no initrd
+  unsigned dtb_addr;   // passed in a1
+  unsigned quantum; // instructions a hart runs before switching to (or syncing with) the others
+  unsigned sched;   // SIM_SCHED_xxx
+  unsigned sched_seed;
   unsigned htif_tohost;
   unsigned htif_fromhost;
   // for debugger
@@ -114,13 +147,31 @@ typedef struct sim_t {
   void (*stp_handler)(struct core_step_result *, void *arg);
   void *stp_arg;
   int selected_hart;
+  struct prof_t *prof; // every hart
+  struct procstat_t *procstat;
 } sim_t;
 
 // simulator general interface
 void sim_init(sim_t *);
 void sim_enable_timer(sim_t *);
 void sim_add_core(sim_t *);
-void sim_dtb_on(sim_t *, const char *dtb_path);
+// run each hart on its own host thread, synchronized every quantum instructions (0: default)
+void sim_parallel_on(sim_t *, unsigned quantum);
+// SBI calls of S mode are handled by the simulator (no M mode firmware), the harts other than 0 wait for hart_start
+void sim_sbi_on(sim_t *);
+// interleave the harts by quantum instructions on this thread (default 1)
+void sim_schedule(sim_t *, unsigned quantum, unsigned sched, unsigned seed);
+// entries (of each TLB if split), ways, TLB_REPLACE_xxx (lsu.h)
+int sim_tlb_config(sim_t *, unsigned entries, unsigned ways, unsigned replace, unsigned split);
+// L1 caches of each hart and the shared L2 (NULL: none), cache_config_t (lsu.h)
+struct cache_config_t;
+int sim_cache_config(sim_t *, const struct cache_config_t *icache, const struct cache_config_t *dcache,
+                     const struct cache_config_t *l2);
+// a prebuilt blob (up to DEVTREE_ROM_SIZE), returns 0 or -1
+int sim_dtb_on(sim_t *, const char *dtb_path);
+// device tree of the current configuration (call after adding the harts and the devices),
+// bootargs NULL for the default
+int sim_dtb_generate(sim_t *, const char *bootargs);
 void sim_config_on(sim_t *);
 void sim_single_step(sim_t *);
 void sim_resume(sim_t *);
@@ -143,8 +194,19 @@ int sim_rst_access_trigger(sim_t *, unsigned addr);
 void sim_fini(sim_t *);
 // loading elf file to ram
 int sim_load_elf(sim_t *, const char *elf_path);
-// set block device I/O
+// RISC-V Linux Image (entered in S mode with the native SBI), 1 if not an Image, -1 if it does not load
+int sim_load_image(sim_t *, const char *image_path);
+int sim_load_initrd(sim_t *, const char *initrd_path);
+// set block device I/O, returns the virtio-mmio slot or -1
 int sim_virtio_disk(sim_t *, const char *img_path, int mode);
+// set virtio console I/O (NULL for stdin/stdout), returns the virtio-mmio slot or -1
+int sim_virtio_console(sim_t *, const char *in_path, const char *out_path);
+// share a host directory (virtio-9p), returns the virtio-mmio slot or -1
+int sim_virtio_9p(sim_t *, const char *root, const char *tag);
+// network device connected to the switch at socket_path, returns the virtio-mmio slot or -1
+int sim_virtio_net(sim_t *, const char *socket_path);
+// run the switch for the network devices (of this and the other simulators)
+int sim_net_switch(sim_t *, const char *socket_path);
 // set character device I/O
 int sim_uart_io(sim_t *, const char *in_path, const char *out_path);
 // debugger helper to tdata
@@ -159,8 +221,20 @@ void sim_set_debug_callback(sim_t *sim, void (*callback)(sim_t *, unsigned, unsi
 // set callback function on every step
 void sim_set_step_callback(sim_t *, void (*func)(struct core_step_result *result, void *));
 void sim_set_step_callback_arg(sim_t *sim, void *arg);
+// samples the pc of every hart (prof.h), besides the step callback
+struct prof_t;
+void sim_prof_on(sim_t *sim, struct prof_t *prof);
+// counts the steps of every hart to the address spaces (procstat.h)
+struct procstat_t;
+void sim_procstat_on(sim_t *sim, struct procstat_t *procstat);
 #if REGISTER_STATISTICS
+struct regstat_config_t;
+struct regstat_t;
 void sim_regstat_en(sim_t *sim);
+// an additional configuration of the skip analysis (after sim_regstat_en), returns its index
+int sim_regstat_config(sim_t *sim, const struct regstat_config_t *config);
+// the skips of all harts
+void sim_regstat_sum(sim_t *sim, struct regstat_t *sum);
 #endif
 
 #endif
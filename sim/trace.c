@@ -0,0 +1,256 @@
+#include "trace.h"
+#include "sim.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static unsigned trace_inst_len(unsigned inst) {
+  return ((inst & 0x03) == 0x03) ? 4 : 2;
+}
+
+static unsigned char *trace_put_varint(unsigned char *p, unsigned value) {
+  while (value >= 0x80) {
+    *p++ = (value & 0x7f) | 0x80;
+    value >>= 7;
+  }
+  *p++ = value;
+  return p;
+}
+
+// signed deltas: small in either direction
+static unsigned char *trace_put_delta(unsigned char *p, unsigned delta) {
+  return trace_put_varint(p, (delta << 1) ^ (unsigned)((int)delta >> 31));
+}
+
+// up to 1 + 1 + 1 + 5 + 4 + 1 + 5 + 5 + 5 + 5 bytes
+#define TRACE_RECORD_MAX 40
+
+static unsigned char *trace_encode(trace_codec_t *codec, const trace_record_t *r, unsigned char *p) {
+  unsigned char *flags = p++;
+  *flags = 0;
+  if (r->hart_id != codec->hart_id) {
+    *flags |= TRACE_FLAG_HART;
+    *p++ = r->hart_id;
+    codec->hart_id = r->hart_id;
+  }
+  if (r->prv != codec->prv) {
+    *flags |= TRACE_FLAG_PRV;
+    *p++ = r->prv;
+    codec->prv = r->prv;
+  }
+  if (r->pc != codec->pc) {
+    *flags |= TRACE_FLAG_JUMP;
+    p = trace_put_delta(p, r->pc - codec->pc);
+  }
+  unsigned len = trace_inst_len(r->inst);
+  for (unsigned i = 0; i < len; i++) {
+    *p++ = r->inst >> (8 * i);
+  }
+  codec->pc = r->pc + len;
+  if (r->rd) {
+    *flags |= TRACE_FLAG_RD;
+    *p++ = r->rd;
+    p = trace_put_varint(p, r->rd_data);
+  }
+  if (r->m_access) {
+    *flags |= r->m_access;
+    p = trace_put_delta(p, r->m_vaddr - codec->m_vaddr);
+    codec->m_vaddr = r->m_vaddr;
+    if (r->m_access & TRACE_FLAG_STORE) {
+      p = trace_put_varint(p, r->m_data);
+    }
+  }
+  if (r->exception_code) {
+    *flags |= TRACE_FLAG_TRAP;
+    p = trace_put_varint(p, r->exception_code);
+  }
+  return p;
+}
+
+static int trace_writer(void *arg) {
+  trace_t *trace = (trace_t *)arg;
+  unsigned char *p = trace->buf;
+  for (;;) {
+    // stop is read before head, the records of the last steps are written
+    unsigned char stop = __atomic_load_n(&trace->stop, __ATOMIC_ACQUIRE);
+    unsigned head = __atomic_load_n(&trace->head, __ATOMIC_ACQUIRE);
+    unsigned tail = trace->tail;
+    if (head == tail) {
+      if (stop) {
+        break;
+      }
+      fwrite(trace->buf, 1, p - trace->buf, trace->fp);
+      p = trace->buf;
+      struct timespec wait = {0, 1000000};
+      thrd_sleep(&wait, NULL);
+      continue;
+    }
+    for (; tail != head; tail++) {
+      if (p - trace->buf > TRACE_BUF_SIZE - TRACE_RECORD_MAX) {
+        fwrite(trace->buf, 1, p - trace->buf, trace->fp);
+        p = trace->buf;
+      }
+      p = trace_encode(&trace->codec, &trace->ring[tail & (TRACE_RING_SIZE - 1)], p);
+    }
+    __atomic_store_n(&trace->tail, tail, __ATOMIC_RELEASE);
+  }
+  fwrite(trace->buf, 1, p - trace->buf, trace->fp);
+  return 0;
+}
+
+static void trace_codec_init(trace_codec_t *codec) {
+  codec->pc = 0;
+  codec->m_vaddr = 0;
+  codec->hart_id = 0;
+  codec->prv = PRIVILEGE_MODE_M;
+}
+
+int trace_init(trace_t *trace, const char *path) {
+  trace->fp = fopen(path, "wb");
+  if (trace->fp == NULL) {
+    perror(path);
+    return -1;
+  }
+  fwrite(TRACE_MAGIC, 1, TRACE_MAGIC_LEN, trace->fp);
+  trace->ring = (trace_record_t *)malloc(TRACE_RING_SIZE * sizeof(trace_record_t));
+  trace->buf = (unsigned char *)malloc(TRACE_BUF_SIZE);
+  trace->head = 0;
+  trace->tail = 0;
+  trace->stop = 0;
+  trace->count = 0;
+  trace_codec_init(&trace->codec);
+  if (thrd_create(&trace->thread, trace_writer, trace) != thrd_success) {
+    fprintf(stderr, "trace error: thread create\n");
+    fclose(trace->fp);
+    free(trace->ring);
+    free(trace->buf);
+    return -1;
+  }
+  return 0;
+}
+
+void trace_step(struct core_step_result *result, void *arg) {
+  trace_t *trace = (trace_t *)arg;
+  unsigned head = trace->head;
+  // full: waits for the writer (nothing is dropped)
+  while (head - __atomic_load_n(&trace->tail, __ATOMIC_ACQUIRE) == TRACE_RING_SIZE) {
+    thrd_yield();
+  }
+  trace_record_t *r = &trace->ring[head & (TRACE_RING_SIZE - 1)];
+  r->pc = result->pc;
+  r->inst = result->inst;
+  r->hart_id = result->hart_id;
+  r->prv = result->prv;
+  r->exception_code = result->exception_code;
+  r->rd = 0;
+  r->m_access = 0;
+  if (result->exception_code == 0) {
+    if (result->rd_is_fpr || result->rd_regno != 0) {
+      r->rd = result->rd_regno | (result->rd_is_fpr ? TRACE_RD_FPR : 0);
+      r->rd_data = result->rd_data;
+    }
+    if (result->m_access & CSR_MATCH6_LOAD) {
+      r->m_access |= TRACE_FLAG_LOAD;
+    }
+    if (result->m_access & CSR_MATCH6_STORE) {
+      r->m_access |= TRACE_FLAG_STORE;
+      r->m_data = result->m_data;
+    }
+    r->m_vaddr = result->m_vaddr;
+  }
+  __atomic_store_n(&trace->head, head + 1, __ATOMIC_RELEASE);
+  trace->count++;
+}
+
+void trace_fini(trace_t *trace) {
+  __atomic_store_n(&trace->stop, 1, __ATOMIC_RELEASE);
+  thrd_join(trace->thread, NULL);
+  fclose(trace->fp);
+  free(trace->ring);
+  free(trace->buf);
+}
+
+int trace_read_header(FILE *fp, trace_codec_t *codec) {
+  char magic[TRACE_MAGIC_LEN];
+  trace_codec_init(codec);
+  if (fread(magic, 1, TRACE_MAGIC_LEN, fp) != TRACE_MAGIC_LEN || memcmp(magic, TRACE_MAGIC, TRACE_MAGIC_LEN) != 0) {
+    return -1;
+  }
+  return 0;
+}
+
+static int trace_get_varint(FILE *fp, unsigned *value) {
+  *value = 0;
+  for (unsigned shift = 0; shift < 35; shift += 7) {
+    int c = fgetc(fp);
+    if (c == EOF) {
+      return -1;
+    }
+    *value |= (unsigned)(c & 0x7f) << shift;
+    if (!(c & 0x80)) {
+      return 0;
+    }
+  }
+  return -1;
+}
+
+static int trace_get_delta(FILE *fp, unsigned *delta) {
+  unsigned value;
+  if (trace_get_varint(fp, &value)) {
+    return -1;
+  }
+  *delta = (value >> 1) ^ -(value & 1);
+  return 0;
+}
+
+int trace_read(FILE *fp, trace_codec_t *codec, trace_record_t *r) {
+  int flags = fgetc(fp);
+  if (flags == EOF) {
+    return 0;
+  }
+  if (flags & TRACE_FLAG_HART) {
+    int c = fgetc(fp);
+    if (c == EOF) return -1;
+    codec->hart_id = c;
+  }
+  if (flags & TRACE_FLAG_PRV) {
+    int c = fgetc(fp);
+    if (c == EOF) return -1;
+    codec->prv = c;
+  }
+  if (flags & TRACE_FLAG_JUMP) {
+    unsigned delta;
+    if (trace_get_delta(fp, &delta)) return -1;
+    codec->pc += delta;
+  }
+  r->hart_id = codec->hart_id;
+  r->prv = codec->prv;
+  r->pc = codec->pc;
+  r->inst = 0;
+  for (unsigned i = 0; i < 4; i++) {
+    int c = fgetc(fp);
+    if (c == EOF) return -1;
+    r->inst |= (unsigned)c << (8 * i);
+    if (i == 1 && trace_inst_len(r->inst) == 2) {
+      break;
+    }
+  }
+  codec->pc += trace_inst_len(r->inst);
+  r->rd = 0;
+  if (flags & TRACE_FLAG_RD) {
+    int c = fgetc(fp);
+    if (c == EOF || trace_get_varint(fp, &r->rd_data)) return -1;
+    r->rd = c;
+  }
+  r->m_access = flags & (TRACE_FLAG_LOAD | TRACE_FLAG_STORE);
+  if (r->m_access) {
+    unsigned delta;
+    if (trace_get_delta(fp, &delta)) return -1;
+    codec->m_vaddr += delta;
+    r->m_vaddr = codec->m_vaddr;
+    if ((r->m_access & TRACE_FLAG_STORE) && trace_get_varint(fp, &r->m_data)) return -1;
+  }
+  r->exception_code = 0;
+  if ((flags & TRACE_FLAG_TRAP) && trace_get_varint(fp, &r->exception_code)) return -1;
+  return 1;
+}
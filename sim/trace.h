@@ -0,0 +1,78 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <threads.h>
+
+struct core_step_result;
+
+// binary instruction trace: the step callback copies the retired instructions into a ring buffer
+// (no lock, the sim thread is the only producer), a writer thread encodes and writes them.
+// file: TRACE_MAGIC, then a record per instruction
+//   flags (TRACE_FLAG_xxx)
+//   [hart] [prv]                        with HART, PRV (a byte each)
+//   [pc - the pc after the previous]    with JUMP, not sequential (zigzag varint)
+//   inst                                2 or 4 bytes (compressed or not), little endian
+//   [rd (bit 7: fpr) rd_data]           with RD (a byte, varint)
+//   [vaddr - the previous vaddr]        with LOAD or STORE (zigzag varint)
+//   [m_data]                            with STORE (varint)
+//   [exception_code]                    with TRAP (varint)
+#define TRACE_MAGIC "LBTRACE1"
+#define TRACE_MAGIC_LEN 8
+#define TRACE_FLAG_JUMP 0x01
+#define TRACE_FLAG_RD 0x02
+#define TRACE_FLAG_LOAD 0x04
+#define TRACE_FLAG_STORE 0x08 // LOAD and STORE: AMO
+#define TRACE_FLAG_TRAP 0x10
+#define TRACE_FLAG_PRV 0x20
+#define TRACE_FLAG_HART 0x40
+#define TRACE_RD_FPR 0x80
+
+#define TRACE_RING_SIZE (1 << 16) // records, a power of 2
+#define TRACE_BUF_SIZE (1 << 16) // bytes of the writer
+
+typedef struct trace_record_t {
+  unsigned pc;
+  unsigned inst;
+  unsigned rd_data;
+  unsigned m_vaddr;
+  unsigned m_data;
+  unsigned exception_code;
+  unsigned char hart_id;
+  unsigned char prv;
+  unsigned char rd; // regno | TRACE_RD_FPR, 0: none
+  unsigned char m_access; // TRACE_FLAG_LOAD | TRACE_FLAG_STORE
+} trace_record_t;
+
+// the state of the delta encoding (both ends)
+typedef struct trace_codec_t {
+  unsigned pc; // sequential
+  unsigned m_vaddr;
+  unsigned char hart_id;
+  unsigned char prv;
+} trace_codec_t;
+
+typedef struct trace_t {
+  FILE *fp;
+  trace_record_t *ring;
+  unsigned head; // the sim thread
+  unsigned tail; // the writer thread
+  unsigned char stop;
+  thrd_t thread;
+  trace_codec_t codec;
+  unsigned char *buf;
+  unsigned long long count;
+} trace_t;
+
+int trace_init(trace_t *, const char *path);
+// step callback (sim_set_step_callback) of a trace_t
+void trace_step(struct core_step_result *result, void *trace);
+// waits for the writer, closes the file
+void trace_fini(trace_t *);
+
+// decoder: checks the magic of the file
+int trace_read_header(FILE *fp, trace_codec_t *);
+// returns 1 for a record, 0 at the end and -1 if broken
+int trace_read(FILE *fp, trace_codec_t *, trace_record_t *);
+
+#endif
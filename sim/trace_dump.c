@@ -0,0 +1,52 @@
+#include <stdio.h>
+#include "riscv.h"
+#include "trace.h"
+
+// prints a binary trace of launch_sim --trace as text
+int main(int argc, char *argv[]) {
+  static const char prv_name[] = {'U', 'S', 'H', 'M', 'D'};
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s [Trace File]\n", argv[0]);
+    return 1;
+  }
+  FILE *fp = fopen(argv[1], "rb");
+  if (fp == NULL) {
+    perror(argv[1]);
+    return 1;
+  }
+  trace_codec_t codec;
+  trace_record_t r;
+  int ret;
+  if (trace_read_header(fp, &codec) != 0) {
+    fprintf(stderr, "not a trace: %s\n", argv[1]);
+    fclose(fp);
+    return 1;
+  }
+  while ((ret = trace_read(fp, &codec, &r)) > 0) {
+    printf("%u %c %08x: ", r.hart_id, (r.prv < sizeof(prv_name)) ? prv_name[r.prv] : '?', r.pc);
+    if ((r.inst & 0x03) == 0x03) {
+      printf("%08x ", r.inst);
+    } else {
+      printf("    %04x ", r.inst);
+    }
+    printf("%-10s", riscv_get_mnemonic(riscv_decompress(r.inst)));
+    if (r.rd) {
+      printf(" %c%u=%08x", (r.rd & TRACE_RD_FPR) ? 'f' : 'x', r.rd & ~TRACE_RD_FPR, r.rd_data);
+    }
+    if (r.m_access & TRACE_FLAG_STORE) {
+      printf(" [%08x]<=%08x", r.m_vaddr, r.m_data);
+    } else if (r.m_access & TRACE_FLAG_LOAD) {
+      printf(" [%08x]", r.m_vaddr);
+    }
+    if (r.exception_code) {
+      printf(" trap %u", r.exception_code);
+    }
+    printf("\n");
+  }
+  fclose(fp);
+  if (ret < 0) {
+    fprintf(stderr, "broken trace: %s\n", argv[1]);
+    return 1;
+  }
+  return 0;
+}
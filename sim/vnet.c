@@ -0,0 +1,359 @@
+#include "vnet.h"
+#include "memory.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/select.h>
+
+#define VIRTIO_NET_F_MAC (5) // Device has given MAC address.
+#define VIRTIO_NET_F_MRG_RXBUF (15) // Driver can merge receive buffers.
+#define VIRTIO_NET_F_STATUS (16) // Configuration status field is available.
+#define VIRTIO_F_VERSION_1 (32)
+
+#define VIRTIO_NET_S_LINK_UP 1
+
+#define VNET_RECEIVEQ 0
+#define VNET_TRANSMITQ 1
+// the receive ring is checked once in the cycles below
+#define VNET_POLL_INTERVAL 1024
+
+#define ETH_ADDR_LEN 6
+#define ETH_HEADER_LEN 14
+
+// virtio_net_hdr (10 byte), + num_buffers with VERSION_1 or MRG_RXBUF
+static unsigned vnet_hdr_len(const virtio_t *vio) {
+  if (vio->guest_features & ((1LL << VIRTIO_F_VERSION_1) | (1LL << VIRTIO_NET_F_MRG_RXBUF))) {
+    return 12;
+  } else {
+    return 10;
+  }
+}
+
+static int vnet_rx_routine(void *arg) {
+  vnet_t *net = (vnet_t *)arg;
+  int select_maxfd = (net->sock > net->i_pipe[0]) ? net->sock : net->i_pipe[0];
+  int loop = 1;
+  while (loop) {
+    // wait for a free slot
+    mtx_lock(&net->mutex);
+    while (!net->quit && (net->rx_wr_index - net->rx_rd_index) == VNET_RX_RING) {
+      cnd_wait(&net->cond, &net->mutex);
+    }
+    unsigned wr = net->rx_wr_index;
+    loop = !net->quit;
+    mtx_unlock(&net->mutex);
+    if (!loop) {
+      break;
+    }
+    fd_set select_fds;
+    FD_ZERO(&select_fds);
+    FD_SET(net->sock, &select_fds);
+    FD_SET(net->i_pipe[0], &select_fds);
+    select(select_maxfd + 1, &select_fds, NULL, NULL, NULL);
+    if (FD_ISSET(net->i_pipe[0], &select_fds)) {
+      loop = 0;
+    } else if (FD_ISSET(net->sock, &select_fds)) {
+      ssize_t ret = recv(net->sock, &net->rx_buf[(wr % VNET_RX_RING) * VNET_FRAME_SIZE], VNET_FRAME_SIZE, 0);
+      if (ret < 0) {
+        perror("virtio net recv");
+        loop = 0;
+      } else if (ret >= ETH_HEADER_LEN) {
+        net->rx_len[wr % VNET_RX_RING] = ret;
+        mtx_lock(&net->mutex);
+        net->rx_wr_index++;
+        mtx_unlock(&net->mutex);
+      }
+    }
+  }
+  thrd_exit(0);
+}
+
+static void vnet_receive(virtio_t *vio) {
+  vnet_t *net = (vnet_t *)vio->dev;
+  virtio_chain_t chain;
+  mtx_lock(&net->mutex);
+  unsigned wr = net->rx_wr_index;
+  mtx_unlock(&net->mutex);
+  unsigned rd = net->rx_rd_index;
+  if (rd == wr) {
+    return;
+  }
+  // all the frames received so far, as long as the guest has buffers
+  unsigned hdr_len = vnet_hdr_len(vio);
+  char hdr[12] = {0};
+  hdr[10] = 1; // num_buffers
+  while (rd != wr && virtio_queue_pop(vio, VNET_RECEIVEQ, &chain)) {
+    unsigned len = net->rx_len[rd % VNET_RX_RING];
+    if (hdr_len + len <= virtio_chain_len(&chain, 1)) {
+      virtio_chain_write(vio, &chain, 0, hdr, hdr_len);
+      virtio_chain_write(vio, &chain, hdr_len, &net->rx_buf[(rd % VNET_RX_RING) * VNET_FRAME_SIZE], len);
+      virtio_queue_push(vio, VNET_RECEIVEQ, chain.head, hdr_len + len);
+    } else {
+      // too small buffer, drop the frame
+      virtio_queue_push(vio, VNET_RECEIVEQ, chain.head, 0);
+    }
+    rd++;
+  }
+  mtx_lock(&net->mutex);
+  net->rx_rd_index = rd;
+  cnd_signal(&net->cond);
+  mtx_unlock(&net->mutex);
+}
+
+static void vnet_transmit(virtio_t *vio) {
+  vnet_t *net = (vnet_t *)vio->dev;
+  virtio_chain_t chain;
+  unsigned hdr_len = vnet_hdr_len(vio);
+  // the whole batch of the notification
+  while (virtio_queue_pop(vio, VNET_TRANSMITQ, &chain)) {
+    unsigned len = virtio_chain_len(&chain, 0);
+    if (len >= hdr_len + ETH_HEADER_LEN && len - hdr_len <= VNET_FRAME_SIZE) {
+      virtio_chain_read(vio, &chain, hdr_len, net->tx_buf, len - hdr_len);
+      // a frame the switch can not take is dropped, as on a wire
+      sendto(net->sock, net->tx_buf, len - hdr_len, 0, (struct sockaddr *)&net->peer, sizeof(net->peer));
+    }
+    virtio_queue_push(vio, VNET_TRANSMITQ, chain.head, 0);
+  }
+}
+
+static void vnet_notify(virtio_t *vio, unsigned queue) {
+  if (queue == VNET_TRANSMITQ) {
+    vnet_transmit(vio);
+  } else {
+    // new receive buffers
+    vnet_receive(vio);
+  }
+}
+
+static void vnet_cycle(virtio_t *vio, unsigned cycles) {
+  vnet_t *net = (vnet_t *)vio->dev;
+  net->poll_count += cycles;
+  if (net->poll_count < VNET_POLL_INTERVAL) {
+    return;
+  }
+  net->poll_count = 0;
+  vnet_receive(vio);
+}
+
+static unsigned vnet_config(virtio_t *vio, unsigned offs) {
+  // mac[6] status[2]
+  vnet_t *net = (vnet_t *)vio->dev;
+  unsigned ret = 0;
+  for (unsigned i = 0; i < 4; i++) {
+    unsigned pos = offs + i;
+    unsigned char c = 0;
+    if (pos < ETH_ADDR_LEN) {
+      c = net->mac[pos];
+    } else if (pos == ETH_ADDR_LEN) {
+      c = VIRTIO_NET_S_LINK_UP;
+    }
+    ret |= (unsigned)c << (8 * i);
+  }
+  return ret;
+}
+
+static void vnet_fini(virtio_t *vio) {
+  vnet_t *net = (vnet_t *)vio->dev;
+  char c = 'a';
+  mtx_lock(&net->mutex);
+  net->quit = 1;
+  cnd_signal(&net->cond);
+  mtx_unlock(&net->mutex);
+  if (write(net->i_pipe[1], &c, 1) < 0) {
+    perror("virtio net fini write notification");
+  }
+  thrd_join(net->rx_thread, NULL);
+  close(net->sock);
+  unlink(net->addr.sun_path);
+  close(net->i_pipe[0]);
+  close(net->i_pipe[1]);
+  cnd_destroy(&net->cond);
+  mtx_destroy(&net->mutex);
+  free(net->rx_buf);
+  free(net->tx_buf);
+}
+
+// the node binds to "[switch_path].[pid].[id]"
+int vnet_attach(virtio_t *vio, const char *switch_path, unsigned id) {
+  if (vio->dev) {
+    return -1;
+  }
+  vnet_t *net = (vnet_t *)calloc(1, sizeof(vnet_t));
+  net->addr.sun_family = AF_UNIX;
+  net->peer.sun_family = AF_UNIX;
+  if (snprintf(net->addr.sun_path, sizeof(net->addr.sun_path), "%s.%d.%u", switch_path, (int)getpid(), id) >= (int)sizeof(net->addr.sun_path) ||
+      snprintf(net->peer.sun_path, sizeof(net->peer.sun_path), "%s", switch_path) >= (int)sizeof(net->peer.sun_path)) {
+    fprintf(stderr, "virtio net: too long socket path: %s\n", switch_path);
+    free(net);
+    return -1;
+  }
+  if ((net->sock = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0) {
+    perror("virtio net socket");
+    free(net);
+    return -1;
+  }
+  unlink(net->addr.sun_path);
+  if (bind(net->sock, (struct sockaddr *)&net->addr, sizeof(net->addr)) < 0) {
+    perror("virtio net bind");
+    close(net->sock);
+    free(net);
+    return -1;
+  }
+  // locally administered address 52:54:00 + pid and id
+  unsigned pid = (unsigned)getpid();
+  net->mac[0] = 0x52;
+  net->mac[1] = 0x54;
+  net->mac[2] = (unsigned char)(pid >> 16);
+  net->mac[3] = (unsigned char)(pid >> 8);
+  net->mac[4] = (unsigned char)pid;
+  net->mac[5] = (unsigned char)id;
+  if (pipe(net->i_pipe) == -1) {
+    perror("virtio net init pipe for child thread");
+  }
+  net->rx_buf = (char *)malloc(VNET_RX_RING * VNET_FRAME_SIZE);
+  net->tx_buf = (char *)malloc(VNET_FRAME_SIZE);
+  mtx_init(&net->mutex, mtx_plain);
+  cnd_init(&net->cond);
+  if (thrd_create(&net->rx_thread, (thrd_start_t)vnet_rx_routine, (void *)net) == thrd_error) {
+    fprintf(stderr, "virtio net initialization error: thread create\n");
+  }
+  // hello to the switch, so that it learns this port before the first frame
+  sendto(net->sock, NULL, 0, 0, (struct sockaddr *)&net->peer, sizeof(net->peer));
+  vio->dev = net;
+  vio->device_id = VIRTIO_MMIO_DEVICE_NET;
+  vio->num_queues = 2; // receiveq1, transmitq1
+  vio->host_features |= (1LL << VIRTIO_NET_F_MAC) | (1LL << VIRTIO_NET_F_STATUS);
+  vio->dev_notify = vnet_notify;
+  vio->dev_config = vnet_config;
+  vio->dev_cycle = vnet_cycle;
+  vio->dev_fini = vnet_fini;
+  return 0;
+}
+
+static int vnet_switch_port(vnet_switch_t *sw, const struct sockaddr_un *from) {
+  for (unsigned i = 0; i < sw->num_ports; i++) {
+    if (strcmp(sw->port[i].sun_path, from->sun_path) == 0) {
+      return i;
+    }
+  }
+  if (sw->num_ports == VNET_SWITCH_MAX_PORTS) {
+    return -1;
+  }
+  sw->port[sw->num_ports] = *from;
+  sw->port_mac_valid[sw->num_ports] = 0;
+  return sw->num_ports++;
+}
+
+static void vnet_switch_del_port(vnet_switch_t *sw, unsigned port) {
+  sw->num_ports--;
+  sw->port[port] = sw->port[sw->num_ports];
+  memcpy(sw->port_mac[port], sw->port_mac[sw->num_ports], ETH_ADDR_LEN);
+  sw->port_mac_valid[port] = sw->port_mac_valid[sw->num_ports];
+}
+
+static void vnet_switch_send(vnet_switch_t *sw, unsigned port, const char *frame, unsigned len) {
+  // never blocks on a slow node, the frame is dropped instead
+  if (sendto(sw->sock, frame, len, MSG_DONTWAIT, (struct sockaddr *)&sw->port[port], sizeof(sw->port[port])) < 0 &&
+      (errno == ECONNREFUSED || errno == ENOENT)) {
+    // the node has gone
+    vnet_switch_del_port(sw, port);
+  }
+}
+
+static int vnet_switch_routine(void *arg) {
+  vnet_switch_t *sw = (vnet_switch_t *)arg;
+  int select_maxfd = (sw->sock > sw->i_pipe[0]) ? sw->sock : sw->i_pipe[0];
+  char *frame = (char *)malloc(VNET_FRAME_SIZE);
+  int loop = 1;
+  while (loop) {
+    fd_set select_fds;
+    FD_ZERO(&select_fds);
+    FD_SET(sw->sock, &select_fds);
+    FD_SET(sw->i_pipe[0], &select_fds);
+    select(select_maxfd + 1, &select_fds, NULL, NULL, NULL);
+    if (FD_ISSET(sw->i_pipe[0], &select_fds)) {
+      loop = 0;
+      continue;
+    }
+    struct sockaddr_un from;
+    socklen_t from_len = sizeof(from);
+    memset(&from, 0, sizeof(from));
+    ssize_t len = recvfrom(sw->sock, frame, VNET_FRAME_SIZE, 0, (struct sockaddr *)&from, &from_len);
+    if (len < 0) {
+      perror("virtio net switch recv");
+      continue;
+    }
+    int src = vnet_switch_port(sw, &from);
+    if (src < 0 || len < ETH_HEADER_LEN) {
+      continue;
+    }
+    // learn the source address
+    memcpy(sw->port_mac[src], &frame[ETH_ADDR_LEN], ETH_ADDR_LEN);
+    sw->port_mac_valid[src] = 1;
+    int dst = -1;
+    if (!(frame[0] & 0x01)) {
+      for (unsigned i = 0; i < sw->num_ports; i++) {
+        if (sw->port_mac_valid[i] && memcmp(sw->port_mac[i], frame, ETH_ADDR_LEN) == 0) {
+          dst = i;
+          break;
+        }
+      }
+    }
+    if (dst >= 0) {
+      if (dst != src) {
+        vnet_switch_send(sw, dst, frame, len);
+      }
+    } else {
+      // broadcast, multicast or unknown unicast
+      for (int i = sw->num_ports - 1; i >= 0; i--) {
+        if (i != src) {
+          vnet_switch_send(sw, i, frame, len);
+        }
+      }
+    }
+  }
+  free(frame);
+  thrd_exit(0);
+}
+
+int vnet_switch_init(vnet_switch_t *sw, const char *path) {
+  sw->num_ports = 0;
+  memset(&sw->addr, 0, sizeof(sw->addr));
+  sw->addr.sun_family = AF_UNIX;
+  if (snprintf(sw->addr.sun_path, sizeof(sw->addr.sun_path), "%s", path) >= (int)sizeof(sw->addr.sun_path)) {
+    fprintf(stderr, "virtio net switch: too long socket path: %s\n", path);
+    return -1;
+  }
+  if ((sw->sock = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0) {
+    perror("virtio net switch socket");
+    return -1;
+  }
+  unlink(sw->addr.sun_path);
+  if (bind(sw->sock, (struct sockaddr *)&sw->addr, sizeof(sw->addr)) < 0) {
+    perror("virtio net switch bind");
+    close(sw->sock);
+    return -1;
+  }
+  if (pipe(sw->i_pipe) == -1) {
+    perror("virtio net switch init pipe for child thread");
+  }
+  if (thrd_create(&sw->thread, (thrd_start_t)vnet_switch_routine, (void *)sw) == thrd_error) {
+    fprintf(stderr, "virtio net switch initialization error: thread create\n");
+  }
+  return 0;
+}
+
+void vnet_switch_fini(vnet_switch_t *sw) {
+  char c = 'a';
+  if (write(sw->i_pipe[1], &c, 1) < 0) {
+    perror("virtio net switch fini write notification");
+  }
+  thrd_join(sw->thread, NULL);
+  close(sw->sock);
+  unlink(sw->addr.sun_path);
+  close(sw->i_pipe[0]);
+  close(sw->i_pipe[1]);
+}
@@ -0,0 +1,49 @@
+#ifndef VNET_H
+#define VNET_H
+
+#include "mmio.h"
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define VNET_RX_RING 64
+#define VNET_FRAME_SIZE 2048 // 1514 byte frames (and a VLAN tag)
+#define VNET_SWITCH_MAX_PORTS 32
+
+// virtio-net, frames go over a Unix datagram socket to a vnet_switch_t
+typedef struct vnet_t {
+  int sock;
+  struct sockaddr_un addr; // this node
+  struct sockaddr_un peer; // the switch
+  unsigned char mac[6];
+  // receive: the reader thread fills the ring, vnet_cycle moves it to the receiveq
+  char *rx_buf;
+  unsigned rx_len[VNET_RX_RING];
+  unsigned rx_wr_index; // written by the reader
+  unsigned rx_rd_index; // written by the sim thread
+  thrd_t rx_thread;
+  mtx_t mutex;
+  cnd_t cond;
+  int i_pipe[2];
+  unsigned char quit;
+  unsigned poll_count;
+  char *tx_buf;
+} vnet_t;
+
+int vnet_attach(virtio_t *vio, const char *switch_path, unsigned id);
+
+// learning switch forwarding frames between the nodes
+typedef struct vnet_switch_t {
+  int sock;
+  struct sockaddr_un addr;
+  thrd_t thread;
+  int i_pipe[2];
+  unsigned num_ports;
+  struct sockaddr_un port[VNET_SWITCH_MAX_PORTS];
+  unsigned char port_mac[VNET_SWITCH_MAX_PORTS][6];
+  unsigned char port_mac_valid[VNET_SWITCH_MAX_PORTS];
+} vnet_switch_t;
+
+int vnet_switch_init(vnet_switch_t *sw, const char *path);
+void vnet_switch_fini(vnet_switch_t *sw);
+
+#endif